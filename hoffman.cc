@@ -111,7 +111,9 @@
 
 #include <algorithm>		/* for std::sort */
 #include <deque>
+#include <unordered_map>
 #include <vector>
+#include <numeric>		/* for std::iota */
 #include <set>
 
 #include <thread>
@@ -119,12 +121,16 @@
 #include <mutex>
 #include <condition_variable>
 #include <type_traits>
+#include <functional>
 
 #include <chrono>
+#include <random>
+#include <cmath>
 
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 
 #include <boost/lexical_cast.hpp>
 
@@ -166,6 +172,10 @@ namespace io = boost::iostreams;
 
 #include <sys/time.h>		/* for reporting resource utilization */
 #include <sys/resource.h>
+#include <sys/mman.h>		/* for mmap() of uncompressed futurebases */
+#include <sys/stat.h>
+#include <sys/wait.h>		/* for waitpid() in the build driver */
+#include <sched.h>		/* for sched_setaffinity() in NUMA mode */
 
 #include <errno.h>		/* for errno and strerror() */
 
@@ -377,6 +387,14 @@ public:
 
 #define MAX_PROMOTION_POSSIBILITIES 5
 
+/* Maximum number of moves in a move list.  A queen has at most 27 moves, and everything else
+ * fewer, even a pawn with three destinations and MAX_PROMOTION_POSSIBILITIES promotions on each.
+ * ComputeBitfields() works out a tighter bound for each tablebase, but we need one at compile time
+ * to put move lists on the stack.
+ */
+
+#define MAX_MOVES (MAX_PIECES * 28)
+
 /* seven possible pieces: KQRBNP; 64 possible squares, up to 8 directions per piece, up to 7
  * movements in one direction
  */
@@ -484,6 +502,22 @@ std::vector<uint64_t> positions_finalized;
 std::atomic<uint64_t> backproped_moves_this_pass;
 std::vector<uint64_t> backproped_moves;
 
+/* These counters are cumulative over the whole run; finalize_pass_statistics() reports how much
+ * they changed during each pass.  Bytes are counted as they go to and from the disk, i.e, after
+ * compression.  Idle time is the time pool threads spend waiting for the slowest thread to finish
+ * its share of a pass.
+ */
+
+std::atomic<uint64_t> temporary_file_bytes_read(0);
+std::atomic<uint64_t> temporary_file_bytes_written(0);
+std::atomic<uint64_t> fetch_entry_hits(0);
+std::atomic<uint64_t> fetch_entry_misses(0);
+uint64_t thread_idle_nanoseconds = 0;
+
+/* If set, finalize_pass_statistics() also writes each pass's statistics here as a line of JSON */
+
+std::ofstream stats_stream;
+
 /* If we're generating a DTM tablebase, then we make a series of passes, one for each DTM value in
  * the tablebase.  A DTM 15 position, for example, won't get finalised until the DTM 15 pass, which
  * ensures that if a better mate (say DTM 12) appears, it will change the position into a DTM 12.
@@ -524,12 +558,102 @@ bool * negative_passes_needed = nullptr;
 
 const bool ignore_futurevectors = false;
 
+/* A 64-bit futurevector limits us to 64 futuremoves for each color, which isn't enough for some
+ * complex pawn endings.  Configuring with --with-futurevector-bits=128 (or 256) makes
+ * futurevector_t a little class holding an array of 64-bit words, with the same bitwise operators
+ * as an integer, written as loops over the words that the compiler can turn into SSE or AVX
+ * instructions.  The futurevectors array in the tablebase only ever uses as many bits per position
+ * as there are futuremoves, so this only costs memory in the tablebases that need it.
+ *
+ * futurevector_word() and set_futurevector_word() get at the individual 64-bit words, so code that
+ * packs futurevectors into bit fields doesn't need to know which kind it has.
+ */
+
+#ifndef FUTUREVECTOR_BITS
+#define FUTUREVECTOR_BITS 64
+#endif
+
+#if FUTUREVECTOR_BITS == 64
+
 typedef uint64_t futurevector_t;
-#define get_futurevector_t_field get_uint64_t_field
-#define set_futurevector_t_field set_uint64_t_field
-#define FUTUREVECTOR_HEX_FORMAT "0x%" PRIx64
 #define FUTUREVECTOR(move) (1ULL << (move))
 #define FUTUREVECTORS(move, n) (((1ULL << (n)) - 1) << (move))
+
+inline uint64_t futurevector_word(const futurevector_t fv, int) { return fv; }
+inline void set_futurevector_word(futurevector_t & fv, int, uint64_t word) { fv = word; }
+
+#elif (FUTUREVECTOR_BITS == 128) || (FUTUREVECTOR_BITS == 256)
+
+class alignas(FUTUREVECTOR_BITS/8) futurevector_t {
+    static const int words = FUTUREVECTOR_BITS/64;
+    uint64_t word[words];
+
+public:
+    futurevector_t(uint64_t low = 0) {
+	word[0] = low;
+	for (int i = 1; i < words; i ++) word[i] = 0;
+    }
+
+    static futurevector_t bit(int move) {
+	futurevector_t fv;
+	fv.word[move / 64] = 1ULL << (move % 64);
+	return fv;
+    }
+
+    static futurevector_t bits(int move, int n) {
+	futurevector_t fv;
+	for (int i = move; i < move + n; i ++) fv.word[i / 64] |= 1ULL << (i % 64);
+	return fv;
+    }
+
+    explicit operator bool() const {
+	uint64_t any = 0;
+	for (int i = 0; i < words; i ++) any |= word[i];
+	return any != 0;
+    }
+
+    futurevector_t operator~() const {
+	futurevector_t fv;
+	for (int i = 0; i < words; i ++) fv.word[i] = ~word[i];
+	return fv;
+    }
+
+    futurevector_t & operator&=(const futurevector_t & other) {
+	for (int i = 0; i < words; i ++) word[i] &= other.word[i];
+	return *this;
+    }
+
+    futurevector_t & operator|=(const futurevector_t & other) {
+	for (int i = 0; i < words; i ++) word[i] |= other.word[i];
+	return *this;
+    }
+
+    futurevector_t operator&(const futurevector_t & other) const { futurevector_t fv = *this; return fv &= other; }
+    futurevector_t operator|(const futurevector_t & other) const { futurevector_t fv = *this; return fv |= other; }
+
+    friend uint64_t futurevector_word(const futurevector_t & fv, int i) { return fv.word[i]; }
+    friend void set_futurevector_word(futurevector_t & fv, int i, uint64_t w) { fv.word[i] = w; }
+};
+
+#define FUTUREVECTOR(move) (futurevector_t::bit(move))
+#define FUTUREVECTORS(move, n) (futurevector_t::bits((move), (n)))
+
+#else
+#error "FUTUREVECTOR_BITS must be 64, 128, or 256"
+#endif
+
+std::string futurevector_to_hex(const futurevector_t & fv)
+{
+    std::ostringstream hex;
+
+    hex << "0x" << std::hex;
+    for (int i = FUTUREVECTOR_BITS/64 - 1; i >= 0; i --) {
+	hex << std::setw((i == FUTUREVECTOR_BITS/64 - 1) ? 0 : 16) << std::setfill('0') << futurevector_word(fv, i);
+    }
+
+    return hex.str();
+}
+
 #define NO_FUTUREMOVE -1
 #define DISCARD_FUTUREMOVE -2
 #define CONCEDE_FUTUREMOVE -3
@@ -650,6 +774,19 @@ struct translation_result;
 class tablebase_t;
 class local_position_t;
 
+/* The position/index conversion routines are templated on the tablebase's index encoding class, so
+ * the kernels that call them most often can be instantiated for a specific encoding and avoid the
+ * virtual calls.  The default, index_encoding, is the generic version that works with any of them.
+ */
+
+class index_encoding;
+
+template <typename Encoding = index_encoding>
+index_t normalized_position_to_index(const tablebase_t *tb, local_position_t *position);
+
+template <typename Encoding = index_encoding>
+bool index_to_local_position(const tablebase_t *tb, index_t index, int reflection, local_position_t *position);
+
 /* XXX initialize local_position meaningfully so we can drop a lot of these friends */
 
 template<typename primative>
@@ -663,13 +800,14 @@ class ReadOnly {
     friend class combinadic_index;
 
     friend void normalize_position(const tablebase_t *, local_position_t *);
-    friend index_t normalized_position_to_index(const tablebase_t *, local_position_t *);
-    friend bool index_to_local_position(const tablebase_t *tb, index_t index, int reflection, local_position_t *position);
+    template <typename Encoding> friend index_t normalized_position_to_index(const tablebase_t *, local_position_t *);
+    template <typename Encoding> friend bool index_to_local_position(const tablebase_t *tb, index_t index, int reflection, local_position_t *position);
     friend int check_1000_positions(tablebase_t *);
     friend translation_result translate_foreign_position_to_local_position(tablebase_t *foreign_tb, local_position_t *foreign_position,
 									   tablebase_t *local_tb, local_position_t *local_position,
 									   bool invert_colors);
     friend translation_result global_position_to_local_position(tablebase_t *tb, struct global_position *global, local_position_t *local);
+    friend translation_result slow_global_position_to_local_position(tablebase_t *tb, struct global_position *global, local_position_t *local);
     friend bool place_piece_in_local_position(tablebase_t *tb, local_position_t *pos, int square, PieceColor color, PieceType type);
     friend bool parse_FEN_to_local_position(char *, tablebase_t *, local_position_t *);
 
@@ -737,6 +875,7 @@ public:
      * XXX Should we update PTM_vector?
      */
 
+    template <typename Encoding = index_encoding>
     void move_piece(int piece, int destination_square);
 
     void place_piece(int piece, int destination_square) {
@@ -938,7 +1077,7 @@ bimap<Glib::ustring, int, casefold_compare> restriction_types =
 bimap<Glib::ustring, int, casefold_compare> formats =
     {{"fourbyte", FORMAT_FOURBYTE}, {"one-byte-dtm", FORMAT_ONE_BYTE_DTM}};
 
-enum class Index { Naive, Naive2, Simple, Compact, NoEnPassant, Combinadic3, Combinadic4, Combinadic5 };
+enum class Index { Naive, Naive2, Simple, Compact, NoEnPassant, Combinadic3, Combinadic4, Combinadic5, Syzygy };
 
 #define DEFAULT_INDEX Index::Combinadic5
 
@@ -946,7 +1085,7 @@ bimap<Glib::ustring, Index, casefold_compare> index_types =
     {{"naive", Index::Naive}, {"naive2", Index::Naive2}, {"simple", Index::Simple},
      {"compact", Index::Compact}, {"no-en-passant", Index::NoEnPassant},
      {"combinadic3", Index::Combinadic3}, {"combinadic4", Index::Combinadic4},
-     {"pawngen", Index::Combinadic4}, {"combinadic5", Index::Combinadic5}};
+     {"pawngen", Index::Combinadic4}, {"combinadic5", Index::Combinadic5}, {"syzygy", Index::Syzygy}};
 
 enum class FuturebaseType { Capture, Promotion, CapturePromotion, Normal, Pawngen };
 
@@ -1017,6 +1156,58 @@ unsigned long eval_to_uint64(xmlpp::Node *node, std::string xpath);
 class index_encoding;
 struct pawngen;
 
+/* A file descriptor that's closed when it goes out of scope.  tablebase_t has to stay movable (the
+ * futurebases live in a std::vector), so this moves, but doesn't copy.
+ */
+
+class file_descriptor {
+    int fd = -1;
+
+public:
+    file_descriptor(void) { }
+    file_descriptor(const file_descriptor &) = delete;
+    file_descriptor(file_descriptor && other) : fd(other.fd) { other.fd = -1; }
+    ~file_descriptor() { if (fd != -1) close(fd); }
+
+    file_descriptor & operator=(file_descriptor && other) {
+	std::swap(fd, other.fd);
+	return *this;
+    }
+
+    file_descriptor & operator=(int new_fd) {
+	if (fd != -1) close(fd);
+	fd = new_fd;
+	return *this;
+    }
+
+    operator int() const { return fd; }
+};
+
+/* Likewise, a memory mapping that's unmapped when it goes out of scope */
+
+class file_mapping {
+    void * address = nullptr;
+    size_t length = 0;
+
+public:
+    file_mapping(void) { }
+    file_mapping(const file_mapping &) = delete;
+    file_mapping(file_mapping && other) : address(other.address), length(other.length) { other.address = nullptr; }
+    ~file_mapping() { if (address) munmap(address, length); }
+
+    file_mapping & operator=(file_mapping && other) {
+	std::swap(address, other.address);
+	std::swap(length, other.length);
+	return *this;
+    }
+
+    void reset(void * new_address, size_t new_length) {
+	if (address) munmap(address, length);
+	address = new_address;
+	length = new_length;
+    }
+};
+
 class tablebase_t {
 public:
     /* I want an xmlpp::DomParser instance variable, to hold the tablebase's associated XML
@@ -1053,10 +1244,14 @@ public:
     struct format format;
 
     index_t fetch_entry(index_t index);
+    index_t read_entries(index_t index, char * entries);
+    char * entries_containing(index_t & index);
     int get_DTM(index_t index);
     int get_DTC(index_t index);
     bool get_flag(index_t index);
     Basic get_basic(index_t index);
+    int probe_nalimov(index_t index);
+    Basic probe_syzygy(index_t index);
 
     /* Which squares can a piece possible capture onto? */
 
@@ -1078,6 +1273,17 @@ public:
     Glib::ustring filename;
     std::unique_ptr<io::filtering_istream> instream;
 
+    /* for futurebases written in the block-compressed format (see write_tablebase_to_file); the
+     * block index is read into block_offsets, and the blocks themselves are read with pread()
+     * directly from block_fd, bypassing instream entirely.
+     */
+    std::vector<uint64_t> block_offsets;
+    file_descriptor block_fd;
+
+    /* for uncompressed futurebases; the entries are read directly from the mapped file */
+    file_mapping mapping;
+    char * mapped_entries = nullptr;
+
     FuturebaseType futurebase_type;
     index_t next_read_index;
     off_t offset;
@@ -1092,6 +1298,14 @@ public:
     /* Pieces */
 
     int num_pieces;
+
+    /* For each color and type of piece (color*NUM_PIECES + type) and each square, the first of our
+     * pieces that can go on that square, or -1.  This is matching_local_semilegal_group for a
+     * piece on a global board, computed once so that global_position_to_local_position() doesn't
+     * have to build a fake tablebase to get it.
+     */
+
+    int8_t global_semilegal_group[2*NUM_PIECES][64];
     std::map<PieceColor, short> num_pieces_by_color;
     std::vector<piece> pieces;
 
@@ -1099,6 +1313,13 @@ public:
 
     bool encode_stm;
 
+    /* Side-to-move is normally the index's LSB, but the 'syzygy' index puts it in the MSB, so
+     * that all of the white-to-move positions come first, like the separate tables in Nalimov
+     * and Syzygy files.
+     */
+
+    bool stm_in_msb = false;
+
     std::map<PieceColor, int> prune_enable;
     int stalemate_prune_type;		/* only RESTRICTION_NONE (0) or RESTRICTION_CONCEDE (2) allowed */
     PieceColor stalemate_prune_color;
@@ -1130,6 +1351,19 @@ int num_futurebases;
 bool using_proptables = false;		/* Proptables (see below) */
 bool compress_proptables = false;
 bool compress_entries_table = false;
+bool varint_proptables = false;		/* Delta/varint encode proptable runs */
+int temporary_file_compression_level = io::zlib::default_compression;
+
+/* Output format for finished tablebases.  Gzip is the traditional format, a single gzip stream
+ * covering both the XML header and the entries.  Blocked leaves the XML header uncompressed and
+ * zlib compresses the entries in independently decodable blocks of futurebase_stride entries,
+ * preceded by a table of their file offsets, so that fetch_entry() can seek directly to any block.
+ * Uncompressed writes the whole thing out as is, so the entries can be mmap'ed when the tablebase
+ * is later used as a futurebase.
+ */
+
+enum class OutputFormat {Gzip, Blocked, Uncompressed};
+OutputFormat output_format = OutputFormat::Gzip;
 size_t proptable_MBs = 0;
 
 xmlpp::Element * generation_statistics;
@@ -1171,9 +1405,14 @@ index_t debug_futuremove = INVALID_INDEX;
 
 /* in_middle_of_line is used to indicate that we're in the middle of printing a progress line, so a
  * text message of any kind should be prefixed with a newline.
+ *
+ * Messages come from all the threads, so each call to fatal(), warning() or info() prints under
+ * output_lock.  A message that takes several calls to build can still get interleaved with
+ * another thread's, so build it into a string first and print it with one call.
  */
 
-int fatal_errors = 0;
+std::atomic<int> fatal_errors(0);
+std::recursive_mutex output_lock;	/* recursive, since the signal handlers call fatal(), too */
 
 std::atomic<bool> in_middle_of_line(false);
 
@@ -1196,14 +1435,18 @@ void fatal (const char * format, ...)
     /* BREAKPOINT */
     if (index(format, '\n')) fatal_errors ++;
 
-    if (in_middle_of_line) {
-	fputc('\n', stderr);
-	in_middle_of_line = false;
-    }
+    {
+	std::lock_guard<std::recursive_mutex> _(output_lock);
 
-    va_start(va, format);
-    vfprintf(stderr, format, va);
-    va_end(va);
+	if (in_middle_of_line) {
+	    fputc('\n', stderr);
+	    in_middle_of_line = false;
+	}
+
+	va_start(va, format);
+	vfprintf(stderr, format, va);
+	va_end(va);
+    }
 
     if (fatal_errors >= MAX_FATAL_ERRORS) terminate();
 }
@@ -1211,6 +1454,7 @@ void fatal (const char * format, ...)
 void warning (const char * format, ...)
 {
     va_list va;
+    std::lock_guard<std::recursive_mutex> _(output_lock);
 
     if (in_middle_of_line) {
 	fputc('\n', stderr);
@@ -1226,6 +1470,7 @@ void warning (const char * format, ...)
 void info (const char * format, ...)
 {
     va_list va;
+    std::lock_guard<std::recursive_mutex> _(output_lock);
 
     if (in_middle_of_line) {
 	fputc('\n', stderr);
@@ -1330,164 +1575,639 @@ void sigaction_internal_error (int signal, siginfo_t * siginfo, void * ucontext)
     terminate();
 }
 
-/***** UTILITY FUNCTIONS *****/
+/***** LARGE ALLOCATIONS *****/
 
-int ROW(int square) {
-    return square / 8;
-}
+/* The entries table, the unpropagated index table, the frontier bitmap and the proptables can run
+ * to tens of gigabytes between them, and we hit them all over the place, so with 4KB pages nearly
+ * every access is a TLB miss.  allocate_large() gets them straight from mmap() instead of new[],
+ * and asks for huge pages:
+ *
+ * --huge-pages=transparent (the default) uses ordinary pages, with madvise(MADV_HUGEPAGE) asking the
+ * kernel to back them with transparent huge pages when it can.
+ *
+ * --huge-pages (or --huge-pages=hugetlb) uses MAP_HUGETLB, trying 1GB pages for allocations of at
+ * least 1GB, then 2MB pages.  These have to be reserved by the administrator (vm.nr_hugepages, or
+ * hugepagesz=1G hugepages=N on the kernel command line), so if there aren't enough we fall back on
+ * transparent huge pages.
+ *
+ * --huge-pages=none just uses ordinary pages.
+ *
+ * Memory from mmap() is zeroed and untouched, which is just what numa_place() needs.  Since no
+ * constructors are run, this is only for types where all zero bytes is the initial value.  We
+ * remember the length and page size of each mapping, so free_large() only needs the pointer.
+ *
+ * The old hoffman.cc.allocator experiment wrapped proptable memory in a persistent_allocator that
+ * reused the same block on every pass.  large_allocator does the same job as std::allocator, but
+ * with allocate_large() underneath, for the proptables' std::vectors.
+ *
+ * The per-thread futurebase caches (cached_entries) are only a few kilobytes each, so they're not
+ * worth a huge page.
+ */
 
-int COL(int square) {
-    return square % 8;
-}
+enum class HugePages { None, Transparent, HugeTLB };
 
-inline int rowcol2square(int row, int col)
-{
-    return (col + row*8);
-}
+HugePages huge_pages = HugePages::Transparent;
 
-/* diagonal_reflection() flips along the a1/h8 diagonal by simply interchanging the row and column */
+const size_t huge_page_2MB = 2 << 20;
+const size_t huge_page_1GB = 1 << 30;
 
-int diagonal_reflection(int square)
-{
-    return rowcol2square(COL(square), ROW(square));
-}
+struct large_mapping {
+    size_t length;
+    size_t page_size;
+};
 
-int horizontal_reflection(int square)
-{
-    return rowcol2square(ROW(square), 7-COL(square));
-}
+std::mutex large_mappings_lock;
+std::map<void *, large_mapping> large_mappings;
 
-int vertical_reflection(int square)
-{
-    return rowcol2square(7-ROW(square), COL(square));
-}
+/* Allocate 'bytes' of zeroed memory, setting 'pages' to a description of what we got.  Throws
+ * std::bad_alloc, like new[].
+ */
 
-void subtract_timeval(struct timeval *dest, struct timeval *src)
+void * allocate_large(size_t bytes, const char * & pages)
 {
-    dest->tv_sec -= src->tv_sec;
-    if (dest->tv_usec >= src->tv_usec) {
-	dest->tv_usec -= src->tv_usec;
-    } else {
-	dest->tv_usec = 1000000 + dest->tv_usec - src->tv_usec;
-	dest->tv_sec --;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    void * memory = MAP_FAILED;
+
+    if (bytes == 0) bytes = 1;
+
+    size_t length = bytes;
+
+    pages = "normal pages";
+
+#ifdef MAP_HUGETLB
+    if ((huge_pages == HugePages::HugeTLB) && (bytes >= huge_page_2MB)) {
+#ifdef MAP_HUGE_1GB
+	if (bytes >= huge_page_1GB) {
+	    length = (bytes + huge_page_1GB - 1) & ~(huge_page_1GB - 1);
+	    memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+	    if (memory != MAP_FAILED) {
+		page_size = huge_page_1GB;
+		pages = "1GB huge pages";
+	    }
+	}
+#endif
+	if (memory == MAP_FAILED) {
+	    length = (bytes + huge_page_2MB - 1) & ~(huge_page_2MB - 1);
+	    memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	    if (memory != MAP_FAILED) {
+		page_size = huge_page_2MB;
+		pages = "2MB huge pages";
+	    }
+	}
+	if (memory == MAP_FAILED) {
+	    warning("Can't get %zdMB of huge pages (%s); trying transparent huge pages\n",
+		    length/(1024*1024), strerror(errno));
+	}
     }
-}
+#endif
 
-void add_timeval(struct timeval *dest, struct timeval *src)
-{
-    dest->tv_sec += src->tv_sec;
-    dest->tv_usec += src->tv_usec;
-    if (dest->tv_usec >= 1000000) {
-	dest->tv_usec -= 1000000;
-	dest->tv_sec ++;
+    if (memory == MAP_FAILED) {
+	length = bytes;
+	memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) throw std::bad_alloc();
+
+#ifdef MADV_HUGEPAGE
+	if ((huge_pages != HugePages::None) && (bytes >= huge_page_2MB)
+	    && (madvise(memory, length, MADV_HUGEPAGE) == 0)) {
+	    pages = "transparent huge pages";
+	}
+#endif
     }
+
+    std::lock_guard<std::mutex> _(large_mappings_lock);
+    large_mappings[memory] = {length, page_size};
+
+    return memory;
 }
 
-void sprint_timeval(char *strbuf, struct timeval *timevalp)
+void free_large(void * memory)
 {
-    if (timevalp->tv_sec < 60) {
-	sprintf(strbuf, "%ld.%03lds", timevalp->tv_sec, timevalp->tv_usec/1000);
-    } else if (timevalp->tv_sec < 3600) {
-	sprintf(strbuf, "%ldm%02ld.%03lds", timevalp->tv_sec/60, timevalp->tv_sec%60,
-		timevalp->tv_usec/1000);
-    } else if (timevalp->tv_sec < 24*3600) {
-	sprintf(strbuf, "%ldh%02ldm%02ld.%03lds", timevalp->tv_sec/3600,
-		(timevalp->tv_sec/60)%60, timevalp->tv_sec%60, timevalp->tv_usec/1000);
-    } else {
-	sprintf(strbuf, "%ldd%02ldh%02ldm%02ld.%03lds",
-		timevalp->tv_sec/(24*3600), (timevalp->tv_sec/3600)%24,
-		(timevalp->tv_sec/60)%60, timevalp->tv_sec%60, timevalp->tv_usec/1000);
+    if (memory == nullptr) return;
+
+    std::lock_guard<std::mutex> _(large_mappings_lock);
+    auto it = large_mappings.find(memory);
+
+    if (it == large_mappings.end()) {
+	fatal("free_large() called on memory that allocate_large() didn't return\n");
+	return;
     }
+
+    munmap(memory, it->second.length);
+    large_mappings.erase(it);
 }
 
-void fprint_system_time(void)
+size_t large_page_size(void * memory)
 {
-    struct rusage rusage;
-    char strbuf[256];
+    std::lock_guard<std::mutex> _(large_mappings_lock);
+    auto it = large_mappings.find(memory);
 
-    getrusage(RUSAGE_SELF, &rusage);
-    sprint_timeval(strbuf, &rusage.ru_stime);
-    fprintf(stderr, "System time: %s\n", strbuf);
+    return (it == large_mappings.end()) ? sysconf(_SC_PAGESIZE) : it->second.page_size;
 }
 
-void expand_per_pass_statistics(void)
-{
-    if (max_passes == 0) max_passes = 100;
-    else max_passes *= 2;
+template <typename T>
+struct large_allocator {
+    typedef T value_type;
 
-    pass_type = (const char **) realloc(pass_type, max_passes * sizeof(const char *));
-    pass_target_dtms = (int *) realloc(pass_target_dtms, max_passes * sizeof(int));
-    positions_finalized.resize(max_passes, 0);
-    backproped_moves.resize(max_passes, 0);
+    large_allocator() { }
+    template <typename U> large_allocator(const large_allocator<U> &) { }
 
-    /* not all of these arrays are cumulative, but just zero them all to be on the safe size */
-    bzero(pass_type + total_passes, (max_passes-total_passes)*sizeof(char *));
-    bzero(pass_target_dtms + total_passes, (max_passes-total_passes)*sizeof(int));
-}
+    T * allocate(size_t n) {
+	const char * pages;
+	return static_cast<T *>(allocate_large(n * sizeof(T), pages));
+    }
 
-/***** PIECE MOVEMENT *****/
+    void deallocate(T * p, size_t) {
+	free_large(p);
+    }
+};
 
-/* namespace Movement primarily exports a single function, movements(), which is passed a piece type
- * and color, a starting square, direction (Forward or Backward), and movement type (AllMoves,
- * Capture, or NonCapture).  Return value is a vector of "directions", each direction being a vector
- * of squares.  Movement along each direction is possible until a square is occupied.  No attempt is
- * made to detect whether a square is occupied in a particular position; that's the caller's job.
- * All we're doing here is to produce a list of squares the piece can move to if there was nothing
- * else on the board.
+template <typename T, typename U>
+bool operator==(const large_allocator<T> &, const large_allocator<U> &) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const large_allocator<T> &, const large_allocator<U> &) { return false; }
+
+/***** THREAD POOL *****/
+
+/* Originally, every pass created num_threads std::threads, split the tablebase into num_threads
+ * equal contiguous blocks, and joined them all at the end.  That has two problems.  First, we pay
+ * thread creation costs on every pass, and there can be hundreds of passes.  Second, the amount of
+ * work per index varies wildly across the index space (pawn positions, king positions, illegal
+ * positions that are skipped almost immediately), so the slowest block dominated every pass while
+ * the other cores sat idle.
+ *
+ * So we now keep a single pool of persistent threads.  run() executes a function once on every
+ * thread in the pool and waits for them all to finish; this is what the proptable passes need,
+ * since they pull their own work off a shared counter and DiskEntriesTable expects every thread to
+ * stay around until the pass is done.  parallel_for() hands out chunks of an index range from a
+ * shared atomic counter, with the chunk size shrinking as the range is used up (guided
+ * scheduling), so the tail of the pass gets spread over all the threads.
+ *
+ * Chunks are always multiples of 64 indices, so that no two threads ever modify the same word of a
+ * bit-packed array like the futurevectors.
+ *
+ * The pool is never destroyed.  The worker threads just sit waiting on a condition variable until
+ * the program exits, which is better than trying to join them from a static destructor in a
+ * program that can call exit() from any thread.
+ *
+ * The pool runs one job at a time.  A job that itself called run() would wait forever for its own
+ * thread to finish, so parallel_for() from inside a job just runs the whole range on the calling
+ * thread, and run() from inside a job is a fatal error.  Callers on other threads wait their turn.
+ *
+ * On a multi-socket machine, each socket (NUMA node) has its own memory, and a thread reading
+ * another node's memory is a good deal slower than one reading its own.  By default everything is
+ * allocated by the main thread, so the kernel puts it all on one node and the threads on the other
+ * node(s) spend the whole run waiting on remote memory.  With --numa, we read the node layout from
+ * /sys, pin each pool thread to the CPUs of one node, and give each node a contiguous slice of the
+ * index space.  parallel_for() hands each thread chunks from its own node's slice until it runs
+ * out, and only then helps out with the other nodes.  Big arrays come from allocate_large(), so
+ * none of their pages exist yet, then numa_place() has each thread touch the pages of its own
+ * slice, and the kernel's first-touch policy puts each page on the node that's going to use it.
+ *
+ * That's --numa=partition, the default.  Back propagation writes to the predecessors of each
+ * position, which can be anywhere in the table, so --numa=interleave instead spreads the pages
+ * round-robin over the nodes, which at least balances the load on the memory controllers.  The
+ * unpropagated index table has no owner, so it's always interleaved.
+ *
+ * We don't use libnuma, so it's all done with first touch and sched_setaffinity().
+ *
+ * XXX --build runs several generators at once, and they all start pinning at node 0
  */
 
-namespace Movement {
+enum class NumaMode { None, Partition, Interleave };
 
-    enum PieceDirection { RIGHT, LEFT, UP, DOWN, DIAG_UL, DIAG_UR, DIAG_DL, DIAG_DR, KNIGHTmoves };
+NumaMode numa_mode = NumaMode::None;
 
-    std::vector<PieceDirection> AllPieceDirections = { RIGHT, LEFT, UP, DOWN, DIAG_UL, DIAG_UR, DIAG_DL, DIAG_DR };
+/* The CPUs of each node that we're allowed to run on, ignoring nodes without any */
 
-    class PieceMovement {
-    public:
-	std::vector<PieceDirection> directions;
-	int max_distance;
-    };
+std::vector<cpu_set_t> numa_node_cpus;
 
-    std::map<PieceType, PieceMovement> PieceMovements =
-	{{PieceType::King, {AllPieceDirections, 1}},
-	 {PieceType::Queen, {AllPieceDirections, 8}},
-	 {PieceType::Rook, {{RIGHT, LEFT, UP, DOWN}, 8}},
-	 {PieceType::Bishop, {{DIAG_UL, DIAG_UR, DIAG_DL, DIAG_DR}, 8}},
-	 {PieceType::Knight, {{KNIGHTmoves}, 1}}};
+thread_local unsigned int pool_thread_number = 0;
+thread_local unsigned int pool_thread_node = 0;
+thread_local bool in_thread_pool = false;
 
-    /* XXX is std::map the most efficient thing to use here? */
+/* Parse a Linux cpulist, like "0-7,16-23" */
 
-    typedef std::vector<std::vector<square_t>> direction_vectors;
+void parse_cpulist(const std::string & cpulist, cpu_set_t * cpus)
+{
+    std::istringstream list(cpulist);
+    std::string range;
 
-    std::map<std::pair<PieceType, square_t>, direction_vectors> piece_movements;
+    CPU_ZERO(cpus);
 
-    std::map<std::pair<PieceColor, square_t>, direction_vectors> normal_pawn_movements;
-    std::map<std::pair<PieceColor, square_t>, direction_vectors> capture_pawn_movements;
+    while (std::getline(list, range, ',')) {
+	unsigned int first, last;
+	int fields = sscanf(range.c_str(), "%u-%u", &first, &last);
+	if (fields < 1) continue;
+	if (fields == 1) last = first;
+	for (unsigned int cpu = first; (cpu <= last) && (cpu < CPU_SETSIZE); cpu ++) {
+	    CPU_SET(cpu, cpus);
+	}
+    }
+}
 
-    std::map<std::pair<PieceColor, square_t>, direction_vectors> normal_pawn_movements_bkwd;
-    std::map<std::pair<PieceColor, square_t>, direction_vectors> capture_pawn_movements_bkwd;
+void initialize_numa(void)
+{
+    cpu_set_t allowed;
 
-    std::map<std::pair<PieceColor, square_t>, direction_vectors> all_pawn_movements;
-    std::map<std::pair<PieceColor, square_t>, direction_vectors> all_pawn_movements_bkwd;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+	warning("Can't get CPU affinity (%s); NUMA mode disabled\n", strerror(errno));
+	numa_mode = NumaMode::None;
+	return;
+    }
 
-    enum Direction { Forward, Backward };
-    enum Type { AllMoves, Capture, NonCapture, NoDoublePawn };
+    for (unsigned int node = 0; ; node ++) {
+	std::ifstream cpulist_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	std::string cpulist;
 
-    const direction_vectors& movements(PieceType type, PieceColor color, square_t square,
-				       Direction dir, Type mvmt_type)
-    {
-	if (type != PieceType::Pawn) {
-	    return piece_movements[std::make_pair(type, square)];
-	} else {
+	if (! cpulist_file.good()) break;
+	std::getline(cpulist_file, cpulist);
 
-	    switch (dir) {
-	    case Forward:
-		switch (mvmt_type) {
-		case NonCapture:
-		    return normal_pawn_movements[std::make_pair(color, square)];
+	cpu_set_t cpus;
+	parse_cpulist(cpulist, &cpus);
+	CPU_AND(&cpus, &cpus, &allowed);
+	if (CPU_COUNT(&cpus) > 0) numa_node_cpus.push_back(cpus);
+    }
 
-		case Capture:
-		    return capture_pawn_movements[std::make_pair(color, square)];
+    if (numa_node_cpus.size() < 2) {
+	info("Only one NUMA node; NUMA mode disabled\n");
+	numa_node_cpus.clear();
+	numa_mode = NumaMode::None;
+	return;
+    }
+
+    if (num_threads < numa_node_cpus.size()) {
+	warning("Fewer threads than NUMA nodes; some nodes won't be used\n");
+    }
+
+    info("Using %zd NUMA nodes (%s)\n", numa_node_cpus.size(),
+	 (numa_mode == NumaMode::Interleave) ? "interleaved" : "partitioned");
+}
+
+unsigned int numa_nodes(void)
+{
+    return (numa_mode == NumaMode::None) ? 1 : numa_node_cpus.size();
+}
+
+/* Threads are handed out to the nodes in contiguous blocks, as evenly as possible */
+
+unsigned int numa_node_of_thread(unsigned int thread)
+{
+    return (uint64_t) thread * numa_nodes() / num_threads;
+}
+
+/* Where each node's slice of an index range begins.  The boundaries only depend on the end of the
+ * range, so numa_place() places an array's pages the same way parallel_for() later hands it
+ * out.  They're multiples of 4096 indices, so they're on page boundaries, and multiples of 64,
+ * which parallel_for() needs.
+ */
+
+const index_t numa_slice_alignment = 4096;
+
+index_t numa_slice_start(index_t start, index_t end, unsigned int node)
+{
+    if (node == 0) return start;
+    if (node >= numa_nodes()) return end;
+
+    index_t boundary = (end / numa_nodes()) * node + (end % numa_nodes()) * node / numa_nodes();
+    boundary -= boundary % numa_slice_alignment;
+
+    return std::min(std::max(boundary, start), end);
+}
+
+class thread_pool {
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable work_available;
+    std::condition_variable work_done;
+
+    std::function<void(void)> job;
+    unsigned int generation = 0;
+    unsigned int threads_running = 0;
+    std::vector<std::chrono::steady_clock::time_point> finish_times;
+
+    void worker(unsigned int thread) {
+	unsigned int my_generation = 0;
+
+	pool_thread_number = thread;
+	pool_thread_node = numa_node_of_thread(thread);
+	in_thread_pool = true;
+
+	if (numa_mode != NumaMode::None) {
+	    if (sched_setaffinity(0, sizeof(cpu_set_t), &numa_node_cpus[pool_thread_node]) != 0) {
+		warning("Can't pin thread %u to NUMA node %u: %s\n", thread, pool_thread_node, strerror(errno));
+	    }
+	}
+
+	while (true) {
+	    {
+		std::unique_lock<std::mutex> l(lock);
+		work_available.wait(l, [&]{ return generation != my_generation; });
+		my_generation = generation;
+	    }
+
+	    /* Don't count indices left over from the last pass */
+	    local_indices_processed = 0;
+
+	    job();
+
+	    std::lock_guard<std::mutex> _(lock);
+	    finish_times.push_back(std::chrono::steady_clock::now());
+	    if (-- threads_running == 0) work_done.notify_all();
+	}
+    }
+
+public:
+
+    void run(std::function<void(void)> function) {
+	if (in_thread_pool) {
+	    fatal("Internal error: thread pool job called run()\n");
+	    terminate();
+	}
+
+	std::unique_lock<std::mutex> l(lock);
+
+	work_done.wait(l, [this]{ return threads_running == 0; });
+
+	/* Threads are started the first time we're called, when num_threads has been set */
+
+	while (threads.size() < num_threads) {
+	    threads.emplace_back(&thread_pool::worker, this, threads.size());
+	}
+
+	job = function;
+	threads_running = threads.size();
+	finish_times.clear();
+	generation ++;
+	work_available.notify_all();
+
+	work_done.wait(l, [this]{ return threads_running == 0; });
+
+	/* The last thread to finish wasn't idle; everybody else was idle from when they finished */
+
+	for (auto finish_time : finish_times) {
+	    thread_idle_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>
+		(finish_times.back() - finish_time).count();
+	}
+    }
+
+    /* Call section(first, last) on every chunk of [start, end), where 'last' is inclusive to
+     * match the section functions that already existed when we used static blocks.
+     */
+
+    void parallel_for(index_t start, index_t end, std::function<void(index_t, index_t)> section) {
+
+	const index_t min_chunk = 1024;
+	const unsigned int nodes = numa_nodes();
+
+	if (in_thread_pool) {
+	    if (start < end) section(start, end - 1);
+	    return;
+	}
+
+	/* One shared counter per NUMA node slice (just one if we're not in NUMA mode) */
+
+	std::vector<std::atomic<index_t>> next(nodes);
+	std::vector<index_t> ends(nodes);
+
+	for (unsigned int node = 0; node < nodes; node ++) {
+	    next[node] = numa_slice_start(start, end, node);
+	    ends[node] = numa_slice_start(start, end, node + 1);
+	}
+
+	auto consume = [&](std::atomic<index_t> & next, const index_t end) {
+	    index_t first = next;
+	    index_t last;
+
+	    while (true) {
+		do {
+		    if (first >= end) return;
+		    index_t chunk = (end - first) / (4 * threads.size());
+		    if (chunk < min_chunk) chunk = min_chunk;
+		    chunk = (chunk + 63) & ~((index_t) 63);
+		    last = (end - first > chunk) ? (first + chunk) : end;
+		} while (! next.compare_exchange_weak(first, last));
+
+		section(first, last - 1);
+
+		first = next;
+	    }
+	};
+
+	run([&]{
+		for (unsigned int i = 0; i < nodes; i ++) {
+		    unsigned int node = (pool_thread_node + i) % nodes;
+		    consume(next[node], ends[node]);
+		}
+	    });
+    }
+};
+
+thread_pool &pool = * new thread_pool;
+
+/* In NUMA mode, place the pages of an array of 'count' elements from allocate_large(), either in
+ * the same slices that parallel_for() uses or round-robin.
+ */
+
+void numa_place(void * memory, size_t element_size, index_t count, bool interleave)
+{
+    if (numa_mode == NumaMode::None) return;
+
+    const size_t page_size = large_page_size(memory);
+    const size_t bytes = element_size * count;
+    const size_t pages = (bytes + page_size - 1) / page_size;
+    const unsigned int nodes = numa_nodes();
+
+    pool.run([&]{
+	    volatile char * bytes_ptr = static_cast<volatile char *>(memory);
+	    unsigned int node = pool_thread_node;
+
+	    /* Our rank among the threads on our node */
+
+	    unsigned int first_thread = pool_thread_number;
+	    unsigned int last_thread = pool_thread_number;
+	    while ((first_thread > 0) && (numa_node_of_thread(first_thread - 1) == node)) first_thread --;
+	    while ((last_thread + 1 < num_threads) && (numa_node_of_thread(last_thread + 1) == node)) last_thread ++;
+
+	    const unsigned int rank = pool_thread_number - first_thread;
+	    const unsigned int node_threads = last_thread - first_thread + 1;
+
+	    if (interleave) {
+		for (size_t page = node + rank * nodes; page < pages; page += nodes * node_threads) {
+		    bytes_ptr[page * page_size] = 0;
+		}
+	    } else {
+		const size_t first_page = numa_slice_start(0, count, node) * element_size / page_size;
+		const size_t end_page = (numa_slice_start(0, count, node + 1) * element_size + page_size - 1) / page_size;
+
+		for (size_t page = first_page + rank; page < end_page; page += node_threads) {
+		    bytes_ptr[page * page_size] = 0;
+		}
+	    }
+	});
+}
+
+/***** UTILITY FUNCTIONS *****/
+
+int ROW(int square) {
+    return square / 8;
+}
+
+int COL(int square) {
+    return square % 8;
+}
+
+inline int rowcol2square(int row, int col)
+{
+    return (col + row*8);
+}
+
+/* diagonal_reflection() flips along the a1/h8 diagonal by simply interchanging the row and column */
+
+int diagonal_reflection(int square)
+{
+    return rowcol2square(COL(square), ROW(square));
+}
+
+int horizontal_reflection(int square)
+{
+    return rowcol2square(ROW(square), 7-COL(square));
+}
+
+int vertical_reflection(int square)
+{
+    return rowcol2square(7-ROW(square), COL(square));
+}
+
+void subtract_timeval(struct timeval *dest, struct timeval *src)
+{
+    dest->tv_sec -= src->tv_sec;
+    if (dest->tv_usec >= src->tv_usec) {
+	dest->tv_usec -= src->tv_usec;
+    } else {
+	dest->tv_usec = 1000000 + dest->tv_usec - src->tv_usec;
+	dest->tv_sec --;
+    }
+}
+
+void add_timeval(struct timeval *dest, struct timeval *src)
+{
+    dest->tv_sec += src->tv_sec;
+    dest->tv_usec += src->tv_usec;
+    if (dest->tv_usec >= 1000000) {
+	dest->tv_usec -= 1000000;
+	dest->tv_sec ++;
+    }
+}
+
+void sprint_timeval(char *strbuf, struct timeval *timevalp)
+{
+    if (timevalp->tv_sec < 60) {
+	sprintf(strbuf, "%ld.%03lds", timevalp->tv_sec, timevalp->tv_usec/1000);
+    } else if (timevalp->tv_sec < 3600) {
+	sprintf(strbuf, "%ldm%02ld.%03lds", timevalp->tv_sec/60, timevalp->tv_sec%60,
+		timevalp->tv_usec/1000);
+    } else if (timevalp->tv_sec < 24*3600) {
+	sprintf(strbuf, "%ldh%02ldm%02ld.%03lds", timevalp->tv_sec/3600,
+		(timevalp->tv_sec/60)%60, timevalp->tv_sec%60, timevalp->tv_usec/1000);
+    } else {
+	sprintf(strbuf, "%ldd%02ldh%02ldm%02ld.%03lds",
+		timevalp->tv_sec/(24*3600), (timevalp->tv_sec/3600)%24,
+		(timevalp->tv_sec/60)%60, timevalp->tv_sec%60, timevalp->tv_usec/1000);
+    }
+}
+
+void fprint_system_time(void)
+{
+    struct rusage rusage;
+    char strbuf[256];
+
+    getrusage(RUSAGE_SELF, &rusage);
+    sprint_timeval(strbuf, &rusage.ru_stime);
+    fprintf(stderr, "System time: %s\n", strbuf);
+}
+
+void expand_per_pass_statistics(void)
+{
+    if (max_passes == 0) max_passes = 100;
+    else max_passes *= 2;
+
+    pass_type = (const char **) realloc(pass_type, max_passes * sizeof(const char *));
+    pass_target_dtms = (int *) realloc(pass_target_dtms, max_passes * sizeof(int));
+    positions_finalized.resize(max_passes, 0);
+    backproped_moves.resize(max_passes, 0);
+
+    /* not all of these arrays are cumulative, but just zero them all to be on the safe size */
+    bzero(pass_type + total_passes, (max_passes-total_passes)*sizeof(char *));
+    bzero(pass_target_dtms + total_passes, (max_passes-total_passes)*sizeof(int));
+}
+
+/***** PIECE MOVEMENT *****/
+
+/* namespace Movement primarily exports a single function, movements(), which is passed a piece type
+ * and color, a starting square, direction (Forward or Backward), and movement type (AllMoves,
+ * Capture, or NonCapture).  Return value is a vector of "directions", each direction being a vector
+ * of squares.  Movement along each direction is possible until a square is occupied.  No attempt is
+ * made to detect whether a square is occupied in a particular position; that's the caller's job.
+ * All we're doing here is to produce a list of squares the piece can move to if there was nothing
+ * else on the board.
+ */
+
+namespace Movement {
+
+    enum PieceDirection { RIGHT, LEFT, UP, DOWN, DIAG_UL, DIAG_UR, DIAG_DL, DIAG_DR, KNIGHTmoves };
+
+    std::vector<PieceDirection> AllPieceDirections = { RIGHT, LEFT, UP, DOWN, DIAG_UL, DIAG_UR, DIAG_DL, DIAG_DR };
+
+    class PieceMovement {
+    public:
+	std::vector<PieceDirection> directions;
+	int max_distance;
+    };
+
+    std::map<PieceType, PieceMovement> PieceMovements =
+	{{PieceType::King, {AllPieceDirections, 1}},
+	 {PieceType::Queen, {AllPieceDirections, 8}},
+	 {PieceType::Rook, {{RIGHT, LEFT, UP, DOWN}, 8}},
+	 {PieceType::Bishop, {{DIAG_UL, DIAG_UR, DIAG_DL, DIAG_DR}, 8}},
+	 {PieceType::Knight, {{KNIGHTmoves}, 1}}};
+
+    /* XXX is std::map the most efficient thing to use here? */
+
+    typedef std::vector<std::vector<square_t>> direction_vectors;
+
+    std::map<std::pair<PieceType, square_t>, direction_vectors> piece_movements;
+
+    std::map<std::pair<PieceColor, square_t>, direction_vectors> normal_pawn_movements;
+    std::map<std::pair<PieceColor, square_t>, direction_vectors> capture_pawn_movements;
+
+    std::map<std::pair<PieceColor, square_t>, direction_vectors> normal_pawn_movements_bkwd;
+    std::map<std::pair<PieceColor, square_t>, direction_vectors> capture_pawn_movements_bkwd;
+
+    std::map<std::pair<PieceColor, square_t>, direction_vectors> all_pawn_movements;
+    std::map<std::pair<PieceColor, square_t>, direction_vectors> all_pawn_movements_bkwd;
+
+    enum Direction { Forward, Backward };
+    enum Type { AllMoves, Capture, NonCapture, NoDoublePawn };
+
+    const direction_vectors& movements(PieceType type, PieceColor color, square_t square,
+				       Direction dir, Type mvmt_type)
+    {
+	if (type != PieceType::Pawn) {
+	    return piece_movements[std::make_pair(type, square)];
+	} else {
+
+	    switch (dir) {
+	    case Forward:
+		switch (mvmt_type) {
+		case NonCapture:
+		    return normal_pawn_movements[std::make_pair(color, square)];
+
+		case Capture:
+		    return capture_pawn_movements[std::make_pair(color, square)];
 
 		case AllMoves:
 		    return all_pawn_movements[std::make_pair(color, square)];
@@ -1799,16 +2519,15 @@ int black_pawns_required = 0;
  *
  * Will be used to form into two std::sets that track valid_pawn_positions and
  * invalid_pawn_positions, ordered by the default operators.  operator<, in particular, is somewhat
- * slow.  The valid_pawn_positions will be sorted into two std::vectors, pawn_positions_by_position
- * (ordered by pawn_position_fast_compare) and pawn_positions_by_index (ordered by the standard
- * operators).
+ * slow.  The valid_pawn_positions will be copied into a std::vector, pawn_positions_by_index (ordered
+ * by the standard operators), and a perfect hash (see build_pawngen_lookup) maps pawn positions
+ * back to their indices.
  */
 
 class pawn_position {
 
     friend bool operator< (const pawn_position & LHS, const pawn_position & RHS);
     friend bool operator== (const pawn_position & LHS, const pawn_position & RHS);
-    friend bool pawn_position_fast_compare (const pawn_position & LHS, const pawn_position & RHS);
 
     int total_white_pawns = 0;
     int total_black_pawns = 0;
@@ -1971,8 +2690,8 @@ public:
  * side-to-move flag encoded, as the side-to-move is always the opposite color of the en passant
  * pawn.
  *
- * XXX We might want a second, faster comparison operator to use when searching for a particular
- * position after the index numbers have been assigned.
+ * Once the index numbers have been assigned, we find a particular position with a hash lookup,
+ * not by comparing.
  */
 
 /* bit count of the number of bits in a 8-bit number */
@@ -2036,17 +2755,6 @@ bool operator!= (const pawn_position & LHS, const pawn_position & RHS)
     return !(LHS == RHS);
 }
 
-bool pawn_position_fast_compare (const pawn_position & LHS, const pawn_position & RHS)
-{
-    if (LHS.white_pawns != RHS.white_pawns) {
-	return LHS.white_pawns < RHS.white_pawns;
-    } else if (LHS.black_pawns != RHS.black_pawns) {
-	return LHS.black_pawns < RHS.black_pawns;
-    } else {
-	return LHS.en_passant_square < RHS.en_passant_square;
-    }
-}
-
 /* Recursively compute all possible pawn positions that can arise from a starting position.
  *
  * Pawns can always be captured by a piece.  They can always move forward and can always capture
@@ -2064,9 +2772,12 @@ std::set<pawn_position> invalid_pawn_positions;
 struct pawngen {
     uint64_t initial_white_pawns;
     uint64_t initial_black_pawns;
-    std::vector<pawn_position> pawn_positions_by_position;
     std::vector<pawn_position> pawn_positions_by_index;
 
+    /* Perfect hash from pawn position to pawngen index; see build_pawngen_lookup() */
+    std::vector<uint32_t> displacements;
+    std::vector<int32_t> slots;
+
     off_t offset;  /* Offset in file for pre-computed tables */
     int start;     /* Starting pawngen index in this tablebase */
     int count;     /* Number of pawngen indices in this tablebase */
@@ -2350,6 +3061,111 @@ void tablebase_t::parse_pawngen_element(xmlpp::Node * xml)
     }
 }
 
+/* Looking up a pawn position's index used to be a binary search through a second copy of
+ * pawn_positions_by_index sorted by bitboards, and finding a pawn position's predecessors in
+ * finalize_pawngen_initialization() was a linear search, which made it quadratic in the number of
+ * pawn positions.  Now we use a "hash and displace" perfect hash.  Each position's hash picks a
+ * bucket, and each bucket gets a displacement, chosen when the table is built, that sends all of
+ * its positions to distinct empty slots.  A lookup is then two hashes, one slot, and one compare
+ * (to reject positions that aren't in the table), with no probing.
+ *
+ * The slot table is a power of two at least twice the number of positions, and there's a bucket
+ * for every four positions.  At that load, the biggest buckets (which we place first) only need a
+ * handful of tries.
+ */
+
+inline uint64_t pawngen_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+inline uint64_t pawngen_hash(const pawn_position & pp)
+{
+    return pawngen_mix(pp.white_pawns ^ pawngen_mix(pp.black_pawns ^ (uint32_t) pp.en_passant_square));
+}
+
+inline size_t pawngen_slot(const struct pawngen * pawngen, uint64_t hash, uint32_t displacement)
+{
+    return pawngen_mix(hash + displacement * 0x9e3779b97f4a7c15ULL) & (pawngen->slots.size() - 1);
+}
+
+void build_pawngen_lookup(struct pawngen * pawngen)
+{
+    size_t count = pawngen->pawn_positions_by_index.size();
+    size_t num_slots = 2;
+
+    while (num_slots < 2 * count) num_slots *= 2;
+
+    pawngen->slots.assign(num_slots, -1);
+    pawngen->displacements.assign(count / 4 + 1, 0);
+
+    std::vector<uint64_t> hashes(count);
+    std::vector<std::vector<int32_t>> buckets(pawngen->displacements.size());
+
+    for (size_t index = 0; index < count; index ++) {
+	hashes[index] = pawngen_hash(pawngen->pawn_positions_by_index[index]);
+	buckets[hashes[index] % buckets.size()].push_back(index);
+    }
+
+    std::vector<uint32_t> order(buckets.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+		     [&](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+    std::vector<size_t> bucket_slots;
+
+    for (auto bucket : order) {
+	if (buckets[bucket].empty()) break;
+
+	for (uint32_t displacement = 0; ; displacement ++) {
+
+	    /* Two identical pawn positions would never land in different slots */
+
+	    if (displacement == (1 << 24)) {
+		throw std::runtime_error("Can't build pawngen lookup table (duplicate pawn positions?)");
+	    }
+
+	    bucket_slots.clear();
+	    for (auto index : buckets[bucket]) {
+		size_t slot = pawngen_slot(pawngen, hashes[index], displacement);
+		if ((pawngen->slots[slot] != -1)
+		    || (std::find(bucket_slots.begin(), bucket_slots.end(), slot) != bucket_slots.end())) {
+		    break;
+		}
+		bucket_slots.push_back(slot);
+	    }
+
+	    if (bucket_slots.size() == buckets[bucket].size()) {
+		for (size_t i = 0; i < bucket_slots.size(); i ++) {
+		    pawngen->slots[bucket_slots[i]] = buckets[bucket][i];
+		}
+		pawngen->displacements[bucket] = displacement;
+		break;
+	    }
+	}
+    }
+}
+
+/* Returns pp's index in pawn_positions_by_index, or -1 if it isn't there */
+
+int pawngen_lookup(const struct pawngen * pawngen, const pawn_position & pp)
+{
+    uint64_t hash = pawngen_hash(pp);
+    uint32_t displacement = pawngen->displacements[hash % pawngen->displacements.size()];
+    int32_t index = pawngen->slots[pawngen_slot(pawngen, hash, displacement)];
+
+    if ((index == -1) || (pawngen->pawn_positions_by_index[index] != pp)) {
+	return -1;
+    }
+
+    return index;
+}
+
 /* The pawngen pawn positions take a while to compute, so we save them as part of the stored
  * tablebase.  If we're loaded a precomputed tablebase, we need to wait until we've parsed the XML
  * before loading the pawn positions.  Then we finish processing pawngen.
@@ -2363,68 +3179,66 @@ void tablebase_t::finalize_pawngen_initialization(void)
 	pawngen->count = pawngen->pawn_positions_by_index.size() - pawngen->start;
     }
 
-    pawngen->pawn_positions_by_position.resize(pawngen->pawn_positions_by_index.size());
+    build_pawngen_lookup(pawngen.get());
 
     /* Figure which pawn positions arise from moving each pawn one step backwards, and save the
-     * corresponding change in index in delta_pawngen_index.
+     * corresponding change in index in delta_pawngen_index.  Each index only writes its own
+     * pawn_position, so we can split them up between the threads.
+     *
+     * This makes constructing a tablebase use the thread pool, and the first use of the pool starts
+     * its threads, so no tablebase can be constructed before -t and --numa have been processed
+     * (see main(), which calls initialize_numa() before --build for this reason).  If we're
+     * constructed from inside a pool job, parallel_for() runs this on our own thread.
      */
 
-    for (unsigned int index = 0; index < pawngen->pawn_positions_by_index.size(); index ++) {
-	for (int piece = 0; piece < num_pieces; piece ++) {
-	    pawngen->pawn_positions_by_index[index].prev_position[piece] = ILLEGAL_POSITION;
-	    pawngen->pawn_positions_by_index[index].delta_pawngen_index[piece] = 0;
-	    pawngen->pawn_positions_by_index[index].prev_position2[piece] = ILLEGAL_POSITION;
-	    pawngen->pawn_positions_by_index[index].delta_pawngen_index2[piece] = 0;
-	    if (pieces[piece].piece_type == PieceType::Pawn) {
-		pawn_position prev_pp = pawngen->pawn_positions_by_index[index];
-		uint8_t prev_position;
-		if (pieces[piece].color == PieceColor::White) {
-		    prev_position = prev_pp.position[piece] - 8;
-		    prev_pp.remove_white_pawn(prev_pp.position[piece]);
-		    prev_pp.add_white_pawn(prev_position);
-		} else {
-		    prev_position = prev_pp.position[piece] + 8;
-		    prev_pp.remove_black_pawn(prev_pp.position[piece]);
-		    prev_pp.add_black_pawn(prev_position);
-		}
-		auto it = std::find(pawngen->pawn_positions_by_index.begin(),
-				    pawngen->pawn_positions_by_index.end(),
-				    prev_pp);
-		if (it != pawngen->pawn_positions_by_index.end()) {
-		    pawngen->pawn_positions_by_index[index].prev_position[piece] = prev_position;
-		    pawngen->pawn_positions_by_index[index].delta_pawngen_index[piece]
-			= it->index - pawngen->pawn_positions_by_index[index].index;
-		}
-
-		if (((pieces[piece].color == PieceColor::White) && (ROW(prev_position) == 2))
-		    || ((pieces[piece].color == PieceColor::Black) && (ROW(prev_position) == 5))) {
-
+    pool.parallel_for(0, pawngen->pawn_positions_by_index.size(), [this](index_t first, index_t last) {
+	for (int index = first; index <= (int) last; index ++) {
+	    for (int piece = 0; piece < num_pieces; piece ++) {
+		pawngen->pawn_positions_by_index[index].prev_position[piece] = ILLEGAL_POSITION;
+		pawngen->pawn_positions_by_index[index].delta_pawngen_index[piece] = 0;
+		pawngen->pawn_positions_by_index[index].prev_position2[piece] = ILLEGAL_POSITION;
+		pawngen->pawn_positions_by_index[index].delta_pawngen_index2[piece] = 0;
+		if (pieces[piece].piece_type == PieceType::Pawn) {
+		    pawn_position prev_pp = pawngen->pawn_positions_by_index[index];
+		    uint8_t prev_position;
 		    if (pieces[piece].color == PieceColor::White) {
-			prev_pp.remove_white_pawn(prev_position);
-			prev_position -= 8;
+			prev_position = prev_pp.position[piece] - 8;
+			prev_pp.remove_white_pawn(prev_pp.position[piece]);
 			prev_pp.add_white_pawn(prev_position);
 		    } else {
-			prev_pp.remove_black_pawn(prev_position);
-			prev_position += 8;
+			prev_position = prev_pp.position[piece] + 8;
+			prev_pp.remove_black_pawn(prev_pp.position[piece]);
 			prev_pp.add_black_pawn(prev_position);
 		    }
+		    int prev_index = pawngen_lookup(pawngen.get(), prev_pp);
+		    if (prev_index != -1) {
+			pawngen->pawn_positions_by_index[index].prev_position[piece] = prev_position;
+			pawngen->pawn_positions_by_index[index].delta_pawngen_index[piece] = prev_index - index;
+		    }
+
+		    if (((pieces[piece].color == PieceColor::White) && (ROW(prev_position) == 2))
+			|| ((pieces[piece].color == PieceColor::Black) && (ROW(prev_position) == 5))) {
+
+			if (pieces[piece].color == PieceColor::White) {
+			    prev_pp.remove_white_pawn(prev_position);
+			    prev_position -= 8;
+			    prev_pp.add_white_pawn(prev_position);
+			} else {
+			    prev_pp.remove_black_pawn(prev_position);
+			    prev_position += 8;
+			    prev_pp.add_black_pawn(prev_position);
+			}
 
-		    auto it = std::find(pawngen->pawn_positions_by_index.begin(),
-					pawngen->pawn_positions_by_index.end(),
-					prev_pp);
-		    if (it != pawngen->pawn_positions_by_index.end()) {
-			pawngen->pawn_positions_by_index[index].prev_position2[piece] = prev_position;
-			pawngen->pawn_positions_by_index[index].delta_pawngen_index2[piece]
-			    = it->index - pawngen->pawn_positions_by_index[index].index;
+			int prev_index = pawngen_lookup(pawngen.get(), prev_pp);
+			if (prev_index != -1) {
+			    pawngen->pawn_positions_by_index[index].prev_position2[piece] = prev_position;
+			    pawngen->pawn_positions_by_index[index].delta_pawngen_index2[piece] = prev_index - index;
+			}
 		    }
 		}
 	    }
 	}
-	pawngen->pawn_positions_by_position[index] = pawngen->pawn_positions_by_index[index];
-    }
-
-    std::sort(pawngen->pawn_positions_by_position.begin(), pawngen->pawn_positions_by_position.end(),
-	      pawn_position_fast_compare);
+    });
 }
 
 
@@ -2731,6 +3545,49 @@ public:
 	pos->decoded = false;
     }
 
+protected:
+
+    /* Incremental moves.  Most of our moves during back propagation are a single piece stepping
+     * from one square to another.  If that piece's term in the index depends on nothing but its
+     * own square, we can subtract out the old term, add in the new one, and leave the position
+     * 'decoded', saving a full normalize/encode on the next local_position_to_index().
+     *
+     * That's only true for a piece that isn't a king (which would change the reflections and
+     * multiplicity), isn't a pawn (en passant, blocking pawns, pawngen), and isn't in a semilegal
+     * group (which normalize_position would sort).  The position can't be reflected or color
+     * inverted, either, since then the index doesn't encode piece_position[] directly, and the
+     * destination must be a legal, empty square, or the new position wouldn't be valid.  When in
+     * doubt, the derived classes fall back on index_encoding::move_piece().
+     */
+
+    bool can_move_piece_in_place(const tablebase_t * tb, local_position_t *pos, const int piece, const int destination_square)
+    {
+	return tb->encode_stm
+	    && (pos->reflection == REFLECTION_NONE)
+	    && (pos->en_passant_square == ILLEGAL_POSITION)
+	    && (tb->pieces[piece].piece_type != PieceType::King)
+	    && (tb->pieces[piece].piece_type != PieceType::Pawn)
+	    && (tb->pieces[piece].prev_piece_in_semilegal_group == -1)
+	    && (tb->pieces[piece].next_piece_in_semilegal_group == -1)
+	    && (tb->pieces[piece].legal_squares & BITVECTOR(destination_square))
+	    && ! (pos->board_vector & BITVECTOR(destination_square));
+    }
+
+    /* 'delta' is the change in the encoding's own index; unsigned wraparound takes care of
+     * negative deltas.  Side-to-move is usually the LSB of the tablebase index, so we scale by two.
+     */
+
+    void move_piece_in_place(const tablebase_t * tb, local_position_t *pos, const int piece, const int destination_square, index_t delta)
+    {
+	pos->board_vector &= ~BITVECTOR(pos->piece_position[piece]);
+	pos->piece_position[piece] = destination_square;
+	pos->unreflected_piece_position[piece] = destination_square;
+	pos->board_vector |= BITVECTOR(destination_square);
+	pos->index += (tb->stm_in_msb ? 1 : 2) * delta;
+    }
+
+public:
+
     /* 'size' is the number of indices generated the index encoding, which is different from the
      * number of indices in the tablebase, because 'size' excludes side-to-move and pawngen.
      */
@@ -2755,7 +3612,7 @@ public:
  * its white king encoding, since it works with 2-way and 4-way symmetry.
  */
 
-class naive_index : public index_encoding {
+class naive_index final : public index_encoding {
 
 public:
 
@@ -2881,7 +3738,7 @@ public:
  * Currently, only pairs of identical pieces are correctly handled.
  */
 
-class naive2_index : public index_encoding
+class naive2_index final : public index_encoding
 {
     int prev_piece_in_encoding_group[MAX_PIECES];
     int next_piece_in_encoding_group[MAX_PIECES];
@@ -3097,12 +3954,16 @@ public:
  * restrictions on the pieces.
  */
 
-class simple_index : public index_encoding
+class simple_index final : public index_encoding
 {
     int piece_position[MAX_PIECES][64];
     index_t piece_index[MAX_PIECES][64];
 
     int total_legal_positions[MAX_PIECES] = {};
+    index_t piece_multiplier[MAX_PIECES];
+
+    const unsigned int serial = ++ next_serial;
+    static std::atomic<unsigned int> next_serial;
 
 public:
 
@@ -3136,10 +3997,61 @@ public:
     {
 	int piece;
 
+	/* Decoding a mixed radix number takes a division per piece, which is expensive compared to
+	 * everything else we do here.  Most of our callers walk through the tablebase in order, so
+	 * each thread remembers the digits of the last index it decoded.  If we've moved forward by
+	 * less than the radix of the last piece, we can add the difference into the last digit and
+	 * carry at most once into each of the others.  We key the cache on a serial number rather
+	 * than 'this' because futurebases come and go, and a new one could land at an old address.
+	 */
+
+	static thread_local unsigned int cached_encoding = 0;
+	static thread_local index_t cached_index;
+	static thread_local int cached_digits[MAX_PIECES];
+
+	if ((cached_encoding == serial) && (index >= cached_index)
+	    && (index - cached_index < (index_t) total_legal_positions[tb->num_pieces - 1])) {
+
+	    cached_digits[tb->num_pieces - 1] += index - cached_index;
+
+	    for (piece = tb->num_pieces - 1;
+		 (piece > 0) && (cached_digits[piece] >= total_legal_positions[piece]);
+		 piece --) {
+		cached_digits[piece] -= total_legal_positions[piece];
+		cached_digits[piece - 1] ++;
+	    }
+
+	    /* Carrying out of the first digit means we've run off the end of the table */
+
+	    if (cached_digits[0] >= total_legal_positions[0]) {
+		cached_encoding = 0;
+		fatal("index != 0 at end of simple_index::index_to_position!\n");
+		return false;
+	    }
+
+	} else {
+
+	    index_t remaining = index;
+
+	    for (piece = tb->num_pieces - 1; piece >= 0; piece --) {
+		cached_digits[piece] = remaining % total_legal_positions[piece];
+		remaining /= total_legal_positions[piece];
+	    }
+
+	    if (remaining != 0) {
+		cached_encoding = 0;
+		fatal("index != 0 at end of simple_index::index_to_position!\n");
+		return false;
+	    }
+
+	    cached_encoding = serial;
+	}
+
+	cached_index = index;
+
 	for (piece = tb->num_pieces - 1; piece >= 0; piece --) {
 
-	    int square = piece_position[piece][index % total_legal_positions[piece]];
-	    index /= total_legal_positions[piece];
+	    int square = piece_position[piece][cached_digits[piece]];
 
 	    /* En passant */
 	    if ((tb->pieces[piece].piece_type == PieceType::Pawn) && (square < 8)) {
@@ -3167,14 +4079,24 @@ public:
 	    }
 	}
 
-	if (index != 0) {
-	    fatal("index != 0 at end of simple_index::index_to_position!\n");
-	    return false;
-	}
-
 	return true;
     }
 
+    /* A piece's term in a simple index is just its digit times the product of the radices of
+     * the pieces after it.
+     */
+
+    void move_piece(const tablebase_t * tb, local_position_t *pos, const int piece, const int destination_square)
+    {
+	if (can_move_piece_in_place(tb, pos, piece, destination_square)) {
+	    move_piece_in_place(tb, pos, piece, destination_square,
+				(piece_index[piece][destination_square] - piece_index[piece][pos->piece_position[piece]])
+				* piece_multiplier[piece]);
+	} else {
+	    index_encoding::move_piece(tb, pos, piece, destination_square);
+	}
+    }
+
     simple_index(const tablebase_t *tb)
     {
 	size = 1;
@@ -3200,10 +4122,19 @@ public:
 	    }
 	    size *= total_legal_positions[piece];
 	}
+
+	index_t multiplier = 1;
+
+	for (int piece = tb->num_pieces - 1; piece >= 0; piece --) {
+	    piece_multiplier[piece] = multiplier;
+	    multiplier *= total_legal_positions[piece];
+	}
     }
 
 };
 
+std::atomic<unsigned int> simple_index::next_serial(0);
+
 /* "compact" index
  *
  * A combination of the delta encoding for identical pieces used in "naive2", the encoding of
@@ -3249,7 +4180,7 @@ public:
  * the two pawns wouldn't be identical in their ranges.
  */
 
-class compact_index : public index_encoding
+class compact_index final : public index_encoding
 {
     int prev_piece_in_encoding_group[MAX_PIECES];
     int next_piece_in_encoding_group[MAX_PIECES];
@@ -3611,7 +4542,7 @@ int choose(int n, int k) {
     return retval;
 }
 
-class combinadic_index : public index_encoding
+class combinadic_index final : public index_encoding
 {
     int prev_piece_in_encoding_group[MAX_PIECES];
     int next_piece_in_encoding_group[MAX_PIECES];
@@ -3624,6 +4555,7 @@ class combinadic_index : public index_encoding
     uint8_t black_king_position[64*64];
     index_t king_index[64][64];
     index_t king_multiplier;
+    index_t king_positions = 0;
 
     int total_legal_positions[MAX_PIECES] = {};
     int total_legal_piece_values[MAX_PIECES];
@@ -3639,6 +4571,18 @@ class combinadic_index : public index_encoding
     int last_overlapping_piece[MAX_PIECES];
     int last_overlapping_group[MAX_PIECES];
 
+    /* Is this piece an overlapping piece for some later piece?  If so, moving it changes the
+     * later piece's encoding value, too, and move_piece() can't update the index incrementally.
+     */
+
+    bool overlaps_later_piece[MAX_PIECES] = {};
+
+    /* The 'syzygy' index puts the king index in the most significant bits (just below
+     * side-to-move), no matter where the kings are in the piece list.
+     */
+
+    const bool kings_in_msb;
+
     /* A bitvector of the smaller squares than this one.  Initialized in constructor.
      *
      * XXX smaller_pieces needs to take restricted locations into account
@@ -3749,17 +4693,22 @@ public:
 	 * (running) index, subtract it out of the index, and store the encoding values.  This loop
 	 * has to run in reverse order over the pieces, since a combinadic encoding must be backed
 	 * out from the largest piece first.
+	 *
+	 * When we're walking through the tablebase in order, only the last piece or two change from
+	 * one index to the next, so each thread keeps the values it decoded last time as hints.  A
+	 * hint costs a pair of comparisons to check, and we only fall back on the binary search (or
+	 * the division, for the kings) if it's wrong.  The check is exact, so a stale hint left over
+	 * from some other tablebase is harmless.
 	 */
 
-	for (piece = tb->num_pieces - 1; piece >= 0; piece --) {
+	static thread_local uint8_t value_hint[MAX_PIECES];
 
-	    if (piece == tb->white_king) {
-		index_t king_index = index / king_multiplier;
-		index %= king_multiplier;
+	if (kings_in_msb) decode_kings(tb, index, p);
 
-		p->piece_position[tb->white_king] = white_king_position[king_index];
-		p->piece_position[tb->black_king] = black_king_position[king_index];
+	for (piece = tb->num_pieces - 1; piece >= 0; piece --) {
 
+	    if (piece == tb->white_king) {
+		if (! kings_in_msb) decode_kings(tb, index, p);
 		continue;
 	    }
 
@@ -3767,9 +4716,15 @@ public:
 
 	    if (tb->pawngen && (tb->pieces[piece].piece_type == PieceType::Pawn)) continue;
 
-	    vals[piece]
-		= std::lower_bound(piece_index[piece], piece_index[piece] + 64, index+1)
-		- piece_index[piece] - 1;
+	    vals[piece] = value_hint[piece];
+
+	    if ((index < piece_index[piece][vals[piece]])
+		|| ((vals[piece] < 63) && (index >= piece_index[piece][vals[piece] + 1]))) {
+		vals[piece]
+		    = std::lower_bound(piece_index[piece], piece_index[piece] + 64, index+1)
+		    - piece_index[piece] - 1;
+		value_hint[piece] = vals[piece];
+	    }
 
 	    index -= piece_index[piece][vals[piece]];
 
@@ -3925,9 +4880,94 @@ public:
 	return true;
     }
 
+    /* The king index is the most significant part of whatever's left of the index by the time we
+     * get to the white king, which is either all of it (kings_in_msb) or the part above the pieces
+     * that precede the white king in the piece list.  Like the encoding values above, we keep the
+     * last king index as a hint.
+     */
+
+    void decode_kings(const tablebase_t * tb, index_t & index, local_position_t *p)
+    {
+	static thread_local unsigned int king_hint;
+
+	index_t king_index = king_hint;
+
+	if ((king_index >= king_positions)
+	    || (index < king_index * king_multiplier) || (index - king_index * king_multiplier >= king_multiplier)) {
+	    king_index = index / king_multiplier;
+	    king_hint = king_index;
+	}
+
+	index -= king_index * king_multiplier;
+
+	p->piece_position[tb->white_king] = white_king_position[king_index];
+	p->piece_position[tb->black_king] = black_king_position[king_index];
+    }
+
+    /* A piece alone in its encoding group contributes piece_index[] of its own encoding value,
+     * reduced by one for each earlier overlapping piece on a smaller square, exactly as in
+     * position_to_index().
+     */
+
+    index_t piece_term(local_position_t *pos, const int piece, const int square)
+    {
+	int val = value[piece][square];
+
+	for (int piece2 = last_overlapping_piece[piece]; piece2 != -1; piece2 = last_overlapping_piece[piece2]) {
+	    if (square > pos->piece_position[piece2]) val --;
+	}
+
+	return piece_index[piece][val];
+    }
+
+    void move_piece(const tablebase_t * tb, local_position_t *pos, const int piece, const int destination_square)
+    {
+	if (! overlaps_later_piece[piece]
+	    && (prev_piece_in_encoding_group[piece] == -1) && (next_piece_in_encoding_group[piece] == -1)
+	    && can_move_piece_in_place(tb, pos, piece, destination_square)) {
+	    move_piece_in_place(tb, pos, piece, destination_square,
+				piece_term(pos, piece, destination_square)
+				- piece_term(pos, piece, pos->piece_position[piece]));
+	} else {
+	    index_encoding::move_piece(tb, pos, piece, destination_square);
+	}
+    }
+
+    /* Build the paired king encoding, using whatever 'size' we've accumulated so far as the
+     * multiplier.
+     */
+
+    void encode_kings(const tablebase_t * tb)
+    {
+	int king_position = 0;
+	for (int white_king_square = 0; white_king_square < 64; white_king_square ++) {
+	    if (! (tb->pieces[tb->white_king].legal_squares & BITVECTOR(white_king_square))) continue;
+	    for (int black_king_square = 0; black_king_square < 64; black_king_square ++) {
+		if (! (tb->pieces[tb->black_king].legal_squares & BITVECTOR(black_king_square))) continue;
+		if ((tb->symmetry >= 2) && (COL(white_king_square) >= 4)) continue;
+		if ((tb->symmetry >= 4) && (ROW(white_king_square) >= 4)) continue;
+		if ((tb->symmetry == 8) && (ROW(white_king_square) > COL(white_king_square))) continue;
+		if ((tb->symmetry == 8) && (ROW(white_king_square) == COL(white_king_square))
+		    && (ROW(black_king_square) > COL(black_king_square))) continue;
+
+		if (tb->positions_with_adjacent_kings_are_illegal
+		    && ! check_king_legality(white_king_square, black_king_square)) continue;
+
+		white_king_position[king_position] = white_king_square;
+		black_king_position[king_position] = black_king_square;
+		king_index[white_king_square][black_king_square] = size * king_position;
+		king_position ++;
+	    }
+	}
+
+	king_multiplier = size;
+	king_positions = king_position;
+	size *= king_position;
+    }
+
     /* XXX This argument isn't 'const' because it might modify semilegal ranges. */
 
-    combinadic_index(tablebase_t *tb)
+    combinadic_index(tablebase_t *tb) : kings_in_msb(tb->index_type == Index::Syzygy)
     {
 	/* Construct smaller_pieces */
 	for (int i=0; i<64; i++) {
@@ -4037,30 +5077,7 @@ public:
 	    last_overlapping_group[piece] = last_overlapping_piece[piece2];
 
 	    if (piece == tb->white_king) {
-		int king_position = 0;
-		for (int white_king_square = 0; white_king_square < 64; white_king_square ++) {
-		    if (! (tb->pieces[tb->white_king].legal_squares & BITVECTOR(white_king_square))) continue;
-		    for (int black_king_square = 0; black_king_square < 64; black_king_square ++) {
-			if (! (tb->pieces[tb->black_king].legal_squares & BITVECTOR(black_king_square))) continue;
-			if ((tb->symmetry >= 2) && (COL(white_king_square) >= 4)) continue;
-			if ((tb->symmetry >= 4) && (ROW(white_king_square) >= 4)) continue;
-			if ((tb->symmetry == 8) && (ROW(white_king_square) > COL(white_king_square))) continue;
-			if ((tb->symmetry == 8) && (ROW(white_king_square) == COL(white_king_square))
-			    && (ROW(black_king_square) > COL(black_king_square))) continue;
-
-			if (tb->positions_with_adjacent_kings_are_illegal
-			    && ! check_king_legality(white_king_square, black_king_square)) continue;
-
-			white_king_position[king_position] = white_king_square;
-			black_king_position[king_position] = black_king_square;
-			king_index[white_king_square][black_king_square] = size * king_position;
-			king_position ++;
-		    }
-		}
-
-		king_multiplier = size;
-		size *= king_position;
-
+		if (! kings_in_msb) encode_kings(tb);
 		continue;
 	    }
 
@@ -4137,6 +5154,8 @@ public:
 
 	}
 
+	if (kings_in_msb) encode_kings(tb);
+
 	/* Now we pad the tail end of the index arrays with 'size'.  This allows us to search the
 	 * table using std::lower_bound without having to worry about where its actual end is, which
 	 * will typically be before its physical end.
@@ -4149,9 +5168,64 @@ public:
 		piece_index[piece][value] = size;
 	    }
 	}
+
+	for (int piece = 0; piece < tb->num_pieces; piece ++) {
+	    if ((piece == tb->white_king) || (piece == tb->black_king)) continue;
+	    if (tb->pawngen && (tb->pieces[piece].piece_type == PieceType::Pawn)) continue;
+	    int piece2;
+	    for (piece2 = piece; prev_piece_in_encoding_group[piece2] != -1; piece2 = prev_piece_in_encoding_group[piece2]);
+	    for (piece2 = last_overlapping_piece[piece2]; piece2 != -1; piece2 = last_overlapping_piece[piece2]) {
+		overlaps_later_piece[piece2] = true;
+	    }
+	}
     }
 };
 
+/* Since the encoding classes are all final, a call through a pointer to one of them is an ordinary
+ * function call that the compiler can inline.  Through index_encoding, it's a virtual call.
+ */
+
+template <typename Encoding>
+inline Encoding * concrete_encoding(const tablebase_t *tb)
+{
+    return static_cast<Encoding *>(tb->encoding.get());
+}
+
+/* Hot loops get a copy specialized for the tablebase's index encoding.  dispatch_on_encoding()
+ * picks the copy: it calls functor.operator()<Encoding>() for the encoding class that implements
+ * tb->index_type.  The switch is on a value that never changes during a run, so it costs next to
+ * nothing compared to the virtual calls it saves.
+ */
+
+template <typename Functor>
+inline void dispatch_on_encoding(const tablebase_t *tb, const Functor & functor)
+{
+    switch (tb->index_type) {
+    case Index::Naive:
+	functor.template operator()<naive_index>();
+	break;
+    case Index::Naive2:
+	functor.template operator()<naive2_index>();
+	break;
+    case Index::Simple:
+	functor.template operator()<simple_index>();
+	break;
+    case Index::Compact:
+	functor.template operator()<compact_index>();
+	break;
+    case Index::Combinadic3:
+    case Index::Combinadic4:
+    case Index::Combinadic5:
+    case Index::Syzygy:
+	functor.template operator()<combinadic_index>();
+	break;
+    default:
+	functor.template operator()<index_encoding>();
+	break;
+    }
+}
+
+template <typename Encoding>
 index_t normalized_position_to_index(const tablebase_t *tb, local_position_t *position)
 {
     index_t index;
@@ -4213,7 +5287,7 @@ index_t normalized_position_to_index(const tablebase_t *tb, local_position_t *po
 
     /* Encode pieces and non-pawngen pawns using whatever index function was selected */
 
-    index = tb->encoding->position_to_index(tb, position);
+    index = concrete_encoding<Encoding>(tb)->position_to_index(tb, position);
 
     /* Pawngen - the index encoding function skipped any pawngen pawns */
 
@@ -4232,9 +5306,7 @@ index_t normalized_position_to_index(const tablebase_t *tb, local_position_t *po
 	}
 	pawns.en_passant_square = position->en_passant_square;
 
-	auto it = std::lower_bound(tb->pawngen->pawn_positions_by_position.begin(),
-				   tb->pawngen->pawn_positions_by_position.end(),
-				   pawns, pawn_position_fast_compare);
+	int pawngen_index = pawngen_lookup(tb->pawngen.get(), pawns);
 
 	/* In the course of normal program operation, we should never generate invalid pawn
 	 * positions, but it can happen during testing with check_1000_positions().  So invalid pawn
@@ -4243,25 +5315,27 @@ index_t normalized_position_to_index(const tablebase_t *tb, local_position_t *po
 	 * XXX throw errors more aggressively here during actual program operation
 	 */
 
-	if (it == tb->pawngen->pawn_positions_by_position.end()) {
+	if (pawngen_index == -1) {
 	    return INVALID_INDEX;
-	} else if (*it != pawns) {
-	    return INVALID_INDEX;
-	} else if ((it->index < tb->pawngen->start) || (it->index >= tb->pawngen->start + tb->pawngen->count)) {
+	} else if ((pawngen_index < tb->pawngen->start) || (pawngen_index >= tb->pawngen->start + tb->pawngen->count)) {
 	    return INVALID_INDEX;
 	} else {
-	    index += tb->encoding->size * (it->index - tb->pawngen->start);
+	    index += tb->encoding->size * (pawngen_index - tb->pawngen->start);
 	}
 
     }
 
     /* Now encode side-to-move (if needed).  Other code, like index_to_side_to_move(), assumes that
-     * side-to-move is the index's LSB.
+     * side-to-move is the index's LSB, unless stm_in_msb is set.
      */
 
     if (tb->encode_stm) {
-	index <<= 1;
-	index += (position->side_to_move == PieceColor::White) ? 0 : 1;
+	if (tb->stm_in_msb) {
+	    if (position->side_to_move == PieceColor::Black) index += tb->num_indices / 2;
+	} else {
+	    index <<= 1;
+	    index += (position->side_to_move == PieceColor::White) ? 0 : 1;
+	}
     }
 
     /* Multiplicity - number of non-identical positions that this index corresponds to.  We want to
@@ -4299,6 +5373,7 @@ index_t normalized_position_to_index(local_position_t &position)
     return normalized_position_to_index(position.tb, &position);
 }
 
+template <typename Encoding = index_encoding>
 index_t local_position_to_index(const tablebase_t *tb, local_position_t *original)
 {
     index_t index;
@@ -4313,7 +5388,7 @@ index_t local_position_to_index(const tablebase_t *tb, local_position_t *origina
 
     normalize_position(tb, &copy);
 
-    index = normalized_position_to_index(tb, &copy);
+    index = normalized_position_to_index<Encoding>(tb, &copy);
 
     original->multiplicity = copy.multiplicity;
 
@@ -4330,6 +5405,7 @@ index_t local_position_to_index(local_position_t &original)
     return local_position_to_index(original.tb, &original);
 }
 
+template <typename Encoding>
 bool index_to_local_position(const tablebase_t *tb, index_t index, int reflection, local_position_t *position)
 {
     int ret;
@@ -4369,7 +5445,14 @@ bool index_to_local_position(const tablebase_t *tb, index_t index, int reflectio
      * pass.
      */
 
-    if (tb->encode_stm) {
+    if (tb->encode_stm && tb->stm_in_msb) {
+	if (index >= tb->num_indices / 2) {
+	    position->side_to_move = PieceColor::Black;
+	    index -= tb->num_indices / 2;
+	} else {
+	    position->side_to_move = PieceColor::White;
+	}
+    } else if (tb->encode_stm) {
 	position->side_to_move = (index % 2 == 0) ? PieceColor::White : PieceColor::Black;
 	index >>= 1;
     } else {
@@ -4467,7 +5550,7 @@ bool index_to_local_position(const tablebase_t *tb, index_t index, int reflectio
      * pawns) and en_passant_square is already set.
      */
 
-    ret = tb->encoding->index_to_position(tb, index, position);
+    ret = concrete_encoding<Encoding>(tb)->index_to_position(tb, index, position);
 
     if (!ret) return false;
 
@@ -4620,7 +5703,9 @@ index_t num_indices(tablebase_t * tb)
 
 PieceColor index_to_side_to_move(tablebase_t *tb, index_t index)
 {
-    if (tb->encode_stm) {
+    if (tb->encode_stm && tb->stm_in_msb) {
+	return (index >= tb->num_indices / 2) ? PieceColor::Black : PieceColor::White;
+    } else if (tb->encode_stm) {
 	if (index & 1) {
 	    return PieceColor::Black;
 	} else {
@@ -4734,7 +5819,13 @@ void local_position_t::flip_side_to_move(void)
 {
     side_to_move = ~ side_to_move;
 
-    if (decoded && valid && tb->encode_stm) {
+    if (decoded && valid && tb->encode_stm && tb->stm_in_msb) {
+	if (side_to_move == PieceColor::Black) {
+	    index += tb->num_indices / 2;
+	} else {
+	    index -= tb->num_indices / 2;
+	}
+    } else if (decoded && valid && tb->encode_stm) {
 	index ^= 1;
     } else {
 	decoded = false;
@@ -4758,6 +5849,7 @@ const char * local_position_t::FEN() const {
     }
 }
 
+template <typename Encoding>
 void local_position_t::move_piece(int piece, int destination_square) {
 
     if (!decoded || !valid) {
@@ -4799,7 +5891,7 @@ void local_position_t::move_piece(int piece, int destination_square) {
 	    decoded = false;
 	}
     } else {
-	tb->encoding->move_piece(tb, this, piece, destination_square);
+	concrete_encoding<Encoding>(tb)->move_piece(tb, this, piece, destination_square);
     }
 }
 
@@ -5574,6 +6666,22 @@ void tablebase_t::finalize_initialization(void)
     }
 
 
+    for (int piece_kind = 0; piece_kind < 2*NUM_PIECES; piece_kind ++) {
+	for (int square = 0; square < 64; square ++) {
+	    global_semilegal_group[piece_kind][square] = -1;
+	}
+    }
+
+    for (int piece = num_pieces - 1; piece >= 0; piece --) {
+	const int piece_kind = ((pieces[piece].color == PieceColor::White) ? 0 : NUM_PIECES)
+	    + static_cast<int>(pieces[piece].piece_type);
+	for (int square = 0; square < 64; square ++) {
+	    if (pieces[piece].semilegal_squares & BITVECTOR(square)) {
+		global_semilegal_group[piece_kind][square] = piece;
+	    }
+	}
+    }
+
 #if DEBUG
     for (int piece = 0; piece < num_pieces; piece ++) {
 	info("Piece %d: type %s color %s legal_squares %0" PRIx64 " semilegal_squares %0" PRIx64 "\n",
@@ -5717,13 +6825,23 @@ void tablebase_t::finalize_initialization(void)
      * is_color_symmetric() also computes color_symmetric_transpose in the piece array
      */
 
-    if (((index_type == Index::Combinadic4) || (index_type == Index::Combinadic5))
+    if (((index_type == Index::Combinadic4) || (index_type == Index::Combinadic5) || (index_type == Index::Syzygy))
 	&& is_color_symmetric() && (format.flag_type == FormatFlag::None)) {
 	encode_stm = false;
     } else {
 	encode_stm = true;
     }
 
+    /* Syzygy puts side-to-move in the index's MSB, and local_position_t::move_piece() and the
+     * suicide code only know how to step an index with side-to-move in the LSB.
+     */
+
+    if ((index_type == Index::Syzygy) && (pawngen || (variant == Variant::Suicide))) {
+	throw std::runtime_error("'syzygy' index can't be used with pawngen or the 'suicide' variant");
+    }
+
+    stm_in_msb = (index_type == Index::Syzygy);
+
     /* Initialize the indexing functions */
 
     /* The constructor for the index encoding is expected to compute and assign num_indices in the
@@ -5750,6 +6868,7 @@ void tablebase_t::finalize_initialization(void)
     case Index::Combinadic3:
     case Index::Combinadic4:
     case Index::Combinadic5:
+    case Index::Syzygy:
 	encoding.reset(new combinadic_index(this));
 	break;
 
@@ -5798,6 +6917,25 @@ xmlpp::Element * create_GenStats_node(std::string name)
     return node;
 }
 
+/* A hash of the control file, as parsed, but before we add anything run-specific like generation
+ * statistics, so checkpoints can tell which tablebase they belong to.  It's FNV-1a, so it's the
+ * same from one run (and one machine) to the next.
+ */
+
+uint64_t control_file_hash = 0;
+
+uint64_t fnv1a_hash(const std::string & string)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (unsigned char c : string) {
+	hash ^= c;
+	hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
 /* Parses an XML control file.
  */
 
@@ -5823,6 +6961,8 @@ tablebase_t * parse_XML_control_file(char *filename)
     // XXX this might throw an exception
     tb = new tablebase_t(& instream);
 
+    control_file_hash = fnv1a_hash(tb->xml->write_to_string());
+
     auto tablebase = tb->xml->get_root_node();
 
     tablebase->add_child_text("   ");
@@ -6458,6 +7598,8 @@ static std::map<std::string, struct dtms> dtms =
  * of trying to parse a Nalimov tablebase ourselves.
  */
 
+extern const int futurebase_stride;
+
 tablebase_t::tablebase_t(Glib::ustring filename) : filename(filename), offset(0), invert_colors(false), num_pieces(0)
 {
     if (filename.substr(filename.length() - 4) == ".emd"
@@ -6528,7 +7670,11 @@ tablebase_t::tablebase_t(Glib::ustring filename) : filename(filename), offset(0)
 	white_king = i-2;
 	black_king = i-1;
 
-	index_type = Index::Combinadic5;
+	/* Nalimov keeps white-to-move and black-to-move in separate files, so walk through all of
+	 * one before starting on the other.
+	 */
+
+	index_type = Index::Syzygy;
 
 	format = nalimov_format;
 
@@ -6620,7 +7766,11 @@ tablebase_t::tablebase_t(Glib::ustring filename) : filename(filename), offset(0)
 	white_king = num_pieces - 2;
 	black_king = num_pieces - 1;
 
-	index_type = Index::Combinadic5;
+	/* Use the index that comes closest to the order of the Syzygy files, so that back
+	 * propagation probes them more or less sequentially.
+	 */
+
+	index_type = Index::Syzygy;
 
 	format = syzygy_format;
 
@@ -6715,12 +7865,99 @@ tablebase_t::tablebase_t(Glib::ustring filename) : filename(filename), offset(0)
 	input_file->seekg(0);
     }
 
-#if 0
-
-    /* XXX This is what I'd like to do, but it doesn't work.  Boost 1.54 can't handle io::restrict
-     * on gzip_decompressor (or its stock io::gzip_decompressor).  Instead, we need to construct a
-     * new input stream, push the file and the decompressor into it, then io::restrict the stream.
-     * Yuck.
+    /* Block-compressed format.  The XML header and pawngen data are uncompressed, and 'offset'
+     * points to a table of (number of blocks + 1) 64-bit little endian file offsets, each block
+     * being an independent zlib stream of futurebase_stride entries.  We read the block table now
+     * and fetch_entry() will pread() the blocks from a separate file descriptor, so we don't need
+     * instream at all.
+     */
+
+    if (eval_to_number_or_zero(xml->get_root_node(), "/tablebase/@block-size") != 0) {
+
+	if (eval_to_number_or_zero(xml->get_root_node(), "/tablebase/@block-size") != futurebase_stride) {
+	    fatal("'%s': block size doesn't match futurebase stride (%d)\n", filename.c_str(), futurebase_stride);
+	    terminate();
+	}
+
+	next_read_index = 0;
+
+	finalize_initialization();
+
+	block_offsets.resize((num_indices + futurebase_stride - 1) / futurebase_stride + 1);
+
+	input_file->seekg(offset);
+	for (auto & block_offset : block_offsets) {
+	    unsigned char buf[8];
+	    input_file->read(reinterpret_cast<char *>(buf), sizeof(buf));
+	    block_offset = 0;
+	    for (int i = 7; i >= 0; i --) {
+		block_offset = (block_offset << 8) | buf[i];
+	    }
+	}
+
+	instream.reset();
+	delete input_file;
+
+	block_fd = open(filename.c_str(), O_RDONLY);
+	if (block_fd == -1) {
+	    throw std::runtime_error("Can't open file");
+	}
+
+	return;
+    }
+
+    /* Uncompressed format.  We mmap the entire file and point mapped_entries at the entries, which
+     * get_DTM() and friends then read directly, with no locking and no copying.
+     *
+     * The bitlib routines read whole words, and can therefore read a few bytes past the last entry.
+     * If the file ends exactly on a page boundary, that would fault, so we first reserve an
+     * anonymous mapping a little bigger than the file, then map the file over the front of it.
+     */
+
+    if (input_file->peek() != '\037') {
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	struct stat st;
+
+	if ((fd == -1) || (fstat(fd, &st) == -1)) {
+	    throw std::runtime_error("Can't open file");
+	}
+
+	size_t length = st.st_size + 2*sizeof(uint64_t);
+	void * address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if ((address == MAP_FAILED)
+	    || (mmap(address, st.st_size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+	    fatal("Can't mmap '%s': %s\n", filename.c_str(), strerror(errno));
+	    terminate();
+	}
+
+	/* One munmap() of the whole reservation also removes the file mapping over its front */
+
+	mapping.reset(address, length);
+
+	/* The mapping stays valid after the file descriptor is closed */
+
+	close(fd);
+
+	mapped_entries = static_cast<char *>(address) + offset;
+
+	instream.reset();
+	delete input_file;
+
+	next_read_index = 0;
+
+	finalize_initialization();
+
+	return;
+    }
+
+#if 0
+
+    /* XXX This is what I'd like to do, but it doesn't work.  Boost 1.54 can't handle io::restrict
+     * on gzip_decompressor (or its stock io::gzip_decompressor).  Instead, we need to construct a
+     * new input stream, push the file and the decompressor into it, then io::restrict the stream.
+     * Yuck.
      */
 
     if (input_file->peek() == '\037') {
@@ -7032,6 +8269,12 @@ void finalize_pass_statistics()
     static struct rusage last_rusage;
     static int last_timings_valid = false;
 
+    static uint64_t last_bytes_read = 0;
+    static uint64_t last_bytes_written = 0;
+    static uint64_t last_fetch_entry_hits = 0;
+    static uint64_t last_fetch_entry_misses = 0;
+    static uint64_t last_thread_idle_nanoseconds = 0;
+
     struct timeval timeval;
     struct rusage rusage;
 
@@ -7076,6 +8319,7 @@ void finalize_pass_statistics()
     if (last_timings_valid) {
 	subtract_timeval(&timeval, &last_timeval);
 	subtract_timeval(&rusage.ru_utime, &last_rusage.ru_utime);
+	subtract_timeval(&rusage.ru_stime, &last_rusage.ru_stime);
     } else {
 	subtract_timeval(&timeval, &program_start_time);
     }
@@ -7086,10 +8330,44 @@ void finalize_pass_statistics()
     sprint_timeval(strbuf, &rusage.ru_utime);
     passNode->set_attribute("user-time", strbuf);
 
+    sprint_timeval(strbuf, &rusage.ru_stime);
+    passNode->set_attribute("system-time", strbuf);
+
     gettimeofday(&last_timeval, nullptr);
     getrusage(RUSAGE_SELF, &last_rusage);
     last_timings_valid = true;
 
+    uint64_t bytes_read = temporary_file_bytes_read - last_bytes_read;
+    uint64_t bytes_written = temporary_file_bytes_written - last_bytes_written;
+    uint64_t hits = fetch_entry_hits - last_fetch_entry_hits;
+    uint64_t misses = fetch_entry_misses - last_fetch_entry_misses;
+    uint64_t idle_nanoseconds = thread_idle_nanoseconds - last_thread_idle_nanoseconds;
+
+    last_bytes_read += bytes_read;
+    last_bytes_written += bytes_written;
+    last_fetch_entry_hits += hits;
+    last_fetch_entry_misses += misses;
+    last_thread_idle_nanoseconds += idle_nanoseconds;
+
+    struct timeval idle_time;
+    idle_time.tv_sec = idle_nanoseconds / 1000000000;
+    idle_time.tv_usec = (idle_nanoseconds % 1000000000) / 1000;
+
+    if (bytes_read > 0) {
+	passNode->set_attribute("bytes-read", boost::lexical_cast<std::string>(bytes_read));
+    }
+    if (bytes_written > 0) {
+	passNode->set_attribute("bytes-written", boost::lexical_cast<std::string>(bytes_written));
+    }
+    if (hits + misses > 0) {
+	passNode->set_attribute("fetch-entry-hits", boost::lexical_cast<std::string>(hits));
+	passNode->set_attribute("fetch-entry-misses", boost::lexical_cast<std::string>(misses));
+    }
+    if (idle_nanoseconds > 0) {
+	sprint_timeval(strbuf, &idle_time);
+	passNode->set_attribute("idle-time", strbuf);
+    }
+
     if (! strcmp(pass_type[total_passes], "intratable")) {
 	if (tracking_dtm) {
 	    passNode->set_attribute("dtm", boost::lexical_cast<std::string>(pass_target_dtms[total_passes]));
@@ -7097,6 +8375,32 @@ void finalize_pass_statistics()
 	passNode->set_attribute("positions-finalized", boost::lexical_cast<std::string>(positions_finalized[total_passes]));
 	passNode->set_attribute("moves-generated", boost::lexical_cast<std::string>(backproped_moves[total_passes]));
     }
+
+    /* The same thing again as a line of JSON, with times as plain seconds so that they're easy to
+     * process.  We flush after each line so that the file can be watched during a long run.
+     */
+
+    if (stats_stream.is_open()) {
+	stats_stream << "{\"pass\": " << total_passes
+		     << ", \"type\": \"" << pass_type[total_passes] << "\"";
+	if (! strcmp(pass_type[total_passes], "intratable")) {
+	    if (tracking_dtm) {
+		stats_stream << ", \"dtm\": " << pass_target_dtms[total_passes];
+	    }
+	    stats_stream << ", \"positions-finalized\": " << positions_finalized[total_passes]
+			 << ", \"moves-generated\": " << backproped_moves[total_passes];
+	}
+	stats_stream << std::fixed << std::setprecision(6)
+		     << ", \"real-time\": " << timeval.tv_sec + timeval.tv_usec / 1e6
+		     << ", \"user-time\": " << rusage.ru_utime.tv_sec + rusage.ru_utime.tv_usec / 1e6
+		     << ", \"system-time\": " << rusage.ru_stime.tv_sec + rusage.ru_stime.tv_usec / 1e6
+		     << ", \"idle-time\": " << idle_nanoseconds / 1e9
+		     << ", \"bytes-read\": " << bytes_read
+		     << ", \"bytes-written\": " << bytes_written
+		     << ", \"fetch-entry-hits\": " << hits
+		     << ", \"fetch-entry-misses\": " << misses
+		     << "}" << std::endl;
+    }
 }
 
 /* Given a tablebase, change its XML structure to reflect the fact that the tablebase has now
@@ -7440,7 +8744,94 @@ translation_result translate_foreign_index_to_local_position(tablebase_t *foreig
     return translate_foreign_position_to_local_position(foreign_tb, &foreign_position, local_tb, local_position, invert_colors);
 }
 
+/* global_position_to_local_position()
+ *
+ * The general case builds a fake tablebase with one piece for each piece on the board, runs
+ * compute_extra_and_missing_pieces() on it, and then translates it like a futurebase position.
+ * That's expensive, and when we're probing, we call it twice for every tablebase we try, usually
+ * for a position with exactly the tablebase's material.  So we first try to put each piece on the
+ * board directly into its semilegal group, using the table precomputed by finalize_initialization().
+ * If every piece slots in and every one of our pieces gets used, the translation is trivial, and
+ * it's exactly what the general case would have come up with.  Anything else (extra, missing or
+ * restricted pieces) goes the long way around.
+ */
+
+translation_result slow_global_position_to_local_position(tablebase_t *tb, global_position_t *global, local_position_t *local);
+
 translation_result global_position_to_local_position(tablebase_t *tb, global_position_t *global, local_position_t *local)
+{
+    /* Which color*NUM_PIECES + type each board character is, or -1 */
+
+    static const std::vector<int8_t> piece_kinds = [] {
+	std::vector<int8_t> kinds(256, -1);
+	for (int color = 0; color < 2; color ++) {
+	    for (int type = 0; type < NUM_PIECES; type ++) {
+		kinds[global_pieces[color][type]] = color*NUM_PIECES + type;
+	    }
+	}
+	return kinds;
+    }();
+
+    /* Clear everything that the memset() in translate_foreign_position_to_local_position() would,
+     * without memset()'ing a class.
+     */
+
+    local->tb = tb;
+    local->decoded = false;
+    local->unreflected_valid = false;
+    local->valid = false;
+    local->index = 0;
+    local->pawngen_index = 0;
+    local->pawngen_base_index = 0;
+    local->reflection = REFLECTION_NONE;
+    local->board_vector = 0;
+    local->PTM_vector = 0;
+    local->unreflected_en_passant_square = 0;
+    local->multiplicity = 0;
+
+    for (int piece = 0; piece < MAX_PIECES; piece ++) {
+	local->unreflected_piece_position[piece] = 0;
+	local->piece_position[piece] = 0;
+	local->permuted_piece[piece] = 0;
+    }
+
+    for (int piece = 0; piece < tb->num_pieces; piece ++) {
+	local->piece_position[piece] = ILLEGAL_POSITION;
+	local->permuted_piece[piece] = piece;
+    }
+
+    local->en_passant_square = global->en_passant_square;
+    local->side_to_move = global->side_to_move;
+
+    int pieces_placed = 0;
+
+    for (int square = 0; square < NUM_SQUARES; square ++) {
+	if ((global->board[square] == 0) || (global->board[square] == ' ')) continue;
+
+	int piece_kind = piece_kinds[(unsigned char) global->board[square]];
+	int piece;
+
+	if (piece_kind == -1) continue;
+
+	for (piece = tb->global_semilegal_group[piece_kind][square];
+	     piece != -1; piece = tb->pieces[piece].next_piece_in_semilegal_group) {
+	    if (local->piece_position[piece] == ILLEGAL_POSITION) break;
+	}
+
+	if (piece == -1) return slow_global_position_to_local_position(tb, global, local);
+
+	local->piece_position[piece] = square;
+	local->board_vector |= BITVECTOR(square);
+	if (tb->pieces[piece].color == local->side_to_move) local->PTM_vector |= BITVECTOR(square);
+	pieces_placed ++;
+    }
+
+    if (pieces_placed != tb->num_pieces) return slow_global_position_to_local_position(tb, global, local);
+
+    return trivial_translation;
+}
+
+translation_result slow_global_position_to_local_position(tablebase_t *tb, global_position_t *global, local_position_t *local)
 {
     int square;
     tablebase_t fake_tb;
@@ -7783,13 +9174,14 @@ bool parse_FEN_to_global_position(char *FEN_string, global_position_t *pos)
 }
 
 /* Note that the two buffers in this function are static, but we alternate back and forth between them,
- * so we can use this function twice in a single debugging print statement.
+ * so we can use this function twice in a single debugging print statement.  They're thread_local,
+ * since the parallel passes report errors (with FENs) from all of their threads at once.
  */
 
 char * global_position_to_FEN(global_position_t *position)
 {
-    static char buffer[2][256];
-    static int which_buffer = 0;
+    static thread_local char buffer[2][256];
+    static thread_local int which_buffer = 0;
     char *ptr = buffer[which_buffer ^= 1];
     int empty_squares;
     int row, col;
@@ -7966,17 +9358,88 @@ thread_local tablebase_t * cached_tb = nullptr;
 thread_local char * cached_entries = nullptr;
 thread_local index_t cached_index;
 
+/* Cache hits are counted locally and only added into the global counter on a miss (or when a
+ * thread calls flush_fetch_entry_statistics() before exiting), to keep a global atomic increment
+ * out of get_DTM().
+ */
+
+thread_local uint64_t local_fetch_entry_hits = 0;
+
+void flush_fetch_entry_statistics(void)
+{
+    fetch_entry_hits += local_fetch_entry_hits;
+    local_fetch_entry_hits = 0;
+}
+
+/* Nalimov and Syzygy futurebases have no entries to cache; every get_DTM() or get_basic() is a
+ * probe of the external library, preceded by a conversion of the index into a board position.
+ * During back propagation, each future index gets looked up once for every reflection and every
+ * backwards move out of it, so we typically probe the same position a dozen or more times.
+ *
+ * Each thread works through a block of futurebase_stride indices that it got from fetch_entry(),
+ * so we remember the results of the probes in the current thread's block, and only convert and
+ * probe each index the first time it's asked for.  The libraries themselves do their own caching
+ * (Nalimov's LRU of decompressed chunks, and the mmap'ed Syzygy files), and sequential use of the
+ * 'syzygy' index keeps their working sets small.
+ *
+ * Like cached_tb above, we key on the tablebase pointer, and forget() is called when a thread is
+ * done with a futurebase.
+ */
+
+class external_probe_cache {
+    const tablebase_t * tb = nullptr;
+    index_t start = 0;
+    std::vector<int> values;
+    std::vector<bool> probed;
+
+public:
+
+    bool lookup(const tablebase_t * probed_tb, index_t index, int & value)
+    {
+	if ((probed_tb != tb) || (index < start) || (index - start >= futurebase_stride)) {
+	    tb = probed_tb;
+	    start = index & ~(futurebase_stride - 1);
+	    values.resize(futurebase_stride);
+	    probed.assign(futurebase_stride, false);
+	    return false;
+	}
+
+	if (! probed[index - start]) return false;
+
+	value = values[index - start];
+	return true;
+    }
+
+    /* Only call store() right after a failed lookup(), which has already switched to the
+     * index's block.
+     */
+
+    void store(index_t index, int value)
+    {
+	values[index - start] = value;
+	probed[index - start] = true;
+    }
+
+    void forget(void)
+    {
+	tb = nullptr;
+    }
+};
+
+thread_local external_probe_cache external_probes;
+
 index_t tablebase_t::fetch_entry(index_t index = INVALID_INDEX)
 {
-    /* Nalimov or Syzygy tablebase?  Just return the index for the next block, in a thread-safe manner.
+    /* Nalimov, Syzygy, or mmap'ed tablebase?  Just return the index for the next block, in a
+     * thread-safe manner.  Probes of Nalimov and Syzygy tablebases are cached per block in
+     * external_probes.
      *
-     * XXX move this counting code to back_propagate_futurebase_thread(), and just implement
-     * a caching scheme (maybe LRU like Nalimov) here.
+     * XXX move this counting code to back_propagate_futurebase_thread()
      *
      * XXX eventually read the Nalimov format directly
      */
 
-    if ((format.bits == -1) || (format.bits == -2)) {
+    if ((format.bits == -1) || (format.bits == -2) || mapped_entries) {
 	static std::mutex lock;
 	std::lock_guard<std::mutex> _(lock);
 
@@ -8001,7 +9464,7 @@ index_t tablebase_t::fetch_entry(index_t index = INVALID_INDEX)
 
 	/* If cache is non existant, build it */
 
-	if (instream == nullptr) {
+	if ((instream == nullptr) && block_offsets.empty()) {
 	    fatal("fetch_entry() called on a non-preloaded tablebase\n");
 	    terminate();
 	}
@@ -8016,14 +9479,75 @@ index_t tablebase_t::fetch_entry(index_t index = INVALID_INDEX)
 
 	/* We've got the requested index in the cache */
 
+	local_fetch_entry_hits ++;
+
 	return cached_index;
 
     }
 
+    fetch_entry_misses ++;
+    flush_fetch_entry_statistics();
+
     /* Round down to stride boundary */
 
     if (index != INVALID_INDEX) index &= ~(futurebase_stride - 1);
 
+    /* Block-compressed tablebase?  Each stride is its own zlib stream, so we only need the lock to
+     * hand out the next sequential block.  The read itself is a pread() and the decompression is
+     * done in our own thread, so multiple threads can fetch blocks concurrently.
+     */
+
+    if (! block_offsets.empty()) {
+
+	if (index == INVALID_INDEX) {
+	    static std::mutex lock;
+	    std::lock_guard<std::mutex> _(lock);
+
+	    index = next_read_index;
+	    if (next_read_index < num_indices) next_read_index += futurebase_stride;
+	}
+
+	if (index >= num_indices) return num_indices;
+
+	thread_local std::vector<Bytef> compressed_block;
+
+	index_t block = index / futurebase_stride;
+	size_t compressed_size = block_offsets[block + 1] - block_offsets[block];
+	uLongf uncompressed_size = format.bits * futurebase_stride / 8;
+
+	compressed_block.resize(compressed_size);
+
+	if (pread(block_fd, compressed_block.data(), compressed_size, block_offsets[block]) != (ssize_t) compressed_size) {
+	    fatal("'%s': short read on block %" PRIindex "\n", filename.c_str(), block);
+	    terminate();
+	}
+
+	if (uncompress(reinterpret_cast<Bytef *>(cached_entries), &uncompressed_size,
+		       compressed_block.data(), compressed_size) != Z_OK) {
+	    fatal("'%s': can't decompress block %" PRIindex "\n", filename.c_str(), block);
+	    terminate();
+	}
+
+	cached_index = index;
+
+	return index;
+    }
+
+    cached_index = read_entries(index, cached_entries);
+
+    return cached_index;
+}
+
+/* Read a block of futurebase_stride entries from instream into 'entries', starting at 'index', or
+ * at the next sequential block if 'index' is INVALID_INDEX.  Returns the starting index, which is
+ * num_indices if we're already at the end of the tablebase.
+ *
+ * Called from fetch_entry(), and also from the reader thread when futurebase back propagation is
+ * pipelined (see back_propagate_all_futurebases).
+ */
+
+index_t tablebase_t::read_entries(index_t index, char * entries)
+{
     /* Mutex lock to protect the remainder of this function.  Only one thread should be accessing
      * tablebase variable next_read_index or calling zlib.
      */
@@ -8041,13 +9565,13 @@ index_t tablebase_t::fetch_entry(index_t index = INVALID_INDEX)
     }
 
     if (next_read_index + futurebase_stride <= num_indices) {
-	instream->read(cached_entries, format.bits * futurebase_stride / 8);
+	instream->read(entries, format.bits * futurebase_stride / 8);
 	next_read_index += futurebase_stride;
     } else {
 	/* short read at end of file */
 	int bytes_to_read = format.bits * (num_indices - next_read_index) / 8;
 	if ((format.bits * (num_indices - next_read_index)) % 8 != 0) bytes_to_read ++;
-	instream->read(cached_entries, bytes_to_read);
+	instream->read(entries, bytes_to_read);
 	next_read_index = num_indices;
     }
 
@@ -8062,75 +9586,88 @@ index_t tablebase_t::fetch_entry(index_t index = INVALID_INDEX)
     }
 #endif
 
-
-    cached_index = index;
-
     return index;
 }
 
 /* To retrieve fields in the tablebase, we call fetch_entry() to both get the index into
  * cached_entries and return the starting index, which is subtracted to get an index offset into
- * cached_entries.
+ * cached_entries.  If the tablebase is mmap'ed, fetch_entry() isn't needed at all.
  */
 
+inline char * tablebase_t::entries_containing(index_t & index)
+{
+    if (mapped_entries) return mapped_entries;
+
+    index -= fetch_entry(index);
+    return cached_entries;
+}
+
 bool global_PNTM_in_check(global_position_t *position);
 
-int tablebase_t::get_DTM(index_t index)
+int tablebase_t::probe_nalimov(index_t index)
 {
-    if (format.bits == -1) {
-	/* Nalimov's code is thread-safe for queries, if compiled with -DSMP */
-	/* throw std::runtime_error("NYI: Nalimov format"); */
+    /* Nalimov's code is thread-safe for queries, if compiled with -DSMP */
 
-	global_position_t global;
-	int score;
+    global_position_t global;
+    int score;
 
-	if (index_to_global_position(this, index, &global)) {
-	    if (global_PNTM_in_check(&global)) {
+    if (! index_to_global_position(this, index, &global)) {
+	throw std::runtime_error("index_to_global_position failed in Nalimov base lookup");
+    }
 
-		/* I've learned the hard way not to probe a Nalimov tablebase for an illegal position... */
-		return 1;
+    if (global_PNTM_in_check(&global)) {
 
-	    } else {
+	/* I've learned the hard way not to probe a Nalimov tablebase for an illegal position... */
+	return 1;
 
-		/* Nor does Nalimov like it if the en passant pawn can't actually be captured by
-		 * another pawn.
-		 */
+    }
 
-		if ((global.en_passant_square != ILLEGAL_POSITION)
-		    && ((global.board[global.en_passant_square - 9] != 'P')
-			|| (global.en_passant_square == 40)
-			|| (global.side_to_move == PieceColor::Black))
-		    && ((global.board[global.en_passant_square - 7] != 'P')
-			|| (global.en_passant_square == 47)
-			|| (global.side_to_move == PieceColor::Black))
-		    && ((global.board[global.en_passant_square + 7] != 'p')
-			|| (global.en_passant_square == 16)
-			|| (global.side_to_move == PieceColor::White))
-		    && ((global.board[global.en_passant_square + 9] != 'p')
-			|| (global.en_passant_square == 23)
-			|| (global.side_to_move == PieceColor::White))) {
-
-		    global.en_passant_square = ILLEGAL_POSITION;
-		}
-
-		if (EGTBProbe(global.side_to_move == PieceColor::White, global.board,
-			      global.en_passant_square == ILLEGAL_POSITION ? -1 : global.en_passant_square, &score) == 1) {
-		    if (score > 0) {
-			return ((65536-4)/2)-score+2;
-		    } else if (score < 0) {
-			return -(((65536-4)/2)+score)-1;
-		    } else {
-			return 0;
-		    }
-		} else {
-		    /* Nalimov says illegal */
-		    throw std::runtime_error("Nalimov says illegal");
-		}
-	    }
+    /* Nor does Nalimov like it if the en passant pawn can't actually be captured by another pawn. */
+
+    if ((global.en_passant_square != ILLEGAL_POSITION)
+	&& ((global.board[global.en_passant_square - 9] != 'P')
+	    || (global.en_passant_square == 40)
+	    || (global.side_to_move == PieceColor::Black))
+	&& ((global.board[global.en_passant_square - 7] != 'P')
+	    || (global.en_passant_square == 47)
+	    || (global.side_to_move == PieceColor::Black))
+	&& ((global.board[global.en_passant_square + 7] != 'p')
+	    || (global.en_passant_square == 16)
+	    || (global.side_to_move == PieceColor::White))
+	&& ((global.board[global.en_passant_square + 9] != 'p')
+	    || (global.en_passant_square == 23)
+	    || (global.side_to_move == PieceColor::White))) {
+
+	global.en_passant_square = ILLEGAL_POSITION;
+    }
+
+    if (EGTBProbe(global.side_to_move == PieceColor::White, global.board,
+		  global.en_passant_square == ILLEGAL_POSITION ? -1 : global.en_passant_square, &score) == 1) {
+	if (score > 0) {
+	    return ((65536-4)/2)-score+2;
+	} else if (score < 0) {
+	    return -(((65536-4)/2)+score)-1;
+	} else {
+	    return 0;
 	}
+    } else {
+	/* Nalimov says illegal */
+	throw std::runtime_error("Nalimov says illegal");
     }
+}
 
-    index -= fetch_entry(index);
+int tablebase_t::get_DTM(index_t index)
+{
+    if (format.bits == -1) {
+	int dtm;
+	if (! external_probes.lookup(this, index, dtm)) {
+	    dtm = probe_nalimov(index);
+	    external_probes.store(index, dtm);
+	}
+	return dtm;
+    }
+
+    char * entries = entries_containing(index);
 
     /* Normally, we encode signed DTM fields, but single bit DTM fields are an exception, as we
      * always wish to encode 1 (PNTM in check) since these positions should not be backproped.  So
@@ -8138,9 +9675,9 @@ int tablebase_t::get_DTM(index_t index)
      */
 
     if (format.dtm_bits == 1) {
-	return get_unsigned_int_field(cached_entries, format.dtm_offset + index * format.bits, format.dtm_bits);
+	return get_unsigned_int_field(entries, format.dtm_offset + index * format.bits, format.dtm_bits);
     } else {
-	return get_int_field(cached_entries, format.dtm_offset + index * format.bits, format.dtm_bits);
+	return get_int_field(entries, format.dtm_offset + index * format.bits, format.dtm_bits);
     }
 }
 
@@ -8148,7 +9685,7 @@ int tablebase_t::get_DTC(index_t index)
 {
     /* XXX add some code here to probe Syzygy rtbz tablebases */
 
-    index -= fetch_entry(index);
+    char * entries = entries_containing(index);
 
     /* Normally, we encode signed DTC fields, but single bit DTC fields are an exception, as we
      * always wish to encode 1 (PNTM in check) since these positions should not be backproped.  So
@@ -8156,16 +9693,16 @@ int tablebase_t::get_DTC(index_t index)
      */
 
     if (format.dtc_bits == 1) {
-	return get_unsigned_int_field(cached_entries, format.dtc_offset + index * format.bits, format.dtc_bits);
+	return get_unsigned_int_field(entries, format.dtc_offset + index * format.bits, format.dtc_bits);
     } else {
-	return get_int_field(cached_entries, format.dtc_offset + index * format.bits, format.dtc_bits);
+	return get_int_field(entries, format.dtc_offset + index * format.bits, format.dtc_bits);
     }
 }
 
 bool tablebase_t::get_flag(index_t index)
 {
-    index -= fetch_entry(index);
-    return get_bit_field(cached_entries, format.flag_offset + index * format.bits);
+    char * entries = entries_containing(index);
+    return get_bit_field(entries, format.flag_offset + index * format.bits);
 }
 
 bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position);
@@ -8173,138 +9710,147 @@ bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position);
 Basic tablebase_t::get_basic(index_t index)
 {
     if (format.bits == -2) {
+	int basic;
+	if (! external_probes.lookup(this, index, basic)) {
+	    basic = static_cast<int>(probe_syzygy(index));
+	    external_probes.store(index, basic);
+	}
+	return static_cast<Basic>(basic);
+    }
+
+    char * entries = entries_containing(index);
+    return static_cast<Basic>(get_unsigned_int_field(entries, format.basic_offset + index * format.bits, 2));
+}
 
-	static std::mutex initialization_guard;
+Basic tablebase_t::probe_syzygy(index_t index)
+{
+    static std::mutex initialization_guard;
 
-	/* Initialize the Syzygy library, if needed.  We wait until this
-	 * point in the code to ensure that all of the filenames have been
-	 * parsed into the syzygy_search_path.
-	 *
-	 * XXX could move this code elsewhere and avoid the need for the mutex.
-	 */
+    /* Initialize the Syzygy library, if needed.  We wait until this
+     * point in the code to ensure that all of the filenames have been
+     * parsed into the syzygy_search_path.
+     *
+     * XXX could move this code elsewhere and avoid the need for the mutex.
+     */
 
-	{
-	    std::lock_guard<std::mutex> _(initialization_guard);
+    {
+	std::lock_guard<std::mutex> _(initialization_guard);
 
-	    if (! syzygy_library_initialized) {
+	if (! syzygy_library_initialized) {
 #ifndef _WIN32
-		std::string syzygy_path = boost::algorithm::join(syzygy_search_path, ":");
+	    std::string syzygy_path = boost::algorithm::join(syzygy_search_path, ":");
 #else
-		std::string syzygy_path = boost::algorithm::join(syzygy_search_path, ";");
+	    std::string syzygy_path = boost::algorithm::join(syzygy_search_path, ";");
 #endif
 
-		tb_init(syzygy_path.c_str());
+	    tb_init(syzygy_path.c_str());
 
-		syzygy_library_initialized = true;
-	    }
+	    syzygy_library_initialized = true;
 	}
+    }
 
-	/* Syzygy query code is thread-safe */
-
-	local_position_t pos(this);
+    /* Syzygy query code is thread-safe */
 
-	if (! index_to_local_position(this, index, 0, &pos)) {
-	    throw std::runtime_error("index_to_local_position failed in Syzygy base lookup");
-	}
+    local_position_t pos(this);
 
-	if (PNTM_in_check(this, &pos)) {
+    if (! index_to_local_position(this, index, 0, &pos)) {
+	throw std::runtime_error("index_to_local_position failed in Syzygy base lookup");
+    }
 
-	    /* I've learned the hard way not to probe a Nalimov tablebase for an illegal
-	     * position.  I'm not sure about Syzygy tablebases, but treat them the same way.
-	     */
+    if (PNTM_in_check(this, &pos)) {
 
-	    return Basic::Illegal;
-	}
+	/* I've learned the hard way not to probe a Nalimov tablebase for an illegal
+	 * position.  I'm not sure about Syzygy tablebases, but treat them the same way.
+	 */
 
-	uint64_t white = 0;
-	uint64_t black = 0;
+	return Basic::Illegal;
+    }
 
-	uint64_t kings = 0;
-	uint64_t queens = 0;
-	uint64_t rooks = 0;
-	uint64_t bishops = 0;
-	uint64_t knights = 0;
-	uint64_t pawns = 0;
+    uint64_t white = 0;
+    uint64_t black = 0;
 
-	for (int piece = 0; piece < num_pieces; piece ++) {
+    uint64_t kings = 0;
+    uint64_t queens = 0;
+    uint64_t rooks = 0;
+    uint64_t bishops = 0;
+    uint64_t knights = 0;
+    uint64_t pawns = 0;
 
-	    switch (pieces[piece].piece_type) {
-	    case PieceType::King:
-		kings |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    case PieceType::Queen:
-		queens |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    case PieceType::Rook:
-		rooks |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    case PieceType::Bishop:
-		bishops |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    case PieceType::Knight:
-		knights |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    case PieceType::Pawn:
-		pawns |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    }
+    for (int piece = 0; piece < num_pieces; piece ++) {
 
-	    if (pieces[piece].color == PieceColor::White) {
-		white |= BITVECTOR(pos.piece_position[piece]);
-	    } else {
-		black |= BITVECTOR(pos.piece_position[piece]);
-	    }
+	switch (pieces[piece].piece_type) {
+	case PieceType::King:
+	    kings |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	case PieceType::Queen:
+	    queens |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	case PieceType::Rook:
+	    rooks |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	case PieceType::Bishop:
+	    bishops |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	case PieceType::Knight:
+	    knights |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	case PieceType::Pawn:
+	    pawns |= BITVECTOR(pos.piece_position[piece]);
+	    break;
 	}
 
-	/* Nor does Nalimov like it if the en passant pawn can't actually be captured by
-	 * another pawn.  Again, treat Syzygy the same way.
-	 */
+	if (pieces[piece].color == PieceColor::White) {
+	    white |= BITVECTOR(pos.piece_position[piece]);
+	} else {
+	    black |= BITVECTOR(pos.piece_position[piece]);
+	}
+    }
 
-	if ((pos.en_passant_square != ILLEGAL_POSITION)
-	    && (((pawns & white & BITVECTOR(pos.en_passant_square - 9)) == 0)
-		|| (pos.en_passant_square == 40)
-		|| (pos.side_to_move == PieceColor::Black))
-	    && (((pawns & white & BITVECTOR(pos.en_passant_square - 7)) == 0)
-		|| (pos.en_passant_square == 47)
-		|| (pos.side_to_move == PieceColor::Black))
-	    && (((pawns & black & BITVECTOR(pos.en_passant_square + 7)) == 0)
-		|| (pos.en_passant_square == 16)
-		|| (pos.side_to_move == PieceColor::White))
-	    && (((pawns & black & BITVECTOR(pos.en_passant_square + 9)) == 0)
-		|| (pos.en_passant_square == 23)
-		|| (pos.side_to_move == PieceColor::White))) {
-	    
-	    pos.en_passant_square = ILLEGAL_POSITION;
-	}
-
-	unsigned result = tb_probe_wdl(white, black,
-				       kings, queens, rooks, bishops, knights, pawns,
-				       0, 0, (pos.en_passant_square == ILLEGAL_POSITION) ? 0 : pos.en_passant_square,
-				       (pos.side_to_move == PieceColor::White));
-
-	/* XXX add a Hoffman XML option to respect the 50 move rule, then we can handle BLESSED_LOSS
-	 * and CURSED_WIN properly.
-	 */
+    /* Nor does Nalimov like it if the en passant pawn can't actually be captured by
+     * another pawn.  Again, treat Syzygy the same way.
+     */
 
-	switch (result) {
-	case TB_LOSS:
-	    return Basic::PNTMwins;
-	case TB_BLESSED_LOSS:
-	case TB_CURSED_WIN:
-	case TB_DRAW:
-	    return Basic::Draw;
-	case TB_WIN:
-	    return Basic::PTMwins;
-	case TB_RESULT_FAILED:
-	    return Basic::Unknown;
-	default:
-	    throw std::runtime_error("Syzygy base returns unknown result code");
-	}
+    if ((pos.en_passant_square != ILLEGAL_POSITION)
+	&& (((pawns & white & BITVECTOR(pos.en_passant_square - 9)) == 0)
+	    || (pos.en_passant_square == 40)
+	    || (pos.side_to_move == PieceColor::Black))
+	&& (((pawns & white & BITVECTOR(pos.en_passant_square - 7)) == 0)
+	    || (pos.en_passant_square == 47)
+	    || (pos.side_to_move == PieceColor::Black))
+	&& (((pawns & black & BITVECTOR(pos.en_passant_square + 7)) == 0)
+	    || (pos.en_passant_square == 16)
+	    || (pos.side_to_move == PieceColor::White))
+	&& (((pawns & black & BITVECTOR(pos.en_passant_square + 9)) == 0)
+	    || (pos.en_passant_square == 23)
+	    || (pos.side_to_move == PieceColor::White))) {
+
+	pos.en_passant_square = ILLEGAL_POSITION;
+    }
+
+    unsigned result = tb_probe_wdl(white, black,
+				   kings, queens, rooks, bishops, knights, pawns,
+				   0, 0, (pos.en_passant_square == ILLEGAL_POSITION) ? 0 : pos.en_passant_square,
+				   (pos.side_to_move == PieceColor::White));
+
+    /* XXX add a Hoffman XML option to respect the 50 move rule, then we can handle BLESSED_LOSS
+     * and CURSED_WIN properly.
+     */
 
+    switch (result) {
+    case TB_LOSS:
+	return Basic::PNTMwins;
+    case TB_BLESSED_LOSS:
+    case TB_CURSED_WIN:
+    case TB_DRAW:
+	return Basic::Draw;
+    case TB_WIN:
+	return Basic::PTMwins;
+    case TB_RESULT_FAILED:
+	return Basic::Unknown;
+    default:
+	throw std::runtime_error("Syzygy base returns unknown result code");
     }
 
-    index -= fetch_entry(index);
-    return static_cast<Basic>(get_unsigned_int_field(cached_entries, format.basic_offset + index * format.bits, 2));
 }
 
 
@@ -8660,6 +10206,14 @@ class EntriesTable {
 	this->threads = threads;
     }
 
+    /* True if all the threads have to work their way through the table together, in which case
+     * they can't be handed separate ranges of indices to work on.
+     */
+
+    virtual bool lockstep(void) {
+	return false;
+    }
+
     /* This function is virtual so that subclasses can do a better job of handling a DTM overflow.
      * We only use it at the beginning of a pass.
      *
@@ -8690,6 +10244,22 @@ class EntriesTable {
 	return (*this)[index].get_DTM();
     }
 
+    /* Hint that we're about to update an entry.  Only the in-memory tables do anything. */
+
+    virtual void prefetch(index_t index) { }
+
+    /* Dump the raw entries into a checkpoint file, or reload them from one.  Tables that can't
+     * hand us all their entries at once (DiskEntriesTable) can't be checkpointed.
+     */
+
+    virtual void write_checkpoint(std::ostream & os) {
+	throw std::runtime_error("this entries table can't be checkpointed");
+    }
+
+    virtual void read_checkpoint(std::istream & is) {
+	throw std::runtime_error("this entries table can't be checkpointed");
+    }
+
     /* Seven possible ways we can initialize a tablebase entry for a position:
      *  - it's illegal
      *  - PNTM's mated
@@ -8855,40 +10425,45 @@ public:
 
 };
 
-/* MemoryEntriesTable - an EntriesTable held completely in memory */
+/* MemoryEntriesTable - an EntriesTable held completely in memory
+ *
+ * MappedEntriesTable - the same thing, but with the entries in a memory-mapped temporary file, so
+ * the table can be bigger than RAM and the kernel pages it in and out as we go.  Used instead of
+ * DiskEntriesTable for proptable runs, unless we've been asked to compress temporary files.
+ *
+ * They're both instantiations of BasicMemoryEntriesTable, which takes a storage class that
+ * allocates the entries and gets told about every access.  They used to be a class and its
+ * subclass, but then MemoryEntriesTable's methods couldn't be final, and back_propagate_section()
+ * depends on calls through an EntriesTablePtr<MemoryEntriesTable> being inlined.  This way, both
+ * classes are final and neither one pays for the other.
+ */
 
-class MemoryEntriesTable: public EntriesTable {
+template <typename Storage>
+class BasicMemoryEntriesTable final : public EntriesTable {
 
  private:
+    Storage storage;
     atomic_entry * entries;
 
  public:
-    MemoryEntriesTable(void) {
-	size_t bytes = current_tb->num_indices * sizeof(atomic_entry);
-	try {
-	    entries = new atomic_entry [current_tb->num_indices];
-	    if (bytes < 1024*1024) {
-		info("Malloced %zdKB for tablebase entries\n", bytes/1024);
-	    } else {
-		info("Malloced %zdMB for tablebase entries\n", bytes/(1024*1024));
-	    }
-	} catch (std::bad_alloc ex) {
-	    fatal("Can't malloc %zdMB for tablebase entries: %s\n", bytes/(1024*1024), ex.what());
-	}
-
+    BasicMemoryEntriesTable(void) {
+	entries = storage.allocate(current_tb->num_indices);
 	print_current_format();
     }
 
     const nonatomic_entry operator[](const index_t index) {
+	storage.advise(entries, index);
 	return entries[index];
     }
 
-    bool is_unpropagated(index_t index) final {
+    bool is_unpropagated(index_t index) {
+	storage.advise(entries, index);
 	unsigned int movecnt = entries[index].get_movecnt();
 	return (movecnt == MOVECNT_PTM_WINS_UNPROPED) || (movecnt == MOVECNT_PNTM_WINS_UNPROPED);
     }
 
-    int get_DTM(index_t index) final {
+    int get_DTM(index_t index) {
+	storage.advise(entries, index);
 	unsigned int movecnt = entries[index].get_movecnt();
 
 	if ((movecnt == MOVECNT_PTM_WINS_UNPROPED) || (movecnt == MOVECNT_PNTM_WINS_UNPROPED)
@@ -8899,15 +10474,147 @@ class MemoryEntriesTable: public EntriesTable {
 	}
     }
 
-    virtual void set(const index_t index, const nonatomic_entry & value) {
+    void set(const index_t index, const nonatomic_entry & value) {
+	storage.advise(entries, index);
 	entries[index] = value;
     }
 
+    void prefetch(index_t index) {
+	__builtin_prefetch(&entries[index], 1);
+    }
+
+    void write_checkpoint(std::ostream & os) {
+	os.write(reinterpret_cast<char *>(entries), current_tb->num_indices * sizeof(atomic_entry));
+    }
+
+    void read_checkpoint(std::istream & is) {
+	is.read(reinterpret_cast<char *>(entries), current_tb->num_indices * sizeof(atomic_entry));
+    }
+
     bool compare_exchange_weak(const index_t index, nonatomic_entry & expected, const nonatomic_entry & desired) {
+	storage.advise(entries, index);
 	return entries[index].compare_exchange_weak(expected, desired);
     }
 };
 
+/* Storage for MemoryEntriesTable.  advise() does nothing and compiles away. */
+
+class HeapEntriesStorage {
+
+ private:
+    atomic_entry * entries = nullptr;
+
+ public:
+    atomic_entry * allocate(index_t num_indices) {
+	size_t bytes = num_indices * sizeof(atomic_entry);
+	const char * pages;
+	try {
+	    entries = static_cast<atomic_entry *>(allocate_large(bytes, pages));
+	    numa_place(entries, sizeof(atomic_entry), num_indices, numa_mode == NumaMode::Interleave);
+	    if (bytes < 1024*1024) {
+		info("Malloced %zdKB for tablebase entries (%s)\n", bytes/1024, pages);
+	    } else {
+		info("Malloced %zdMB for tablebase entries (%s)\n", bytes/(1024*1024), pages);
+	    }
+	} catch (std::bad_alloc ex) {
+	    fatal("Can't malloc %zdMB for tablebase entries: %s\n", bytes/(1024*1024), ex.what());
+	}
+	return entries;
+    }
+
+    void advise(atomic_entry * entries, const index_t index) { }
+
+    ~HeapEntriesStorage() {
+	free_large(entries);
+    }
+};
+
+/* Storage for MappedEntriesTable.
+ *
+ * In proptable mode every pass sweeps the table in index order, with each thread working on
+ * indices close to everybody else's, so the access pattern is sequential.  The sparse file
+ * starts out as all zeros, which is what an empty entry looks like, and is never copied - each
+ * pass just updates it in place.  Random access works too (it's just slow if we've gone beyond
+ * RAM), so unlike DiskEntriesTable we don't need all the threads to advance in lockstep.
+ *
+ * We tell the kernel that we're going to read sequentially, and each thread keeps track of the
+ * window of entries it's working in.  When a thread moves out of its window, it issues a
+ * MADV_WILLNEED for its new window and the one after, so the reads are in flight before we
+ * fault on them.
+ *
+ * The file is unlinked as soon as it's mapped, so it doesn't get left lying around if we die.
+ */
+
+static const index_t mapped_entries_window = 1 << 20;
+
+class MappedEntriesStorage {
+
+ private:
+    void * mapping = nullptr;
+    size_t bytes = 0;
+
+ public:
+    atomic_entry * allocate(index_t num_indices) {
+	char filename[16] = "entriesXXXXXX";
+	int fd = mkostemp(filename, O_RDWR | O_CREAT | O_EXCL);
+
+	bytes = num_indices * sizeof(atomic_entry);
+
+	if (fd == -1) {
+	    fatal("Can't open '%s' for writing: %s\n", filename, strerror(errno));
+	    terminate();
+	}
+
+	if (ftruncate(fd, bytes) == -1) {
+	    fatal("Can't extend '%s' to %zdMB: %s\n", filename, bytes/(1024*1024), strerror(errno));
+	    terminate();
+	}
+
+	mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (mapping == MAP_FAILED) {
+	    fatal("Can't mmap '%s': %s\n", filename, strerror(errno));
+	    terminate();
+	}
+
+	/* The mapping stays valid after the file descriptor is closed and the file unlinked */
+
+	close(fd);
+	unlink(filename);
+
+	madvise(mapping, bytes, MADV_SEQUENTIAL);
+
+	if (bytes < 1024*1024) {
+	    info("Mapped %zdKB for tablebase entries\n", bytes/1024);
+	} else {
+	    info("Mapped %zdMB for tablebase entries\n", bytes/(1024*1024));
+	}
+
+	return static_cast<atomic_entry *>(mapping);
+    }
+
+    void advise(atomic_entry * entries, const index_t index) {
+	thread_local index_t window_start = 1;
+	thread_local index_t window_end = 0;
+
+	if ((index >= window_start) && (index < window_end)) return;
+
+	window_start = index - index % mapped_entries_window;
+	window_end = window_start + mapped_entries_window;
+
+	index_t advise_end = std::min(window_end + mapped_entries_window, current_tb->num_indices);
+
+	madvise(entries + window_start, (advise_end - window_start) * sizeof(atomic_entry), MADV_WILLNEED);
+    }
+
+    ~MappedEntriesStorage() {
+	if (mapping) munmap(mapping, bytes);
+    }
+};
+
+typedef BasicMemoryEntriesTable<HeapEntriesStorage> MemoryEntriesTable;
+typedef BasicMemoryEntriesTable<MappedEntriesStorage> MappedEntriesTable;
+
 /* CompactMemoryEntriesTable - an EntriesTable held completely in memory, using bit-aligned fields.
  * Intended for bitbases where we only need to store a movecnt and need less than 8 bits per entry
  * to do it.
@@ -8919,25 +10626,50 @@ class MemoryEntriesTable: public EntriesTable {
 class CompactMemoryEntriesTable: public EntriesTable {
 
  private:
-    uint8_t * entries;
+    uint8_t * entries = nullptr;
     uint16_t mask;
     uint used_bits;
 
+    /* Unpack 'count' consecutive entries starting at 'start', with the field width known at
+     * compile time.  Each entry is a single unaligned 32-bit load, a constant shift and a mask, so
+     * the compiler can unroll and vectorize the loop, which it can't do for operator[] or
+     * get_unsigned_int_field().
+     */
+
+    template <unsigned int B>
+    void unpack_entries(index_t start, unsigned int count, entry_t * out) const {
+	static_assert(B <= 16, "compact entries are at most 16 bits");
+	const uint8_t * base = entries + (start * B) / 8;
+	const unsigned int first_bit = (start * B) % 8;
+
+	for (unsigned int i = 0; i < count; i ++) {
+	    const unsigned int bit = first_bit + i * B;
+	    uint32_t word;
+	    memcpy(&word, base + bit/8, sizeof(word));
+	    out[i] = (word >> bit%8) & ((1U << B) - 1);
+	}
+    }
+
  public:
     CompactMemoryEntriesTable(void) {
 	used_bits = bits - unused_bits;
 	unused_bits = 0;
 	mask = (1U << used_bits) - 1;
 
+	/* Pad the end so that unpack() can read a whole word at the last entry */
+
 	size_t bits = current_tb->num_indices * used_bits;
-	size_t bytes = (bits + 7) / 8 + 1;
+	size_t bytes = (bits + 7) / 8 + sizeof(uint32_t);
+	const char * pages;
 
 	try {
-	    entries = new uint8_t [bytes];
+	    entries = static_cast<uint8_t *>(allocate_large(bytes, pages));
+	    /* Entries are packed in index order, so placing bytes places indices */
+	    numa_place(entries, 1, bytes, numa_mode == NumaMode::Interleave);
 	    if (bytes < 1024*1024) {
-		info("Malloced %zdKB for tablebase entries\n", bytes/1024);
+		info("Malloced %zdKB for tablebase entries (%s)\n", bytes/1024, pages);
 	    } else {
-		info("Malloced %zdMB for tablebase entries\n", bytes/(1024*1024));
+		info("Malloced %zdMB for tablebase entries (%s)\n", bytes/(1024*1024), pages);
 	    }
 	} catch (std::bad_alloc ex) {
 	    fatal("Can't malloc %zdMB for tablebase entries: %s\n", bytes/(1024*1024), ex.what());
@@ -8946,11 +10678,52 @@ class CompactMemoryEntriesTable: public EntriesTable {
 	print_current_format();
     }
 
+    ~CompactMemoryEntriesTable() {
+	free_large(entries);
+    }
+
     const nonatomic_entry operator[](const index_t index) {
 	size_t bits = index * used_bits;
 	return nonatomic_entry((*(uint16_t *)(entries + bits/8) >> bits%8) & mask);
     }
 
+    /* Bulk version of operator[], for sequential sweeps.  Entries are read non-atomically, so one
+     * that another thread is changing may come back as either its old or new value.
+     */
+
+    void unpack(index_t start, unsigned int count, entry_t * out) const {
+	switch (used_bits) {
+	case 1: unpack_entries<1>(start, count, out); break;
+	case 2: unpack_entries<2>(start, count, out); break;
+	case 3: unpack_entries<3>(start, count, out); break;
+	case 4: unpack_entries<4>(start, count, out); break;
+	case 5: unpack_entries<5>(start, count, out); break;
+	case 6: unpack_entries<6>(start, count, out); break;
+	case 7: unpack_entries<7>(start, count, out); break;
+	case 8: unpack_entries<8>(start, count, out); break;
+	case 9: unpack_entries<9>(start, count, out); break;
+	case 10: unpack_entries<10>(start, count, out); break;
+	case 11: unpack_entries<11>(start, count, out); break;
+	case 12: unpack_entries<12>(start, count, out); break;
+	case 13: unpack_entries<13>(start, count, out); break;
+	case 14: unpack_entries<14>(start, count, out); break;
+	case 15: unpack_entries<15>(start, count, out); break;
+	case 16: unpack_entries<16>(start, count, out); break;
+	}
+    }
+
+    void prefetch(index_t index) final {
+	__builtin_prefetch(entries + index * used_bits / 8, 1);
+    }
+
+    void write_checkpoint(std::ostream & os) final {
+	os.write(reinterpret_cast<char *>(entries), (current_tb->num_indices * used_bits + 7) / 8);
+    }
+
+    void read_checkpoint(std::istream & is) final {
+	is.read(reinterpret_cast<char *>(entries), (current_tb->num_indices * used_bits + 7) / 8);
+    }
+
     bool is_unpropagated(index_t index) final {
 	size_t bits = index * used_bits;
 	unsigned int movecnt = get_unsigned_int_field(entries, bits + movecnt_offset, movecnt_bits);
@@ -9052,6 +10825,27 @@ public:
 
 };
 
+/* counted_file_descriptor is an io::file_descriptor that tallies the bytes it moves into
+ * temporary_file_bytes_read and temporary_file_bytes_written, for the per-pass statistics.
+ */
+
+class counted_file_descriptor : public io::file_descriptor {
+public:
+    counted_file_descriptor(int fd) : io::file_descriptor(fd, io::never_close_handle) { }
+
+    std::streamsize read(char * s, std::streamsize n) {
+	std::streamsize result = io::file_descriptor::read(s, n);
+	if (result > 0) temporary_file_bytes_read += result;
+	return result;
+    }
+
+    std::streamsize write(const char * s, std::streamsize n) {
+	std::streamsize result = io::file_descriptor::write(s, n);
+	if (result > 0) temporary_file_bytes_written += result;
+	return result;
+    }
+};
+
 /* temporary_file implements a temporary disk file that presents input and output streams, can be
  * optionally compressed, and will be deleted on disk when the object is destroyed.
  */
@@ -9062,10 +10856,10 @@ class temporary_file {
     int fd;
     bool compress;
 
-    io::file_descriptor device(void)
+    counted_file_descriptor device(void)
     {
 	lseek(fd, 0, SEEK_SET);
-	return io::file_descriptor(fd, io::never_close_handle);
+	return counted_file_descriptor(fd);
     }
 
 public:
@@ -9084,7 +10878,7 @@ public:
     {
 	io::filtering_ostream * os = new io::filtering_ostream;
 
-	if (compress) os->push(io::gzip_compressor());
+	if (compress) os->push(io::gzip_compressor(io::gzip_params(temporary_file_compression_level)));
 	os->push(device());
 	os->exceptions(BOOST_IOS::failbit | BOOST_IOS::badbit);
 
@@ -9235,6 +11029,10 @@ class DiskEntriesTable: public EntriesTable {
 	if (entries_write_device != nullptr) delete entries_write_device;
     }
 
+    bool lockstep(void) final {
+	return true;
+    }
+
     const nonatomic_entry operator[](const index_t index) {
 	advance_entry_buffer_to_index(index);
 
@@ -9290,14 +11088,16 @@ struct UnpropagatedIndexTable {
     UnpropagatedIndexTable(size_t size) : total_size(size)
     {
 	size_t bytes = total_size * sizeof(index_t);
+	const char * pages;
 
 	try {
-	    unpropagated_indices = new index_t[total_size];
+	    unpropagated_indices = static_cast<index_t *>(allocate_large(bytes, pages));
+	    numa_place(unpropagated_indices, sizeof(index_t), total_size, true);
 
 	    if (bytes < 1024*1024) {
-		info("Malloced %zdKB for unpropagated index table\n", bytes/1024);
+		info("Malloced %zdKB for unpropagated index table (%s)\n", bytes/1024, pages);
 	    } else {
-		info("Malloced %zdMB for unpropagated index table\n", bytes/(1024*1024));
+		info("Malloced %zdMB for unpropagated index table (%s)\n", bytes/(1024*1024), pages);
 	    }
 	} catch (std::bad_alloc ex) {
 	    fatal("Can't malloc %zdMB for unpropagated index table: %s\n", bytes/(1024*1024), ex.what());
@@ -9368,6 +11168,141 @@ struct UnpropagatedIndexTable {
 UnpropagatedIndexTable * unpropagated_index_table = NULL;
 size_t unpropagated_index_table_MBs = 1;
 
+/* Frontier bitmap.
+ *
+ * The unpropagated index table only helps until it overflows, and on a big bitbase it overflows
+ * during most of the passes that matter.  The frontier bitmap does the same job with one bit per
+ * index, so it never overflows, and it's consumed in parallel.  It's enabled with
+ * --frontier-bitmap, since on a compact table that one bit can be a good fraction of the memory
+ * used by the entries themselves.
+ *
+ * Finding the set bits in a huge, mostly empty bitmap would still mean reading all of it, so
+ * there's a second level, with one summary bit for each 64-bit word of the bitmap.  To flag an
+ * index, we set its bit, then its word's summary bit.  To consume, we clear a summary word, then
+ * clear and process each bitmap word that it flagged.  If we race with somebody flagging an index,
+ * either we see the index now, or its summary bit stays set and we see it next pass (or both,
+ * which is harmless, since back_propagate_index() checks the entry anyway).
+ *
+ * Unlike the unpropagated index table, there's just one of everything, not one for this pass and
+ * one for the last one.  An index flagged ahead of where we're consuming just gets processed this
+ * pass, like it would have been if we were sweeping the whole table.
+ */
+
+class FrontierBitmap {
+
+    index_t words;
+    index_t summary_words;
+    std::atomic<uint64_t> * bits;
+    std::atomic<uint64_t> * summary;
+
+    std::atomic<index_t> count;
+    index_t last_pass_count = 0;
+    bool tracking = false;
+
+ public:
+
+    FrontierBitmap(index_t num_indices) : count(0)
+    {
+	words = (num_indices + 63) / 64;
+	summary_words = (words + 63) / 64;
+
+	size_t bytes = (words + summary_words) * sizeof(uint64_t);
+	const char * pages;
+
+	/* The bitmap and its summary come from allocate_large(), already zeroed */
+
+	try {
+	    bits = static_cast<std::atomic<uint64_t> *>(allocate_large(words * sizeof(uint64_t), pages));
+	    summary = static_cast<std::atomic<uint64_t> *>(allocate_large(summary_words * sizeof(uint64_t), pages));
+	    numa_place(bits, sizeof(uint64_t), words, numa_mode == NumaMode::Interleave);
+	    numa_place(summary, sizeof(uint64_t), summary_words, true);
+
+	    if (bytes < 1024*1024) {
+		info("Malloced %zdKB for frontier bitmap (%s)\n", bytes/1024, pages);
+	    } else {
+		info("Malloced %zdMB for frontier bitmap (%s)\n", bytes/(1024*1024), pages);
+	    }
+	} catch (const std::bad_alloc & ex) {
+	    fatal("Can't malloc %zdMB for frontier bitmap: %s\n", bytes/(1024*1024), ex.what());
+	}
+    }
+
+    ~FrontierBitmap()
+    {
+	free_large(bits);
+	free_large(summary);
+    }
+
+    /* Returns true if we tracked everything during the last pass, so this pass can just consume
+     * the bitmap.  Otherwise (the first intra-table pass), we have to sweep the entire table.
+     */
+
+    bool start_new_pass(void)
+    {
+	bool last_pass_tracked = tracking;
+
+	tracking = true;
+	last_pass_count = count.exchange(0);
+
+	return last_pass_tracked;
+    }
+
+    /* Number of indices flagged during the last pass; only used for the progress indicator */
+
+    index_t size(void)
+    {
+	return last_pass_count;
+    }
+
+    index_t summary_size(void)
+    {
+	return summary_words;
+    }
+
+    void track(const index_t index)
+    {
+	if (! tracking) return;
+
+	const uint64_t bit = 1ULL << (index % 64);
+	const index_t word = index / 64;
+
+	if ((bits[word].fetch_or(bit) & bit) == 0) {
+	    count ++;
+	}
+	if ((summary[word / 64].load() & (1ULL << (word % 64))) == 0) {
+	    summary[word / 64].fetch_or(1ULL << (word % 64));
+	}
+    }
+
+    /* Clear and call function(index) on every flagged index covered by summary words first
+     * through last (inclusive, like parallel_for() sections).
+     */
+
+    template <typename Function>
+    void consume(index_t first, index_t last, Function function)
+    {
+	for (index_t summary_word = first; summary_word <= last; summary_word ++) {
+
+	    uint64_t flagged_words = summary[summary_word].exchange(0);
+
+	    while (flagged_words != 0) {
+		const index_t word = summary_word * 64 + __builtin_ctzll(flagged_words);
+		flagged_words &= flagged_words - 1;
+
+		uint64_t flagged_bits = bits[word].exchange(0);
+
+		while (flagged_bits != 0) {
+		    function(word * 64 + __builtin_ctzll(flagged_bits));
+		    flagged_bits &= flagged_bits - 1;
+		}
+	    }
+	}
+    }
+};
+
+FrontierBitmap * frontier_bitmap = nullptr;
+bool use_frontier_bitmap = false;
+
 /* finalize_update()
  *
  * starting with PTM_wins() and add_one_to_PNTM_wins()
@@ -9430,6 +11365,9 @@ inline void PTM_wins(index_t index, int dtm)
 	if (unpropagated_index_table) {
 	    unpropagated_index_table->track(index);
 	}
+	if (frontier_bitmap) {
+	    frontier_bitmap->track(index);
+	}
     }
 }
 
@@ -9482,6 +11420,9 @@ inline void add_one_to_PNTM_wins(index_t index, int dtm)
 	if (unpropagated_index_table) {
 	    unpropagated_index_table->track(index);
 	}
+	if (frontier_bitmap) {
+	    frontier_bitmap->track(index);
+	}
     }
 }
 
@@ -9549,6 +11490,7 @@ void finalize_update(index_t index, short dtm, short movecnt, int futuremove)
  */
 
 void back_propagate_index_within_table(index_t index, int reflection);
+void flush_intra_table_updates(void);
 
 template <bool use_templated_tracking_dtm, bool templated_tracking_dtm, typename EntriesTableType>
 void back_propagate_index(index_t index, int target_dtm, EntriesTableType entriesTable)
@@ -9593,6 +11535,7 @@ void back_propagate_index(index_t index, int target_dtm, EntriesTableType entrie
 	if (current_tb->symmetry == 8) {
 	    back_propagate_index_within_table(index, REFLECTION_DIAGONAL);
 	}
+	flush_intra_table_updates();
 
 	/* Track statistics.  For the "player wins" statistics, we don't want to count illegal (PNTM
 	 * mated) positions, so we don't increment anything if DTM is 1.
@@ -9620,14 +11563,13 @@ void back_propagate_index(index_t index, int target_dtm)
  * through the entries table, intra-table backpropagating to a single target DTM.  We could go
  * though the table sequentially, each thread picking the next available entry for processing, but
  * that would create a lot of contention between threads as they access adjacent entries that occupy
- * the same cache line.  Instead, we break the table into large blocks and assign a thread to each
- * one.
+ * the same cache line.  Instead, we break the table into blocks and hand them out to the threads
+ * in the thread pool.
  *
- * XXX What happens if part of the table back props a lot faster than another part?  For, say, a ten
- * minute pass with two threads, a 1% difference in speed would result in six seconds of idle time
- * for the faster thread.  Maybe we should use smaller blocks, just big enough to avoid cache
- * conflicts.  On the other hand, Intel processors recognize sequential data access patterns and
- * prefetch data from memory, so there is a clear advantage to a simple sequential access pattern.
+ * It used to be one big block per thread, but then if part of the table back props a lot faster
+ * than another part, the faster threads sit idle.  parallel_for() now hands out blocks that start
+ * large and get smaller towards the end of the pass.  They're still big enough to avoid cache
+ * conflicts and to let the processor's prefetcher recognize a sequential access pattern.
  */
 
 void back_propagate_section(index_t start_index, index_t end_index, int target_dtm)
@@ -9638,10 +11580,27 @@ void back_propagate_section(index_t start_index, index_t end_index, int target_d
     MemoryEntriesTable * met = dynamic_cast<MemoryEntriesTable *>(entriesTable.entriesTable);
 
     if ((cmet != nullptr) && !tracking_dtm) {
+
+	/* Unpack the compact table a block at a time and only call back_propagate_index() on the
+	 * entries that look unpropagated.  It checks again, so a stale read in this direction is
+	 * harmless.  A stale read in the other direction, an entry flagged by another thread after
+	 * we unpacked it, is the same as if it had been flagged just behind us, and we'll get it next
+	 * pass, which will happen, because some position was finalized this pass to flag it.
+	 */
+
 	auto etable = EntriesTablePtr<CompactMemoryEntriesTable>(cmet);
-	for (index = start_index; index <= end_index; index++) {
-	    mark_progress();
-	    back_propagate_index<true, false>(index, target_dtm, etable);
+	const unsigned int block_size = 64;
+	entry_t block[block_size];
+
+	for (index = start_index; index <= end_index; index += block_size) {
+	    unsigned int count = std::min<index_t>(block_size, end_index - index + 1);
+	    cmet->unpack(index, count, block);
+	    for (unsigned int i = 0; i < count; i ++) {
+		mark_progress();
+		if (nonatomic_entry(block[i]).is_unpropagated()) {
+		    back_propagate_index<true, false>(index + i, target_dtm, etable);
+		}
+	    }
 	}
     } else if ((met != nullptr) && tracking_dtm) {
 	auto etable = EntriesTablePtr<MemoryEntriesTable>(met);
@@ -9663,6 +11622,27 @@ void non_proptable_pass(int target_dtm)
     std::stringstream label;
     label << "Pass " << std::setw(4) << target_dtm;
 
+    if ((! tracking_dtm) && frontier_bitmap && frontier_bitmap->start_new_pass()) {
+
+	reset_progress_indicator(label.str().c_str(), frontier_bitmap->size());
+
+	entriesTable->set_threads(num_threads);
+
+	pool.parallel_for(0, frontier_bitmap->summary_size(),
+			  [target_dtm](index_t first, index_t last) {
+			      frontier_bitmap->consume(first, last, [target_dtm](index_t index) {
+				      mark_progress();
+				      back_propagate_index(index, target_dtm);
+				  });
+			  });
+
+	entriesTable->set_threads(1);
+
+	end_progress_indicator(positions_finalized_this_pass.load(), "positions finalized");
+
+	return;
+    }
+
     if ((! tracking_dtm) && unpropagated_index_table) {
 
 	unpropagated_index_table->start_new_pass();
@@ -9682,30 +11662,14 @@ void non_proptable_pass(int target_dtm)
 	}
     }
 
-    std::thread t[num_threads];
-    unsigned int thread;
-    index_t block_size = current_tb->num_indices / num_threads;
-
     entriesTable->set_threads(num_threads);
 
     reset_progress_indicator(label.str().c_str(), current_tb->num_indices);
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	index_t start_index = thread*block_size;
-	index_t end_index;
-
-        if (thread != num_threads-1) {
-            end_index = (thread+1)*block_size - 1;
-        } else {
-            end_index = current_tb->num_indices - 1;
-        }
-
-	t[thread] = std::thread(back_propagate_section, start_index, end_index, target_dtm);
-    }
-
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread].join();
-    }
+    pool.parallel_for(0, current_tb->num_indices,
+		      [target_dtm](index_t start_index, index_t end_index) {
+			  back_propagate_section(start_index, end_index, target_dtm);
+		      });
 
     end_progress_indicator(positions_finalized_this_pass.load(), "positions finalized");
 
@@ -9831,27 +11795,59 @@ struct disk_que {
     int next;
 
     disk_que(typename Container::iterator head, typename Container::iterator tail)
-	: size(tail - head), next(0)
+	: last(0), size(tail - head), next(0)
     {
-	/* If we're compressing, convert the sorted array into a delta encoded list, which improves
-	 * gzip's ability to compress proptables dramatically.
-	 *
-	 * XXX changes contents of the data passed into the function, but we can get away with this
-	 * because we know it's about to be throw away
-	 */
+	file = new temporary_file("proptableXXXXXX", compress_proptables);
 
-	if (compress_proptables) {
-	    value_type last = *head;
-	    for (auto it=head+1; it < tail; it++) {
-		*it -= last;
-		last += *it;
+	std::ostream * os = file->ostream();
+
+	if (varint_proptables) {
+
+	    /* Write the differences between successive (sorted) entries as little-endian base-128
+	     * varints, seven bits to a byte with the high bit set on all but the last byte.  The
+	     * index is the most significant field, so in a reasonably full proptable most of the
+	     * differences fit in one or two bytes, even before any gzip compression.
+	     */
+
+	    char buffer[4096 + 16];
+	    size_t len = 0;
+	    value_type last = 0;
+
+	    for (auto it=head; it < tail; it++) {
+		value_type delta = *it - last;
+		last = *it;
+		while (delta >= 0x80) {
+		    buffer[len ++] = (delta & 0x7f) | 0x80;
+		    delta >>= 7;
+		}
+		buffer[len ++] = delta;
+		if (len >= 4096) {
+		    os->write(buffer, len);
+		    len = 0;
+		}
 	    }
-	}
+	    os->write(buffer, len);
 
-	file = new temporary_file("proptableXXXXXX", compress_proptables);
+	} else {
+
+	    /* If we're compressing, convert the sorted array into a delta encoded list, which
+	     * improves gzip's ability to compress proptables dramatically.
+	     *
+	     * XXX changes contents of the data passed into the function, but we can get away with
+	     * this because we know it's about to be throw away
+	     */
+
+	    if (compress_proptables) {
+		value_type last = *head;
+		for (auto it=head+1; it < tail; it++) {
+		    *it -= last;
+		    last += *it;
+		}
+	    }
+
+	    os->write(reinterpret_cast<char *>(head.base()), size * sizeof(value_type));
+	}
 
-	std::ostream * os = file->ostream();
-	os->write(reinterpret_cast<char *>(head.base()), size * sizeof(value_type));
 	delete os;
 
 	is = file->istream();
@@ -9866,9 +11862,41 @@ struct disk_que {
 	return (next == size);
     }
 
+    /* Call function(value) on everything, then rewind, so it can all be read again.  Only allowed
+     * before anybody has started reading.  Used for checkpoints.
+     */
+
+    template <typename Function>
+    void for_each(Function function) {
+	if (next != 0) throw std::runtime_error("disk_que::for_each called after reading started");
+
+	while (! empty()) function(pop_front());
+
+	delete is;
+	is = file->istream();
+	next = 0;
+	last = 0;
+    }
+
     value_type pop_front(void) {
 	value_type val;
 	if (empty()) throw std::runtime_error("read past end of disk_que");
+
+	if (varint_proptables) {
+	    value_type delta = 0;
+	    int shift = 0;
+	    int c;
+	    do {
+		c = is->get();
+		if (c == EOF) throw std::runtime_error("premature end of disk_que");
+		delta |= static_cast<value_type>(c & 0x7f) << shift;
+		shift += 7;
+	    } while (c & 0x80);
+	    last += delta;
+	    next ++;
+	    return last;
+	}
+
 	is->read(reinterpret_cast<char *>(&val), sizeof(value_type));
 
 	/* Back out delta encoding introduced above */
@@ -10144,13 +12172,34 @@ public:
 	if (in_memory_queue) delete in_memory_queue;
     }
 
-    void push(const T& x) {
+    /* Call function(x) on everything that pop_front() would return, in no particular order, but
+     * leave it all in the queue.  Only allowed before retrieval starts, with nobody pushing.  The
+     * part of the in-memory queue that we look at is whatever prepare_to_retrieve() would dump.
+     */
 
-	std::unique_lock<std::mutex> self_lock(*this);
+    template <typename Function>
+    void for_each(Function function) {
+	if (in_memory_queue == nullptr) throw std::runtime_error("priority_queue: for_each attempted after retrieval started");
 
-	if (in_memory_queue == nullptr) throw std::runtime_error("priority_queue: push attempted after retrieval started");
+	for (auto & disk_que : disk_ques) {
+	    disk_que->for_each(function);
+	}
 
-	item_count ++;
+	if (remaining_space >= num_threads) {
+	    std::for_each(head, tail, function);
+	} else {
+	    unsigned int current = num_threads - remaining_space - 1;
+	    std::for_each(in_memory_queue->begin() + current * block_size, in_memory_queue->end(), function);
+	}
+    }
+
+    void push(const T& x) {
+
+	std::unique_lock<std::mutex> self_lock(*this);
+
+	if (in_memory_queue == nullptr) throw std::runtime_error("priority_queue: push attempted after retrieval started");
+
+	item_count ++;
 	*(tail ++) = x;
 	remaining_space --;
 	sorted = false;
@@ -10319,32 +12368,40 @@ public:
  */
 
 template<typename T>
-class typed_proptable : public priority_queue<T> {
+class typed_proptable : public priority_queue<T, std::vector<T, large_allocator<T>>> {
+
+    typedef priority_queue<T, std::vector<T, large_allocator<T>>> queue;
 
 public:
     proptable_format format;
 
-    /* priority_queue<T>'s constructor passes all of its arguments to its MemoryContainer's
-     * constructor (remember?), and priority_queue<T>'s default MemoryContainer is std::vector<T>,
-     * which will take a size_type and build a container with that many elements.
+    /* priority_queue's constructor passes all of its arguments to its MemoryContainer's
+     * constructor (remember?), and our MemoryContainer is a std::vector<T> (with its memory from
+     * allocate_large()), which will take a size_type and build a container with that many
+     * elements.
      */
 
     typed_proptable(proptable_format format, size_t size_in_bytes):
-	priority_queue<T>(size_in_bytes / sizeof(T)), format(format)
+	queue(size_in_bytes / sizeof(T)), format(format)
     {
 	if (format.bits > 8 * (int) sizeof(T)) throw std::runtime_error("proptable format too large");
     }
 
     proptable_entry front() {
-	return proptable_entry(&format, priority_queue<T>::front());
+	return proptable_entry(&format, queue::front());
     }
 
     proptable_entry pop_front() {
-	return proptable_entry(&format, priority_queue<T>::pop_front());
+	return proptable_entry(&format, queue::pop_front());
     }
 
     void push(proptable_entry &entry) {
-	priority_queue<T>::push(entry.encode<T>(&format));
+	queue::push(entry.encode<T>(&format));
+    }
+
+    template <typename Function>
+    void for_each(Function function) {
+	queue::for_each([&](const T & value) { function(proptable_entry(&format, value)); });
     }
 };
 
@@ -10609,11 +12666,123 @@ struct disk_que<memory_proptable> {
 /* Finally, the actual priority queue(s) */
 
 // The bit-aligned version.  Significantly slower.
-//typedef priority_queue<class proptable_entry, class memory_proptable> proptable;
+//typedef priority_queue<class proptable_entry, class memory_proptable> proptable_queue;
 
 // Byte-aligned versions.  No appreciable slowdown in using 64-bit version on a 32-bit problem.
-//typedef typed_proptable<uint32_t> proptable;
-typedef typed_proptable<uint64_t> proptable;
+//typedef typed_proptable<uint32_t> proptable_queue;
+typedef typed_proptable<uint64_t> proptable_queue;
+
+/* The range of indices that we're responsible for.  Always the whole table, unless we're one node
+ * of a distributed generation run (see below).
+ */
+
+index_t owned_index_start = 0;
+index_t owned_index_end = 0;
+
+/* A proptable is split into partitions covering disjoint, consecutive ranges of indices, each with
+ * its own priority queue (and its own share of the memory).  Inserts go to whichever partition
+ * covers the entry's index, so inserting threads mostly don't contend on the same lock.  When we
+ * retrieve, each thread claims a whole partition and walks through its range of indices, merging
+ * that partition's sorted runs by itself, so the passes don't serialize on a single sorting
+ * network.
+ *
+ * Partitions are equal ranges of indices, not equal numbers of entries, so some of them take a
+ * lot longer than others.  We make several partitions per thread, and threads claim them from a
+ * shared counter, so a thread that finishes early goes on to the next unclaimed partition instead
+ * of waiting for the slow ones.
+ *
+ * If the entries table needs its threads to move through it in lockstep (DiskEntriesTable), we
+ * use a single partition, and all the threads share it, one index at a time, like we always did.
+ */
+
+const unsigned int proptable_partitions_per_thread = 4;
+
+class proptable {
+
+ public:
+
+    struct partition {
+	proptable_queue queue;
+	std::atomic<index_t> next_index;
+	index_t end;
+
+	partition(proptable_format format, size_t size_in_bytes, index_t start, index_t end):
+	    queue(format, size_in_bytes), next_index(start), end(end) { }
+    };
+
+ private:
+
+    std::vector<std::unique_ptr<partition>> partitions;
+    index_t partition_size;
+    std::atomic<unsigned int> next_partition;
+
+ public:
+
+    proptable_format format;
+
+    proptable(proptable_format format, size_t size_in_bytes): next_partition(0), format(format)
+    {
+	index_t num_owned_indices = owned_index_end - owned_index_start;
+	unsigned int num_partitions = entriesTable->lockstep() ? 1 : num_threads * proptable_partitions_per_thread;
+
+	/* Don't make partitions with no indices in them, and don't let partition_size be zero (for a
+	 * node that owns nothing), since push() divides by it.
+	 */
+
+	if (num_partitions > num_owned_indices) num_partitions = std::max<index_t>(num_owned_indices, 1);
+
+	partition_size = std::max<index_t>((num_owned_indices + num_partitions - 1) / num_partitions, 1);
+
+	for (unsigned int i = 0; i < num_partitions; i ++) {
+	    index_t start = std::min(owned_index_start + i * partition_size, owned_index_end);
+	    index_t end = std::min(start + partition_size, owned_index_end);
+	    partitions.emplace_back(new partition(format, size_in_bytes / num_partitions, start, end));
+	}
+    }
+
+    void push(proptable_entry &entry) {
+	partitions[(entry.index - owned_index_start) / partition_size]->queue.push(entry);
+    }
+
+    void prepare_to_retrieve(void) {
+	for (auto & partition : partitions) {
+	    partition->queue.prepare_to_retrieve();
+	}
+    }
+
+    size_t count(void) {
+	size_t total = 0;
+	for (auto & partition : partitions) {
+	    total += partition->queue.count();
+	}
+	return total;
+    }
+
+    /* Call function(entry) on every entry, in no particular order, leaving them all in place.
+     * Used for checkpoints.
+     */
+
+    template <typename Function>
+    void for_each(Function function) {
+	for (auto & partition : partitions) {
+	    partition->queue.for_each(function);
+	}
+    }
+
+    /* Returns the next partition for a thread to work on, or nullptr if there aren't any more.  A
+     * single partition is shared by everybody until its indices run out.
+     */
+
+    partition * claim_partition(void) {
+	if (partitions.size() == 1) {
+	    return (partitions[0]->next_index < partitions[0]->end) ? partitions[0].get() : nullptr;
+	}
+
+	unsigned int next = next_partition ++;
+
+	return (next < partitions.size()) ? partitions[next].get() : nullptr;
+    }
+};
 
 proptable * input_proptable;
 proptable * output_proptable;
@@ -10621,6 +12790,37 @@ proptable * output_proptable;
 futurevector_t initialize_tablebase_entry(tablebase_t *tb, index_t index);
 void finalize_futuremove(tablebase_t *tb, index_t index, futurevector_t futurevector);
 
+/* The futurevectors array packs tb->futurevector_bits bits for each index, which can be more than
+ * fits into one 64-bit field, so we read and write them a word at a time.  The array is allocated
+ * in whole 64-bit words (plus one spare, since the bitlib functions can touch the word after the
+ * field), and since parallel_for() chunks are multiples of 64 indices, no two threads ever write
+ * the same word.
+ */
+
+futurevector_t get_futurevector(const tablebase_t *tb, index_t index)
+{
+    futurevector_t futurevector = 0;
+    const bitoffset bit_offset = (bitoffset) index * tb->futurevector_bits;
+
+    for (int word = 0; 64*word < tb->futurevector_bits; word ++) {
+	set_futurevector_word(futurevector, word,
+			      get_uint64_t_field(tb->futurevectors, bit_offset + 64*word,
+						 std::min(64, tb->futurevector_bits - 64*word)));
+    }
+
+    return futurevector;
+}
+
+void set_futurevector(tablebase_t *tb, index_t index, const futurevector_t & futurevector)
+{
+    const bitoffset bit_offset = (bitoffset) index * tb->futurevector_bits;
+
+    for (int word = 0; 64*word < tb->futurevector_bits; word ++) {
+	set_uint64_t_field(tb->futurevectors, bit_offset + 64*word,
+			   std::min(64, tb->futurevector_bits - 64*word), futurevector_word(futurevector, word));
+    }
+}
+
 /* proptable_pass()
  *
  * Commit an old set of proptables into the entries array while writing a new set.
@@ -10632,36 +12832,42 @@ void proptable_pass_thread(int target_dtm)
 {
     index_t index;
     std::deque<class proptable_entry> current_pt_entries;
+    proptable::partition * partition = input_proptable->claim_partition();
 
-    while (1) {
+    while (partition != nullptr) {
 
 	futurevector_t futurevector = 0;
 
 	current_pt_entries.clear();
 
-	/* Lock the input proptable, advance the shared index, retrieve everything
-	 * from the proptable that matches the new index, then unlock
+	/* Lock the input partition, advance its index, retrieve everything from it that matches
+	 * the new index, then unlock.  Unless the partition is shared, nobody else is waiting.
 	 */
 
 	{
-	    std::lock_guard<std::mutex> _(*input_proptable);
+	    std::lock_guard<std::mutex> _(partition->queue);
 
-	    index = (proptable_shared_index ++);
+	    index = (partition->next_index ++);
 
-	    if (index >= current_tb->num_indices) break;
+	    if ((index < partition->end) && ! partition->queue.empty()) {
 
-	    if (! input_proptable->empty()) {
-
-		if (input_proptable->front().index < index) {
+		if (partition->queue.front().index < index) {
 		    fatal("Out-of-order entries in proptable\n");
 		}
 
-		while (! input_proptable->empty() && input_proptable->front().index == index) {
-		    current_pt_entries.push_back(input_proptable->pop_front());
+		while (! partition->queue.empty() && partition->queue.front().index == index) {
+		    current_pt_entries.push_back(partition->queue.pop_front());
 		}
 	    }
 	}
 
+	/* Done with this partition; move on to the next one nobody has claimed yet */
+
+	if (index >= partition->end) {
+	    partition = input_proptable->claim_partition();
+	    continue;
+	}
+
 	/* initialize_tablebase_entry() calls mark_progress(), so we only need to mark our progress
 	 * here if we're not calling initialize_tablebase_entry().
 	 */
@@ -10751,9 +12957,6 @@ void proptable_pass_thread(int target_dtm)
 
 void proptable_pass(int target_dtm)
 {
-    std::thread t[num_threads];
-    unsigned int thread;
-
     /* Proptable for intra-tablebase propagation only needs to record the index, since the dtm is
      * known from the pass number, the movecnt is always one, and we're done tracking futuremoves.
      */
@@ -10776,25 +12979,17 @@ void proptable_pass(int target_dtm)
 	throw nested_exception("Constructing output proptable", ex);
     }
 
-    proptable_shared_index = 0;
-
     if (target_dtm == 0) {
-	reset_progress_indicator("Initializing tablebase", current_tb->num_indices);
+	reset_progress_indicator("Initializing tablebase", owned_index_end - owned_index_start);
     } else {
 	std::stringstream label;
 	label << "Pass " << std::setw(4) << target_dtm;
-	reset_progress_indicator(label.str().c_str(), current_tb->num_indices);
+	reset_progress_indicator(label.str().c_str(), owned_index_end - owned_index_start);
     }
 
     entriesTable->set_threads(num_threads);
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread] = std::thread(proptable_pass_thread, target_dtm);
-    }
-
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread].join();
-    }
+    pool.run(std::bind(proptable_pass_thread, target_dtm));
 
     entriesTable->set_threads(1);
 
@@ -10825,9 +13020,6 @@ void reconstruct_proptable_thread(int target_dtm)
 
 void reconstruct_proptable(int target_dtm)
 {
-    std::thread t[num_threads];
-    unsigned int thread;
-
     proptable_format format(current_tb->num_indices, 0, 0, 0, 0);
 
     output_proptable = new proptable(format, proptable_MBs << 20);
@@ -10836,5176 +13028,7447 @@ void reconstruct_proptable(int target_dtm)
 
     entriesTable->set_threads(num_threads);
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread] = std::thread(proptable_pass_thread, target_dtm);
-    }
-
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread].join();
-    }
+    pool.run(std::bind(proptable_pass_thread, target_dtm));
 
     entriesTable->set_threads(1);
 }
 
-void insert_new_propentry(index_t index, int dtm, unsigned int movecnt, int futuremove)
-{
-    class proptable_entry pt_entry;
+/***** DISTRIBUTED GENERATION *****
+ *
+ * A proptable run can be split across several nodes that share a directory (NFS, say), with
+ * --exchange-dir=DIR and --node=K/N.  Node K owns the K'th of N consecutive ranges of indices.  It
+ * initializes and back propagates only its own range, and any update for an index that somebody
+ * else owns gets written to a file for its owner instead of going into our output proptable.  At
+ * the end of each pass, everybody publishes their update files along with a "done" file holding
+ * their pass statistics, waits for everybody else's done files, and reads in the updates addressed
+ * to them.  The pass statistics are summed (and the passes needed or'ed together), so that every
+ * node sees the same totals and makes the same decisions about which pass to run next.
+ *
+ * Intra-table proptable entries are just indices, so that's all the update files contain.
+ *
+ * The entries table of a node is a full-sized MappedEntriesTable, but since it's a sparse file
+ * and we only touch our own range, that's all it costs us.  At the end, every other node writes
+ * its range to the exchange directory and node 0 collects them all and writes the tablebase.
+ *
+ * Every exchange filename carries the control file hash and a run id, so that files left behind
+ * by an earlier run (of this tablebase or another one) in the same directory can't be mistaken
+ * for ours.  Node 0 picks the run id at random and publishes it in a "run" file named by the hash
+ * alone.  Everybody else reads it, answers with a "joined" file holding a random token of their
+ * own, and waits for node 0's "started" file to list that token.  A node that read a stale run
+ * file (node 0 hasn't started yet) never sees its token, and rejoins when the run file changes.
+ * On a clean exit, node 0 removes whatever is left.
+ *
+ * XXX every node back propagates all of the futurebases and discards the updates it doesn't own,
+ * which is simple but wastes N-1 copies of that work
+ *
+ * XXX the barrier is just polling for files, so this is only as reliable as the shared filesystem
+ */
 
-    if (futuremove != NO_FUTUREMOVE) {
-	assert(futuremove >= 0);
-	assert(static_cast<uint64_t>(futuremove) < output_proptable->format.futuremove_mask);
-    }
+std::string exchange_directory;
+unsigned int node_number = 0;
+unsigned int num_nodes = 1;
 
-    pt_entry.index = index;
-    pt_entry.dtm = dtm;
-    pt_entry.movecnt = movecnt;
-    pt_entry.futuremove = futuremove;
+struct outbound_updates {
+    std::mutex lock;
+    std::ofstream file;
+    uint64_t count = 0;			/* Announced in the done file, so the reader can check it */
+};
 
-    output_proptable->push(pt_entry);
+std::vector<std::unique_ptr<outbound_updates>> outbound;
 
-    /* fprintf(stderr, "Size of proptable: %llu\n", output_proptable->size()); */
+int exchange_number = 0;		/* Number of end-of-pass exchanges so far */
+uint64_t exchange_run_id = 0;		/* Agreed on by join_distributed_run() */
+
+bool owns_index(index_t index)
+{
+    return (index >= owned_index_start) && (index < owned_index_end);
 }
 
+void set_owned_index_range(void)
+{
+    const index_t node_size = (current_tb->num_indices + num_nodes - 1) / num_nodes;
 
-/* If we're running multi-threaded, then there is a possibility that 1) two different positions will
- * try to backprop into the same position (if we're not using proptables), or that 2) two different
- * threads will try to retrieve from the proptable at the same time (if we're using proptables).
- *
- * The first case is handled by a locking sequence on individual entries in finalize_update(); the
- * second case is handled by a locking sequence on the priority_queue in proptable_pass_thread().
- */
+    owned_index_start = std::min(node_number * node_size, current_tb->num_indices);
+    owned_index_end = std::min(owned_index_start + node_size, current_tb->num_indices);
 
-void commit_update(index_t index, short dtm, short movecnt, int futuremove)
+    if (num_nodes > 1) {
+	info("Node %d of %d: indices %" PRIindex " to %" PRIindex "\n",
+	     node_number, num_nodes, owned_index_start, owned_index_end - 1);
+    }
+}
+
+std::string run_filename(void)
 {
+    char hash[17];
 
-    if (index == debug_move) {
-	info("commit_update; index=%" PRIindex "; dtm=%d; movecnt=%d; futuremove=%d\n",
-	     index, dtm, movecnt, futuremove);
-    }
+    snprintf(hash, sizeof(hash), "%016" PRIx64, control_file_hash);
 
-    backproped_moves_this_pass ++;
+    return exchange_directory + "/run-" + hash;
+}
 
-    if (!using_proptables) {
+std::string exchange_filename(const char * what, int exchange, int from, int to = -1)
+{
+    std::stringstream filename;
+    char run[34];
 
-	if (! ignore_futurevectors) {
+    snprintf(run, sizeof(run), "%016" PRIx64 "-%016" PRIx64, control_file_hash, exchange_run_id);
 
-	    if (futuremove != NO_FUTUREMOVE) {
+    filename << exchange_directory << "/" << what << "-" << run << "-" << exchange << "-" << from;
+    if (to != -1) filename << "-" << to;
 
-		/* Futuremove - check off bits in an array that got filled in when we initialized
-		 *
-		 * Do nothing if the bit is clear, either because we were never to process this
-		 * futuremove at all (this is how a suicide analysis rejects non-capture futuremoves
-		 * from a position where captures are possible), or because a previous pass through
-		 * this code has already processed it.  In the later case, we fatally complain if
-		 * the the entriesTable contains a normal position with DTM not 1 (PNTM in check).
-		 *
-		 * We can't tell the difference at this point, and probably need to use proptables
-		 * for more accurate checking.
-		 *
-		 * This is done atomically, because there will be other indices in this bit vector.
-		 */
+    return filename.str();
+}
 
-		long long bit_offset = ((long long)index * current_tb->futurevector_bits);
+/* If another node dies, we'd wait for its files forever, so we give up after --exchange-timeout
+ * minutes (0 means wait forever).  It has to be longer than the slowest node can take to finish a
+ * pass after the fastest one does, and the nodes have to be started within that long of each other.
+ */
 
-		if (! test_and_set_bit_field(current_tb->futurevectors, bit_offset + futuremove, 0)) {
+int exchange_timeout_minutes = 60;
 
-		    if ((entriesTable[index].get_raw_DTM() != 1) && entriesTable[index].is_normal_movecnt()
-			&& (current_tb->variant != Variant::Suicide)) {
+void check_exchange_timeout(std::chrono::steady_clock::time_point start, const std::string & filename)
+{
+    if ((exchange_timeout_minutes > 0)
+	&& (std::chrono::steady_clock::now() - start > std::chrono::minutes(exchange_timeout_minutes))) {
+	fatal("Gave up waiting for '%s' after %d minutes\n", filename.c_str(), exchange_timeout_minutes);
+	terminate();
+    }
+}
 
-			fatal("commit_update; futuremove processed; index=%" PRIindex "; dtm=%d; movecnt=%d; futuremove=%d\n",
-			      index, dtm, movecnt, futuremove);
-		    }
+void wait_for_file(const std::string & filename)
+{
+    auto start = std::chrono::steady_clock::now();
 
-		    return;
-		}
+    while (access(filename.c_str(), R_OK) == -1) {
+	check_exchange_timeout(start, filename);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
 
-	    }
-	}
+/* Start collecting updates for other nodes.  Until this is first called (during futurebase back
+ * prop), updates for other nodes are just dropped, since their owners are making them too.
+ */
 
-	finalize_update(index, dtm, movecnt, futuremove);
+void open_outbound_updates(void)
+{
+    outbound.clear();
 
-    } else {
+    for (unsigned int node = 0; node < num_nodes; node ++) {
+	outbound.emplace_back(new outbound_updates);
+	if (node == node_number) continue;
 
-	insert_new_propentry(index, dtm, movecnt, futuremove);
+	std::string filename = exchange_filename("updates", exchange_number, node_number, node) + ".new";
 
+	outbound.back()->file.open(filename, std::ofstream::binary | std::ofstream::trunc);
+	if (! outbound.back()->file) {
+	    fatal("Can't open '%s' for writing: %s\n", filename.c_str(), strerror(errno));
+	    terminate();
+	}
     }
+}
+
+void send_update_to_owner(index_t index)
+{
+    if (outbound.empty()) return;
 
+    const index_t node_size = (current_tb->num_indices + num_nodes - 1) / num_nodes;
+    outbound_updates & peer = *outbound[index / node_size];
+
+    std::lock_guard<std::mutex> _(peer.lock);
+    peer.file.write(reinterpret_cast<const char *>(&index), sizeof(index));
+    peer.count ++;
+}
+
+template <typename T>
+void write_exchange_value(std::ostream & os, const T & value)
+{
+    os.write(reinterpret_cast<const char *>(&value), sizeof(T));
 }
 
+template <typename T>
+T read_exchange_value(std::istream & is)
+{
+    T value;
+    is.read(reinterpret_cast<char *>(&value), sizeof(T));
+    return value;
+}
 
-/* target_dtm 0 is the initialization / futurebase back prop pass */
+/* Write a small exchange file under a temporary name and rename it into place, so nobody ever
+ * sees part of it.
+ */
 
-uint64_t propagation_pass(int target_dtm)
+void write_exchange_file(const std::string & filename, const std::vector<uint64_t> & values)
 {
-    positions_finalized_this_pass = 0;
-    backproped_moves_this_pass = 0;
+    std::ofstream os(filename + ".new", std::ofstream::binary | std::ofstream::trunc);
 
-    if (tracking_dtm) {
-	if (target_dtm > 0) {
-	    entriesTable->verify_DTM_field_size(target_dtm+1);
-	} else {
-	    entriesTable->verify_DTM_field_size(target_dtm-1);
-	}
+    for (auto value : values) {
+	write_exchange_value<uint64_t>(os, value);
     }
 
-    if (pass_type[total_passes] == nullptr) pass_type[total_passes] = "intratable";
-    pass_target_dtms[total_passes] = target_dtm;
-
-    if (using_proptables) {
-	proptable_pass(target_dtm);
-    } else {
-	non_proptable_pass(target_dtm);
+    os.close();
+    if (! os || (rename((filename + ".new").c_str(), filename.c_str()) == -1)) {
+	fatal("Can't write '%s': %s\n", filename.c_str(), strerror(errno));
+	terminate();
     }
+}
 
-    positions_finalized[total_passes] = positions_finalized_this_pass;
-    backproped_moves[total_passes] = backproped_moves_this_pass;
+/* Reads 'count' values from an exchange file, returning false if it isn't there or is short */
 
-    total_backproped_moves += backproped_moves[total_passes];
+bool read_exchange_file(const std::string & filename, std::vector<uint64_t> & values, size_t count)
+{
+    std::ifstream is(filename, std::ifstream::binary);
 
-    if (positions_finalized_this_pass > 0) {
-	if (target_dtm > max_dtm) max_dtm = target_dtm;
-	if (target_dtm < min_dtm) min_dtm = target_dtm;
+    values.resize(count);
+    for (auto & value : values) {
+	value = read_exchange_value<uint64_t>(is);
     }
 
-    finalize_pass_statistics();
+    return is.is_open() && is.good();
+}
 
-    total_passes ++;
-    if (total_passes == max_passes) expand_per_pass_statistics();
+/* Agree with the other nodes on a run id (see above).  Called once, before the first exchange. */
 
-    return positions_finalized_this_pass;
-}
+void join_distributed_run(void)
+{
+    std::random_device random;
+    std::uniform_int_distribution<uint64_t> distribution;
+    std::vector<uint64_t> values;
 
-/***** FUTUREBASES *****/
+    if (node_number == 0) {
 
-/* Subroutines to backpropagate an individual index, or an individual local position (these are the
- * "mini" routines), or a set of local positions that differ only in the en passant square.
- *
- * The idea behind the en passant handling is this.  If we back propagate a position with the en
- * passant square set, then that's the only position we process.  If we back prop a position without
- * the en passant square set, then we process not only that position, but also any positions just
- * like it that have en passant set.  The idea being that we set en passant if we actually need it,
- * and we clear it if we don't need it, so if it's clear we need to process positions where it was
- * set, but we didn't use it.
- */
+	exchange_run_id = distribution(random);
+	write_exchange_file(run_filename(), {exchange_run_id});
 
-bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position);
+	std::vector<uint64_t> tokens(num_nodes, 0);
 
-void propagate_minilocal_position_from_futurebase(local_position_t &current_position,
-						  const local_position_t &foreign_position,
-						  int futuremove, bool normalize)
-{
-    /* XXX get rid of this const_cast ; need it because get_DTM might modify its tablebase */
-    tablebase_t * futurebase = const_cast<tablebase_t *>(foreign_position.tb);
-    index_t current_index;
-    index_t future_index = foreign_position.index;
+	for (unsigned int node = 1; node < num_nodes; node ++) {
+	    std::string filename = exchange_filename("joined", 0, node);
+	    wait_for_file(filename);
+	    if (! read_exchange_file(filename, values, 1)) {
+		fatal("Can't read '%s'\n", filename.c_str());
+		terminate();
+	    }
+	    tokens[node] = values[0];
+	    unlink(filename.c_str());
+	}
 
-    /* Look up the position in the current tablebase... */
+	write_exchange_file(exchange_filename("started", 0, 0), tokens);
 
-    if (normalize) {
-	current_index = normalized_position_to_index(current_position);
     } else {
-	current_index = local_position_to_index(current_position);
-    }
 
-    if (current_index == INVALID_INDEX) {
-	return;
-    }
+	const uint64_t token = distribution(random);
+	bool started = false;
+	auto start = std::chrono::steady_clock::now();
 
-    if ((futuremove < 0) && (futuremove != HANDLED_FUTUREMOVE)) {
-	fatal("Futuremove %d never assigned: %s\n", futuremove, current_position.FEN());
-	return;
-    }
+	while (! started) {
 
-    /* local_position_to_index() updated the position structure's multiplicity and reflection, so we
-     * know they're correct.  If we're back proping into an 8-way symmetric tablebase (the only way
-     * REFLECTION_DIAGONAL will ever be set), we must be back proping from an 8-way symmetric
-     * futurebase (since futurebases can never have less symmetry than the current tablebase).  In
-     * this case, if diagonal reflection is required on the current position, then discard this case
-     * since we'll be called again without diagonal reflection.  Otherwise, use the 8-way
-     * multiplicity (2 and 4 way symmetry are ignored when computing multiplicity, which is thus
-     * always either 1 or 2) as a movecnt.
-     */
+	    wait_for_file(run_filename());
+	    if (! read_exchange_file(run_filename(), values, 1)) {
+		check_exchange_timeout(start, run_filename());
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		continue;
+	    }
 
-    int movecnt;
+	    exchange_run_id = values[0];
+	    write_exchange_file(exchange_filename("joined", 0, node_number), {token});
 
-    if (futuremove == HANDLED_FUTUREMOVE) {
-	movecnt = 1;
-	futuremove = NO_FUTUREMOVE;
-    } else if (ignore_futurevectors) {
-	movecnt = 1;
-    } else {
-	if ((current_position.multiplicity == 2) && (current_position.reflection & REFLECTION_DIAGONAL)) {
-	    return;
-	}
+	    while (true) {
+		check_exchange_timeout(start, exchange_filename("started", 0, 0));
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
-	movecnt = current_position.multiplicity;
-    }
+		if (read_exchange_file(exchange_filename("started", 0, 0), values, num_nodes)
+		    && (values[node_number] == token)) {
+		    started = true;
+		    break;
+		}
 
-    if ((current_index == debug_move) || (future_index == debug_futuremove)) {
-	info("propagate_index_from_futurebase; %" PRIindex " %s refl %d mul %d from %s %s %" PRIindex " %s refl %d mul %d futuremove %d\n",
-	     current_index, current_position.FEN(), current_position.reflection, current_position.multiplicity,
-	     foreign_position.tb->filename.c_str(), foreign_position.tb->invert_colors ? "(Inv)" : "",
-	     foreign_position.index, foreign_position.FEN(), foreign_position.reflection,
-	     foreign_position.multiplicity, futuremove);
+		if (read_exchange_file(run_filename(), values, 1) && (values[0] != exchange_run_id)) {
+		    unlink(exchange_filename("joined", 0, node_number).c_str());
+		    break;
+		}
+	    }
+	}
     }
 
-    if (futurebase->format.dtm_bits > 0) {
+    info("Node %d joined distributed run %016" PRIx64 "\n", node_number, exchange_run_id);
+}
 
-	int dtm = futurebase->get_DTM(future_index);
+/* The end-of-pass barrier.  Publish our updates and statistics, wait for everybody else's, then
+ * pull in the updates that were sent to us and replace our pass statistics with the totals.
+ */
 
-	if (dtm > 0) {
-	    /* Don't backprop DTM 1 (PNTM in check) because we don't count illegal moves (unless it's suicide) */
-	    if ((futurebase->variant == Variant::Suicide) || (dtm != 1)) {
-		commit_update(current_index, -dtm, movecnt, futuremove);
-	    }
-	} else if (dtm < 0) {
-	    commit_update(current_index, -dtm+1, movecnt, futuremove);
-	} else {
-	    /* We insert even if dtm is zero because we have to track futuremoves,
-	     * but we use movecnt=0 since this is a draw, which is different
-	     * from a discard.
-	     */
-	    commit_update(current_index, 0, 0, futuremove);
-	}
+void exchange_updates(void)
+{
+    std::vector<uint64_t> updates_sent(num_nodes, 0);
 
-    } else if (futurebase->format.basic_offset != -1) {
+    for (unsigned int node = 0; node < num_nodes; node ++) {
+	if (node == node_number) continue;
 
-	Basic basic = futurebase->get_basic(future_index);
+	updates_sent[node] = outbound[node]->count;
 
-	if (basic == Basic::Draw) {
-	    commit_update(current_index, 0, 0, futuremove);
-	} else if (basic == Basic::PTMwins) {
-	    commit_update(current_index, -2, movecnt, futuremove);
-	} else if (basic == Basic::PNTMwins) {
-	    commit_update(current_index, 2, movecnt, futuremove);
-	} else if (basic == Basic::Illegal) {
-	    /* basic == 3: illegal position, PNTM in check, no backprop */
-	} else {
-	    throw std::runtime_error("Basic::Unknown in backprop " + std::string(foreign_position.FEN()));
+	std::string filename = exchange_filename("updates", exchange_number, node_number, node);
+
+	outbound[node]->file.close();
+	if (! outbound[node]->file || (rename((filename + ".new").c_str(), filename.c_str()) == -1)) {
+	    fatal("Can't write '%s': %s\n", filename.c_str(), strerror(errno));
+	    terminate();
 	}
+    }
+    outbound.clear();
 
-    } else {
+    std::string done_filename = exchange_filename("done", exchange_number, node_number);
+    std::ofstream done(done_filename + ".new", std::ofstream::binary | std::ofstream::trunc);
 
-	bool flag = futurebase->get_flag(future_index);
-	PieceColor stm = index_to_side_to_move(futurebase, future_index);
+    write_exchange_value<uint64_t>(done, positions_finalized_this_pass);
+    write_exchange_value<uint64_t>(done, backproped_moves_this_pass);
+    done.write(reinterpret_cast<char *>(positive_passes_needed), (max_tracked_dtm + 1) * sizeof(bool));
+    done.write(reinterpret_cast<char *>(negative_passes_needed), (-min_tracked_dtm + 1) * sizeof(bool));
+    for (auto count : updates_sent) {
+	write_exchange_value<uint64_t>(done, count);
+    }
+    done.close();
 
-	if (ignore_futurevectors) {
-	    if (PNTM_in_check(futurebase, &foreign_position)) {
-		return;
-	    }
-	}
+    if (! done || (rename((done_filename + ".new").c_str(), done_filename.c_str()) == -1)) {
+	fatal("Can't write '%s': %s\n", done_filename.c_str(), strerror(errno));
+	terminate();
+    }
 
-	/* What happens if we're back propagating a flag from a color-inverted futurebase?
-	 *
-	 * Well, first of all, a "white-wins" flag in an inverted futurebase becomes a "black-wins"
-	 * flag here, which is basically a "NOT white-draws" flag, so we have to be careful to
-	 * backprop from draw flags to win flags and from win flags to draw flags if the colors have
-	 * been inverted.  Other than that, since the side to move we just fetched is in the
-	 * futurebase, the white/black sense of the flag matches with it, so we don't need to invert
-	 * anything to figure out if this is a PTM win or a PNTM win.
-	 */
+    uint64_t total_positions_finalized = positions_finalized_this_pass;
+    uint64_t total_moves_generated = backproped_moves_this_pass;
 
-	/* I use twos here because there's a lot of stuff that gets cut out for the special case of 1 */
+    for (unsigned int node = 0; node < num_nodes; node ++) {
+	if (node == node_number) continue;
 
-	if ((flag && (stm == PieceColor::White)) || (!flag && (stm == PieceColor::Black))) {
-	    commit_update(current_index, -2, movecnt, futuremove);
-	} else {
-	    commit_update(current_index, 2, movecnt, futuremove);
-	}
+	std::string filename = exchange_filename("done", exchange_number, node);
+	wait_for_file(filename);
 
-    }
-}
+	std::ifstream is(filename, std::ifstream::binary);
+	total_positions_finalized += read_exchange_value<uint64_t>(is);
+	total_moves_generated += read_exchange_value<uint64_t>(is);
+	for (int dtm = 0; dtm <= max_tracked_dtm; dtm ++) {
+	    if (read_exchange_value<bool>(is)) positive_passes_needed[dtm] = true;
+	}
+	for (int dtm = 0; dtm <= -min_tracked_dtm; dtm ++) {
+	    if (read_exchange_value<bool>(is)) negative_passes_needed[dtm] = true;
+	}
+	uint64_t updates_expected = 0;
+	for (unsigned int peer = 0; peer < num_nodes; peer ++) {
+	    uint64_t count = read_exchange_value<uint64_t>(is);
+	    if (peer == node_number) updates_expected = count;
+	}
+	if (! is) {
+	    fatal("Can't read '%s'\n", filename.c_str());
+	    terminate();
+	}
 
-void propagate_local_position_from_futurebase(local_position_t &position,
-					      const local_position_t &foreign_position,
-					      const int futuremove, bool normalize)
-{
-    int piece;
-    const tablebase_t * const tb = position.tb;
+	/* The updates file was renamed into place before the done file was, so it has to be
+	 * there now, and it has to hold exactly as many updates as the done file says it does.
+	 */
 
-    /* We may need to consider a bunch of additional positions here that are identical to the base
-     * position except that a single one of the pawns on the fourth or fifth ranks was capturable en
-     * passant.
-     * 
-     * We key off the en_passant flag in the position that was passed in.  If it's set, then we're
-     * back propagating a position that requires en passant, so we just do it.  Otherwise, we're
-     * back propagating a position that doesn't require en passant, so we check for additional
-     * en passant positions.
-     */
+	filename = exchange_filename("updates", exchange_number, node, node_number);
+	std::ifstream updates(filename, std::ifstream::binary);
+	uint64_t updates_received = 0;
+	index_t index;
 
-    propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
+	if (! updates.is_open()) {
+	    fatal("Can't open '%s': %s\n", filename.c_str(), strerror(errno));
+	    terminate();
+	}
 
-    if (position.en_passant_square == ILLEGAL_POSITION) {
+	while (updates.read(reinterpret_cast<char *>(&index), sizeof(index))) {
+	    proptable_entry entry(index, 0, 1, 0);
+	    output_proptable->push(entry);
+	    updates_received ++;
+	}
 
-	for (piece = 0; piece < tb->num_pieces; piece ++) {
+	if (updates.bad() || (updates.gcount() != 0) || (updates_received != updates_expected)) {
+	    fatal("'%s' is incomplete: read %" PRIu64 " of %" PRIu64 " updates\n",
+		  filename.c_str(), updates_received, updates_expected);
+	    terminate();
+	}
 
-	    if (tb->pieces[piece].color == position.side_to_move) continue;
-	    if (tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+	updates.close();
+	unlink(filename.c_str());
+    }
 
-	    /* I took care in the calling routines to update board_vector specifically so we can
-	     * check for en passant legality here.
-	     */
+    positions_finalized_this_pass = total_positions_finalized;
+    backproped_moves_this_pass = total_moves_generated;
 
-	    if ((tb->pieces[piece].color == PieceColor::White)
-		&& (ROW(position.piece_position[piece]) == 3)
-		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] - 8))
-		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] - 16))) {
-		position.set_en_passant_square(position.piece_position[piece] - 8);
-		propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
-	    }
+    /* Everybody has gotten past the last barrier, so nobody needs the done file before that */
 
-	    if ((tb->pieces[piece].color == PieceColor::Black)
-		&& (ROW(position.piece_position[piece]) == 4)
-		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] + 8))
-		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] + 16))) {
-		position.set_en_passant_square(position.piece_position[piece] + 8);
-		propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
-	    }
+    if (exchange_number >= 2) unlink(exchange_filename("done", exchange_number - 2, node_number).c_str());
 
-	    position.clear_en_passant_square();
-	}
-    }
+    exchange_number ++;
 }
 
-/* Reflections.
+/* At the end of the run, every node but node 0 writes out its range of entries and its totals,
+ * and node 0 reads them all in.  Returns true on node 0, which goes on to write the tablebase.
  *
- * If the futurebase has greater symmetry than the tablebase under construction, then we have to
- * apply a series of reflections to each futurebase position in order to get all the corresponding
- * positions in the current tablebase.  This utility function computes them.
- *
- * If we're back propagating from a futurebase with greater symmetry, then a single futurebase index
- * will correspond to several positions in the current tablebase.  We'll need to apply some
- * reflections to get those additional positions, so compute here how many of them we'll need.  It's
- * a fairly easy calculation, since our symmetry options are currently limited to 1/2/4/8, so a
- * simple ratio suffices, except if both tablebases have symmetry 8, in which case the more complex
- * effects of diagonal symmetry require a double conversion no matter what.
+ * The totals are everything we count per position, so node 0's statistics come out the same as a
+ * single-node run's.  Errors (unhandled futuremoves, mostly) were reported on the node that found
+ * them, so node 0 just notes that they happened, so that it exits with a failure, too.
  */
 
+extern std::atomic<bool> all_futuremoves_handled;
 
-int compute_reflections(tablebase_t *tb, tablebase_t *futurebase, int *reflections)
+bool gather_entries(void)
 {
-    int max_reflection;
+    if (node_number != 0) {
+	std::string filename = exchange_filename("entries", 0, node_number);
+	std::ofstream os(filename + ".new", std::ofstream::binary | std::ofstream::trunc);
+
+	write_exchange_value<uint64_t>(os, total_legal_positions);
+	write_exchange_value<uint64_t>(os, total_PNTM_mated_positions);
+	write_exchange_value<uint64_t>(os, total_stalemate_positions);
+	write_exchange_value<uint64_t>(os, total_moves);
+	write_exchange_value<uint64_t>(os, total_futuremoves);
+	write_exchange_value<uint64_t>(os, player_wins[PieceColor::White]);
+	write_exchange_value<uint64_t>(os, player_wins[PieceColor::Black]);
+	write_exchange_value<uint64_t>(os, fatal_errors);
+	write_exchange_value<bool>(os, all_futuremoves_handled);
+
+	for (index_t index = owned_index_start; index < owned_index_end; index ++) {
+	    write_exchange_value<entry_t>(os, entriesTable[index].e);
+	}
+
+	os.close();
+	if (! os || (rename((filename + ".new").c_str(), filename.c_str()) == -1)) {
+	    fatal("Can't write '%s': %s\n", filename.c_str(), strerror(errno));
+	    terminate();
+	}
 
-    max_reflection = futurebase->symmetry / tb->symmetry;
-    if ((futurebase->symmetry == 8) && (tb->symmetry == 8)) max_reflection = 2;
+	info("Node %d finished; node 0 will write the tablebase\n", node_number);
+	return false;
+    }
 
-    reflections[0] = REFLECTION_NONE;
-    if (futurebase->symmetry == 8) reflections[1] = REFLECTION_DIAGONAL;
-    if (futurebase->symmetry == 4) reflections[1] = REFLECTION_VERTICAL;
-    if (futurebase->symmetry == 2) reflections[1] = REFLECTION_HORIZONTAL;
-    if (max_reflection >= 4) {
-	if (futurebase->symmetry == 8) {
-	    /* This is either the 8 -> 2 or 8 -> 1 cases */
-	    reflections[2] = reflections[0] | REFLECTION_VERTICAL;
-	    reflections[3] = reflections[1] | REFLECTION_VERTICAL;
-	} else {
-	    /* This is the 4 -> 1 case */
-	    reflections[2] = reflections[0] | REFLECTION_HORIZONTAL;
-	    reflections[3] = reflections[1] | REFLECTION_HORIZONTAL;
+    const index_t node_size = (current_tb->num_indices + num_nodes - 1) / num_nodes;
+
+    for (unsigned int node = 1; node < num_nodes; node ++) {
+	std::string filename = exchange_filename("entries", 0, node);
+	wait_for_file(filename);
+
+	std::ifstream is(filename, std::ifstream::binary);
+
+	total_legal_positions += read_exchange_value<uint64_t>(is);
+	total_PNTM_mated_positions += read_exchange_value<uint64_t>(is);
+	total_stalemate_positions += read_exchange_value<uint64_t>(is);
+	total_moves += read_exchange_value<uint64_t>(is);
+	total_futuremoves += read_exchange_value<uint64_t>(is);
+	player_wins[PieceColor::White] += read_exchange_value<uint64_t>(is);
+	player_wins[PieceColor::Black] += read_exchange_value<uint64_t>(is);
+	uint64_t errors = read_exchange_value<uint64_t>(is);
+	if (! read_exchange_value<bool>(is)) all_futuremoves_handled = false;
+
+	index_t start = std::min(node * node_size, current_tb->num_indices);
+	index_t end = std::min(start + node_size, current_tb->num_indices);
+
+	for (index_t index = start; index < end; index ++) {
+	    entriesTable->set(index, nonatomic_entry(read_exchange_value<entry_t>(is)));
 	}
-    }
-    if (max_reflection == 8) {
-	/* The 8 -> 1 case */
-	reflections[4] = reflections[0] | REFLECTION_HORIZONTAL;
-	reflections[5] = reflections[1] | REFLECTION_HORIZONTAL;
-	reflections[6] = reflections[2] | REFLECTION_HORIZONTAL;
-	reflections[7] = reflections[3] | REFLECTION_HORIZONTAL;
+
+	if (! is) {
+	    fatal("Can't read '%s'\n", filename.c_str());
+	    terminate();
+	}
+
+	if (errors > 0) {
+	    fatal("Node %d reported %" PRIu64 " errors\n", node, errors);
+	}
+
+	is.close();
+	unlink(filename.c_str());
     }
 
-    if (! futurebase->encode_stm) {
-	for (int r = 0; r < max_reflection; r ++) {
-	    reflections[max_reflection + r] = reflections[r] | REFLECTION_COLOR;
+    /* Everybody has finished their last exchange, so the done files that each node kept around
+     * for its last two barriers can go, along with the run id.
+     */
+
+    for (unsigned int node = 0; node < num_nodes; node ++) {
+	for (int exchange = std::max(exchange_number - 2, 0); exchange < exchange_number; exchange ++) {
+	    unlink(exchange_filename("done", exchange, node).c_str());
 	}
-	max_reflection *= 2;
     }
 
-    return max_reflection;
+    unlink(exchange_filename("started", 0, 0).c_str());
+    unlink(run_filename().c_str());
+
+    owned_index_start = 0;
+    owned_index_end = current_tb->num_indices;
+
+    return true;
 }
 
+void insert_new_propentry(index_t index, int dtm, unsigned int movecnt, int futuremove)
+{
+    class proptable_entry pt_entry;
 
-/* Some variables common to many or all of the futurebase backprop routines */
+    if (! owns_index(index)) {
+	send_update_to_owner(index);
+	return;
+    }
 
-int max_reflection;
-int reflections[16];
+    if (futuremove != NO_FUTUREMOVE) {
+	assert(futuremove >= 0);
+	assert(static_cast<uint64_t>(futuremove) < output_proptable->format.futuremove_mask);
+    }
 
-PieceColor promotion_color;
-int first_back_rank_square;
-int last_back_rank_square;
-int promotion_move;
+    pt_entry.index = index;
+    pt_entry.dtm = dtm;
+    pt_entry.movecnt = movecnt;
+    pt_entry.futuremove = futuremove;
 
-tablebase_t * futurebase;
+    output_proptable->push(pt_entry);
 
-std::atomic<index_t> next_future_index;
+    /* fprintf(stderr, "Size of proptable: %llu\n", output_proptable->size()); */
+}
 
-/* The four futurebase back-propagation functions
- *
- * These functions handle threading differently from the intra-table case, where we split the
- * tablebase up into N sections for the N threads and let each thread tear into its own section.
- * This time, we're reading the futurebase from disk, and it might be biiiig, so we want to proceed
- * through it sequentially.  Each thread reads a portion of the futurebase, calls the appropriate
- * one of these functions for every index in that portion, and loops until everything is done.
+
+/* If we're running multi-threaded, then there is a possibility that 1) two different positions will
+ * try to backprop into the same position (if we're not using proptables), or that 2) two different
+ * threads will try to retrieve from the proptable at the same time (if we're using proptables).
  *
- * reflections[] is a global variable that gets computed for every futurebase.  See comments on
- * compute_reflections().
- *
- * For each possible reflection of each possible futuremove, we attempt to translate the futurebase
- * pieces into corresponding local tablebase pieces.  Actually, we did this for the entire
- * futurebase when we loaded it, and those piece assignments should never change within a single
- * futurebase, so all we really do is blunder check.
- */
-
-/* NORMAL PAWN PROMOTION
- *
- * We can easily identify what we're promoting into, since there's a single type and color of piece
- * in the futurebase of which there are one more than in the current tablebase.  Assume, without
- * loss of generality, that it's a queen.  There are also pawns in the current tablebase.  To a
- * first approximation, we have to consider all pairs of local pawns and foreign queens.
- *
- * Actually, we can limit things further.  Let's just consider each foreign queen in turn.  The only
- * possible local pawn that could promote into it is located one square directly behind it.  So in a
- * given futurebase position, we only need to consider all foreign queens, with the local position
- * that leads to it uniquely determined.
- *
- * Furthermore, in a given position, each foreign piece will map into a local semilegal group.  One
- * of those local semilegal groups will have one more piece (the extra piece) map into it; all of
- * the others must have the same number of pieces map into them as they contain.  Once a local
- * position has been setup for back propagation, that special semilegal group will be fully
- * populated and will contain the promotion square, too.  We just cycle the promotion square among
- * all of the n pieces in this group, creating n+1 total positions.  None of pieces that map into
- * other semilegal groups could be the promotion piece, because that would create an imbalance among
- * the semilegal groups - one would have one piece too many, another would have one piece too few.
- *
- * Prior to 1.779, we cycled among semilegal groups in the FUTUREBASE, but that was a bug.
- * Futurebase semilegal groups don't matter, only the local semilegal group matters.
+ * The first case is handled by a locking sequence on individual entries in finalize_update(); the
+ * second case is handled by a locking sequence on the priority_queue in proptable_pass_thread().
  */
 
-void propagate_moves_from_promotion_futurebase(index_t future_index, int reflection)
+void commit_update(index_t index, short dtm, short movecnt, int futuremove)
 {
-    local_position_t foreign_position(futurebase);
-    local_position_t position(current_tb);
-    translation_result translation;
-    int true_pawn;
 
-    /* Take the position from the futurebase and translate it into a local position for the current
-     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
-     * there should be one piece missing from the local position (the pawn that promoted) and one
-     * piece extra (what it promoted into).  There can be no pieces on restricted squares.
-     */
+    if (index == debug_move) {
+	info("commit_update; index=%" PRIindex "; dtm=%d; movecnt=%d; futuremove=%d\n",
+	     index, dtm, movecnt, futuremove);
+    }
 
-    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
-				  &foreign_position)) return;
+    backproped_moves_this_pass ++;
 
-    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
-							       current_tb, &position,
-							       futurebase->invert_colors);
+    if (!using_proptables) {
 
-    if (translation != invalid_translation) {
+	if (! ignore_futurevectors) {
 
-	if ((translation.extra_piece == NONE) || (translation.missing_piece1 == NONE)
-	    || (translation.missing_piece2 != NONE) || (translation.restricted_piece != NONE)) return;
+	    if (futuremove != NO_FUTUREMOVE) {
 
-	uint8_t pawn = translation.missing_piece1;
+		/* Futuremove - check off bits in an array that got filled in when we initialized
+		 *
+		 * Do nothing if the bit is clear, either because we were never to process this
+		 * futuremove at all (this is how a suicide analysis rejects non-capture futuremoves
+		 * from a position where captures are possible), or because a previous pass through
+		 * this code has already processed it.  In the later case, we fatally complain if
+		 * the the entriesTable contains a normal position with DTM not 1 (PNTM in check).
+		 *
+		 * We can't tell the difference at this point, and probably need to use proptables
+		 * for more accurate checking.
+		 *
+		 * This is done atomically, because there will be other indices in this bit vector.
+		 */
 
-	/* Since the last move had to have been a promotion move, there is absolutely no way we
-	 * could have en passant capturable pawns in the futurebase position.
-	 */
+		long long bit_offset = ((long long)index * current_tb->futurevector_bits);
 
-	if (position.en_passant_square != ILLEGAL_POSITION) return;
+		if (! test_and_set_bit_field(current_tb->futurevectors, bit_offset + futuremove, 0)) {
 
-	/* Whatever color the promoted piece is, after the promotion it must be the other side to
-	 * move.
-	 */
+		    if ((entriesTable[index].get_raw_DTM() != 1) && entriesTable[index].is_normal_movecnt()
+			&& (current_tb->variant != Variant::Suicide)) {
 
-	if (position.side_to_move == promotion_color) return;
+			fatal("commit_update; futuremove processed; index=%" PRIindex "; dtm=%d; movecnt=%d; futuremove=%d\n",
+			      index, dtm, movecnt, futuremove);
+		    }
 
-	/* We're going to back step a half move now */
+		    return;
+		}
 
-	position.flip_side_to_move();
+	    }
+	}
 
-	/* We need an extra loop in here to handle futurebases with multiple identical pieces.
-	 * Let's say we're back propagating from a Q+Q endgame into a Q+P endgame.  If we've got a
-	 * futurebase position with both queens on the back rank, then we have to consider the
-	 * possibility that the pawn could promote into either of them.
-	 */
+	finalize_update(index, dtm, movecnt, futuremove);
 
-	int promotion_sq = foreign_position.piece_position[translation.extra_piece];
+    } else {
 
-	if (futurebase->invert_colors)
-	    promotion_sq = rowcol2square(7 - ROW(promotion_sq), COL(promotion_sq));
+	insert_new_propentry(index, dtm, movecnt, futuremove);
 
-	int local_piece = futurebase->pieces[translation.extra_piece].matching_local_semilegal_group[promotion_sq];
+    }
 
-	while (true) {
+}
 
-	    /* The extra piece has to be on the back rank.
-	     *
-	     * I used to (pre 1.547) 'break' here if it wasn't, figuring that since identical pieces
-	     * are sorted into ascending square numbers, if we'd backed up to an extra piece that
-	     * wasn't on the back rank, then there couldn't be any more identical pieces on the back
-	     * rank.
-	     *
-	     * But Laurent Bartholdi exposed that as a bug.  If black is promoting, then we start
-	     * with the piece with the highest square number - that isn't on the back rank - and
-	     * have to back up to find one that is.
-	     *
-	     * We could invert the whole piece processing order to make the original optimization
-	     * work, but then when you consider what can happen if there are movement restrictions
-	     * in the futurebase, maybe the pieces aren't even going to show up in the right order.
-	     * Better to ditch that whole idea, I think.
-	     */
 
-	    if ((promotion_sq >= first_back_rank_square) && (promotion_sq <= last_back_rank_square)) {
+/* target_dtm 0 is the initialization / futurebase back prop pass */
 
-		/* There has to be an empty square right behind where the pawn came from, and it has
-		 * to be at least semilegal for the pawn.
-		 */
+uint64_t propagation_pass(int target_dtm)
+{
+    positions_finalized_this_pass = 0;
+    backproped_moves_this_pass = 0;
 
-		if (!(position.board_vector & BITVECTOR(promotion_sq - promotion_move))
-		    && (current_tb->pieces[pawn].semilegal_squares & BITVECTOR(promotion_sq - promotion_move))) {
+    if (tracking_dtm) {
+	if (target_dtm > 0) {
+	    entriesTable->verify_DTM_field_size(target_dtm+1);
+	} else {
+	    entriesTable->verify_DTM_field_size(target_dtm-1);
+	}
+    }
 
-		    local_position_t new_position = position;
+    if (pass_type[total_passes] == nullptr) pass_type[total_passes] = "intratable";
+    pass_target_dtms[total_passes] = target_dtm;
 
-		    /* Put the missing pawn on the seventh (or second). */
+    if (using_proptables) {
+	if (num_nodes > 1) open_outbound_updates();
+	proptable_pass(target_dtm);
+	if (num_nodes > 1) exchange_updates();
+    } else {
+	non_proptable_pass(target_dtm);
+    }
 
-		    new_position.place_piece(pawn, promotion_sq - promotion_move);
+    positions_finalized[total_passes] = positions_finalized_this_pass;
+    backproped_moves[total_passes] = backproped_moves_this_pass;
 
-		    /* Normalize the position, and back prop it. */
+    total_backproped_moves += backproped_moves[total_passes];
 
-		    normalize_position(current_tb, &new_position);
+    if (positions_finalized_this_pass > 0) {
+	if (target_dtm > max_dtm) max_dtm = target_dtm;
+	if (target_dtm < min_dtm) min_dtm = target_dtm;
+    }
 
-		    true_pawn = new_position.permuted_piece[pawn];
+    finalize_pass_statistics();
 
-		    propagate_local_position_from_futurebase(new_position, foreign_position,
-							     promotions[true_pawn][futurebase->promotion], true);
-		}
+    total_passes ++;
+    if (total_passes == max_passes) expand_per_pass_statistics();
 
-	    }
+    return positions_finalized_this_pass;
+}
 
-	    /* If the extra piece mapped into a non-empty semilegal group, then swap it with
-	     * the next piece in the group and try again.
-	     */
+/***** FUTUREBASES *****/
 
-	    if (local_piece == -1) return;
+/* Subroutines to backpropagate an individual index, or an individual local position (these are the
+ * "mini" routines), or a set of local positions that differ only in the en passant square.
+ *
+ * The idea behind the en passant handling is this.  If we back propagate a position with the en
+ * passant square set, then that's the only position we process.  If we back prop a position without
+ * the en passant square set, then we process not only that position, but also any positions just
+ * like it that have en passant set.  The idea being that we set en passant if we actually need it,
+ * and we clear it if we don't need it, so if it's clear we need to process positions where it was
+ * set, but we didn't use it.
+ */
 
-	    int new_promotion_sq = position.piece_position[local_piece];
+bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position);
 
-	    position.move_piece(local_piece, promotion_sq);
-	    promotion_sq = new_promotion_sq;
+void propagate_minilocal_position_from_futurebase(local_position_t &current_position,
+						  const local_position_t &foreign_position,
+						  int futuremove, bool normalize)
+{
+    /* XXX get rid of this const_cast ; need it because get_DTM might modify its tablebase */
+    tablebase_t * futurebase = const_cast<tablebase_t *>(foreign_position.tb);
+    index_t current_index;
+    index_t future_index = foreign_position.index;
 
-	    local_piece = current_tb->pieces[local_piece].next_piece_in_semilegal_group;
-	}
+    /* Look up the position in the current tablebase... */
+
+    if (normalize) {
+	current_index = normalized_position_to_index(current_position);
+    } else {
+	current_index = local_position_to_index(current_position);
     }
-}
 
-void propagate_moves_from_promotion_capture_futurebase(index_t future_index, int reflection)
-{
-    local_position_t foreign_position(futurebase);
-    local_position_t position(current_tb);
-    translation_result translation;
-    int true_captured_piece;
-    int true_pawn;
+    if (current_index == INVALID_INDEX) {
+	return;
+    }
 
-    /* Take the position from the futurebase and translate it into a local position for the current
-     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
-     * there should be two pieces missing from the local position (the pawn that promoted and the
-     * piece it captured) and one piece extra (what it promoted into).  There can be no pieces on
-     * restricted squares.
+    if ((futuremove < 0) && (futuremove != HANDLED_FUTUREMOVE)) {
+	fatal("Futuremove %d never assigned: %s\n", futuremove, current_position.FEN());
+	return;
+    }
+
+    /* local_position_to_index() updated the position structure's multiplicity and reflection, so we
+     * know they're correct.  If we're back proping into an 8-way symmetric tablebase (the only way
+     * REFLECTION_DIAGONAL will ever be set), we must be back proping from an 8-way symmetric
+     * futurebase (since futurebases can never have less symmetry than the current tablebase).  In
+     * this case, if diagonal reflection is required on the current position, then discard this case
+     * since we'll be called again without diagonal reflection.  Otherwise, use the 8-way
+     * multiplicity (2 and 4 way symmetry are ignored when computing multiplicity, which is thus
+     * always either 1 or 2) as a movecnt.
      */
 
-    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
-				  &foreign_position)) return;
+    int movecnt;
 
-    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
-							       current_tb, &position,
-							       futurebase->invert_colors);
+    if (futuremove == HANDLED_FUTUREMOVE) {
+	movecnt = 1;
+	futuremove = NO_FUTUREMOVE;
+    } else if (ignore_futurevectors) {
+	movecnt = 1;
+    } else {
+	if ((current_position.multiplicity == 2) && (current_position.reflection & REFLECTION_DIAGONAL)) {
+	    return;
+	}
 
-    if (translation != invalid_translation) {
+	movecnt = current_position.multiplicity;
+    }
 
-	if ((translation.extra_piece == NONE) || (translation.missing_piece1 == NONE)
-	    || (translation.missing_piece2 == NONE) || (translation.restricted_piece != NONE)) return;
+    if ((current_index == debug_move) || (future_index == debug_futuremove)) {
+	info("propagate_index_from_futurebase; %" PRIindex " %s refl %d mul %d from %s %s %" PRIindex " %s refl %d mul %d futuremove %d\n",
+	     current_index, current_position.FEN(), current_position.reflection, current_position.multiplicity,
+	     foreign_position.tb->filename.c_str(), foreign_position.tb->invert_colors ? "(Inv)" : "",
+	     foreign_position.index, foreign_position.FEN(), foreign_position.reflection,
+	     foreign_position.multiplicity, futuremove);
+    }
 
-	/* Since the last move had to have been a promotion move, there is absolutely no way
-	 * we could have en passant capturable pawns in the futurebase position.
-	 */
+    if (futurebase->format.dtm_bits > 0) {
 
-	if (position.en_passant_square != ILLEGAL_POSITION) return;
+	int dtm = futurebase->get_DTM(future_index);
 
-	/* Whatever color the promoted piece is, after the promotion it must be the other
-	 * side to move.
-	 */
+	if (dtm > 0) {
+	    /* Don't backprop DTM 1 (PNTM in check) because we don't count illegal moves (unless it's suicide) */
+	    if ((futurebase->variant == Variant::Suicide) || (dtm != 1)) {
+		commit_update(current_index, -dtm, movecnt, futuremove);
+	    }
+	} else if (dtm < 0) {
+	    commit_update(current_index, -dtm+1, movecnt, futuremove);
+	} else {
+	    /* We insert even if dtm is zero because we have to track futuremoves,
+	     * but we use movecnt=0 since this is a draw, which is different
+	     * from a discard.
+	     */
+	    commit_update(current_index, 0, 0, futuremove);
+	}
 
-	if (position.side_to_move == promotion_color) return;
+    } else if (futurebase->format.basic_offset != -1) {
 
-	/* We're going to back step a half move now */
+	Basic basic = futurebase->get_basic(future_index);
 
-	position.flip_side_to_move();
+	if (basic == Basic::Draw) {
+	    commit_update(current_index, 0, 0, futuremove);
+	} else if (basic == Basic::PTMwins) {
+	    commit_update(current_index, -2, movecnt, futuremove);
+	} else if (basic == Basic::PNTMwins) {
+	    commit_update(current_index, 2, movecnt, futuremove);
+	} else if (basic == Basic::Illegal) {
+	    /* basic == 3: illegal position, PNTM in check, no backprop */
+	} else {
+	    throw std::runtime_error("Basic::Unknown in backprop " + std::string(foreign_position.FEN()));
+	}
 
-	/* We need an extra loop in here to handle futurebases with multiple identical pieces.
-	 * Let's say we're back propagating from a Q+Q endgame into a Q+P endgame.  If we've got a
-	 * futurebase position with both queens on the back rank, then we have to consider the
-	 * possibility that the pawn could promote into either of them.
+    } else {
+
+	bool flag = futurebase->get_flag(future_index);
+	PieceColor stm = index_to_side_to_move(futurebase, future_index);
+
+	if (ignore_futurevectors) {
+	    if (PNTM_in_check(futurebase, &foreign_position)) {
+		return;
+	    }
+	}
+
+	/* What happens if we're back propagating a flag from a color-inverted futurebase?
+	 *
+	 * Well, first of all, a "white-wins" flag in an inverted futurebase becomes a "black-wins"
+	 * flag here, which is basically a "NOT white-draws" flag, so we have to be careful to
+	 * backprop from draw flags to win flags and from win flags to draw flags if the colors have
+	 * been inverted.  Other than that, since the side to move we just fetched is in the
+	 * futurebase, the white/black sense of the flag matches with it, so we don't need to invert
+	 * anything to figure out if this is a PTM win or a PNTM win.
 	 */
 
-	int promotion_sq = foreign_position.piece_position[translation.extra_piece];
+	/* I use twos here because there's a lot of stuff that gets cut out for the special case of 1 */
 
-	if (futurebase->invert_colors)
-	    promotion_sq = rowcol2square(7 - ROW(promotion_sq), COL(promotion_sq));
+	if ((flag && (stm == PieceColor::White)) || (!flag && (stm == PieceColor::Black))) {
+	    commit_update(current_index, -2, movecnt, futuremove);
+	} else {
+	    commit_update(current_index, 2, movecnt, futuremove);
+	}
 
-	int local_piece = futurebase->pieces[translation.extra_piece].matching_local_semilegal_group[promotion_sq];
+    }
+}
 
-	while (true) {
+void propagate_local_position_from_futurebase(local_position_t &position,
+					      const local_position_t &foreign_position,
+					      const int futuremove, bool normalize)
+{
+    int piece;
+    const tablebase_t * const tb = position.tb;
 
-	    /* The extra piece has to be on the back rank.
-	     *
-	     * I used to (pre 1.547) 'break' here if it wasn't, figuring that since identical pieces
-	     * are sorted into ascending square numbers, if we'd backed up to an extra piece that
-	     * wasn't on the back rank, then there couldn't be any more identical pieces on the back
-	     * rank.
-	     *
-	     * But Laurent Bartholdi exposed that as a bug.  If black is promoting, then we start
-	     * with the piece with the highest square number - that isn't on the back rank - and
-	     * have to back up to find one that is.
-	     *
-	     * We could invert the whole piece processing order to make the original optimization
-	     * work, but then when you consider what can happen if there are movement restrictions
-	     * in the futurebase, maybe the pieces aren't even going to show up in the right order.
-	     * Better to ditch that whole idea, I think.
+    /* We may need to consider a bunch of additional positions here that are identical to the base
+     * position except that a single one of the pawns on the fourth or fifth ranks was capturable en
+     * passant.
+     * 
+     * We key off the en_passant flag in the position that was passed in.  If it's set, then we're
+     * back propagating a position that requires en passant, so we just do it.  Otherwise, we're
+     * back propagating a position that doesn't require en passant, so we check for additional
+     * en passant positions.
+     */
+
+    propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
+
+    if (position.en_passant_square == ILLEGAL_POSITION) {
+
+	for (piece = 0; piece < tb->num_pieces; piece ++) {
+
+	    if (tb->pieces[piece].color == position.side_to_move) continue;
+	    if (tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+
+	    /* I took care in the calling routines to update board_vector specifically so we can
+	     * check for en passant legality here.
 	     */
 
-	    if ((promotion_sq >= first_back_rank_square) && (promotion_sq <= last_back_rank_square)) {
+	    if ((tb->pieces[piece].color == PieceColor::White)
+		&& (ROW(position.piece_position[piece]) == 3)
+		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] - 8))
+		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] - 16))) {
+		position.set_en_passant_square(position.piece_position[piece] - 8);
+		propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
+	    }
 
-		/* Consider first a capture to the left (white's left).  There has to be an empty
-		 * square where the pawn came from, and it has to be at least semilegal.
-		 */
+	    if ((tb->pieces[piece].color == PieceColor::Black)
+		&& (ROW(position.piece_position[piece]) == 4)
+		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] + 8))
+		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] + 16))) {
+		position.set_en_passant_square(position.piece_position[piece] + 8);
+		propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
+	    }
 
-		if ((COL(promotion_sq) != 0)
-		    && !(position.board_vector & BITVECTOR(promotion_sq - promotion_move - 1))
-		    && (current_tb->pieces[translation.missing_piece1].semilegal_squares & BITVECTOR(promotion_sq - promotion_move - 1))) {
+	    position.clear_en_passant_square();
+	}
+    }
+}
 
-		    local_position_t new_position = position;
+/* Reflections.
+ *
+ * If the futurebase has greater symmetry than the tablebase under construction, then we have to
+ * apply a series of reflections to each futurebase position in order to get all the corresponding
+ * positions in the current tablebase.  This utility function computes them.
+ *
+ * If we're back propagating from a futurebase with greater symmetry, then a single futurebase index
+ * will correspond to several positions in the current tablebase.  We'll need to apply some
+ * reflections to get those additional positions, so compute here how many of them we'll need.  It's
+ * a fairly easy calculation, since our symmetry options are currently limited to 1/2/4/8, so a
+ * simple ratio suffices, except if both tablebases have symmetry 8, in which case the more complex
+ * effects of diagonal symmetry require a double conversion no matter what.
+ */
 
-		    /* Put the piece that was captured onto the board on the promotion square. */
 
-		    new_position.place_piece(translation.missing_piece2, promotion_sq);
+int compute_reflections(tablebase_t *tb, tablebase_t *futurebase, int *reflections)
+{
+    int max_reflection;
 
-		    /* Put the missing pawn on the seventh (or second). */
+    max_reflection = futurebase->symmetry / tb->symmetry;
+    if ((futurebase->symmetry == 8) && (tb->symmetry == 8)) max_reflection = 2;
 
-		    new_position.place_piece(translation.missing_piece1, promotion_sq - promotion_move - 1);
+    reflections[0] = REFLECTION_NONE;
+    if (futurebase->symmetry == 8) reflections[1] = REFLECTION_DIAGONAL;
+    if (futurebase->symmetry == 4) reflections[1] = REFLECTION_VERTICAL;
+    if (futurebase->symmetry == 2) reflections[1] = REFLECTION_HORIZONTAL;
+    if (max_reflection >= 4) {
+	if (futurebase->symmetry == 8) {
+	    /* This is either the 8 -> 2 or 8 -> 1 cases */
+	    reflections[2] = reflections[0] | REFLECTION_VERTICAL;
+	    reflections[3] = reflections[1] | REFLECTION_VERTICAL;
+	} else {
+	    /* This is the 4 -> 1 case */
+	    reflections[2] = reflections[0] | REFLECTION_HORIZONTAL;
+	    reflections[3] = reflections[1] | REFLECTION_HORIZONTAL;
+	}
+    }
+    if (max_reflection == 8) {
+	/* The 8 -> 1 case */
+	reflections[4] = reflections[0] | REFLECTION_HORIZONTAL;
+	reflections[5] = reflections[1] | REFLECTION_HORIZONTAL;
+	reflections[6] = reflections[2] | REFLECTION_HORIZONTAL;
+	reflections[7] = reflections[3] | REFLECTION_HORIZONTAL;
+    }
 
-		    /* Back propagate the resulting position */
+    if (! futurebase->encode_stm) {
+	for (int r = 0; r < max_reflection; r ++) {
+	    reflections[max_reflection + r] = reflections[r] | REFLECTION_COLOR;
+	}
+	max_reflection *= 2;
+    }
 
-		    normalize_position(current_tb, &new_position);
+    return max_reflection;
+}
+
+
+/* Some variables common to many or all of the futurebase backprop routines */
+
+int max_reflection;
+int reflections[16];
+
+PieceColor promotion_color;
+int first_back_rank_square;
+int last_back_rank_square;
+int promotion_move;
+
+tablebase_t * futurebase;
+
+std::atomic<index_t> next_future_index;
+
+/* The four futurebase back-propagation functions
+ *
+ * These functions handle threading differently from the intra-table case, where we split the
+ * tablebase up into N sections for the N threads and let each thread tear into its own section.
+ * This time, we're reading the futurebase from disk, and it might be biiiig, so we want to proceed
+ * through it sequentially.  Each thread reads a portion of the futurebase, calls the appropriate
+ * one of these functions for every index in that portion, and loops until everything is done.
+ *
+ * reflections[] is a global variable that gets computed for every futurebase.  See comments on
+ * compute_reflections().
+ *
+ * For each possible reflection of each possible futuremove, we attempt to translate the futurebase
+ * pieces into corresponding local tablebase pieces.  Actually, we did this for the entire
+ * futurebase when we loaded it, and those piece assignments should never change within a single
+ * futurebase, so all we really do is blunder check.
+ */
+
+/* NORMAL PAWN PROMOTION
+ *
+ * We can easily identify what we're promoting into, since there's a single type and color of piece
+ * in the futurebase of which there are one more than in the current tablebase.  Assume, without
+ * loss of generality, that it's a queen.  There are also pawns in the current tablebase.  To a
+ * first approximation, we have to consider all pairs of local pawns and foreign queens.
+ *
+ * Actually, we can limit things further.  Let's just consider each foreign queen in turn.  The only
+ * possible local pawn that could promote into it is located one square directly behind it.  So in a
+ * given futurebase position, we only need to consider all foreign queens, with the local position
+ * that leads to it uniquely determined.
+ *
+ * Furthermore, in a given position, each foreign piece will map into a local semilegal group.  One
+ * of those local semilegal groups will have one more piece (the extra piece) map into it; all of
+ * the others must have the same number of pieces map into them as they contain.  Once a local
+ * position has been setup for back propagation, that special semilegal group will be fully
+ * populated and will contain the promotion square, too.  We just cycle the promotion square among
+ * all of the n pieces in this group, creating n+1 total positions.  None of pieces that map into
+ * other semilegal groups could be the promotion piece, because that would create an imbalance among
+ * the semilegal groups - one would have one piece too many, another would have one piece too few.
+ *
+ * Prior to 1.779, we cycled among semilegal groups in the FUTUREBASE, but that was a bug.
+ * Futurebase semilegal groups don't matter, only the local semilegal group matters.
+ */
+
+void propagate_moves_from_promotion_futurebase(index_t future_index, int reflection)
+{
+    local_position_t foreign_position(futurebase);
+    local_position_t position(current_tb);
+    translation_result translation;
+    int true_pawn;
+
+    /* Take the position from the futurebase and translate it into a local position for the current
+     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
+     * there should be one piece missing from the local position (the pawn that promoted) and one
+     * piece extra (what it promoted into).  There can be no pieces on restricted squares.
+     */
+
+    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
+				  &foreign_position)) return;
+
+    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
+							       current_tb, &position,
+							       futurebase->invert_colors);
+
+    if (translation != invalid_translation) {
+
+	if ((translation.extra_piece == NONE) || (translation.missing_piece1 == NONE)
+	    || (translation.missing_piece2 != NONE) || (translation.restricted_piece != NONE)) return;
+
+	uint8_t pawn = translation.missing_piece1;
+
+	/* Since the last move had to have been a promotion move, there is absolutely no way we
+	 * could have en passant capturable pawns in the futurebase position.
+	 */
+
+	if (position.en_passant_square != ILLEGAL_POSITION) return;
+
+	/* Whatever color the promoted piece is, after the promotion it must be the other side to
+	 * move.
+	 */
+
+	if (position.side_to_move == promotion_color) return;
+
+	/* We're going to back step a half move now */
+
+	position.flip_side_to_move();
+
+	/* We need an extra loop in here to handle futurebases with multiple identical pieces.
+	 * Let's say we're back propagating from a Q+Q endgame into a Q+P endgame.  If we've got a
+	 * futurebase position with both queens on the back rank, then we have to consider the
+	 * possibility that the pawn could promote into either of them.
+	 */
+
+	int promotion_sq = foreign_position.piece_position[translation.extra_piece];
+
+	if (futurebase->invert_colors)
+	    promotion_sq = rowcol2square(7 - ROW(promotion_sq), COL(promotion_sq));
+
+	int local_piece = futurebase->pieces[translation.extra_piece].matching_local_semilegal_group[promotion_sq];
+
+	while (true) {
+
+	    /* The extra piece has to be on the back rank.
+	     *
+	     * I used to (pre 1.547) 'break' here if it wasn't, figuring that since identical pieces
+	     * are sorted into ascending square numbers, if we'd backed up to an extra piece that
+	     * wasn't on the back rank, then there couldn't be any more identical pieces on the back
+	     * rank.
+	     *
+	     * But Laurent Bartholdi exposed that as a bug.  If black is promoting, then we start
+	     * with the piece with the highest square number - that isn't on the back rank - and
+	     * have to back up to find one that is.
+	     *
+	     * We could invert the whole piece processing order to make the original optimization
+	     * work, but then when you consider what can happen if there are movement restrictions
+	     * in the futurebase, maybe the pieces aren't even going to show up in the right order.
+	     * Better to ditch that whole idea, I think.
+	     */
+
+	    if ((promotion_sq >= first_back_rank_square) && (promotion_sq <= last_back_rank_square)) {
+
+		/* There has to be an empty square right behind where the pawn came from, and it has
+		 * to be at least semilegal for the pawn.
+		 */
+
+		if (!(position.board_vector & BITVECTOR(promotion_sq - promotion_move))
+		    && (current_tb->pieces[pawn].semilegal_squares & BITVECTOR(promotion_sq - promotion_move))) {
+
+		    local_position_t new_position = position;
+
+		    /* Put the missing pawn on the seventh (or second). */
+
+		    new_position.place_piece(pawn, promotion_sq - promotion_move);
+
+		    /* Normalize the position, and back prop it. */
+
+		    normalize_position(current_tb, &new_position);
+
+		    true_pawn = new_position.permuted_piece[pawn];
+
+		    propagate_local_position_from_futurebase(new_position, foreign_position,
+							     promotions[true_pawn][futurebase->promotion], true);
+		}
+
+	    }
+
+	    /* If the extra piece mapped into a non-empty semilegal group, then swap it with
+	     * the next piece in the group and try again.
+	     */
+
+	    if (local_piece == -1) return;
+
+	    int new_promotion_sq = position.piece_position[local_piece];
+
+	    position.move_piece(local_piece, promotion_sq);
+	    promotion_sq = new_promotion_sq;
+
+	    local_piece = current_tb->pieces[local_piece].next_piece_in_semilegal_group;
+	}
+    }
+}
+
+void propagate_moves_from_promotion_capture_futurebase(index_t future_index, int reflection)
+{
+    local_position_t foreign_position(futurebase);
+    local_position_t position(current_tb);
+    translation_result translation;
+    int true_captured_piece;
+    int true_pawn;
+
+    /* Take the position from the futurebase and translate it into a local position for the current
+     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
+     * there should be two pieces missing from the local position (the pawn that promoted and the
+     * piece it captured) and one piece extra (what it promoted into).  There can be no pieces on
+     * restricted squares.
+     */
+
+    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
+				  &foreign_position)) return;
+
+    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
+							       current_tb, &position,
+							       futurebase->invert_colors);
+
+    if (translation != invalid_translation) {
+
+	if ((translation.extra_piece == NONE) || (translation.missing_piece1 == NONE)
+	    || (translation.missing_piece2 == NONE) || (translation.restricted_piece != NONE)) return;
+
+	/* Since the last move had to have been a promotion move, there is absolutely no way
+	 * we could have en passant capturable pawns in the futurebase position.
+	 */
+
+	if (position.en_passant_square != ILLEGAL_POSITION) return;
+
+	/* Whatever color the promoted piece is, after the promotion it must be the other
+	 * side to move.
+	 */
+
+	if (position.side_to_move == promotion_color) return;
+
+	/* We're going to back step a half move now */
+
+	position.flip_side_to_move();
+
+	/* We need an extra loop in here to handle futurebases with multiple identical pieces.
+	 * Let's say we're back propagating from a Q+Q endgame into a Q+P endgame.  If we've got a
+	 * futurebase position with both queens on the back rank, then we have to consider the
+	 * possibility that the pawn could promote into either of them.
+	 */
+
+	int promotion_sq = foreign_position.piece_position[translation.extra_piece];
+
+	if (futurebase->invert_colors)
+	    promotion_sq = rowcol2square(7 - ROW(promotion_sq), COL(promotion_sq));
+
+	int local_piece = futurebase->pieces[translation.extra_piece].matching_local_semilegal_group[promotion_sq];
+
+	while (true) {
+
+	    /* The extra piece has to be on the back rank.
+	     *
+	     * I used to (pre 1.547) 'break' here if it wasn't, figuring that since identical pieces
+	     * are sorted into ascending square numbers, if we'd backed up to an extra piece that
+	     * wasn't on the back rank, then there couldn't be any more identical pieces on the back
+	     * rank.
+	     *
+	     * But Laurent Bartholdi exposed that as a bug.  If black is promoting, then we start
+	     * with the piece with the highest square number - that isn't on the back rank - and
+	     * have to back up to find one that is.
+	     *
+	     * We could invert the whole piece processing order to make the original optimization
+	     * work, but then when you consider what can happen if there are movement restrictions
+	     * in the futurebase, maybe the pieces aren't even going to show up in the right order.
+	     * Better to ditch that whole idea, I think.
+	     */
+
+	    if ((promotion_sq >= first_back_rank_square) && (promotion_sq <= last_back_rank_square)) {
+
+		/* Consider first a capture to the left (white's left).  There has to be an empty
+		 * square where the pawn came from, and it has to be at least semilegal.
+		 */
+
+		if ((COL(promotion_sq) != 0)
+		    && !(position.board_vector & BITVECTOR(promotion_sq - promotion_move - 1))
+		    && (current_tb->pieces[translation.missing_piece1].semilegal_squares & BITVECTOR(promotion_sq - promotion_move - 1))) {
+
+		    local_position_t new_position = position;
+
+		    /* Put the piece that was captured onto the board on the promotion square. */
+
+		    new_position.place_piece(translation.missing_piece2, promotion_sq);
+
+		    /* Put the missing pawn on the seventh (or second). */
+
+		    new_position.place_piece(translation.missing_piece1, promotion_sq - promotion_move - 1);
+
+		    /* Back propagate the resulting position */
+
+		    normalize_position(current_tb, &new_position);
+
+		    true_captured_piece = new_position.permuted_piece[translation.missing_piece2];
+		    true_pawn = new_position.permuted_piece[translation.missing_piece1];
+
+		    /* This function also back props any similar positions with one of the pawns
+		     * from the side that didn't promote in an en passant state.
+		     */
+
+		    propagate_local_position_from_futurebase(new_position, foreign_position,
+							     promotion_captures[true_pawn][true_captured_piece][futurebase->promotion], true);
+
+		}
+
+		/* Now consider a capture to the right (white's right).  Again, there has to be an
+		 * empty square where the pawn came from, and it has to be semilegal.
+		 */
+
+		if ((COL(promotion_sq) != 7)
+		    && !(position.board_vector & BITVECTOR(promotion_sq - promotion_move + 1))
+		    && (current_tb->pieces[translation.missing_piece1].semilegal_squares & BITVECTOR(promotion_sq - promotion_move + 1))) {
+
+		    local_position_t new_position = position;
+
+		    /* Put the piece that was captured onto the board on the promotion square. */
+
+		    new_position.place_piece(translation.missing_piece2, promotion_sq);
+
+		    /* Put the missing pawn on the seventh (or second). */
+
+		    new_position.place_piece(translation.missing_piece1, promotion_sq - promotion_move + 1);
+
+		    normalize_position(current_tb, &new_position);
+
+		    true_captured_piece = new_position.permuted_piece[translation.missing_piece2];
+		    true_pawn = new_position.permuted_piece[translation.missing_piece1];
+
+		    propagate_local_position_from_futurebase(new_position, foreign_position,
+							     promotion_captures[true_pawn][true_captured_piece][futurebase->promotion], true);
+
+		}
+
+	    }
+
+	    /* If the extra piece mapped into a non-empty semilegal group, then swap it with the
+	     * next piece in the group and try again.
+	     */
+
+	    if (local_piece == -1) return;
+
+	    int new_promotion_sq = position.piece_position[local_piece];
+
+	    position.move_piece(local_piece, promotion_sq);
+	    promotion_sq = new_promotion_sq;
+
+	    local_piece = current_tb->pieces[local_piece].next_piece_in_semilegal_group;
+
+	}
+    }
+}
+
+/* Propagate moves from a futurebase that resulted from capturing one of the pieces in the current
+ * tablebase.
+ *
+ * I'm thinking of changing that "invert_colors_of_futurebase" flag to be a subroutine that gets
+ * passed in.  It could be a pointer to invert_colors_of_global_position to do what it does now.  Or
+ * it could be a "reflect board around vertical axis" to move a d4 pawn to e4.  Also see my comments
+ * on invert_colors_of_global position.
+ */
+
+void consider_possible_captures(const local_position_t &foreign_position, const local_position_t *position,
+				const int capturing_piece, const int captured_piece)
+{
+    /* When we finally convert the position to an index (in local_position_to_index()), we'll make a
+     * copy of the position and normalize it by sorting the identical pieces so that they are in
+     * ascending order.  But we have to at least be aware of this here, in order to figure out which
+     * piece "actually" got captured (we're always called with captured_piece set to the last piece
+     * number of any identical pieces), so we can figure out which futuremove number to use.
+     */
+
+    int true_captured_piece;
+    int true_capturing_piece;
+
+    /* We only want to consider pieces of the side which captured... */
+
+    if (current_tb->pieces[capturing_piece].color == current_tb->pieces[captured_piece].color) return;
+
+    /* The en passant special case:
+     *
+     * If both the piece that captured and the piece that was captured are both pawns, and either a
+     * white pawn captured from the fifth rank, or a black pawn captured from the fourth, then there
+     * are two possible back prop positions - the obvious one, and the one where the captured pawn
+     * was in an en passant state.  We also make sure right away that the rank is clear where the
+     * pawn had to come from, and the rank is clear where the pawn had to go to, ensuring that an en
+     * passant move was even possible.
+     */
+
+    /* XXX if statements inside the for loop can be moved out of it */
+
+    if ((current_tb->pieces[capturing_piece].piece_type == PieceType::Pawn)
+	&& (current_tb->pieces[captured_piece].piece_type == PieceType::Pawn)
+	&& !(position->board_vector & BITVECTOR(position->piece_position[capturing_piece]-8))
+	&& !(position->board_vector & BITVECTOR(position->piece_position[capturing_piece]+8))) {
+
+	for (auto &dir : movements(current_tb->pieces[capturing_piece].piece_type,
+				   current_tb->pieces[capturing_piece].color,
+				   position->piece_position[capturing_piece],
+				   Movement::Backward, Movement::Capture)) {
+
+	    for (auto &movement : dir) {
+
+		if ((current_tb->pieces[capturing_piece].color == PieceColor::Black) && (ROW(movement) == 3)) {
+
+		    /* A black pawn capturing a white one (en passant)
+		     *
+		     * The white pawn is actually a rank higher than usual.
+		     */
+
+		    if ((current_tb->pieces[captured_piece].semilegal_squares
+			 & BITVECTOR(position->piece_position[capturing_piece] + 8))) {
+
+			local_position_t new_position = *position;
+
+			new_position.uncapture_piece(capturing_piece, captured_piece, movement);
+
+			new_position.set_en_passant_square(new_position.piece_position[captured_piece]);
+
+			new_position.move_piece(captured_piece, new_position.piece_position[captured_piece] + 8);
+
+			normalize_position(current_tb, &new_position);
+
+			true_capturing_piece = new_position.permuted_piece[capturing_piece];
+			true_captured_piece = new_position.permuted_piece[captured_piece];
+
+			propagate_local_position_from_futurebase(new_position, foreign_position,
+								 futurecaptures[true_capturing_piece][true_captured_piece], true);
+
+		    }
+
+		}
+
+		if ((current_tb->pieces[capturing_piece].color == PieceColor::White) && (ROW(movement) == 4)) {
+
+		    /* A white pawn capturing a black one (en passant)
+		     *
+		     * The black pawn is actually a rank lower than usual.
+		     */
+
+		    if ((current_tb->pieces[captured_piece].semilegal_squares
+			 & BITVECTOR(position->piece_position[capturing_piece] - 8))) {
+
+			local_position_t new_position = *position;
+
+			new_position.uncapture_piece(capturing_piece, captured_piece, movement);
+
+			new_position.set_en_passant_square(new_position.piece_position[captured_piece]);
+
+			new_position.move_piece(captured_piece, new_position.piece_position[captured_piece] - 8);
+
+			normalize_position(current_tb, &new_position);
+
+			true_capturing_piece = new_position.permuted_piece[capturing_piece];
+			true_captured_piece = new_position.permuted_piece[captured_piece];
+
+			propagate_local_position_from_futurebase(new_position, foreign_position,
+								 futurecaptures[true_capturing_piece][true_captured_piece], true);
+
+		    }
+		}
+	    }
+	}
+    }
+
+    /* If the square we're about to put the captured piece on isn't semilegal for it, then don't
+     * consider this capturing piece in this future position any more.  This is after the en passant
+     * case because an en passant pawn capture is special, since then the capturing piece ends up on
+     * a different square from the captured piece.
+     */
+
+    if (!(current_tb->pieces[captured_piece].semilegal_squares
+	  & BITVECTOR(position->piece_position[capturing_piece]))) {
+	return;
+    }
+
+    /* Now consider all possible backwards movements of the capturing piece. */
+
+    for (auto &dir : movements(current_tb->pieces[capturing_piece].piece_type,
+			       current_tb->pieces[capturing_piece].color,
+			       position->piece_position[capturing_piece],
+			       Movement::Backward, Movement::Capture)) {
+
+	for (auto &movement : dir) {
+
+	    if (BITVECTOR(movement) & position->board_vector) break;
+
+	    /* We already checked that the captured piece was on a semilegal square for it.  Now
+	     * check the capturing piece.
+	     */
+
+	    if (! (current_tb->pieces[capturing_piece].semilegal_squares & BITVECTOR(movement))) continue;
+
+	    /* Move the capturing piece, normalize the position, and back prop it.
+	     *
+	     * We have to figure out the "true" capturing and captured pieces, which might not
+	     * be the pieces we started with (see comments on normalization).
+	     */
+
+	    local_position_t new_position = *position;
+
+	    new_position.uncapture_piece(capturing_piece, captured_piece, movement);
+
+	    normalize_position(current_tb, &new_position);
+
+	    true_capturing_piece = new_position.permuted_piece[capturing_piece];
+	    true_captured_piece = new_position.permuted_piece[captured_piece];
+
+	    propagate_local_position_from_futurebase(new_position, foreign_position,
+						     futurecaptures[true_capturing_piece][true_captured_piece], true);
+	}
+    }
+
+}
+
+void propagate_moves_from_capture_futurebase(index_t future_index, int reflection)
+{
+    local_position_t foreign_position(futurebase);
+    local_position_t position(current_tb);
+    int piece;
+    translation_result translation;
+
+    /* Take the position from the futurebase and translate it into a local position for the current
+     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
+     * there should be one piece missing from the local position: the piece that was captured.
+     * There could possibly be one piece on a restricted square, as well.  If so, then it must be
+     * the piece that moved in order to capture.
+     */
+
+    /* XXX If the futurebase is more liberal than the tablebase, then there will be
+     * positions with multiple restricted pieces that should be quietly ignored.
+     */
+
+    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
+				  &foreign_position)) return;
+
+    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
+							       current_tb, &position,
+							       futurebase->invert_colors);
+
+    if (future_index == debug_futuremove) {
+	info("capture backprop; reflection=%d; translation=%x\n",
+	     reflections[reflection], translation);
+    }
+
+    if (translation != invalid_translation) {
+
+	if ((translation.extra_piece != NONE) || (translation.missing_piece1 == NONE)
+	    || (translation.missing_piece2 != NONE)) {
+	    return;
+	}
+
+	uint8_t captured_piece = translation.missing_piece1;
+
+	/* Since the last move had to have been a capture move, there is absolutely no way
+	 * we could have en passant capturable pawns in the futurebase position.
+	 */
+
+	if (position.en_passant_square != ILLEGAL_POSITION) return;
+
+	/* Since the position resulted from a capture, we only want to consider future
+	 * positions where the side to move is not the side that captured.
+	 */
+
+	if (position.side_to_move != current_tb->pieces[captured_piece].color) return;
+
+	/* We're going to back step a half move now */
+
+	position.flip_side_to_move();
+
+	if (translation.restricted_piece == NONE) {
+
+	    /* No pieces were on restricted squares.  Consider them all as the possible
+	     * capturing piece.
+	     */
+
+	    for (piece = 0; piece < current_tb->num_pieces; piece++) {
+
+		consider_possible_captures(foreign_position, &position, piece, captured_piece);
+	    }
+
+	} else {
+
+	    /* One piece was on a restricted square.  It's the obvious capturing piece, but it's not
+	     * the only possible one.  A restricted piece is on a square whose semilegal group is
+	     * either empty or already full.  If the square's semilegal group is in fact empty, then
+	     * there's only one restricted piece we need to consider.  Otherwise, we need to
+	     * consider each piece in the semilegal group as the possible restricted piece.
+	     */
+
+	    int restricted_square = position.piece_position[translation.restricted_piece];
+
+	    consider_possible_captures(foreign_position, &position, translation.restricted_piece, captured_piece);
+
+	    for (piece = 0; piece < current_tb->num_pieces; piece++) {
+
+		if ((current_tb->pieces[piece].color == current_tb->pieces[translation.restricted_piece].color)
+		    && (current_tb->pieces[piece].piece_type == current_tb->pieces[translation.restricted_piece].piece_type)
+		    && (current_tb->pieces[piece].semilegal_squares & BITVECTOR(restricted_square))) {
+
+		    position.swap_pieces(translation.restricted_piece, piece);
+
+		    consider_possible_captures(foreign_position, &position, translation.restricted_piece, captured_piece);
+
+		    position.swap_pieces(translation.restricted_piece, piece);
+		}
+	    }
+	}
+    }
+}
+
+/* A "normal" futurebase is one that's identical to our own in terms of the number and types
+ * of pieces.  It differs only in the frozen positions of the pieces.
+ *
+ * XXX not sure how to handle symmetry changes here.  At the moment it's not an issue, since we
+ * don't allow frozen pieces in symmetric tablebases.
+ */
+
+void propagate_moves_from_normal_futurebase(index_t future_index, int reflection)
+{
+    local_position_t foreign_position(futurebase);
+    local_position_t parent_position(current_tb);
+    local_position_t current_position(current_tb); /* i.e, last position that moved to parent_position */
+    translation_result translation;
+    int piece;
+    int origin_square;
+
+    /* Translate the futurebase index into a local position.  We have exactly the same number and
+     * type of pieces here, but exactly one of them is on a restricted square (according to the
+     * current tablebase).  If more than one of them was on a restricted square, then there'd be no
+     * way we could get to this futurebase with a single move.  On the other hand, if none of them
+     * were on restricted squares, then this would be a position in the current tablebase.
+     */
+
+    /* XXX we need to permute the restricted piece around in its semilegal set */
+
+    /* XXX If the futurebase is more liberal than the tablebase, then there will be positions with
+     * multiple restricted pieces that should be quietly ignored.
+     */
+
+    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
+				  &foreign_position)) return;
+
+    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
+							       current_tb, &current_position,
+							       futurebase->invert_colors);
+
+    if (future_index == debug_futuremove) {
+	info("normal backprop; reflection=%d; translation=%x\n",
+	     reflections[reflection], translation);
+    }
+
+    if (translation != invalid_translation) {
+
+	if ((translation.missing_piece1 != NONE) || (translation.missing_piece2 != NONE)
+	    || (translation.extra_piece != NONE) || (translation.restricted_piece == NONE)) {
+	    return;
+	}
+
+	piece = translation.restricted_piece;
+
+	origin_square = current_position.piece_position[piece];
+
+	/* We've moving BACKWARDS in the game, so this has to be a piece of the player who is NOT TO
+	 * PLAY here - this is the LAST move we're considering, not the next move.
+	 */
+
+	if (current_tb->pieces[piece].color == current_position.side_to_move) return;
+
+	/* If there are any en passant capturable pawns in the position, then the last move had to
+	 * have been a pawn move.  In fact, in this case, we already know exactly what the last move
+	 * had to have been.
+	 */
+
+	if (current_position.en_passant_square != ILLEGAL_POSITION) {
+
+	    if (current_tb->pieces[piece].piece_type != PieceType::Pawn) return;
+
+	    if (((current_tb->pieces[piece].color == PieceColor::White)
+		 && (current_position.piece_position[piece] != current_position.en_passant_square + 8))
+		|| ((current_tb->pieces[piece].color == PieceColor::Black)
+		    && (current_position.piece_position[piece] != current_position.en_passant_square - 8))) {
+
+		/* No reason to complain here.  Maybe some other pawn was the en passant pawn. */
+		return;
+	    }
+
+	    current_position.flip_side_to_move();
+	    current_position.clear_en_passant_square();
+
+	    int square;
+	    if (current_tb->pieces[piece].color == PieceColor::White)
+		square = current_position.piece_position[piece] - 16;
+	    else
+		square = current_position.piece_position[piece] + 16;
+
+	    current_position.move_piece(piece, square);
+
+	    /* We never back out into a restricted position.  Since we've already decided that this
+	     * is the only possible back-move from this point, well...
+	     */
+
+	    if (! (current_tb->pieces[piece].semilegal_squares
+		   & BITVECTOR(current_position.piece_position[piece]))) {
+		return;
+	    }
+
+	    propagate_local_position_from_futurebase(current_position, foreign_position,
+						     futuremoves[piece][origin_square], false);
+
+	    return;
+	}
+
+	/* Abuse of notation here.  We just want to keep a copy of current_position because we
+	 * change it around a lot during the loops below.
+	 */
+
+	parent_position = current_position;
+
+	for (auto &dir : movements(current_tb->pieces[piece].piece_type,
+				   current_tb->pieces[piece].color,
+				   parent_position.piece_position[piece],
+				   Movement::Backward, Movement::NonCapture)) {
+
+	    for (auto &movement : dir) {
+
+		/* We never back out into a restricted position (obviously) */
+
+		if (! (current_tb->pieces[piece].semilegal_squares & BITVECTOR(movement))) continue;
+
+		/* Back stepping a half move here involves several things: flipping the side-to-move
+		 * flag, clearing any en passant pawns into regular pawns, moving the piece
+		 * (backwards), and considering a bunch of additional positions identical to the
+		 * base position except that a single one of the pawns on the fourth or fifth ranks
+		 * was capturable en passant.
+		 *
+		 * Of course, the only way we could have gotten an en passant pawn is if THIS MOVE
+		 * created it.  Since this isn't a pawn move, that can't happen.  Checking
+		 * additional en passant positions is taken care of in
+		 * propagate_one_move_within_table()
+		 */
+
+		/* But we start with an extra check to make sure this isn't a double pawn move, it
+		 * which case it would result in an en passant position, not the non-en passant
+		 * position we are in now (en passant got taken care of in the special case above).
+		 */
+
+		/* XXX should be unnecessary because of NoDoublePawn */
+
+		if (((movement - parent_position.piece_position[piece]) == 16)
+		    || ((movement - parent_position.piece_position[piece]) == -16)) {
+		    continue;
+		}
+
+		current_position.flip_side_to_move();
+
+		current_position.move_piece(piece, movement);
+
+		propagate_local_position_from_futurebase(current_position, foreign_position,
+							 futuremoves[piece][origin_square], false);
+	    }
+	}
+
+    }
+}
+
+/* A "pawngen" futurebase is one that's identical to our own, except that it uses a different range
+ * of pawngen indices.  Its local positions can just be copied into our own local position
+ * structure, eliminating the need for the time-consuming translation function.
+ */
+
+void propagate_moves_from_pawngen_futurebase(index_t future_index, int reflection)
+{
+    local_position_t foreign_position(futurebase);
+    local_position_t current_position(current_tb);
+
+    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
+				  &foreign_position)) return;
+
+    if (future_index == debug_futuremove) {
+	info("normal backprop; reflection=%d\n", reflections[reflection]);
+    }
+
+    int pawngen_index = foreign_position.pawngen_index;
+
+    for (int piece = 0; piece < current_tb->num_pieces; piece ++) {
+
+	/* We only consider pawn moves, since they're the only things that change the pawngen index */
+
+	if (current_tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+
+	/* We've moving BACKWARDS in the game, so this has to be a piece of the player who is NOT TO
+	 * PLAY here - this is the LAST move we're considering, not the next move.
+	 */
+
+	if (current_tb->pieces[piece].color == foreign_position.side_to_move) continue;
+
+	/* XXX big assumption here - that we can just copy a position from foreign to current */
+	current_position = foreign_position;
+	current_position.tb = current_tb;
+	current_position.flip_side_to_move();
+
+	/* can we move the pawn backwards and get a position in this tablebase? */
+
+	int delta_pawngen_index = current_tb->pawngen->pawn_positions_by_index[pawngen_index].delta_pawngen_index[piece];
+	uint8_t prev_position = current_tb->pawngen->pawn_positions_by_index[pawngen_index].prev_position[piece];
+
+	if (future_index == debug_futuremove) {
+	    info("pawngen backprop; delta_pawngen_index=%d; prev_position=%d\n", delta_pawngen_index, prev_position);
+	}
+
+	if ((prev_position != ILLEGAL_POSITION) && (! (current_position.board_vector & BITVECTOR(prev_position)))) {
+	    int new_pawngen_index = pawngen_index + delta_pawngen_index;
+
+	    /* move_piece's pawngen optimization makes this quick */
+	    current_position.move_piece(piece, prev_position);
+
+	    if ((new_pawngen_index >= current_tb->pawngen->start)
+		&& (new_pawngen_index < current_tb->pawngen->start + current_tb->pawngen->count)) {
+		/* back prop */
+		propagate_local_position_from_futurebase(current_position, foreign_position, HANDLED_FUTUREMOVE, false);
+	    }
+
+	    /* is a double pawn move possible? */
+
+	    int delta_pawngen_index2 = current_tb->pawngen->pawn_positions_by_index[pawngen_index].delta_pawngen_index2[piece];
+	    int prev_position2 = current_tb->pawngen->pawn_positions_by_index[pawngen_index].prev_position2[piece];
+
+	    if (future_index == debug_futuremove) {
+		info("pawngen backprop; delta_pawngen_index2=%d; prev_position2=%d\n", delta_pawngen_index2, prev_position2);
+	    }
+
+	    if ((prev_position2 != ILLEGAL_POSITION) && (! (current_position.board_vector & BITVECTOR(prev_position2)))) {
+		int new2_pawngen_index = pawngen_index + delta_pawngen_index2;
+
+		if ((new2_pawngen_index >= current_tb->pawngen->start)
+		    && (new2_pawngen_index < current_tb->pawngen->start + current_tb->pawngen->count)) {
+
+		    /* move_piece's pawngen optimization makes this quick */
+		    current_position.move_piece(piece, prev_position2);
+
+		    /* back prop */
+		    propagate_local_position_from_futurebase(current_position, foreign_position, HANDLED_FUTUREMOVE, false);
+		}
+	    }
+	}
+    }
+}
+
+/* Back propagates from all the futurebases.
+ *
+ * Should be called after the tablebase has been initialized, but before intra-table propagation.
+ *
+ * Runs through the parsed XML control file, pulls out all the futurebases, and back-propagates each
+ * one.
+ *
+ * Returns true, or false if something went wrong
+ */
+
+void back_propagate_futurebase_thread(void (* backprop_function)(index_t, int))
+{
+    index_t future_index;
+    int reflection;
+    int i;
+
+    /* XXX We could limit the range of future_index here to only those positions where the promoted
+     * piece appears on the back rank, but watch out for reflection.
+     */
+
+    while ((future_index = futurebase->fetch_entry()) < futurebase->num_indices) {
+
+	for (i=0; i<futurebase_stride; i++) {
+
+	    if (future_index + i < futurebase->num_indices) {
+
+		/* It's tempting to break out the loop here if the position isn't a win, but we want
+		 * to track futuremoves in order to make sure we don't miss one, so the simplest way
+		 * to do that is to run this loop even for draws.
+		 */
+
+		mark_progress();
+
+		for (reflection = 0; reflection < max_reflection; reflection ++) {
+		    (*backprop_function)(future_index + i, reflection);
+		}
+	    }
+	}
+    }
+
+    external_probes.forget();
+    flush_fetch_entry_statistics();
+}
+
+/* Pipelined futurebase back propagation.
+ *
+ * A gzip'ed futurebase can only be decompressed serially, so if every thread calls fetch_entry(),
+ * they spend most of their time waiting on each other for zlib.  Instead, a single reader thread
+ * decompresses stride-sized blocks into a bounded queue, and the worker threads pull whole blocks
+ * off the queue and back propagate them.  Each worker installs its block as its thread_local
+ * cache, so get_DTM() and friends find their entries there without calling into zlib.
+ */
+
+struct futurebase_block {
+    index_t index;
+    char * entries;
+};
+
+class futurebase_pipeline {
+
+    tablebase_t * futurebase;
+    std::vector<char *> free_buffers;
+    std::deque<futurebase_block> full_blocks;
+    bool done = false;
+
+    std::mutex lock;
+    std::condition_variable buffer_freed;
+    std::condition_variable block_ready;
+
+public:
+
+    futurebase_pipeline(tablebase_t * futurebase, int depth) : futurebase(futurebase) {
+	for (int i = 0; i < depth; i ++) {
+	    free_buffers.push_back(new char[futurebase->format.bits * futurebase_stride / 8]);
+	}
+    }
+
+    ~futurebase_pipeline() {
+	for (auto buffer : free_buffers) {
+	    delete [] buffer;
+	}
+    }
+
+    void reader(void) {
+	while (true) {
+	    char * buffer;
+
+	    {
+		std::unique_lock<std::mutex> l(lock);
+		buffer_freed.wait(l, [this]{ return ! free_buffers.empty(); });
+		buffer = free_buffers.back();
+		free_buffers.pop_back();
+	    }
+
+	    index_t index = futurebase->read_entries(INVALID_INDEX, buffer);
+
+	    std::lock_guard<std::mutex> _(lock);
+
+	    if (index >= futurebase->num_indices) {
+		free_buffers.push_back(buffer);
+		done = true;
+		block_ready.notify_all();
+		return;
+	    }
+
+	    full_blocks.push_back({index, buffer});
+	    block_ready.notify_one();
+	}
+    }
+
+    bool pop(futurebase_block & block) {
+	std::unique_lock<std::mutex> l(lock);
+	block_ready.wait(l, [this]{ return done || ! full_blocks.empty(); });
+	if (full_blocks.empty()) return false;
+	block = full_blocks.front();
+	full_blocks.pop_front();
+	return true;
+    }
+
+    void release(char * buffer) {
+	std::lock_guard<std::mutex> _(lock);
+	free_buffers.push_back(buffer);
+	buffer_freed.notify_one();
+    }
+};
+
+void back_propagate_futurebase_pipeline_thread(futurebase_pipeline * pipeline,
+					       void (* backprop_function)(index_t, int))
+{
+    futurebase_block block;
+    int reflection;
+    int i;
+
+    while (pipeline->pop(block)) {
+
+	cached_tb = futurebase;
+	cached_entries = block.entries;
+	cached_index = block.index;
+
+	for (i=0; i<futurebase_stride; i++) {
+	    if (block.index + i < futurebase->num_indices) {
+		mark_progress();
+		for (reflection = 0; reflection < max_reflection; reflection ++) {
+		    (*backprop_function)(block.index + i, reflection);
+		}
+	    }
+	}
+
+	/* The buffer belongs to the pipeline, so make sure fetch_entry() never tries to free it */
+
+	cached_tb = nullptr;
+	cached_entries = nullptr;
+
+	pipeline->release(block.entries);
+    }
+
+    flush_fetch_entry_statistics();
+}
+
+bool back_propagate_all_futurebases(tablebase_t *tb) {
+
+    int fbnum;
+    void (* backprop_function)(index_t, int);
+
+    for (fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+
+	futurebase = & futurebases[fbnum];
+
+	max_reflection = compute_reflections(tb, futurebase, reflections);
+
+	next_future_index = 0;
+	backprop_function = nullptr;
+
+	switch (futurebase->futurebase_type) {
+
+	case FuturebaseType::Capture:
+
+	    if (fatal_errors == 0) {
+		backprop_function = &propagate_moves_from_capture_futurebase;
+		doing_capture_backprop = true;
+	    }
+
+	    break;
+
+	case FuturebaseType::Promotion:
+
+	    if (fatal_errors == 0) {
+
+		promotion_color = tb->pieces[futurebase->missing_pawn].color;
+		first_back_rank_square = ((promotion_color == PieceColor::White) ? 56 : 0);
+		last_back_rank_square = ((promotion_color == PieceColor::White) ? 63 : 7);
+		promotion_move = ((promotion_color == PieceColor::White) ? 8 : -8);
+
+		backprop_function = &propagate_moves_from_promotion_futurebase;
+		doing_capture_backprop = false;
+	    }
+
+	    break;
+
+	case FuturebaseType::CapturePromotion:
+
+	    if (fatal_errors == 0) {
+
+		promotion_color = tb->pieces[futurebase->missing_pawn].color;
+		first_back_rank_square = ((promotion_color == PieceColor::White) ? 56 : 0);
+		last_back_rank_square = ((promotion_color == PieceColor::White) ? 63 : 7);
+		promotion_move = ((promotion_color == PieceColor::White) ? 8 : -8);
+
+		backprop_function = &propagate_moves_from_promotion_capture_futurebase;
+		doing_capture_backprop = true;
+	    }
+
+	    break;
+
+	case FuturebaseType::Normal:
+
+	    if (fatal_errors == 0) {
+		backprop_function = propagate_moves_from_normal_futurebase;
+		doing_capture_backprop = false;
+	    }
+
+	    break;
+
+	case FuturebaseType::Pawngen:
+
+	    if (fatal_errors == 0) {
+		backprop_function = propagate_moves_from_pawngen_futurebase;
+		doing_capture_backprop = false;
+	    }
+
+	    break;
+
+	default:
+
+	    fatal("Unknown back propagation type for futurebase '%s'\n", futurebase->filename.c_str());
+	    break;
+
+	}
+
+	if (backprop_function) {
+
+	    std::thread t[num_threads];
+	    unsigned int thread;
+
+	    std::string status_message("Back propagating (");
+	    status_message += futurebase_types[futurebase->futurebase_type];
+	    status_message += ") from '";
+	    status_message += futurebase->filename;
+	    status_message += "'";
+
+	    reset_progress_indicator(status_message.c_str(), futurebase->num_indices);
+
+	    /* Only tablebases read through instream need the pipeline; the others (Nalimov, Syzygy,
+	     * block-compressed, and mmap'ed) can already be read by all threads concurrently.
+	     */
+
+	    if (futurebase->instream) {
+
+		futurebase_pipeline pipeline(futurebase, 2*num_threads);
+		std::thread reader(&futurebase_pipeline::reader, &pipeline);
+
+		for (thread = 0; thread < num_threads; thread ++) {
+		    t[thread] = std::thread(back_propagate_futurebase_pipeline_thread, &pipeline, backprop_function);
+		}
+
+		reader.join();
+
+		for (thread = 0; thread < num_threads; thread ++) {
+		    t[thread].join();
+		}
+
+	    } else {
+
+		for (thread = 0; thread < num_threads; thread ++) {
+		    t[thread] = std::thread(back_propagate_futurebase_thread, backprop_function);
+		}
+
+		for (thread = 0; thread < num_threads; thread ++) {
+		    t[thread].join();
+		}
+	    }
+
+	    end_progress_indicator();
+	}
+    }
+
+    return (fatal_errors == 0);
+}
+
+/***** PRUNING *****/
+
+/* If we don't want to fully analyze out the tree past the table we're now building, we prune some
+ * possible futuremoves.  Of course, this will affect the accuracy of the table; the table is a
+ * result of BOTH the position it was set up for AND the pruning decisions (and any pruning
+ * decisions made on the futurebases used to calculate this one).
+ *
+ * We specify pruning in a simple way - by omitting future tables for moves we don't want to
+ * consider.  This can be dangerous, so we require this feature to be specifically enabled.  There
+ * are two possibilities: moves can be DISCARDED, or victory can be CONCEDED to the side that makes
+ * the move.
+ *
+ * So, if we are white, and assuming that this is a table with a frozen white pawn on e3, we can
+ * prune by simply ignoring Pe4 as a possible move.  If there is a black pawn on the g-file, and we
+ * don't want to compute out what happens after it queens, we can prune by conceding Pg1=X as a win
+ * for black.
+ *
+ * For example, let's say we're looking at a Q-and-P vs. Q-and-P endgame.  There are four completely
+ * mobile pieces (2 Ks and 2 Qs), and this is easy.  But if one of the pawns queens, then we've got
+ * a more complex game with five mobile pieces.  But we don't want to completely discard all
+ * possible enemy promotions, if we can immediately capture the new queen.  So we construct a
+ * special tablebase with a queen frozen on the queening square, concede any move by that queen as a
+ * win, then use it as a futurebase.
+ *
+ * And finally, we want to label in the file header that this pruning was done.  In particular, if
+ * we use a pruned tablebase to compute another (earlier) pruned tablebase, we want to make sure the
+ * pruning is consistent, i.e. "our" side has to stay the same.  This is guaranteed by explicitly
+ * flagging in the XML header which sides can be pruned in which way (concede or discard).
+ */
+
+std::atomic<bool> all_futuremoves_handled(true);
+
+/* finalize_futuremove()
+ *
+ * After all futurebase backpropagation is done, this function is called on each legal position to
+ * check if there are any futuremoves that weren't handled by the futurebases.  If so, we either
+ * complain or prune, depending on how we're configured.  We don't use commit_update(), and instead
+ * call finalize_update() directly, because we're making a pass through the entries array to call
+ * finalize_futuremove(), and can thus update the entry directly, without going through a proptable.
+ */
+
+void finalize_futuremove(tablebase_t *tb, index_t index, futurevector_t futurevector) {
+
+    unsigned int futuremove;
+    PieceColor stm = index_to_side_to_move(tb, index);
+
+    if (futurevector & unpruned_futuremoves[stm]) {
+	global_position_t global;
+	index_to_global_position(tb, index, &global);
+
+	/* We're called from every thread at once, so print the whole line with one fatal() */
+
+	std::string moves;
+	for (futuremove = 0; futuremove < num_futuremoves[stm]; futuremove ++) {
+	    if (futurevector & FUTUREVECTOR(futuremove)	& unpruned_futuremoves[stm]) {
+		moves += " ";
+		moves += movestr[stm][futuremove];
+	    }
+	}
+	fatal("Futuremoves not handled: %" PRIindex " %s%s\n", index, global_position_to_FEN(&global), moves.c_str());
+	all_futuremoves_handled = false;
+    }
+
+    /* concede - we treat these unhandled futuremoves as forced wins for PTM.  We update the entry
+     * with DTM=2 (mate in one) and movecnt=1 (doesn't matter for a PTM win).
+     */
+
+    if (futurevector & conceded_futuremoves[stm]) {
+	finalize_update(index, 2, 1, NO_FUTUREMOVE);
+    }
+
+    /* discard - we ignore these unhandled futuremoves by updating with DTM=0, which decrements
+     * movecnt by position.multiplicity, because we multiplied movecnt by position.multiplicity when
+     * we initialized the entry.
+     *
+     * XXX Can't test the use of position.multiplicity because we currently can't have piece
+     * restrictions with symmetric tablebases, we need 8-way symmetry to get multiplicity, and we
+     * need piece restrictions to get a futurebase where only some futuremoves are handled.
+     */
+
+    if (futurevector & discarded_futuremoves[stm]) {
+	for (futuremove = 0; futuremove < num_futuremoves[stm]; futuremove ++) {
+	    if (futurevector & FUTUREVECTOR(futuremove) & discarded_futuremoves[stm]) {
+
+		local_position_t position(tb);
+
+		index_to_local_position(tb, index, REFLECTION_NONE, &position);
+
+		finalize_update(index, 0, position.multiplicity, NO_FUTUREMOVE);
+	    }
+	}
+    }
+}
+
+/* have_all_futuremoves_been_handled() - this is the non-proptable case to run through the entries
+ * table and call finalize_futuremove()
+ *
+ * By now, the futurebases have cleared the bits of almost every futuremove, and
+ * finalize_futuremove() does nothing with an empty futurevector.  64 indices' worth of
+ * futurevectors is exactly futurevector_bits 64-bit words, so we OR those together and only look at
+ * the individual indices (and their entries) if something's left.  The blocks are handed out to
+ * all the threads.
+ */
+
+bool have_all_futuremoves_been_handled(tablebase_t *tb) {
+
+    if (ignore_futurevectors) return true;
+
+    if (tb->futurevector_bits == 0) return true;
+
+    const uint64_t * words = reinterpret_cast<const uint64_t *>(tb->futurevectors);
+    const int words_per_block = tb->futurevector_bits;
+
+    entriesTable->set_threads(num_threads);
+
+    pool.parallel_for(0, tb->num_indices, [tb, words, words_per_block](index_t first, index_t last) {
+	    for (index_t block = first; block <= last; block += 64) {
+		uint64_t any = 0;
+		const uint64_t * block_words = words + (block / 64) * words_per_block;
+
+		for (int word = 0; word < words_per_block; word ++) {
+		    any |= block_words[word];
+		}
+
+		if (any == 0) continue;
+
+		for (index_t index = block; (index < block + 64) && (index <= last); index ++) {
+		    if (entriesTable[index].get_DTM() != 1) {
+			finalize_futuremove(tb, index, get_futurevector(tb, index));
+		    }
+		}
+	    }
+	});
+
+    entriesTable->set_threads(1);
+
+    return all_futuremoves_handled;
+}
+
+/* assign_pruning_statement() - a helper function for compute_pruned_futuremoves()
+ *
+ * searches the tablebase's XML pruning statements for one matching (more or less identically) the
+ * specified color and string.  If there is a match, set the corresponding bit in the
+ * pruned_futuremoves bit vector.  The function can be called more than once for a given bit, but
+ * probably shouldn't be.  For example, the function might be called on the same bit for "PxQ=Q" if
+ * there are two pawns that can promote into a queen.  UNIX-style wildcards are allowed, so "Kd4"
+ * would match against "Kd4", "Kd?", "K?4", "K[a-d]4", or "K*".  The function also allows a trailing
+ * "any" in the prune statement to act as a "*" wildcard for backwards compatibility.
+ *
+ * If there are multiple prune statements that match a given futuremove, it's a warning if they are
+ * of the same type; a fatal error if their types are different.
+ */
+
+int match_pruning_statement(tablebase_t *tb, PieceColor color, const char *pruning_statement)
+{
+    xmlpp::NodeSet result;
+    int type = RESTRICTION_NONE;
+
+    result = tb->xml->get_root_node()->find("//prune");
+
+    for (auto prune = result.begin(); prune != result.end(); prune ++) {
+
+	Glib::ustring prune_color = (*prune)->eval_to_string("@color");
+	Glib::ustring prune_move = (*prune)->eval_to_string("@move");
+	Glib::ustring prune_type = (*prune)->eval_to_string("@type");
+
+	/* Trailing 'any' is an older syntax that means '*' */
+
+	auto pos = prune_move.find("any");
+	if (pos != std::string::npos) {
+	    prune_move.replace(pos, std::string::npos, "*");
+	}
+
+	if ((colors.at(prune_color) == color)
+	    && (fnmatch(prune_move.c_str(), pruning_statement, FNM_CASEFOLD) == 0)) {
+
+	    if (type == RESTRICTION_NONE) {
+		type = restriction_types.at(prune_type);
+	    } else if (type != restriction_types.at(prune_type)) {
+		fatal("Conflicting %s pruning statements match futuremove %s\n",
+		      colors.at(color).c_str(), pruning_statement);
+	    } else {
+		warning("Multiple %s pruning statements match futuremove %s\n",
+			colors.at(color).c_str(), pruning_statement);
+	    }
+	}
+    }
+
+    return type;
+}
+
+void assign_pruning_statement(tablebase_t *tb, PieceColor color, int futuremove)
+{
+    int type;
+    const char * pruning_statement = movestr[color][futuremove];
+
+    if (futuremove == -1) return;
+
+    pruning_statement = movestr[color][futuremove];
+
+    type = match_pruning_statement(tb, color, pruning_statement);
+
+    if (type != RESTRICTION_NONE) {
+
+	if (pruned_futuremoves[color] & FUTUREVECTOR(futuremove)) {
+	    warning("Multiple pruning statements ('%s') match a futuremove\n", pruning_statement);
+	}
+
+	pruned_futuremoves[color] |= FUTUREVECTOR(futuremove);
+
+	if (type == RESTRICTION_CONCEDE) {
+	    conceded_futuremoves[color] |= FUTUREVECTOR(futuremove);
+	    if (discarded_futuremoves[color] & FUTUREVECTOR(futuremove)) {
+		fatal("Conflicting pruning statements ('%s') match a futuremove\n",
+		      pruning_statement);
+	    }
+	}
+	if (type == RESTRICTION_DISCARD) {
+	    discarded_futuremoves[color] |= FUTUREVECTOR(futuremove);
+	    if (conceded_futuremoves[color] & FUTUREVECTOR(futuremove)) {
+		fatal("Conflicting pruning statements ('%s') match a futuremove\n",
+		      pruning_statement);
+	    }
+	}
+    }
+}
+
+/* assign_numbers_to_futuremoves()
+ *
+ * We could just dismiss any moves that aren't handled by our futurebases, but I've found this to be
+ * a source of error, since moves tend to get overlooked this way.  We're also concerned with the
+ * more sobering possibility of a single move getting processed twice by two different futurebases.
+ *
+ * So we assign numbers, bit positions in a bit vector, actually, to each futuremove.  When we
+ * initialize the tablebase, we set bits in the vector (each position has its own vector) for each
+ * futuremove possible from that position.  As we back propagate futuremoves, we check the bit to
+ * make sure it's still set, then clear it.  After we've back propagated all the futurebases, we run
+ * through the entire tablebase, making sure that the only bits that remain set correspond to prune
+ * statements.
+ *
+ * This function not only assigns the numbers, but also prints an identifying string, such as "KxP"
+ * or "Re4", into the movestr array for each number assigned.  This string will then be matched
+ * against the pruning statements specified in the configuration file.  Sometimes the strings will
+ * repeat.  For example, if we have two pawns and an enemy queen, we'll probably end up with two
+ * different bit positions, both assigned as "QxP".  The reason is that there are probably positions
+ * where the queen could take either pawn, so both possibilities have to be tracked.
+ *
+ * Because we need a "futurevector" for each position in the tablebase, we want to keep it as small
+ * as possible, so we try to use as few bit positions as possible.  In particular, we track white
+ * and black futuremoves seperately (since from a given position only one or the other will be
+ * possible) and we try to reuse bit positions for pawn capture-promotions if the pawns are
+ * sufficiently restricted so that only one or the other could capture the enemy piece in a given
+ * position.
+ */
+
+void assign_numbers_to_futuremoves(tablebase_t *tb) {
+
+    int piece;
+    int captured_piece;
+    int capturing_piece;
+    int sq;
+    int promotion;
+    uint64_t possible_captures[MAX_PIECES];
+    char local_movestr[MOVESTR_CHARS];
+    int futurebase_cnt;
+    int fbnum;
+
+    /* Start by computing a board vector (possible_captures) showing all possible squares where each
+     * piece can capture onto.
+     */
+
+    for (piece = 0; piece < tb->num_pieces; piece ++) {
+
+	possible_captures[piece] = 0;
+
+	for (sq = 0; sq < 64; sq ++) {
+
+	    /* We make the checks here using legal_squares and not semilegal_squares because
+	     * we're assigning futuremove numbers to individual pieces that can capture.  The
+	     * movements we consider here, being captures, would take us to a futurebase anyway,
+	     * so there's no question of whether the resulting position is fully legal or not.
+	     */
+
+	    if (tb->pieces[piece].legal_squares & BITVECTOR(sq)) {
+
+		for (auto &dir : movements(current_tb->pieces[piece].piece_type,
+					   current_tb->pieces[piece].color,
+					   sq,
+					   Movement::Forward, Movement::Capture)) {
+
+		    for (auto &movement : dir) {
+
+			possible_captures[piece] |= BITVECTOR(movement);
+
+			/* If we hit a frozen piece, then this movement direction ends here */
+			if (BITVECTOR(movement) & tb->frozen_pieces_vector) break;
+		    }
+		}
+	    }
+	}
+    }
+
+    /* Now, consider all possible pairs of pieces that might capture, and assign a number (in the
+     * futurecaptures array) to each pair.  We'll ultimately use this number as an index into a bit
+     * vector to determine if this capture has been handled in any particular position.  However,
+     * there's a common enough "special" case: the two pieces are frozen (or at least sufficiently
+     * restricted) so that the capture can never occur.  Go to the trouble of checking for this.
+     */
+
+    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+
+	if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
+
+	for (capturing_piece = 0; capturing_piece < tb->num_pieces; capturing_piece ++) {
+
+	    /* If this is a suicide analysis and we can capture a player's only (i.e, last) piece,
+	     * we lose.  Treat this just like a 'resign' prune, except that we don't need prune or
+	     * prune-enable statements, since these are the rules of the game!
+	     */
+
+	    if ((tb->variant == Variant::Suicide) && (tb->num_pieces_by_color[tb->pieces[captured_piece].color] == 1)) {
+
+		futurecaptures[capturing_piece][captured_piece] = RESIGN_FUTUREMOVE;
+
+		for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+		    promotion_captures[capturing_piece][captured_piece][promotion] = RESIGN_FUTUREMOVE;
+		}
+
+		continue;
+	    }
+
+	    futurecaptures[capturing_piece][captured_piece] = NO_FUTUREMOVE;
+
+	    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+		promotion_captures[capturing_piece][captured_piece][promotion] = NO_FUTUREMOVE;
+	    }
+
+	    if (tb->pieces[capturing_piece].color == tb->pieces[captured_piece].color) continue;
+
+	    if (tb->pieces[capturing_piece].piece_type != PieceType::Pawn) {
+
+		if (possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares) {
+
+		    sprintf(local_movestr, "%cx%c",
+			    piece_char[tb->pieces[capturing_piece].piece_type],
+			    piece_char[tb->pieces[captured_piece].piece_type]);
+
+		    movestr[tb->pieces[capturing_piece].color]
+			[num_futuremoves[tb->pieces[capturing_piece].color]]
+			= strdup(local_movestr);
+
+		    futurecaptures[capturing_piece][captured_piece]
+			= num_futuremoves[tb->pieces[capturing_piece].color] ++;
+		}
+
+	    } else {
+
+		/* if it's a pawn-takes-pawn situation, check for en passant as well */
+
+		if ((possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares)
+		    | ((tb->pieces[captured_piece].piece_type == PieceType::Pawn)
+		       && (((tb->pieces[capturing_piece].color == PieceColor::White)
+			    ? ((possible_captures[capturing_piece] & 0x0000ff0000000000LL) >> 8)
+			    : ((possible_captures[capturing_piece] & 0x0000000000ff0000LL) << 8))
+			   & tb->pieces[captured_piece].legal_squares))) {
+
+		    int candidate_futuremove = NO_FUTUREMOVE;
+
+		    /* start by dishing out a non-promotion futurecapture */
+
+		    sprintf(local_movestr, "%cx%c",
+			    piece_char[tb->pieces[capturing_piece].piece_type],
+			    piece_char[tb->pieces[captured_piece].piece_type]);
+
+		    movestr[tb->pieces[capturing_piece].color]
+			[num_futuremoves[tb->pieces[capturing_piece].color]]
+			= strdup(local_movestr);
+
+		    futurecaptures[capturing_piece][captured_piece]
+			= num_futuremoves[tb->pieces[capturing_piece].color] ++;
+
+		    /* Keep going only if it's a pawn capture that results in promotion */
+
+		    if (! (possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares
+			   & ((tb->pieces[capturing_piece].color == PieceColor::White)
+			      ? 0xff00000000000000LL : 0x00000000000000ffLL))) {
+			continue;
+		    }
+
+		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+
+			candidate_futuremove = NO_FUTUREMOVE;
+
+			sprintf(local_movestr, "Px%c=%c",
+				piece_char[tb->pieces[captured_piece].piece_type],
+				piece_char[promoted_pieces[promotion]]);
+
+			/* Be conservative about handing out bit positions in the futurevector.
+			 * Look through the other pieces that have been assigned bit positions and
+			 * see if we can find one with an identical movestr that can never capture
+			 * onto the squares that our piece can capture onto and reuse its bit
+			 * positions.
+			 *
+			 * This code could be a lot more aggressively conservative, but for now I
+			 * settle for handling the common simple case of pawns more than two files
+			 * apart never being able to capture the same piece.  I only look at
+			 * futuremoves for the current captured_piece, and only so far as the
+			 * current capturing_piece.  That's why the nesting order of the two
+			 * captured_piece and capturing_piece loops is important above.  First we
+			 * look for a candidate futuremove, then we try to bust it by looking for
+			 * overlaps.
+			 */
+
+			for (piece = 0; piece < capturing_piece; piece ++) {
+			    if (tb->pieces[piece].color != tb->pieces[capturing_piece].color) continue;
+			    if (promotion_captures[piece][captured_piece][promotion] != NO_FUTUREMOVE) {
+				if ((! (possible_captures[capturing_piece] & possible_captures[piece]))
+				    && (! strcmp(local_movestr, movestr[tb->pieces[piece].color][promotion_captures[piece][captured_piece][promotion]]))) {
+				    candidate_futuremove = promotion_captures[piece][captured_piece][promotion];
+				}
+			    }
+			}
+
+			if (candidate_futuremove != NO_FUTUREMOVE) {
+			    for (piece = 0; piece < capturing_piece; piece ++) {
+				if (tb->pieces[piece].color != tb->pieces[capturing_piece].color) continue;
+				if (! (possible_captures[capturing_piece] & possible_captures[piece])) continue;
+				if (promotion_captures[piece][captured_piece][promotion] != NO_FUTUREMOVE) {
+				    if (promotion_captures[piece][captured_piece][promotion] == candidate_futuremove) {
+					candidate_futuremove = NO_FUTUREMOVE;
+					break;
+				    }
+				}
+			    }
+			}
+
+			if (candidate_futuremove == NO_FUTUREMOVE) {
+			    candidate_futuremove = num_futuremoves[tb->pieces[capturing_piece].color] ++;
+			    movestr[tb->pieces[capturing_piece].color][candidate_futuremove] = strdup(local_movestr);
+			}
+
+			promotion_captures[capturing_piece][captured_piece][promotion] = candidate_futuremove;
+		    }
+		}
+	    }
+	}
+    }
+
+    /* We also want to consider all promotions.  We don't wrap this into the pawn code that follows
+     * because we want to count all promotions together, not a set for each destination square.
+     * This is a special case of a more general problem that this code doesn't address yet.  We want
+     * to minimize the assigned numbers to keep the futuremove bit vector small, so we want to reuse
+     * those numbers if we're sure that two moves can't happen from different squares.  I.e, if a
+     * king is restricted to the f1/h3 rectangle, then it can move to e1 from f1 and it can move to
+     * h4 from h3, but there is no single position from which it can move to both e1 and h4.  So we
+     * can use the same position in the bit vector for Ke1 and Kh4.  But we don't (yet).
+     */
+
+    for (piece = 0; piece < tb->num_pieces; piece ++) {
+	for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+	    promotions[piece][promotion] = NO_FUTUREMOVE;
+	}
+	if (tb->pieces[piece].piece_type == PieceType::Pawn) {
+	    for (sq = (tb->pieces[piece].color == PieceColor::White ? 48 : 8);
+		 sq <= (tb->pieces[piece].color == PieceColor::White ? 55 : 15); sq++) {
+		if (tb->pieces[piece].legal_squares & BITVECTOR(sq)) {
+
+		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+			promotions[piece][promotion] = num_futuremoves[tb->pieces[piece].color];
+			sprintf(local_movestr, "P=%c", piece_char[promoted_pieces[promotion]]);
+			movestr[tb->pieces[piece].color][promotions[piece][promotion]] = strdup(local_movestr);
+			num_futuremoves[tb->pieces[piece].color] ++;
+		    }
+
+		    break;
+		}
+	    }
+	}
+    }
+
+    /* And now all piece moves outside their restriction.  We record a futuremove for each possible
+     * destination square that the piece can reach outside its move restriction, unless we've
+     * determined that there are no "normal" futurebases, in which case we flag the pruning right
+     * here and now.
+     */
+
+    futurebase_cnt = 0;
+
+    for (fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+	if (futurebases[fbnum].futurebase_type == FuturebaseType::Normal) futurebase_cnt ++;
+    }
+
+    for (piece = 0; piece < tb->num_pieces; piece ++) {
+
+	for (sq = 0; sq < 64; sq ++) futuremoves[piece][sq] = NO_FUTUREMOVE;
+
+	for (sq = 0; sq < 64; sq ++) {
+
+	    /* Consider as _starting_ squares only those within the piece's movement restriction */
+
+	    if (! (tb->pieces[piece].legal_squares & BITVECTOR(sq))) continue;
+
+	    for (auto &dir : movements(current_tb->pieces[piece].piece_type,
+				       current_tb->pieces[piece].color,
+				       sq,
+				       Movement::Forward, Movement::NonCapture)) {
+
+		for (auto &movement : dir) {
+
+		    /* If we hit a frozen piece, movement has to stop.  We don't consider captures
+		     * here; they were handled above.
+		     */
+
+		    if (BITVECTOR(movement) & tb->frozen_pieces_vector) break;
+
+		    /* If the piece is moving outside its semilegal squares, it's a futuremove.  If
+		     * it's moving from a legal square to a semilegal square, it's also a
+		     * futuremove... except for a special case.  Obviously the other piece in its
+		     * semilegal group can't be on either the square it's moving from or the square
+		     * it's moving to (no other piece can be).  If all remaining legal squares
+		     * available to that other piece are also legal squares for this piece, then we
+		     * can always successfully flip the two pieces and this isn't a futuremove.  The
+		     * converse is that there must be at least one legal square available to the
+		     * other piece that isn't a legal square for this piece; in other words, this
+		     * piece must have another semilegal square that isn't legal.
+		     */
+
+		    if (!(tb->pieces[piece].semilegal_squares & BITVECTOR(movement))
+
+			|| (!(tb->pieces[piece].legal_squares & BITVECTOR(movement))
+			    && ( tb->pieces[piece].semilegal_squares & ~(tb->pieces[piece].legal_squares)
+				 & ~BITVECTOR(movement) & ~BITVECTOR(sq) ))) {
+
+			if (futuremoves[piece][movement] == NO_FUTUREMOVE) {
+
+			    sprintf(local_movestr, "%c%c%c", piece_char[tb->pieces[piece].piece_type],
+				    'a' + COL(movement), '1' + ROW(movement));
+
+			    if (futurebase_cnt > 0) {
+				futuremoves[piece][movement]
+				    = num_futuremoves[tb->pieces[piece].color];
+				movestr[tb->pieces[piece].color][num_futuremoves[tb->pieces[piece].color]]
+				    = strdup(local_movestr);
+				num_futuremoves[tb->pieces[piece].color] ++;
+			    } else {
+				switch (match_pruning_statement(tb, tb->pieces[piece].color,
+								local_movestr)) {
+				case RESTRICTION_DISCARD:
+				    futuremoves[piece][movement] = DISCARD_FUTUREMOVE;
+				    break;
+				case RESTRICTION_CONCEDE:
+				    futuremoves[piece][movement] = CONCEDE_FUTUREMOVE;
+				    break;
+				}
+			    }
+			}
+		    }
+		}
+	    }
+	}
+    }
+
+    info("%d possible WHITE futuremoves\n", num_futuremoves[PieceColor::White]);
+    if (tb->encode_stm) {
+	info("%d possible BLACK futuremoves\n", num_futuremoves[PieceColor::Black]);
+    } else {
+	num_futuremoves[PieceColor::Black] = 0;
+    }
+
+    if (num_futuremoves[PieceColor::White] > sizeof(futurevector_t)*8) {
+	fatal("Too many futuremoves - %d!  (only %d bits futurevector_t)\n",
+	      num_futuremoves[PieceColor::White], sizeof(futurevector_t)*8);
+	terminate();
+    }
+    if (num_futuremoves[PieceColor::Black] > sizeof(futurevector_t)*8) {
+	fatal("Too many futuremoves - %d!  (only %d bits futurevector_t)\n",
+	      num_futuremoves[PieceColor::Black], sizeof(futurevector_t)*8);
+	terminate();
+    }
+}
+
+void print_futuremoves(void)
+{
+    unsigned int i;
+
+    info("%d unpruned and unhandled WHITE futuremoves\n", num_futuremoves[PieceColor::White]);
+    if (current_tb->encode_stm) info("%d unpruned and unhandled BLACK futuremoves\n", num_futuremoves[PieceColor::Black]);
+
+    for (i=0; i < num_futuremoves[PieceColor::White]; i ++) {
+	info("WHITE Futuremove %i: %s\n", i, movestr[PieceColor::White][i]);
+    }
+    for (i=0; i < num_futuremoves[PieceColor::Black]; i ++) {
+	if (current_tb->encode_stm) info("BLACK Futuremove %i: %s\n", i, movestr[PieceColor::Black][i]);
+    }
+}
+
+/* This is where we parse pruning statements.  Fill in the pruned_futuremoves bit vector with bits
+ * set for the various pruned moves.  We call this routine after assign_numbers_to_futuremoves(),
+ * which also prints strings into the movestr array, and now we use those strings to match against
+ * pruning statements.  To make this routine easier, assign_pruning_statement() can be called with a
+ * '-1' futuremove, in which case it will do nothing.
+ *
+ * XXX something else I'd like to do here is to flag all of the pruning statements to make
+ * sure we've used each one, and complain if any are left unused.
+ */
 
-		    true_captured_piece = new_position.permuted_piece[translation.missing_piece2];
-		    true_pawn = new_position.permuted_piece[translation.missing_piece1];
+bool compute_pruned_futuremoves(tablebase_t *tb)
+{
+    xmlpp::NodeSet result;
 
-		    /* This function also back props any similar positions with one of the pawns
-		     * from the side that didn't promote in an en passant state.
-		     */
+    /* Check pruning statements for consistency, and record stalemate pruning if specified */
 
-		    propagate_local_position_from_futurebase(new_position, foreign_position,
-							     promotion_captures[true_pawn][true_captured_piece][futurebase->promotion], true);
+    result = tb->xml->get_root_node()->find("//prune");
 
-		}
+    for (auto prune = result.begin(); prune != result.end(); prune ++) {
 
-		/* Now consider a capture to the right (white's right).  Again, there has to be an
-		 * empty square where the pawn came from, and it has to be semilegal.
-		 */
+	Glib::ustring prune_color = (*prune)->eval_to_string("@color");
+	Glib::ustring prune_type = (*prune)->eval_to_string("@type");
 
-		if ((COL(promotion_sq) != 7)
-		    && !(position.board_vector & BITVECTOR(promotion_sq - promotion_move + 1))
-		    && (current_tb->pieces[translation.missing_piece1].semilegal_squares & BITVECTOR(promotion_sq - promotion_move + 1))) {
+	PieceColor color = colors.at(prune_color);
+	int type = restriction_types.at(prune_type);
 
-		    local_position_t new_position = position;
+	if (! (type & tb->prune_enable[color])) {
+	    fatal("Prune statements don't match tablebase prune-enables\n");
+	}
+    }
 
-		    /* Put the piece that was captured onto the board on the promotion square. */
+    if (fatal_errors != 0) return false;
 
-		    new_position.place_piece(translation.missing_piece2, promotion_sq);
+    for (auto color : BothColors) {
+	for (auto fm = 0U; fm < num_futuremoves[color]; fm ++) {
+	    assign_pruning_statement(tb, color, fm);
+	}
+    }
 
-		    /* Put the missing pawn on the seventh (or second). */
+    unpruned_futuremoves[PieceColor::White] = ~pruned_futuremoves[PieceColor::White];
+    unpruned_futuremoves[PieceColor::Black] = ~pruned_futuremoves[PieceColor::Black];
 
-		    new_position.place_piece(translation.missing_piece1, promotion_sq - promotion_move + 1);
+    return (fatal_errors == 0);
+}
 
-		    normalize_position(current_tb, &new_position);
 
-		    true_captured_piece = new_position.permuted_piece[translation.missing_piece2];
-		    true_pawn = new_position.permuted_piece[translation.missing_piece1];
+/* check_pruning()
+ *
+ * We run this function after we've assigned numbers to the futuremoves and then matched pruning
+ * statements against them, but before we initialize the tablebase.
+ *
+ * Check the futurebases to see if there are any for a given futuremove.  If not, check to make sure
+ * the futuremove is pruned.  Otherwise, signal an error and exit right now.  Just because this test
+ * is passed doesn't mean a particular futuremove is handled in a particular position (that's why we
+ * use the bit vector), but if the test fails, well, then we know (almost) for sure that we'd get to
+ * the end of program with unhandled futurebases, so we can save ourselves a long computation by
+ * making this basic check now.
+ *
+ * If no futurebases exist for a given futuremove and it is correctly pruned, then flag it for
+ * optimization, since there is no need to track its futurebase back propagation.
+ *
+ * Also check to see if there are any futurebases that will always match a futuremove.  If so, we
+ * can also optimize these away.  If multiple futurebases match a futuremove and one of them will
+ * always match the futuremove, then we can also signal an error now, because we're going to get
+ * multiply handled futuremoves.
+ *
+ * There is an off chance that piece restrictions will prevent a futuremove from taking place, but
+ * this code will conclude nevertheless that it is possible and demand either a prune statement or a
+ * futurebase.  In this rare case, introducing an extraneous prune statement or two should solve the
+ * problem.
+ */
 
-		    propagate_local_position_from_futurebase(new_position, foreign_position,
-							     promotion_captures[true_pawn][true_captured_piece][futurebase->promotion], true);
+uint64_t tablebase_t::possible_capture_squares(const int capturing_piece) const
+{
+    uint64_t result = 0LL;
 
+    for (square_t from=0; from < NUM_SQUARES; from++) {
+	if (pieces[capturing_piece].legal_squares & BITVECTOR(from)) {
+	    for (auto &dir: movements(pieces[capturing_piece].piece_type, pieces[capturing_piece].color,
+				     from, Movement::Forward, Movement::Capture)) {
+		for (auto &to: dir) {
+		    result |= BITVECTOR(to);
 		}
-
 	    }
+	}
+    }
 
-	    /* If the extra piece mapped into a non-empty semilegal group, then swap it with the
-	     * next piece in the group and try again.
-	     */
-
-	    if (local_piece == -1) return;
-
-	    int new_promotion_sq = position.piece_position[local_piece];
+    return result;
+}
 
-	    position.move_piece(local_piece, promotion_sq);
-	    promotion_sq = new_promotion_sq;
+bool tablebase_t::futurebase_matches_capture(const tablebase_t& fb, const int captured_piece) const
+{
+    /* I've made this a bit more liberal now, because if we're dealing with move restrictions,
+     * then we might have a missing piece in the futurebase line up with one of our pieces that
+     * is identical to captured_piece in the sense that it's the same color and type, but not
+     * identical in the sense of next_piece_in_semilegal_group.
+     */
 
-	    local_piece = current_tb->pieces[local_piece].next_piece_in_semilegal_group;
+    if (fb.futurebase_type != FuturebaseType::Capture) return false;
 
-	}
+    if (pieces[captured_piece].piece_type == PieceType::Pawn) {
+	if ((fb.missing_pawn != -1)
+	    && (pieces[fb.missing_pawn].color == pieces[captured_piece].color)) return true;
+    } else {
+	if ((fb.missing_non_pawn != -1)
+	    && (pieces[fb.missing_non_pawn].color == pieces[captured_piece].color)
+	    && (pieces[fb.missing_non_pawn].piece_type == pieces[captured_piece].piece_type)) return true;
     }
-}
 
-/* Propagate moves from a futurebase that resulted from capturing one of the pieces in the current
- * tablebase.
- *
- * I'm thinking of changing that "invert_colors_of_futurebase" flag to be a subroutine that gets
- * passed in.  It could be a pointer to invert_colors_of_global_position to do what it does now.  Or
- * it could be a "reflect board around vertical axis" to move a d4 pawn to e4.  Also see my comments
- * on invert_colors_of_global position.
- */
+    return false;
+}
 
-void consider_possible_captures(const local_position_t &foreign_position, const local_position_t *position,
-				const int capturing_piece, const int captured_piece)
+bool tablebase_t::futurebase_matches_capture_promotion(const tablebase_t& fb, const int captured_piece, const int promotion) const
 {
-    /* When we finally convert the position to an index (in local_position_to_index()), we'll make a
-     * copy of the position and normalize it by sorting the identical pieces so that they are in
-     * ascending order.  But we have to at least be aware of this here, in order to figure out which
-     * piece "actually" got captured (we're always called with captured_piece set to the last piece
-     * number of any identical pieces), so we can figure out which futuremove number to use.
-     */
-
-    int true_captured_piece;
-    int true_capturing_piece;
+    if (fb.futurebase_type != FuturebaseType::CapturePromotion) return false;
 
-    /* We only want to consider pieces of the side which captured... */
+    if ((pieces[fb.missing_non_pawn].color == pieces[captured_piece].color)
+	&& (pieces[fb.missing_non_pawn].piece_type == pieces[captured_piece].piece_type)
+	&& (fb.promotion == promotion)) {
+	return true;
+    }
 
-    if (current_tb->pieces[capturing_piece].color == current_tb->pieces[captured_piece].color) return;
+    return false;
+}
 
-    /* The en passant special case:
-     *
-     * If both the piece that captured and the piece that was captured are both pawns, and either a
-     * white pawn captured from the fifth rank, or a black pawn captured from the fourth, then there
-     * are two possible back prop positions - the obvious one, and the one where the captured pawn
-     * was in an en passant state.  We also make sure right away that the rank is clear where the
-     * pawn had to come from, and the rank is clear where the pawn had to go to, ensuring that an en
-     * passant move was even possible.
-     */
+bool tablebase_t::futurebase_matches_promotion(const tablebase_t& fb, const int promoting_pawn, const int promotion) const
+{
+    if (fb.futurebase_type != FuturebaseType::Promotion) return false;
 
-    /* XXX if statements inside the for loop can be moved out of it */
+    if ((pieces[fb.missing_pawn].color == pieces[promoting_pawn].color)
+	&& (fb.promotion == promotion)) {
+	return true;
+    }
 
-    if ((current_tb->pieces[capturing_piece].piece_type == PieceType::Pawn)
-	&& (current_tb->pieces[captured_piece].piece_type == PieceType::Pawn)
-	&& !(position->board_vector & BITVECTOR(position->piece_position[capturing_piece]-8))
-	&& !(position->board_vector & BITVECTOR(position->piece_position[capturing_piece]+8))) {
+    return false;
+}
 
-	for (auto &dir : movements(current_tb->pieces[capturing_piece].piece_type,
-				   current_tb->pieces[capturing_piece].color,
-				   position->piece_position[capturing_piece],
-				   Movement::Backward, Movement::Capture)) {
+uint64_t flip_legal_squares(const uint64_t legal_squares)
+{
+    uint64_t output = 0LL;
 
-	    for (auto &movement : dir) {
+    for (int i=0; i<64; i++) {
+	if (legal_squares & BITVECTOR(i)) {
+	    output |= BITVECTOR(63-i);
+	}
+    }
 
-		if ((current_tb->pieces[capturing_piece].color == PieceColor::Black) && (ROW(movement) == 3)) {
+    return output;
+}
 
-		    /* A black pawn capturing a white one (en passant)
-		     *
-		     * The white pawn is actually a rank higher than usual.
-		     */
+bool tablebase_t::futurebase_completely_handles_capture(const tablebase_t& fb, const int capturing_piece, const int captured_piece) const
+{
+    if (! futurebase_matches_capture(fb, captured_piece)) return false;
 
-		    if ((current_tb->pieces[captured_piece].semilegal_squares
-			 & BITVECTOR(position->piece_position[capturing_piece] + 8))) {
+    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
+     * if our initial pawn positions are identical.
+     */
 
-			local_position_t new_position = *position;
+    if (fb.pawngen) {
+	if (! pawngen) return false;
+	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
+	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
+    }
 
-			new_position.uncapture_piece(capturing_piece, captured_piece, movement);
+    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
+     * to consider all possible such mappings.  Remember that there's one less piece in the
+     * futurebase, and that nothing in the futurebase maps to the captured piece.
+     */
 
-			new_position.set_en_passant_square(new_position.piece_position[captured_piece]);
+    int local_piece[MAX_PIECES];
 
-			new_position.move_piece(captured_piece, new_position.piece_position[captured_piece] + 8);
+    for (int piece = 0; piece < num_pieces - 1; piece ++) {
+	if (piece < captured_piece) {
+	    local_piece[piece] = piece;
+	} else {
+	    local_piece[piece] = piece+1;
+	}
+    }
 
-			normalize_position(current_tb, &new_position);
+    /* Compute a bitvector of squares where a capture is possible.  Slight proviso here for pawns -
+     * since capture-promotions are handled in a different subroutine, we use LEGAL_PAWN_BITVECTOR
+     * to exclude the last rank.
+     */
 
-			true_capturing_piece = new_position.permuted_piece[capturing_piece];
-			true_captured_piece = new_position.permuted_piece[captured_piece];
+    uint64_t capture_squares = possible_capture_squares(capturing_piece);
 
-			propagate_local_position_from_futurebase(new_position, foreign_position,
-								 futurecaptures[true_capturing_piece][true_captured_piece], true);
+    if (pieces[capturing_piece].piece_type == PieceType::Pawn) {
+	capture_squares &= LEGAL_PAWN_BITVECTOR;
+    }
 
-		    }
+    /* Can we find a suitable mapping?
+     *
+     * The capturing piece will end up on the captured piece's square, so each legal square for the
+     * captured piece in the current tablebase must be legal for the capturing piece in the
+     * futurebase, assuming that a capture is possible on that square.
+     *
+     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
+     * its location restriction.
+     */
 
-		}
+    do {
+	int piece;
 
-		if ((current_tb->pieces[capturing_piece].color == PieceColor::White) && (ROW(movement) == 4)) {
+	for (piece = 0; piece < num_pieces - 1; piece ++) {
+	    if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
+	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
+	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
 
-		    /* A white pawn capturing a black one (en passant)
-		     *
-		     * The black pawn is actually a rank lower than usual.
-		     */
+	    /* If we're using pawngen, we've already checked that the pawns match right */
+	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
 
-		    if ((current_tb->pieces[captured_piece].semilegal_squares
-			 & BITVECTOR(position->piece_position[capturing_piece] - 8))) {
+	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
 
-			local_position_t new_position = *position;
+	    if (fb.invert_colors) {
+		fb_legal_squares = flip_legal_squares(fb_legal_squares);
+	    }
 
-			new_position.uncapture_piece(capturing_piece, captured_piece, movement);
+	    if ((local_piece[piece] != capturing_piece)
+		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
+		    != pieces[local_piece[piece]].legal_squares)) break;
+	    if ((local_piece[piece] == capturing_piece)
+		&& ((fb_legal_squares & pieces[captured_piece].legal_squares & capture_squares)
+		    != (pieces[captured_piece].legal_squares & capture_squares))) break;
+	}
 
-			new_position.set_en_passant_square(new_position.piece_position[captured_piece]);
+	/* We've found a mapping of pieces that meets the above criteria. */
+	if (piece == num_pieces - 1) {
+	    return true;
+	}
 
-			new_position.move_piece(captured_piece, new_position.piece_position[captured_piece] - 8);
+    } while (std::next_permutation(local_piece, local_piece + num_pieces - 1));
 
-			normalize_position(current_tb, &new_position);
+    return false;
+}
 
-			true_capturing_piece = new_position.permuted_piece[capturing_piece];
-			true_captured_piece = new_position.permuted_piece[captured_piece];
+bool tablebase_t::futurebase_completely_handles_capture_promotion(const tablebase_t& fb, const int capturing_piece, const int captured_piece, const int promotion) const
+{
+    if (! futurebase_matches_capture_promotion(fb, captured_piece, promotion)) return false;
 
-			propagate_local_position_from_futurebase(new_position, foreign_position,
-								 futurecaptures[true_capturing_piece][true_captured_piece], true);
+    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
+     * if our initial pawn positions are identical.
+     */
 
-		    }
-		}
-	    }
-	}
+    if (fb.pawngen) {
+	if (! pawngen) return false;
+	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
+	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
     }
 
-    /* If the square we're about to put the captured piece on isn't semilegal for it, then don't
-     * consider this capturing piece in this future position any more.  This is after the en passant
-     * case because an en passant pawn capture is special, since then the capturing piece ends up on
-     * a different square from the captured piece.
+    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
+     * to consider all possible such mappings.  Remember that there's one less piece in the
+     * futurebase, and that nothing in the futurebase maps to the captured piece.
      */
 
-    if (!(current_tb->pieces[captured_piece].semilegal_squares
-	  & BITVECTOR(position->piece_position[capturing_piece]))) {
-	return;
+    int local_piece[MAX_PIECES];
+
+    for (int piece = 0; piece < num_pieces - 1; piece ++) {
+	if (piece < captured_piece) {
+	    local_piece[piece] = piece;
+	} else {
+	    local_piece[piece] = piece+1;
+	}
     }
 
-    /* Now consider all possible backwards movements of the capturing piece. */
+    /* Can we find a suitable mapping?
+     *
+     * The capturing piece will end up on the captured piece's square, so each legal square for the
+     * captured piece in the current tablebase must be legal for the capturing piece in the
+     * futurebase.
+     *
+     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
+     * its location restriction.
+     */
 
-    for (auto &dir : movements(current_tb->pieces[capturing_piece].piece_type,
-			       current_tb->pieces[capturing_piece].color,
-			       position->piece_position[capturing_piece],
-			       Movement::Backward, Movement::Capture)) {
+    do {
+	int piece;
 
-	for (auto &movement : dir) {
+	for (piece = 0; piece < num_pieces - 1; piece ++) {
+	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
+	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
 
-	    if (BITVECTOR(movement) & position->board_vector) break;
+	    if (local_piece[piece] != capturing_piece) {
+		if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
+	    } else {
+		if (fb.pieces[piece].piece_type != promoted_pieces[promotion]) break;
+	    }
 
-	    /* We already checked that the captured piece was on a semilegal square for it.  Now
-	     * check the capturing piece.
-	     */
+	    /* If we're using pawngen, we've already checked that the pawns match right */
 
-	    if (! (current_tb->pieces[capturing_piece].semilegal_squares & BITVECTOR(movement))) continue;
+	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
 
-	    /* Move the capturing piece, normalize the position, and back prop it.
-	     *
-	     * We have to figure out the "true" capturing and captured pieces, which might not
-	     * be the pieces we started with (see comments on normalization).
-	     */
+	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
 
-	    local_position_t new_position = *position;
+	    if (fb.invert_colors) {
+		fb_legal_squares = flip_legal_squares(fb_legal_squares);
+	    }
 
-	    new_position.uncapture_piece(capturing_piece, captured_piece, movement);
+	    /* For most pieces, check that the legal squares in the futurebase are a superset
+	     * of the legal squares in the local tablebase. */
 
-	    normalize_position(current_tb, &new_position);
+	    if ((local_piece[piece] != capturing_piece)
+		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
+		    != pieces[local_piece[piece]].legal_squares)) break;
 
-	    true_capturing_piece = new_position.permuted_piece[capturing_piece];
-	    true_captured_piece = new_position.permuted_piece[captured_piece];
+	    /* For the capturing and promoting pawn, find its possible promotion-capture squares,
+	     * and make sure the legal squares in the futurebase are a superset of them.
+	     *
+	     * This code ignores frozen pieces that might block a promotion, but this routine is
+	     * essentially an optimisation.  If it returns false, then we need to check every
+	     * position to see if its futuremoves are handled.  Ignoring frozen pieces just means
+	     * that we might need to check those positions by hand, slowing the program down but not
+	     * affecting its proper operation.
+	     */
 
-	    propagate_local_position_from_futurebase(new_position, foreign_position,
-						     futurecaptures[true_capturing_piece][true_captured_piece], true);
+	    if (local_piece[piece] == capturing_piece) {
+		uint64_t promotion_squares = possible_capture_squares(capturing_piece);
+		if (pieces[capturing_piece].color == PieceColor::White) {
+		    promotion_squares &= 0xff00000000000000LL;
+		} else {
+		    promotion_squares &= 0x00000000000000ffLL;
+		}
+		promotion_squares &= pieces[captured_piece].legal_squares;
+		if ((fb_legal_squares & promotion_squares) != promotion_squares) break;
+	    }
 	}
-    }
 
+	/* We've found a mapping of pieces that meets the above criteria. */
+	if (piece == num_pieces - 1) {
+	    return true;
+	}
+
+    } while (std::next_permutation(local_piece, local_piece + num_pieces - 1));
+
+    return false;
 }
 
-void propagate_moves_from_capture_futurebase(index_t future_index, int reflection)
+bool tablebase_t::futurebase_completely_handles_promotion(const tablebase_t& fb, const int promoting_pawn, const int promotion) const
 {
-    local_position_t foreign_position(futurebase);
-    local_position_t position(current_tb);
-    int piece;
-    translation_result translation;
-
-    /* Take the position from the futurebase and translate it into a local position for the current
-     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
-     * there should be one piece missing from the local position: the piece that was captured.
-     * There could possibly be one piece on a restricted square, as well.  If so, then it must be
-     * the piece that moved in order to capture.
-     */
+    if (! futurebase_matches_promotion(fb, promoting_pawn, promotion)) return false;
 
-    /* XXX If the futurebase is more liberal than the tablebase, then there will be
-     * positions with multiple restricted pieces that should be quietly ignored.
+    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
+     * if our initial pawn positions are identical.
      */
 
-    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
-				  &foreign_position)) return;
-
-    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
-							       current_tb, &position,
-							       futurebase->invert_colors);
-
-    if (future_index == debug_futuremove) {
-	info("capture backprop; reflection=%d; translation=%x\n",
-	     reflections[reflection], translation);
+    if (fb.pawngen) {
+	if (! pawngen) return false;
+	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
+	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
     }
 
-    if (translation != invalid_translation) {
-
-	if ((translation.extra_piece != NONE) || (translation.missing_piece1 == NONE)
-	    || (translation.missing_piece2 != NONE)) {
-	    return;
-	}
-
-	uint8_t captured_piece = translation.missing_piece1;
-
-	/* Since the last move had to have been a capture move, there is absolutely no way
-	 * we could have en passant capturable pawns in the futurebase position.
-	 */
-
-	if (position.en_passant_square != ILLEGAL_POSITION) return;
-
-	/* Since the position resulted from a capture, we only want to consider future
-	 * positions where the side to move is not the side that captured.
-	 */
-
-	if (position.side_to_move != current_tb->pieces[captured_piece].color) return;
+    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
+     * to consider all possible such mappings.
+     */
 
-	/* We're going to back step a half move now */
+    int local_piece[MAX_PIECES];
 
-	position.flip_side_to_move();
+    for (int piece = 0; piece < num_pieces; piece ++) {
+	local_piece[piece] = piece;
+    }
 
-	if (translation.restricted_piece == NONE) {
+    /* Can we find a suitable mapping?
+     *
+     * The capturing piece will end up on the captured piece's square, so each legal square for the
+     * captured piece in the current tablebase must be legal for the capturing piece in the
+     * futurebase.
+     *
+     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
+     * its location restriction.
+     */
 
-	    /* No pieces were on restricted squares.  Consider them all as the possible
-	     * capturing piece.
-	     */
+    do {
+	int piece;
 
-	    for (piece = 0; piece < current_tb->num_pieces; piece++) {
+	for (piece = 0; piece < num_pieces; piece ++) {
+	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
+	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
 
-		consider_possible_captures(foreign_position, &position, piece, captured_piece);
+	    if (local_piece[piece] != promoting_pawn) {
+		if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
+	    } else {
+		if (fb.pieces[piece].piece_type != promoted_pieces[promotion]) break;
 	    }
 
-	} else {
-
-	    /* One piece was on a restricted square.  It's the obvious capturing piece, but it's not
-	     * the only possible one.  A restricted piece is on a square whose semilegal group is
-	     * either empty or already full.  If the square's semilegal group is in fact empty, then
-	     * there's only one restricted piece we need to consider.  Otherwise, we need to
-	     * consider each piece in the semilegal group as the possible restricted piece.
-	     */
+	    /* If we're using pawngen, we've already checked that the pawns match right */
 
-	    int restricted_square = position.piece_position[translation.restricted_piece];
+	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
 
-	    consider_possible_captures(foreign_position, &position, translation.restricted_piece, captured_piece);
+	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
 
-	    for (piece = 0; piece < current_tb->num_pieces; piece++) {
+	    if (fb.invert_colors) {
+		fb_legal_squares = flip_legal_squares(fb_legal_squares);
+	    }
 
-		if ((current_tb->pieces[piece].color == current_tb->pieces[translation.restricted_piece].color)
-		    && (current_tb->pieces[piece].piece_type == current_tb->pieces[translation.restricted_piece].piece_type)
-		    && (current_tb->pieces[piece].semilegal_squares & BITVECTOR(restricted_square))) {
+	    /* For most pieces, check that the legal squares in the futurebase are a superset
+	     * of the legal squares in the local tablebase. */
 
-		    position.swap_pieces(translation.restricted_piece, piece);
+	    if ((local_piece[piece] != promoting_pawn)
+		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
+		    != pieces[local_piece[piece]].legal_squares)) break;
 
-		    consider_possible_captures(foreign_position, &position, translation.restricted_piece, captured_piece);
+	    /* For the promoting pawn, find its possible promotion squares and make sure the legal
+	     * squares in the futurebase are a superset of them.
+	     *
+	     * This code ignores frozen pieces that might block a promotion, but this routine is
+	     * essentially an optimisation.  If it returns false, then we need to check every
+	     * position to see if its futuremoves are handled.  Ignoring frozen pieces just means
+	     * that we might need to check those positions by hand, slowing the program down but not
+	     * affecting its proper operation.
+	     */
 
-		    position.swap_pieces(translation.restricted_piece, piece);
+	    if (local_piece[piece] == promoting_pawn) {
+		uint64_t promotion_squares;
+		if (pieces[promoting_pawn].color == PieceColor::White) {
+		    promotion_squares = (pieces[promoting_pawn].legal_squares & 0x00ff000000000000LL) << 8;
+		} else {
+		    promotion_squares = (pieces[promoting_pawn].legal_squares & 0x000000000000ff00LL) >> 8;
 		}
+		if ((fb_legal_squares & promotion_squares) != promotion_squares) break;
 	    }
 	}
-    }
-}
-
-/* A "normal" futurebase is one that's identical to our own in terms of the number and types
- * of pieces.  It differs only in the frozen positions of the pieces.
- *
- * XXX not sure how to handle symmetry changes here.  At the moment it's not an issue, since we
- * don't allow frozen pieces in symmetric tablebases.
- */
 
-void propagate_moves_from_normal_futurebase(index_t future_index, int reflection)
-{
-    local_position_t foreign_position(futurebase);
-    local_position_t parent_position(current_tb);
-    local_position_t current_position(current_tb); /* i.e, last position that moved to parent_position */
-    translation_result translation;
-    int piece;
-    int origin_square;
+	/* We've found a mapping of pieces that meets the above criteria. */
+	if (piece == num_pieces) {
+	    return true;
+	}
 
-    /* Translate the futurebase index into a local position.  We have exactly the same number and
-     * type of pieces here, but exactly one of them is on a restricted square (according to the
-     * current tablebase).  If more than one of them was on a restricted square, then there'd be no
-     * way we could get to this futurebase with a single move.  On the other hand, if none of them
-     * were on restricted squares, then this would be a position in the current tablebase.
-     */
+    } while (std::next_permutation(local_piece, local_piece + num_pieces));
 
-    /* XXX we need to permute the restricted piece around in its semilegal set */
+    return false;
+}
 
-    /* XXX If the futurebase is more liberal than the tablebase, then there will be positions with
-     * multiple restricted pieces that should be quietly ignored.
+bool check_pruning(tablebase_t *tb)
+{
+    /* For each possible captured_piece (i.e, everything but the two kings) check for capture
+     * futurebases.  tb->white_king and tb->black_king are -1 for suicide, so all pieces are treated
+     * the same in a suicide analysis.
      */
 
-    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
-				  &foreign_position)) return;
-
-    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
-							       current_tb, &current_position,
-							       futurebase->invert_colors);
-
-    if (future_index == debug_futuremove) {
-	info("normal backprop; reflection=%d; translation=%x\n",
-	     reflections[reflection], translation);
-    }
-
-    if (translation != invalid_translation) {
+    for (int captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
 
-	if ((translation.missing_piece1 != NONE) || (translation.missing_piece2 != NONE)
-	    || (translation.extra_piece != NONE) || (translation.restricted_piece == NONE)) {
-	    return;
-	}
+	if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
 
-	piece = translation.restricted_piece;
+	/* If we're not encoding side-to-move, then all of the positions in the tablebase are WHITE
+	 * to move positions, so we don't care if the captured piece is WHITE.
+	 */
 
-	origin_square = current_position.piece_position[piece];
+	if ((! tb->encode_stm) && (tb->pieces[captured_piece].color == PieceColor::White)) continue;
 
-	/* We've moving BACKWARDS in the game, so this has to be a piece of the player who is NOT TO
-	 * PLAY here - this is the LAST move we're considering, not the next move.
-	 */
+	int futurebase_cnt = 0;
 
-	if (current_tb->pieces[piece].color == current_position.side_to_move) return;
+	for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+	    if (tb->futurebase_matches_capture(futurebases[fbnum], captured_piece)) {
+		futurebase_cnt ++;
+	    }
+	}
 
-	/* If there are any en passant capturable pawns in the position, then the last move had to
-	 * have been a pawn move.  In fact, in this case, we already know exactly what the last move
-	 * had to have been.
+	/* If no such futurebase exists, then for every other piece, see if the piece restrictions
+	 * would permit it to capture the original piece in question.  If so, there must be a prune
+	 * statement, or it's an error.  On the other hand, if a futurebase handles all of our
+	 * captures, then it must be the only matching futurebase.
 	 */
 
-	if (current_position.en_passant_square != ILLEGAL_POSITION) {
-
-	    if (current_tb->pieces[piece].piece_type != PieceType::Pawn) return;
+	for (int capturing_piece = 0; capturing_piece < tb->num_pieces; capturing_piece ++) {
 
-	    if (((current_tb->pieces[piece].color == PieceColor::White)
-		 && (current_position.piece_position[piece] != current_position.en_passant_square + 8))
-		|| ((current_tb->pieces[piece].color == PieceColor::Black)
-		    && (current_position.piece_position[piece] != current_position.en_passant_square - 8))) {
+	    if (futurecaptures[capturing_piece][captured_piece] == NO_FUTUREMOVE) continue;
+	    if (futurecaptures[capturing_piece][captured_piece] == RESIGN_FUTUREMOVE) continue;
 
-		/* No reason to complain here.  Maybe some other pawn was the en passant pawn. */
-		return;
+	    if (futurecaptures[capturing_piece][captured_piece] < 0) {
+		fatal("futurecaptures (%d) < 0 but not NO_FUTUREMOVE!\n", futurecaptures[capturing_piece][captured_piece]);
 	    }
 
-	    current_position.flip_side_to_move();
-	    current_position.clear_en_passant_square();
-
-	    int square;
-	    if (current_tb->pieces[piece].color == PieceColor::White)
-		square = current_position.piece_position[piece] - 16;
-	    else
-		square = current_position.piece_position[piece] + 16;
+	    if (futurebase_cnt == 0) {
 
-	    current_position.move_piece(piece, square);
+		if (discarded_futuremoves[tb->pieces[capturing_piece].color]
+		    & FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece])) {
+		    futurecaptures[capturing_piece][captured_piece] = DISCARD_FUTUREMOVE;
+		} else if (conceded_futuremoves[tb->pieces[capturing_piece].color]
+			   & FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece])) {
+		    futurecaptures[capturing_piece][captured_piece] = CONCEDE_FUTUREMOVE;
+		} else {
+		    fatal("No futurebase or pruning for %s move %s\n",
+			  colors.at(tb->pieces[capturing_piece].color).c_str(),
+			  movestr[tb->pieces[capturing_piece].color][futurecaptures[capturing_piece][captured_piece]]);
+		    return false;
+		}
 
-	    /* We never back out into a restricted position.  Since we've already decided that this
-	     * is the only possible back-move from this point, well...
-	     */
+	    } else {
+		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+		    if (tb->futurebase_completely_handles_capture(futurebases[fbnum], capturing_piece, captured_piece)) {
 
-	    if (! (current_tb->pieces[piece].semilegal_squares
-		   & BITVECTOR(current_position.piece_position[piece]))) {
-		return;
+			if (futurebase_cnt > 1) {
+			    fatal("Multiple futurebases handle %s move %s\n",
+				  colors.at(tb->pieces[capturing_piece].color).c_str(),
+				  movestr[tb->pieces[capturing_piece].color][futurecaptures[capturing_piece][captured_piece]]);
+			    return false;
+			}
+			if (futurecaptures[capturing_piece][captured_piece] >= 0) {
+			    handled_futuremoves[tb->pieces[capturing_piece].color] |= FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece]);
+			    futurecaptures[capturing_piece][captured_piece] = HANDLED_FUTUREMOVE;
+			}
+			break;
+		    }
+		}
 	    }
+	}
+    }
 
-	    propagate_local_position_from_futurebase(current_position, foreign_position,
-						     futuremoves[piece][origin_square], false);
+    /* Pawns - check for both promotion and promotion capture futurebases here.  Same idea. */
 
-	    return;
-	}
+    for (int pawn = 0; pawn < tb->num_pieces; pawn ++) {
 
-	/* Abuse of notation here.  We just want to keep a copy of current_position because we
-	 * change it around a lot during the loops below.
-	 */
+	int promotion;
 
-	parent_position = current_position;
+	if (tb->pieces[pawn].piece_type != PieceType::Pawn) continue;
 
-	for (auto &dir : movements(current_tb->pieces[piece].piece_type,
-				   current_tb->pieces[piece].color,
-				   parent_position.piece_position[piece],
-				   Movement::Backward, Movement::NonCapture)) {
+	if ((! tb->encode_stm) && (tb->pieces[pawn].color == PieceColor::Black)) continue;
 
-	    for (auto &movement : dir) {
+	/* First, we're looking for promotion capture futurebases. */
 
-		/* We never back out into a restricted position (obviously) */
+	for (int captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
 
-		if (! (current_tb->pieces[piece].semilegal_squares & BITVECTOR(movement))) continue;
+	    if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
 
-		/* Back stepping a half move here involves several things: flipping the side-to-move
-		 * flag, clearing any en passant pawns into regular pawns, moving the piece
-		 * (backwards), and considering a bunch of additional positions identical to the
-		 * base position except that a single one of the pawns on the fourth or fifth ranks
-		 * was capturable en passant.
-		 *
-		 * Of course, the only way we could have gotten an en passant pawn is if THIS MOVE
-		 * created it.  Since this isn't a pawn move, that can't happen.  Checking
-		 * additional en passant positions is taken care of in
-		 * propagate_one_move_within_table()
-		 */
+	    /* Check to see if the pawn can even be on a square where a promotion capture is
+	     * possible.
+	     */
 
-		/* But we start with an extra check to make sure this isn't a double pawn move, it
-		 * which case it would result in an en passant position, not the non-en passant
-		 * position we are in now (en passant got taken care of in the special case above).
-		 */
+	    if (tb->pieces[pawn].color == PieceColor::White) {
+		if (! (tb->pieces[pawn].legal_squares & 0x00ff000000000000LL)) break;
+	    } else {
+		if (! (tb->pieces[pawn].legal_squares & 0x000000000000ff00LL)) break;
+	    }
 
-		/* XXX should be unnecessary because of NoDoublePawn */
+	    /* Check to see that the other piece can be on a square where it could be promotion
+	     * captured.  It's still possible that the other piece could be on a back rank, but
+	     * never on a square where it could be captured by the pawn, but we leave that
+	     * possibility unchecked.  It'd probably be best to tie this code in with the code in
+	     * assign_numbers_to_futuremoves() - maybe by flagging which captures it was determined
+	     * that promotion was possible in?
+	     */
 
-		if (((movement - parent_position.piece_position[piece]) == 16)
-		    || ((movement - parent_position.piece_position[piece]) == -16)) {
-		    continue;
-		}
+	    if (tb->pieces[pawn].color == PieceColor::White) {
+		if (! (tb->pieces[captured_piece].legal_squares & 0xff00000000000000LL)) continue;
+	    } else {
+		if (! (tb->pieces[captured_piece].legal_squares & 0x00000000000000ffLL)) continue;
+	    }
 
-		current_position.flip_side_to_move();
+	    /* check all futurebases for a 'promotion capture' with captured_piece missing */
 
-		current_position.move_piece(piece, movement);
+	    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-		propagate_local_position_from_futurebase(current_position, foreign_position,
-							 futuremoves[piece][origin_square], false);
-	    }
-	}
+		int futurebase_cnt = 0;
 
-    }
-}
+		if (promotion_captures[pawn][captured_piece][promotion] < 0) continue;
 
-/* A "pawngen" futurebase is one that's identical to our own, except that it uses a different range
- * of pawngen indices.  Its local positions can just be copied into our own local position
- * structure, eliminating the need for the time-consuming translation function.
- */
+		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+		    if (tb->futurebase_matches_capture_promotion(futurebases[fbnum], captured_piece, promotion)) {
+			futurebase_cnt ++;
+		    }
+		}
 
-void propagate_moves_from_pawngen_futurebase(index_t future_index, int reflection)
-{
-    local_position_t foreign_position(futurebase);
-    local_position_t current_position(current_tb);
+		/* If no such futurebase exists, then there must be a prune statement, or it's an
+		 * error.
+		 */
 
-    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
-				  &foreign_position)) return;
+		if (futurebase_cnt == 0) {
+
+		    if (discarded_futuremoves[tb->pieces[pawn].color]
+			& FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion])) {
+			promotion_captures[pawn][captured_piece][promotion] = DISCARD_FUTUREMOVE;
+		    } else if (conceded_futuremoves[tb->pieces[pawn].color]
+			       & FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion])) {
+			promotion_captures[pawn][captured_piece][promotion] = CONCEDE_FUTUREMOVE;
+		    } else {
+			fatal("No futurebase or pruning for %s move %s\n",
+			      colors.at(tb->pieces[pawn].color).c_str(),
+			      movestr[tb->pieces[pawn].color][promotion_captures[pawn][captured_piece][promotion]]);
+			return false;
+		    }
 
-    if (future_index == debug_futuremove) {
-	info("normal backprop; reflection=%d\n", reflections[reflection]);
-    }
+		} else {
 
-    int pawngen_index = foreign_position.pawngen_index;
+		    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+			if (tb->futurebase_completely_handles_capture_promotion(futurebases[fbnum], pawn, captured_piece, promotion)) {
 
-    for (int piece = 0; piece < current_tb->num_pieces; piece ++) {
+			    if (futurebase_cnt > 1) {
+				fatal("Multiple futurebases handle %s move %s\n",
+				      colors.at(tb->pieces[pawn].color).c_str(),
+				      movestr[tb->pieces[pawn].color][promotion_captures[pawn][captured_piece][promotion]]);
+				return false;
+			    }
+			    if (promotion_captures[pawn][captured_piece][promotion] >= 0) {
+				handled_futuremoves[tb->pieces[pawn].color] |= FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion]);
+				promotion_captures[pawn][captured_piece][promotion] = HANDLED_FUTUREMOVE;
+			    }
+			    break;
+			}
+		    }
+		}
 
-	/* We only consider pawn moves, since they're the only things that change the pawngen index */
+	    }
+	}
 
-	if (current_tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+	/* straight promotion futurebases */
 
-	/* We've moving BACKWARDS in the game, so this has to be a piece of the player who is NOT TO
-	 * PLAY here - this is the LAST move we're considering, not the next move.
-	 */
+	for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-	if (current_tb->pieces[piece].color == foreign_position.side_to_move) continue;
+	    if (promotions[pawn][promotion] < 0) continue;
 
-	/* XXX big assumption here - that we can just copy a position from foreign to current */
-	current_position = foreign_position;
-	current_position.tb = current_tb;
-	current_position.flip_side_to_move();
+	    int futurebase_cnt = 0;
 
-	/* can we move the pawn backwards and get a position in this tablebase? */
+	    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+		if (tb->futurebase_matches_promotion(futurebases[fbnum], pawn, promotion)) {
+		    futurebase_cnt ++;
+		}
+	    }
 
-	int delta_pawngen_index = current_tb->pawngen->pawn_positions_by_index[pawngen_index].delta_pawngen_index[piece];
-	uint8_t prev_position = current_tb->pawngen->pawn_positions_by_index[pawngen_index].prev_position[piece];
+	    if (futurebase_cnt == 0) {
 
-	if (future_index == debug_futuremove) {
-	    info("pawngen backprop; delta_pawngen_index=%d; prev_position=%d\n", delta_pawngen_index, prev_position);
-	}
+		if (discarded_futuremoves[tb->pieces[pawn].color] & FUTUREVECTOR(promotions[pawn][promotion])) {
+		    promotions[pawn][promotion] = DISCARD_FUTUREMOVE;
+		} else if (conceded_futuremoves[tb->pieces[pawn].color] & FUTUREVECTOR(promotions[pawn][promotion])) {
+		    promotions[pawn][promotion] = CONCEDE_FUTUREMOVE;
+		} else {
+		    fatal("No futurebase or pruning for %s move %s\n",
+			  colors.at(tb->pieces[pawn].color).c_str(),
+			  movestr[tb->pieces[pawn].color][promotions[pawn][promotion]]);
+		    return false;
+		}
 
-	if ((prev_position != ILLEGAL_POSITION) && (! (current_position.board_vector & BITVECTOR(prev_position)))) {
-	    int new_pawngen_index = pawngen_index + delta_pawngen_index;
+	    } else {
 
-	    /* move_piece's pawngen optimization makes this quick */
-	    current_position.move_piece(piece, prev_position);
+		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+		    if (tb->futurebase_completely_handles_promotion(futurebases[fbnum], pawn, promotion)) {
 
-	    if ((new_pawngen_index >= current_tb->pawngen->start)
-		&& (new_pawngen_index < current_tb->pawngen->start + current_tb->pawngen->count)) {
-		/* back prop */
-		propagate_local_position_from_futurebase(current_position, foreign_position, HANDLED_FUTUREMOVE, false);
+			if (futurebase_cnt > 1) {
+			    fatal("Multiple futurebases handle %s move %s\n",
+				  colors.at(tb->pieces[pawn].color).c_str(),
+				  movestr[tb->pieces[pawn].color][promotions[pawn][promotion]]);
+			    return false;
+			}
+			if (promotions[pawn][promotion] >= 0) {
+			    handled_futuremoves[tb->pieces[pawn].color] |= FUTUREVECTOR(promotions[pawn][promotion]);
+			    promotions[pawn][promotion] = HANDLED_FUTUREMOVE;
+			}
+			break;
+		    }
+		}
 	    }
+	}
+    }
 
-	    /* is a double pawn move possible? */
-
-	    int delta_pawngen_index2 = current_tb->pawngen->pawn_positions_by_index[pawngen_index].delta_pawngen_index2[piece];
-	    int prev_position2 = current_tb->pawngen->pawn_positions_by_index[pawngen_index].prev_position2[piece];
+    /* Check for any futurebases that match our piece types exactly.  It (or they) must correspond
+     * to restricted piece movements.
+     */
 
-	    if (future_index == debug_futuremove) {
-		info("pawngen backprop; delta_pawngen_index2=%d; prev_position2=%d\n", delta_pawngen_index2, prev_position2);
-	    }
+    int futurebase_cnt = 0;
 
-	    if ((prev_position2 != ILLEGAL_POSITION) && (! (current_position.board_vector & BITVECTOR(prev_position2)))) {
-		int new2_pawngen_index = pawngen_index + delta_pawngen_index2;
+    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+	if (futurebases[fbnum].futurebase_type == FuturebaseType::Normal) {
+	    futurebase_cnt ++;
+	}
+    }
 
-		if ((new2_pawngen_index >= current_tb->pawngen->start)
-		    && (new2_pawngen_index < current_tb->pawngen->start + current_tb->pawngen->count)) {
+    /* I'd like to construct a mask of all allowable squares for each color and type of piece, and
+     * verify that the futurebases or pruning actually account for all possible restricted
+     * movements.  This would let me catch early things like forgetting to specify a g4 tablebase
+     * for a pawn frozen on g2.  For now, we only check for missing pruning if there are no "normal"
+     * futurebases at all.
+     */
 
-		    /* move_piece's pawngen optimization makes this quick */
-		    current_position.move_piece(piece, prev_position2);
+    if (futurebase_cnt == 0) {
+	for (int piece = 0; piece < tb->num_pieces; piece ++) {
+	    if ((! tb->encode_stm) && (tb->pieces[piece].color == PieceColor::Black)) continue;
+	    for (int sq = 0; sq < 64; sq ++) {
+		if (futuremoves[piece][sq] >= 0) {
 
-		    /* back prop */
-		    propagate_local_position_from_futurebase(current_position, foreign_position, HANDLED_FUTUREMOVE, false);
+		    if (! (pruned_futuremoves[tb->pieces[piece].color] & FUTUREVECTOR(futuremoves[piece][sq]))) {
+			fatal("No futurebase or pruning for %s move %s\n",
+			      colors.at(tb->pieces[piece].color).c_str(),
+			      movestr[tb->pieces[piece].color][futuremoves[piece][sq]]);
+			return false;
+		    }
 		}
 	    }
 	}
     }
+
+    return true;
 }
 
-/* Back propagates from all the futurebases.
- *
- * Should be called after the tablebase has been initialized, but before intra-table propagation.
- *
- * Runs through the parsed XML control file, pulls out all the futurebases, and back-propagates each
- * one.
+
+/* optimize_futuremoves()
  *
- * Returns true, or false if something went wrong
+ * Once we've assigned futuremove numbers, then gone and checked pruning, some of those futuremoves
+ * might now be completely pruned, and their numbers were changed to DISCARD_FUTUREMOVE,
+ * CONCEDE_FUTUREMOVE, RESIGN_FUTUREMOVE or HANDLED_FUTUREMOVE.  Find any unused numbers and
+ * collapse the remaining futuremoves down into a smaller set.
  */
 
-void back_propagate_futurebase_thread(void (* backprop_function)(index_t, int))
+void initialize_futuremoves(tablebase_t *tb)
 {
-    index_t future_index;
-    int reflection;
-    int i;
-
-    /* XXX We could limit the range of future_index here to only those positions where the promoted
-     * piece appears on the back rank, but watch out for reflection.
-     */
-
-    while ((future_index = futurebase->fetch_entry()) < futurebase->num_indices) {
+    for (int piece = 0; piece < tb->num_pieces; piece ++) {
 
-	for (i=0; i<futurebase_stride; i++) {
+	for (int piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
 
-	    if (future_index + i < futurebase->num_indices) {
+	    futurecaptures[piece][piece2] = NO_FUTUREMOVE;
 
-		/* It's tempting to break out the loop here if the position isn't a win, but we want
-		 * to track futuremoves in order to make sure we don't miss one, so the simplest way
-		 * to do that is to run this loop even for draws.
-		 */
+	    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+		promotion_captures[piece][piece2][promotion] = NO_FUTUREMOVE;
+	    }
+	}
 
-		mark_progress();
+	for (square_t sq = 0; sq < 64; sq ++) {
+	    futuremoves[piece][sq] = NO_FUTUREMOVE;
+	}
 
-		for (reflection = 0; reflection < max_reflection; reflection ++) {
-		    (*backprop_function)(future_index + i, reflection);
-		}
-	    }
+	for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+	    promotions[piece][promotion] = NO_FUTUREMOVE;
 	}
     }
 }
 
-bool back_propagate_all_futurebases(tablebase_t *tb) {
-
-    int fbnum;
-    void (* backprop_function)(index_t, int);
-
-    for (fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+/* Remove bit fm from a futurevector, shifting the bits above it down one.  Only used while we're
+ * assigning futuremoves, so it doesn't have to be fast.
+ */
 
-	futurebase = & futurebases[fbnum];
+void remove_futuremove(futurevector_t *fvp, int fm)
+{
+    futurevector_t fv = 0;
 
-	max_reflection = compute_reflections(tb, futurebase, reflections);
+    for (int bit = 0, new_bit = 0; bit < FUTUREVECTOR_BITS; bit ++) {
+	if (bit == fm) continue;
+	if (*fvp & FUTUREVECTOR(bit)) fv |= FUTUREVECTOR(new_bit);
+	new_bit ++;
+    }
 
-	next_future_index = 0;
-	backprop_function = nullptr;
+    *fvp = fv;
+}
 
-	switch (futurebase->futurebase_type) {
+void optimize_futuremoves(tablebase_t *tb)
+{
+    int fm, fm2, piece, piece2, sq, promotion;
 
-	case FuturebaseType::Capture:
+    for (auto color : BothColors) {
 
-	    if (fatal_errors == 0) {
-		backprop_function = &propagate_moves_from_capture_futurebase;
-		doing_capture_backprop = true;
-	    }
+	for (fm = 0; fm < (int) num_futuremoves[color]; fm++) {
 
-	    break;
+	    bool optimize_this_futuremove = true;
 
-	case FuturebaseType::Promotion:
+	    /* XXX make this a subroutine */
 
-	    if (fatal_errors == 0) {
+	    for (piece = 0; piece < tb->num_pieces; piece ++) {
 
-		promotion_color = tb->pieces[futurebase->missing_pawn].color;
-		first_back_rank_square = ((promotion_color == PieceColor::White) ? 56 : 0);
-		last_back_rank_square = ((promotion_color == PieceColor::White) ? 63 : 7);
-		promotion_move = ((promotion_color == PieceColor::White) ? 8 : -8);
+		if (tb->pieces[piece].color != color) continue;
 
-		backprop_function = &propagate_moves_from_promotion_futurebase;
-		doing_capture_backprop = false;
+		for (piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
+		    if (futurecaptures[piece][piece2] == fm) {
+			optimize_this_futuremove = false;
+			break;
+		    }
+		    if (tb->pieces[piece].piece_type == PieceType::Pawn) {
+			for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+			    if (promotion_captures[piece][piece2][promotion] == fm) {
+				optimize_this_futuremove = false;
+				break;
+			    }
+			}
+		    }
+		}
+		for (sq = 0; sq < 64; sq ++) {
+		    if (futuremoves[piece][sq] == fm) {
+			optimize_this_futuremove = false;
+			break;
+		    }
+		}
+		if (tb->pieces[piece].piece_type == PieceType::Pawn) {
+		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+			if (promotions[piece][promotion] == fm) {
+			    optimize_this_futuremove = false;
+			    break;
+			}
+		    }
+		}
 	    }
 
-	    break;
 
-	case FuturebaseType::CapturePromotion:
+	    if (optimize_this_futuremove) {
+
+		for (piece = 0; piece < tb->num_pieces; piece ++) {
 
-	    if (fatal_errors == 0) {
+		    if (tb->pieces[piece].color == color) {
 
-		promotion_color = tb->pieces[futurebase->missing_pawn].color;
-		first_back_rank_square = ((promotion_color == PieceColor::White) ? 56 : 0);
-		last_back_rank_square = ((promotion_color == PieceColor::White) ? 63 : 7);
-		promotion_move = ((promotion_color == PieceColor::White) ? 8 : -8);
+			for (piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
+			    if (futurecaptures[piece][piece2] > fm) {
+				futurecaptures[piece][piece2] --;
+			    }
+			    if (tb->pieces[piece].piece_type == PieceType::Pawn) {
+				for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+				    if (promotion_captures[piece][piece2][promotion] > fm) {
+					promotion_captures[piece][piece2][promotion] --;
+				    }
+				}
+			    }
+			}
 
-		backprop_function = &propagate_moves_from_promotion_capture_futurebase;
-		doing_capture_backprop = true;
-	    }
+			for (sq = 0; sq < 64; sq ++) {
+			    if (futuremoves[piece][sq] > fm) {
+				futuremoves[piece][sq] --;
+			    }
+			}
 
-	    break;
+			if (tb->pieces[piece].piece_type == PieceType::Pawn) {
+			    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+				if (promotions[piece][promotion] > fm) {
+				    promotions[piece][promotion] --;
+				}
+			    }
+			}
+		    }
+		}
 
-	case FuturebaseType::Normal:
+		if (pruned_futuremoves[color] & FUTUREVECTOR(fm)) {
+		    info("Pruned %s futuremove %s\n", colors.at(color).c_str(), movestr[color][fm]);
+		} else if (handled_futuremoves[color] & FUTUREVECTOR(fm)) {
+		    info("%s futuremove %s completely handled by futurebases\n", colors.at(color).c_str(), movestr[color][fm]);
+		} else {
+		    info("Optimized %s futuremove %s, but not sure how!\n", colors.at(color).c_str(), movestr[color][fm]);
+		}
 
-	    if (fatal_errors == 0) {
-		backprop_function = propagate_moves_from_normal_futurebase;
-		doing_capture_backprop = false;
-	    }
+		remove_futuremove(&(pruned_futuremoves[color]), fm);
+		remove_futuremove(&(unpruned_futuremoves[color]), fm);
+		remove_futuremove(&(conceded_futuremoves[color]), fm);
+		remove_futuremove(&(discarded_futuremoves[color]), fm);
+		remove_futuremove(&(handled_futuremoves[color]), fm);
 
-	    break;
+		// free(movestr[color][fm]);
 
-	case FuturebaseType::Pawngen:
+		for (fm2 = fm + 1; fm2 < (int) num_futuremoves[color]; fm2++) {
+		    movestr[color][fm2-1] = movestr[color][fm2];
+		}
 
-	    if (fatal_errors == 0) {
-		backprop_function = propagate_moves_from_pawngen_futurebase;
-		doing_capture_backprop = false;
+		num_futuremoves[color] --;
+		fm --;
 	    }
+	}
+    }
+}
 
-	    break;
+/***** INTRA-TABLE MOVE PROPAGATION *****/
 
-	default:
+/* The positions that a single position back propagates into are scattered all over the entries
+ * table, so each update is usually a cache miss, and if we apply them one at a time as we generate
+ * them, we wait for each miss in turn.  Instead, we collect all the updates from a position (both
+ * reflections, if there are two), prefetching each entry as we go, and apply them once we're done
+ * generating moves, by which time most of the cache lines should have arrived.
+ *
+ * Proptable runs don't touch the entries table here, so their updates go straight through.
+ */
 
-	    fatal("Unknown back propagation type for futurebase '%s'\n", futurebase->filename.c_str());
-	    break;
+class intra_table_update_batch {
 
-	}
+    static const unsigned int capacity = 256;
 
-	if (backprop_function) {
+    struct update {
+	index_t index;
+	short dtm;
+    };
 
-	    std::thread t[num_threads];
-	    unsigned int thread;
+    update updates[capacity];
+    unsigned int count = 0;
 
-	    std::string status_message("Back propagating (");
-	    status_message += futurebase_types[futurebase->futurebase_type];
-	    status_message += ") from '";
-	    status_message += futurebase->filename;
-	    status_message += "'";
+ public:
 
-	    reset_progress_indicator(status_message.c_str(), futurebase->num_indices);
+    void add(index_t index, short dtm) {
+	if (using_proptables) {
+	    commit_update(index, dtm, 1, NO_FUTUREMOVE);
+	    return;
+	}
 
-	    for (thread = 0; thread < num_threads; thread ++) {
-		t[thread] = std::thread(back_propagate_futurebase_thread, backprop_function);
-	    }
+	if (count == capacity) flush();
 
-	    for (thread = 0; thread < num_threads; thread ++) {
-		t[thread].join();
-	    }
+	entriesTable->prefetch(index);
+	updates[count].index = index;
+	updates[count].dtm = dtm;
+	count ++;
+    }
 
-	    end_progress_indicator();
+    void flush(void) {
+	for (unsigned int i = 0; i < count; i ++) {
+	    commit_update(updates[i].index, updates[i].dtm, 1, NO_FUTUREMOVE);
 	}
+	count = 0;
     }
+};
 
-    return (fatal_errors == 0);
-}
+thread_local intra_table_update_batch intra_table_updates;
 
-/***** PRUNING *****/
+void flush_intra_table_updates(void)
+{
+    intra_table_updates.flush();
+}
 
-/* If we don't want to fully analyze out the tree past the table we're now building, we prune some
- * possible futuremoves.  Of course, this will affect the accuracy of the table; the table is a
- * result of BOTH the position it was set up for AND the pruning decisions (and any pruning
- * decisions made on the futurebases used to calculate this one).
- *
- * We specify pruning in a simple way - by omitting future tables for moves we don't want to
- * consider.  This can be dangerous, so we require this feature to be specifically enabled.  There
- * are two possibilities: moves can be DISCARDED, or victory can be CONCEDED to the side that makes
- * the move.
- *
- * So, if we are white, and assuming that this is a table with a frozen white pawn on e3, we can
- * prune by simply ignoring Pe4 as a possible move.  If there is a black pawn on the g-file, and we
- * don't want to compute out what happens after it queens, we can prune by conceding Pg1=X as a win
- * for black.
- *
- * For example, let's say we're looking at a Q-and-P vs. Q-and-P endgame.  There are four completely
- * mobile pieces (2 Ks and 2 Qs), and this is easy.  But if one of the pawns queens, then we've got
- * a more complex game with five mobile pieces.  But we don't want to completely discard all
- * possible enemy promotions, if we can immediately capture the new queen.  So we construct a
- * special tablebase with a queen frozen on the queening square, concede any move by that queen as a
- * win, then use it as a futurebase.
- *
- * And finally, we want to label in the file header that this pruning was done.  In particular, if
- * we use a pruned tablebase to compute another (earlier) pruned tablebase, we want to make sure the
- * pruning is consistent, i.e. "our" side has to stay the same.  This is guaranteed by explicitly
- * flagging in the XML header which sides can be pruned in which way (concede or discard).
+/* We've got a move that needs to be propagated, so we back out one half-move to all of the
+ * positions that could have gotten us here and update their counters in various obscure ways.
  */
 
-bool all_futuremoves_handled = true;
-
-/* finalize_futuremove()
- *
- * After all futurebase backpropagation is done, this function is called on each legal position to
- * check if there are any futuremoves that weren't handled by the futurebases.  If so, we either
- * complain or prune, depending on how we're configured.  We don't use commit_update(), and instead
- * call finalize_update() directly, because we're making a pass through the entries array to call
- * finalize_futuremove(), and can thus update the entry directly, without going through a proptable.
- */
+template <typename Encoding>
+void propagate_one_minimove_within_table(tablebase_t *tb, index_t future_index, local_position_t *current_position)
+{
+    index_t current_index;
+    int dtm = entriesTable[future_index].get_DTM();
 
-void finalize_futuremove(tablebase_t *tb, index_t index, futurevector_t futurevector) {
+    current_index = local_position_to_index<Encoding>(tb, current_position);
 
-    unsigned int futuremove;
-    PieceColor stm = index_to_side_to_move(tb, index);
+    if (current_index == INVALID_INDEX) {
 
-    if (futurevector & unpruned_futuremoves[stm]) {
-	global_position_t global;
-	index_to_global_position(tb, index, &global);
-	fatal("Futuremoves not handled: %" PRIindex " %s", index, global_position_to_FEN(&global));
-	for (futuremove = 0; futuremove < num_futuremoves[stm]; futuremove ++) {
-	    if (futurevector & FUTUREVECTOR(futuremove)	& unpruned_futuremoves[stm]) {
-		fatal(" %s", movestr[stm][futuremove]);
-	    }
+	if (future_index == debug_move) {
+	    info("propagate_one_minimove_within_table:  current_index=INVALID"
+		 "; future_index=%" PRIindex "; dtm=%d\n",
+		 future_index, dtm);
 	}
-	fatal("\n");
-	all_futuremoves_handled = false;
-    }
 
-    /* concede - we treat these unhandled futuremoves as forced wins for PTM.  We update the entry
-     * with DTM=2 (mate in one) and movecnt=1 (doesn't matter for a PTM win).
-     */
+	return;
+    }
 
-    if (futurevector & conceded_futuremoves[stm]) {
-	finalize_update(index, 2, 1, NO_FUTUREMOVE);
+    if ((current_index == debug_move) || (future_index == debug_move)) {
+	info("propagate_one_minimove_within_table:  current_index=%"
+	     PRIindex "; future_index=%" PRIindex "; dtm=%d\n",
+	     current_index, future_index, dtm);
     }
 
-    /* discard - we ignore these unhandled futuremoves by updating with DTM=0, which decrements
-     * movecnt by position.multiplicity, because we multiplied movecnt by position.multiplicity when
-     * we initialized the entry.
+    /* Parent position is the FUTURE position.  We now back-propagate to
+     * the current position, which is the PAST position.
      *
-     * XXX Can't test the use of position.multiplicity because we currently can't have piece
-     * restrictions with symmetric tablebases, we need 8-way symmetry to get multiplicity, and we
-     * need piece restrictions to get a futurebase where only some futuremoves are handled.
+     * If the player to move in the FUTURE position wins, then we add one to that
+     * player's win count in the PAST position.  On other other hand, if the player not
+     * to move in the FUTURE position wins, then the player to move in the PAST position
+     * has a winning move (the one we're considering).
      */
 
-    if (futurevector & discarded_futuremoves[stm]) {
-	for (futuremove = 0; futuremove < num_futuremoves[stm]; futuremove ++) {
-	    if (futurevector & FUTUREVECTOR(futuremove) & discarded_futuremoves[stm]) {
-
-		local_position_t position(tb);
-
-		index_to_local_position(tb, index, REFLECTION_NONE, &position);
-
-		finalize_update(index, 0, position.multiplicity, NO_FUTUREMOVE);
-	    }
-	}
+    if (dtm > 0) {
+	intra_table_updates.add(current_index, -dtm);
+    } else if (dtm < 0) {
+	intra_table_updates.add(current_index, -dtm+1);
+    } else if (entriesTable[future_index].does_PTM_win()) {
+	intra_table_updates.add(current_index, -2);
+    } else if (entriesTable[future_index].does_PNTM_win()) {
+	intra_table_updates.add(current_index, 2);
+    } else {
+	fatal("Intra-table back prop doesn't match dtm or movecnt\n");
     }
 }
 
-/* have_all_futuremoves_been_handled() - this is the non-proptable case to run through the entries
- * table and call finalize_futuremove()
- */
+template <typename Encoding>
+void propagate_one_move_within_table(tablebase_t *tb, index_t future_index, local_position_t *position)
+{
+    int piece;
 
-bool have_all_futuremoves_been_handled(tablebase_t *tb) {
+    propagate_one_minimove_within_table<Encoding>(tb, future_index, position);
 
-    if (ignore_futurevectors) return true;
+    /* En passant:
+     *
+     * We should never enter this function with en-passant set.
+     *
+     * However, we may need to consider a bunch of additional positions here that are identical to
+     * the base position except that a single one of the pawns on the fourth or fifth ranks was
+     * capturable en passant.  Those positions are identical to the base position except that one
+     * extra en passant capture is possible.  Since this is intra-table, we don't do captures.  Just
+     * back-prop into any extra en passant positions that might exist.
+     */
 
-    if (tb->futurevector_bits == 0) return true;
+    if (position->en_passant_square != ILLEGAL_POSITION) {
+	fatal("position->en_passant_square != ILLEGAL_POSITION in propagate_one_move_within_table()\n");
+    }
 
-    index_t index;
+    for (piece = 0; piece < tb->num_pieces; piece ++) {
 
-    /* XXX this code is probably inefficient, and though it appears to assume a little-endian
-     * architecture, I've tried to do it the same way everywhere, so I think it should work no
-     * matter the endianness.  Might have alignment problems, though.
-     */
+	if (tb->pieces[piece].color == position->side_to_move) continue;
+	if (tb->pieces[piece].piece_type != PieceType::Pawn) continue;
 
-    for (index = 0; index < tb->num_indices; index ++) {
-	if (entriesTable[index].get_DTM() != 1) {
-	    long long bit_offset = ((long long)index * current_tb->futurevector_bits);
-	    futurevector_t futurevector = *((futurevector_t *)(current_tb->futurevectors + (bit_offset >> 3)));
+	/* I've taken care to update board_vector in the routine that calls here specifically so we
+	 * can check for en passant legality here.
+	 */
 
-	    futurevector >>= bit_offset & 7;
-	    futurevector &= (1 << current_tb->futurevector_bits) - 1;
-	    finalize_futuremove(tb, index, futurevector);
+	if ((tb->pieces[piece].color == PieceColor::White)
+	    && (ROW(position->piece_position[piece]) == 3)
+	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] - 8))
+	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] - 16))) {
+	    position->set_en_passant_square(position->piece_position[piece] - 8);
+	    propagate_one_minimove_within_table<Encoding>(tb, future_index, position);
 	}
-    }
 
-    return all_futuremoves_handled;
+	if ((tb->pieces[piece].color == PieceColor::Black)
+	    && (ROW(position->piece_position[piece]) == 4)
+	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] + 8))
+	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] + 16))) {
+	    position->set_en_passant_square(position->piece_position[piece] + 8);
+	    propagate_one_minimove_within_table<Encoding>(tb, future_index, position);
+	}
+
+	position->clear_en_passant_square();
+    }
 }
 
-/* assign_pruning_statement() - a helper function for compute_pruned_futuremoves()
- *
- * searches the tablebase's XML pruning statements for one matching (more or less identically) the
- * specified color and string.  If there is a match, set the corresponding bit in the
- * pruned_futuremoves bit vector.  The function can be called more than once for a given bit, but
- * probably shouldn't be.  For example, the function might be called on the same bit for "PxQ=Q" if
- * there are two pawns that can promote into a queen.  UNIX-style wildcards are allowed, so "Kd4"
- * would match against "Kd4", "Kd?", "K?4", "K[a-d]4", or "K*".  The function also allows a trailing
- * "any" in the prune statement to act as a "*" wildcard for backwards compatibility.
+/* back_propagate_index_within_table()
  *
- * If there are multiple prune statements that match a given futuremove, it's a warning if they are
- * of the same type; a fatal error if their types are different.
+ * Once the final status of an index has been determined, this function back propagates all moves
+ * (within the tablebase) from the corresponding position.
  */
 
-int match_pruning_statement(tablebase_t *tb, PieceColor color, const char *pruning_statement)
+template <typename Encoding>
+void back_propagate_index_within_table(index_t index, int reflection)
 {
-    xmlpp::NodeSet result;
-    int type = RESTRICTION_NONE;
-
-    result = tb->xml->get_root_node()->find("//prune");
-
-    for (auto prune = result.begin(); prune != result.end(); prune ++) {
+    local_position_t position(current_tb);
 
-	Glib::ustring prune_color = (*prune)->eval_to_string("@color");
-	Glib::ustring prune_move = (*prune)->eval_to_string("@move");
-	Glib::ustring prune_type = (*prune)->eval_to_string("@type");
+    /* This can fail if the reflection isn't valid for this index */
 
-	/* Trailing 'any' is an older syntax that means '*' */
+    if (! index_to_local_position<Encoding>(current_tb, index, reflection, &position)) {
 
-	auto pos = prune_move.find("any");
-	if (pos != std::string::npos) {
-	    prune_move.replace(pos, std::string::npos, "*");
+	if (index == debug_move) {
+	    info("back_propagate_index_within_table; index=%" PRIindex "; reflection %d; INVALID\n",
+		 index, reflection);
 	}
 
-	if ((colors.at(prune_color) == color)
-	    && (fnmatch(prune_move.c_str(), pruning_statement, FNM_CASEFOLD) == 0)) {
-
-	    if (type == RESTRICTION_NONE) {
-		type = restriction_types.at(prune_type);
-	    } else if (type != restriction_types.at(prune_type)) {
-		fatal("Conflicting %s pruning statements match futuremove %s\n",
-		      colors.at(color).c_str(), pruning_statement);
-	    } else {
-		warning("Multiple %s pruning statements match futuremove %s\n",
-			colors.at(color).c_str(), pruning_statement);
-	    }
-	}
+	return;
     }
 
-    return type;
-}
+    if (index == debug_move) {
+	info("back_propagate_index_within_table; index=%" PRIindex "; reflection %d\n", index, reflection);
+    }
 
-void assign_pruning_statement(tablebase_t *tb, PieceColor color, int futuremove)
-{
-    int type;
-    const char * pruning_statement = movestr[color][futuremove];
+    position.flip_side_to_move();
 
-    if (futuremove == -1) return;
+    /* If there are any en passant capturable pawns in the position, then the last move had to
+     * have been a pawn move.  In fact, in this case, we already know exactly what the last move
+     * had to have been.
+     */
 
-    pruning_statement = movestr[color][futuremove];
+    if (position.en_passant_square != ILLEGAL_POSITION) {
 
-    type = match_pruning_statement(tb, color, pruning_statement);
+	int en_passant_pawn = -1;
 
-    if (type != RESTRICTION_NONE) {
+	/* XXX let's store en_passant_pawn in the local position structure and avoid this loop */
 
-	if (pruned_futuremoves[color] & FUTUREVECTOR(futuremove)) {
-	    warning("Multiple pruning statements ('%s') match a futuremove\n", pruning_statement);
-	}
+	for (int piece = 0; piece < current_tb->num_pieces; piece++) {
 
-	pruned_futuremoves[color] |= FUTUREVECTOR(futuremove);
+	    if (current_tb->pieces[piece].color != position.side_to_move) continue;
+	    if (current_tb->pieces[piece].piece_type != PieceType::Pawn) continue;
 
-	if (type == RESTRICTION_CONCEDE) {
-	    conceded_futuremoves[color] |= FUTUREVECTOR(futuremove);
-	    if (discarded_futuremoves[color] & FUTUREVECTOR(futuremove)) {
-		fatal("Conflicting pruning statements ('%s') match a futuremove\n",
-		      pruning_statement);
+	    if (((current_tb->pieces[piece].color == PieceColor::White)
+		 && (position.piece_position[piece] - 8 == position.en_passant_square))
+		|| ((current_tb->pieces[piece].color == PieceColor::Black)
+		    && (position.piece_position[piece] + 8 == position.en_passant_square))) {
+		if (en_passant_pawn != -1) fatal("Two en passant pawns in back prop?!\n");
+		en_passant_pawn = piece;
 	    }
 	}
-	if (type == RESTRICTION_DISCARD) {
-	    discarded_futuremoves[color] |= FUTUREVECTOR(futuremove);
-	    if (conceded_futuremoves[color] & FUTUREVECTOR(futuremove)) {
-		fatal("Conflicting pruning statements ('%s') match a futuremove\n",
-		      pruning_statement);
+	if (en_passant_pawn == -1) {
+	    fatal("No en passant pawn in back prop!?\n");
+	} else {
+
+	    int square;
+
+	    if (current_tb->pieces[en_passant_pawn].color == PieceColor::White)
+		square = position.piece_position[en_passant_pawn] - 16;
+	    else
+		square = position.piece_position[en_passant_pawn] + 16;
+
+	    /* We never back out into a restricted position.  Since we've already decided that this
+	     * is the only legal back-move from this point, well...
+	     */
+
+	    if (! (current_tb->pieces[en_passant_pawn].semilegal_squares & BITVECTOR(square))) {
+		return;
 	    }
-	}
-    }
-}
 
-/* assign_numbers_to_futuremoves()
- *
- * We could just dismiss any moves that aren't handled by our futurebases, but I've found this to be
- * a source of error, since moves tend to get overlooked this way.  We're also concerned with the
- * more sobering possibility of a single move getting processed twice by two different futurebases.
- *
- * So we assign numbers, bit positions in a bit vector, actually, to each futuremove.  When we
- * initialize the tablebase, we set bits in the vector (each position has its own vector) for each
- * futuremove possible from that position.  As we back propagate futuremoves, we check the bit to
- * make sure it's still set, then clear it.  After we've back propagated all the futurebases, we run
- * through the entire tablebase, making sure that the only bits that remain set correspond to prune
- * statements.
- *
- * This function not only assigns the numbers, but also prints an identifying string, such as "KxP"
- * or "Re4", into the movestr array for each number assigned.  This string will then be matched
- * against the pruning statements specified in the configuration file.  Sometimes the strings will
- * repeat.  For example, if we have two pawns and an enemy queen, we'll probably end up with two
- * different bit positions, both assigned as "QxP".  The reason is that there are probably positions
- * where the queen could take either pawn, so both possibilities have to be tracked.
- *
- * Because we need a "futurevector" for each position in the tablebase, we want to keep it as small
- * as possible, so we try to use as few bit positions as possible.  In particular, we track white
- * and black futuremoves seperately (since from a given position only one or the other will be
- * possible) and we try to reuse bit positions for pawn capture-promotions if the pawns are
- * sufficiently restricted so that only one or the other could capture the enemy piece in a given
- * position.
- */
+	    local_position_t new_position = position;
 
-void assign_numbers_to_futuremoves(tablebase_t *tb) {
+	    new_position.clear_en_passant_square();
 
-    int piece;
-    int captured_piece;
-    int capturing_piece;
-    int sq;
-    int promotion;
-    uint64_t possible_captures[MAX_PIECES];
-    char local_movestr[MOVESTR_CHARS];
-    int futurebase_cnt;
-    int fbnum;
+	    new_position.move_piece<Encoding>(en_passant_pawn, square);
 
-    /* Start by computing a board vector (possible_captures) showing all possible squares where each
-     * piece can capture onto.
-     */
+	    propagate_one_move_within_table<Encoding>(current_tb, index, &new_position);
+	}
 
-    for (piece = 0; piece < tb->num_pieces; piece ++) {
+	return;
+    }
 
-	possible_captures[piece] = 0;
+    /* foreach (mobile piece of player NOT TO PLAY) { */
 
-	for (sq = 0; sq < 64; sq ++) {
+    for (int piece = 0; piece < current_tb->num_pieces; piece++) {
 
-	    /* We make the checks here using legal_squares and not semilegal_squares because
-	     * we're assigning futuremove numbers to individual pieces that can capture.  The
-	     * movements we consider here, being captures, would take us to a futurebase anyway,
-	     * so there's no question of whether the resulting position is fully legal or not.
-	     */
+	/* We've moving BACKWARDS in the game, so we want the pieces of the player who is NOT TO
+	 * PLAY here - this is the LAST move we're considering, not the next move.
+	 */
 
-	    if (tb->pieces[piece].legal_squares & BITVECTOR(sq)) {
+	if (current_tb->pieces[piece].color != position.side_to_move)
+	    continue;
 
-		for (auto &dir : movements(current_tb->pieces[piece].piece_type,
-					   current_tb->pieces[piece].color,
-					   sq,
-					   Movement::Forward, Movement::Capture)) {
+	square_t origin_square = position.piece_position[piece];
 
-		    for (auto &movement : dir) {
+	for (auto &dir : movements(current_tb->pieces[piece].piece_type,
+				   current_tb->pieces[piece].color,
+				   origin_square,
+				   Movement::Backward, Movement::NonCapture)) {
 
-			possible_captures[piece] |= BITVECTOR(movement);
+	    /* What about captures?  Well, first of all, there are no captures here!  We're moving
+	     * BACKWARDS in the game... and pieces don't appear out of thin air.  Captures are
+	     * handled by back-propagation from futurebases, not here in the movement code.  The
+	     * piece moving had to come from somewhere, and that somewhere will now be an empty
+	     * square, so once we've hit another piece along a movement vector, there's absolutely
+	     * no need to consider anything further.
+	     */
 
-			/* If we hit a frozen piece, then this movement direction ends here */
-			if (BITVECTOR(movement) & tb->frozen_pieces_vector) break;
-		    }
-		}
-	    }
-	}
-    }
+	    for (auto &movement : dir) {
 
-    /* Now, consider all possible pairs of pieces that might capture, and assign a number (in the
-     * futurecaptures array) to each pair.  We'll ultimately use this number as an index into a bit
-     * vector to determine if this capture has been handled in any particular position.  However,
-     * there's a common enough "special" case: the two pieces are frozen (or at least sufficiently
-     * restricted) so that the capture can never occur.  Go to the trouble of checking for this.
-     */
+		if ((position.board_vector & BITVECTOR(movement)) != 0) break;
 
-    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+		/* We never back out into a restricted position (obviously) */
 
-	if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
+		if (! (current_tb->pieces[piece].semilegal_squares & BITVECTOR(movement))) continue;
 
-	for (capturing_piece = 0; capturing_piece < tb->num_pieces; capturing_piece ++) {
+		/* Back stepping a half move here involves several things: flipping the side-to-move
+		 * flag, clearing any en passant pawns into regular pawns, moving the piece
+		 * (backwards), and considering a bunch of additional positions identical to the
+		 * base position except that a single one of the pawns on the fourth or fifth ranks
+		 * was capturable en passant.
+		 *
+		 * En passant.
+		 *
+		 * The only way we could have gotten an en passant pawn is if THIS MOVE created it.
+		 * We handle that as a special case above, so we shouldn't have to worry about
+		 * clearing en passant pawns here - there should be none.
+		 *
+		 * However, we may be considering a position without en passant set, but from which
+		 * a backwards double pawn move is possible.  We want to know if it has a matching
+		 * position with en passant set.  If so, we do nothing here, since the double pawn
+		 * move will be handled by the en passant code above.  If not, we process the double
+		 * pawn move here.
+		 *
+		 * Checking additional en passant positions is taken care of in
+		 * propagate_one_move_within_table()
+		 */
 
-	    /* If this is a suicide analysis and we can capture a player's only (i.e, last) piece,
-	     * we lose.  Treat this just like a 'resign' prune, except that we don't need prune or
-	     * prune-enable statements, since these are the rules of the game!
-	     */
+		if ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
+		    && (abs(movement - origin_square) == 16)) {
 
-	    if ((tb->variant == Variant::Suicide) && (tb->num_pieces_by_color[tb->pieces[captured_piece].color] == 1)) {
+		    local_position_t new_position = position;
 
-		futurecaptures[capturing_piece][captured_piece] = RESIGN_FUTUREMOVE;
+		    if (new_position.side_to_move == PieceColor::White) {
+			new_position.set_en_passant_square(origin_square - 8);
+		    } else {
+			new_position.set_en_passant_square(origin_square + 8);
+		    }
+		    new_position.flip_side_to_move();
 
-		for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-		    promotion_captures[capturing_piece][captured_piece][promotion] = RESIGN_FUTUREMOVE;
+		    bool en_passant_position_exists = (local_position_to_index<Encoding>(current_tb, &new_position) != INVALID_INDEX);
+
+		    if (en_passant_position_exists) continue;
 		}
 
-		continue;
-	    }
+		local_position_t new_position = position;
 
-	    futurecaptures[capturing_piece][captured_piece] = NO_FUTUREMOVE;
+		new_position.move_piece<Encoding>(piece, movement);
 
-	    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-		promotion_captures[capturing_piece][captured_piece][promotion] = NO_FUTUREMOVE;
+		propagate_one_move_within_table<Encoding>(current_tb, index, &new_position);
 	    }
+	}
 
-	    if (tb->pieces[capturing_piece].color == tb->pieces[captured_piece].color) continue;
+    }
+}
 
-	    if (tb->pieces[capturing_piece].piece_type != PieceType::Pawn) {
+/* Back propagation is the hottest code we've got, so dispatch to a copy of it specialized for the
+ * tablebase's index encoding, saving a virtual call in every position_to_index().
+ */
+
+struct back_propagate_within_table {
+    index_t index;
+    int reflection;
+
+    template <typename Encoding>
+    void operator()(void) const {
+	back_propagate_index_within_table<Encoding>(index, reflection);
+    }
+};
 
-		if (possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares) {
+void back_propagate_index_within_table(index_t index, int reflection)
+{
+    dispatch_on_encoding(current_tb, back_propagate_within_table{index, reflection});
+}
 
-		    sprintf(local_movestr, "%cx%c",
-			    piece_char[tb->pieces[capturing_piece].piece_type],
-			    piece_char[tb->pieces[captured_piece].piece_type]);
+/* In-check tests
+ *
+ * We use board masks for quickly testing a position to see if we're in check.
+ *
+ * The test works by indexing an array by piece type, piece square, and king square, which returns a
+ * mask that is ANDed with the board mask.  If the result is non-zero, then no capture is possible.
+ * If the result is zero, then the king's in check from that piece.  For sliding piece attacks, we
+ * use a mask with ones along the path between the two squares.  For positions where capture is
+ * always possible, we use a zero mask.  For positions where no capture is possible, we use an
+ * all-1s mask.
+ *
+ * We segregate pawn checks by color; they are a special case.
+ *
+ * sizeof(board_mask) = 196608, so this array should fit in your average L2 cache (mine is 2 MB)
+ *
+ * These tables used to be std::maps keyed on piece type and color, which put a tree search in
+ * front of every mask we looked up, and this is one of the hottest loops in the program.  Now
+ * they're flat arrays that we can index with the enums directly.
+ *
+ * XXX could use this to speed up the global_* routines, but none of them are used during
+ * generation, so they're not as important.
+ */
 
-		    movestr[tb->pieces[capturing_piece].color]
-			[num_futuremoves[tb->pieces[capturing_piece].color]]
-			= strdup(local_movestr);
+template<typename E, typename T, int N>
+class enum_indexed_array {
+    T array[N];
+public:
+    inline T & operator[](E e)			{ return array[static_cast<int>(e)]; }
+    inline const T & operator[](E e) const	{ return array[static_cast<int>(e)]; }
+};
 
-		    futurecaptures[capturing_piece][captured_piece]
-			= num_futuremoves[tb->pieces[capturing_piece].color] ++;
-		}
+enum_indexed_array<PieceType, uint64_t[64][64], 6> board_mask;
+enum_indexed_array<PieceColor, bool[64][64], 2> pawn_board_mask;
 
-	    } else {
+void initialize_board_masks(void)
+{
+    /* Initialize entire array with ALL_ONES_BITVECTOR */
+    for (square_t A = 0; A < 64; A ++) {
+	for (square_t B = 0; B < 64; B ++) {
+	    for (auto piece : AllPieceTypes) {
+		board_mask[piece][A][B] = ALL_ONES_BITVECTOR;
+	    }
+	    for (auto color : BothColors) {
+		pawn_board_mask[color][A][B] = false;
+	    }
+	}
+    }
 
-		/* if it's a pawn-takes-pawn situation, check for en passant as well */
+    for (int piece_square = 0; piece_square < 64; piece_square ++) {
 
-		if ((possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares)
-		    | ((tb->pieces[captured_piece].piece_type == PieceType::Pawn)
-		       && (((tb->pieces[capturing_piece].color == PieceColor::White)
-			    ? ((possible_captures[capturing_piece] & 0x0000ff0000000000LL) >> 8)
-			    : ((possible_captures[capturing_piece] & 0x0000000000ff0000LL) << 8))
-			   & tb->pieces[captured_piece].legal_squares))) {
+	for (auto piece : AllPieceTypes) {
 
-		    int candidate_futuremove = NO_FUTUREMOVE;
+	    if (piece != PieceType::Pawn) {
 
-		    /* start by dishing out a non-promotion futurecapture */
+		for (auto &dir : movements(piece, PieceColor::White,
+					   piece_square,
+					   Movement::Forward, Movement::Capture)) {
 
-		    sprintf(local_movestr, "%cx%c",
-			    piece_char[tb->pieces[capturing_piece].piece_type],
-			    piece_char[tb->pieces[captured_piece].piece_type]);
+		    uint64_t mask = 0;
 
-		    movestr[tb->pieces[capturing_piece].color]
-			[num_futuremoves[tb->pieces[capturing_piece].color]]
-			= strdup(local_movestr);
+		    for (auto &movement : dir) {
 
-		    futurecaptures[capturing_piece][captured_piece]
-			= num_futuremoves[tb->pieces[capturing_piece].color] ++;
+			board_mask[piece][piece_square][movement] = mask;
 
-		    /* Keep going only if it's a pawn capture that results in promotion */
+			mask |= BITVECTOR(movement);
 
-		    if (! (possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares
-			   & ((tb->pieces[capturing_piece].color == PieceColor::White)
-			      ? 0xff00000000000000LL : 0x00000000000000ffLL))) {
-			continue;
 		    }
+		}
 
-		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-
-			candidate_futuremove = NO_FUTUREMOVE;
+	    } else {
 
-			sprintf(local_movestr, "Px%c=%c",
-				piece_char[tb->pieces[captured_piece].piece_type],
-				piece_char[promoted_pieces[promotion]]);
+		for (auto color : BothColors) {
 
-			/* Be conservative about handing out bit positions in the futurevector.
-			 * Look through the other pieces that have been assigned bit positions and
-			 * see if we can find one with an identical movestr that can never capture
-			 * onto the squares that our piece can capture onto and reuse its bit
-			 * positions.
-			 *
-			 * This code could be a lot more aggressively conservative, but for now I
-			 * settle for handling the common simple case of pawns more than two files
-			 * apart never being able to capture the same piece.  I only look at
-			 * futuremoves for the current captured_piece, and only so far as the
-			 * current capturing_piece.  That's why the nesting order of the two
-			 * captured_piece and capturing_piece loops is important above.  First we
-			 * look for a candidate futuremove, then we try to bust it by looking for
-			 * overlaps.
-			 */
+		    for (auto &dir : movements(piece, color,
+					       piece_square,
+					       Movement::Forward, Movement::Capture)) {
 
-			for (piece = 0; piece < capturing_piece; piece ++) {
-			    if (tb->pieces[piece].color != tb->pieces[capturing_piece].color) continue;
-			    if (promotion_captures[piece][captured_piece][promotion] != NO_FUTUREMOVE) {
-				if ((! (possible_captures[capturing_piece] & possible_captures[piece]))
-				    && (! strcmp(local_movestr, movestr[tb->pieces[piece].color][promotion_captures[piece][captured_piece][promotion]]))) {
-				    candidate_futuremove = promotion_captures[piece][captured_piece][promotion];
-				}
-			    }
-			}
+			for (auto &movement : dir) {
 
-			if (candidate_futuremove != NO_FUTUREMOVE) {
-			    for (piece = 0; piece < capturing_piece; piece ++) {
-				if (tb->pieces[piece].color != tb->pieces[capturing_piece].color) continue;
-				if (! (possible_captures[capturing_piece] & possible_captures[piece])) continue;
-				if (promotion_captures[piece][captured_piece][promotion] != NO_FUTUREMOVE) {
-				    if (promotion_captures[piece][captured_piece][promotion] == candidate_futuremove) {
-					candidate_futuremove = NO_FUTUREMOVE;
-					break;
-				    }
-				}
-			    }
-			}
+			    pawn_board_mask[color][piece_square][movement] = true;
 
-			if (candidate_futuremove == NO_FUTUREMOVE) {
-			    candidate_futuremove = num_futuremoves[tb->pieces[capturing_piece].color] ++;
-			    movestr[tb->pieces[capturing_piece].color][candidate_futuremove] = strdup(local_movestr);
 			}
-
-			promotion_captures[capturing_piece][captured_piece][promotion] = candidate_futuremove;
 		    }
 		}
 	    }
 	}
     }
+}
 
-    /* We also want to consider all promotions.  We don't wrap this into the pawn code that follows
-     * because we want to count all promotions together, not a set for each destination square.
-     * This is a special case of a more general problem that this code doesn't address yet.  We want
-     * to minimize the assigned numbers to keep the futuremove bit vector small, so we want to reuse
-     * those numbers if we're sure that two moves can't happen from different squares.  I.e, if a
-     * king is restricted to the f1/h3 rectangle, then it can move to e1 from f1 and it can move to
-     * h4 from h3, but there is no single position from which it can move to both e1 and h4.  So we
-     * can use the same position in the bit vector for Ke1 and Kh4.  But we don't (yet).
-     */
+/* Is the king of the color opposite 'attacking_color' under attack? */
 
-    for (piece = 0; piece < tb->num_pieces; piece ++) {
-	for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-	    promotions[piece][promotion] = NO_FUTUREMOVE;
-	}
-	if (tb->pieces[piece].piece_type == PieceType::Pawn) {
-	    for (sq = (tb->pieces[piece].color == PieceColor::White ? 48 : 8);
-		 sq <= (tb->pieces[piece].color == PieceColor::White ? 55 : 15); sq++) {
-		if (tb->pieces[piece].legal_squares & BITVECTOR(sq)) {
+inline bool king_attacked(const tablebase_t *tb, const local_position_t *position, const PieceColor attacking_color)
+{
+    const int king = (attacking_color == PieceColor::Black) ? tb->white_king : tb->black_king;
+    const int king_position = position->piece_position[king];
 
-		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-			promotions[piece][promotion] = num_futuremoves[tb->pieces[piece].color];
-			sprintf(local_movestr, "P=%c", piece_char[promoted_pieces[promotion]]);
-			movestr[tb->pieces[piece].color][promotions[piece][promotion]] = strdup(local_movestr);
-			num_futuremoves[tb->pieces[piece].color] ++;
-		    }
+    for (int piece = 0; piece < tb->num_pieces; piece++) {
 
-		    break;
-		}
-	    }
-	}
-    }
+	if (tb->pieces[piece].color != attacking_color) continue;
 
-    /* And now all piece moves outside their restriction.  We record a futuremove for each possible
-     * destination square that the piece can reach outside its move restriction, unless we've
-     * determined that there are no "normal" futurebases, in which case we flag the pruning right
-     * here and now.
-     */
+	/* We might have removed the piece from the position... */
 
-    futurebase_cnt = 0;
+	if (position->piece_position[piece] == ILLEGAL_POSITION) continue;
 
-    for (fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-	if (futurebases[fbnum].futurebase_type == FuturebaseType::Normal) futurebase_cnt ++;
-    }
+	if (tb->pieces[piece].piece_type != PieceType::Pawn) {
 
-    for (piece = 0; piece < tb->num_pieces; piece ++) {
+	    if ((board_mask[tb->pieces[piece].piece_type][position->piece_position[piece]][king_position]
+		 & position->board_vector) == 0) return true;
 
-	for (sq = 0; sq < 64; sq ++) futuremoves[piece][sq] = NO_FUTUREMOVE;
+	} else {
 
-	for (sq = 0; sq < 64; sq ++) {
+	    if (pawn_board_mask[tb->pieces[piece].color][position->piece_position[piece]][king_position])
+		return true;
 
-	    /* Consider as _starting_ squares only those within the piece's movement restriction */
+	}
+    }
 
-	    if (! (tb->pieces[piece].legal_squares & BITVECTOR(sq))) continue;
+    return false;
+}
 
-	    for (auto &dir : movements(current_tb->pieces[piece].piece_type,
-				       current_tb->pieces[piece].color,
-				       sq,
-				       Movement::Forward, Movement::NonCapture)) {
+bool PTM_in_check(const tablebase_t *tb, const local_position_t *position)
+{
+    /* The concept of check doesn't exist in suicide - kings are normal pieces */
 
-		for (auto &movement : dir) {
+    if (tb->variant == Variant::Suicide) return false;
 
-		    /* If we hit a frozen piece, movement has to stop.  We don't consider captures
-		     * here; they were handled above.
-		     */
+    /* We only want to consider pieces of the side which is NOT to move... */
 
-		    if (BITVECTOR(movement) & tb->frozen_pieces_vector) break;
+    return king_attacked(tb, position, ~ position->side_to_move);
+}
 
-		    /* If the piece is moving outside its semilegal squares, it's a futuremove.  If
-		     * it's moving from a legal square to a semilegal square, it's also a
-		     * futuremove... except for a special case.  Obviously the other piece in its
-		     * semilegal group can't be on either the square it's moving from or the square
-		     * it's moving to (no other piece can be).  If all remaining legal squares
-		     * available to that other piece are also legal squares for this piece, then we
-		     * can always successfully flip the two pieces and this isn't a futuremove.  The
-		     * converse is that there must be at least one legal square available to the
-		     * other piece that isn't a legal square for this piece; in other words, this
-		     * piece must have another semilegal square that isn't legal.
-		     */
+bool global_PTM_in_check(global_position_t *position)
+{
+    if (position->variant == Variant::Suicide) return false;
 
-		    if (!(tb->pieces[piece].semilegal_squares & BITVECTOR(movement))
+    for (square_t square = 0; square < 64; square ++) {
 
-			|| (!(tb->pieces[piece].legal_squares & BITVECTOR(movement))
-			    && ( tb->pieces[piece].semilegal_squares & ~(tb->pieces[piece].legal_squares)
-				 & ~BITVECTOR(movement) & ~BITVECTOR(sq) ))) {
+	if (position->board[square] == 0) continue;
 
-			if (futuremoves[piece][movement] == NO_FUTUREMOVE) {
+	auto const pair = global_pieces2.at(position->board[square]);
 
-			    sprintf(local_movestr, "%c%c%c", piece_char[tb->pieces[piece].piece_type],
-				    'a' + COL(movement), '1' + ROW(movement));
+	/* We only want to consider pieces of the side which is NOT to move... */
+
+	if (position->side_to_move == pair.first) continue;
+
+	const PieceType piece_type = pair.second;
+
+	for (auto &dir : movements(piece_type, pair.first, square,
+				   Movement::Forward, Movement::Capture)) {
+
+	    for (auto &movement : dir) {
+
+		/* Now check to see if the movement ended because we hit against the king
+		 * of the opposite color.  If so, we're in check.
+		 */
+
+		if ((position->side_to_move == PieceColor::White) && (position->board[movement] == 'K'))
+		    return true;
+		if ((position->side_to_move == PieceColor::Black) && (position->board[movement] == 'k'))
+		    return true;
+		
+		/* Otherwise, if we hit a piece, end this movement and go on to the next one */
+
+		if (position->board[movement] != 0) break;
 
-			    if (futurebase_cnt > 0) {
-				futuremoves[piece][movement]
-				    = num_futuremoves[tb->pieces[piece].color];
-				movestr[tb->pieces[piece].color][num_futuremoves[tb->pieces[piece].color]]
-				    = strdup(local_movestr);
-				num_futuremoves[tb->pieces[piece].color] ++;
-			    } else {
-				switch (match_pruning_statement(tb, tb->pieces[piece].color,
-								local_movestr)) {
-				case RESTRICTION_DISCARD:
-				    futuremoves[piece][movement] = DISCARD_FUTUREMOVE;
-				    break;
-				case RESTRICTION_CONCEDE:
-				    futuremoves[piece][movement] = CONCEDE_FUTUREMOVE;
-				    break;
-				}
-			    }
-			}
-		    }
-		}
 	    }
 	}
     }
 
-    info("%d possible WHITE futuremoves\n", num_futuremoves[PieceColor::White]);
-    if (tb->encode_stm) {
-	info("%d possible BLACK futuremoves\n", num_futuremoves[PieceColor::Black]);
-    } else {
-	num_futuremoves[PieceColor::Black] = 0;
-    }
-
-    if (num_futuremoves[PieceColor::White] > sizeof(futurevector_t)*8) {
-	fatal("Too many futuremoves - %d!  (only %d bits futurevector_t)\n",
-	      num_futuremoves[PieceColor::White], sizeof(futurevector_t)*8);
-	terminate();
-    }
-    if (num_futuremoves[PieceColor::Black] > sizeof(futurevector_t)*8) {
-	fatal("Too many futuremoves - %d!  (only %d bits futurevector_t)\n",
-	      num_futuremoves[PieceColor::Black], sizeof(futurevector_t)*8);
-	terminate();
-    }
+    return false;
 }
 
-void print_futuremoves(void)
+/* XXX very similar to global_PTM_in_check */
+
+bool global_PNTM_in_check(global_position_t *position)
 {
-    unsigned int i;
+    if (position->variant == Variant::Suicide) return false;
 
-    info("%d unpruned and unhandled WHITE futuremoves\n", num_futuremoves[PieceColor::White]);
-    if (current_tb->encode_stm) info("%d unpruned and unhandled BLACK futuremoves\n", num_futuremoves[PieceColor::Black]);
+    for (square_t square = 0; square < 64; square ++) {
 
-    for (i=0; i < num_futuremoves[PieceColor::White]; i ++) {
-	info("WHITE Futuremove %i: %s\n", i, movestr[PieceColor::White][i]);
-    }
-    for (i=0; i < num_futuremoves[PieceColor::Black]; i ++) {
-	if (current_tb->encode_stm) info("BLACK Futuremove %i: %s\n", i, movestr[PieceColor::Black][i]);
-    }
-}
+	if (position->board[square] == 0) continue;
 
-/* This is where we parse pruning statements.  Fill in the pruned_futuremoves bit vector with bits
- * set for the various pruned moves.  We call this routine after assign_numbers_to_futuremoves(),
- * which also prints strings into the movestr array, and now we use those strings to match against
- * pruning statements.  To make this routine easier, assign_pruning_statement() can be called with a
- * '-1' futuremove, in which case it will do nothing.
- *
- * XXX something else I'd like to do here is to flag all of the pruning statements to make
- * sure we've used each one, and complain if any are left unused.
- */
+	auto const pair = global_pieces2.at(position->board[square]);
 
-bool compute_pruned_futuremoves(tablebase_t *tb)
-{
-    xmlpp::NodeSet result;
+	/* We only want to consider pieces of the side which is to move... */
 
-    /* Check pruning statements for consistency, and record stalemate pruning if specified */
+	if (position->side_to_move != pair.first) continue;
 
-    result = tb->xml->get_root_node()->find("//prune");
+	const PieceType piece_type = pair.second;
 
-    for (auto prune = result.begin(); prune != result.end(); prune ++) {
+	for (auto &dir : movements(piece_type, pair.first, square,
+				   Movement::Forward, Movement::Capture)) {
 
-	Glib::ustring prune_color = (*prune)->eval_to_string("@color");
-	Glib::ustring prune_type = (*prune)->eval_to_string("@type");
+	    for (auto &movement : dir) {
 
-	PieceColor color = colors.at(prune_color);
-	int type = restriction_types.at(prune_type);
+		/* Now check to see if the movement ended because we hit against the king
+		 * of the opposite color.  If so, we're in check.
+		 */
 
-	if (! (type & tb->prune_enable[color])) {
-	    fatal("Prune statements don't match tablebase prune-enables\n");
-	}
-    }
+		if ((position->side_to_move == PieceColor::White) && (position->board[movement] == 'k'))
+		    return true;
+		if ((position->side_to_move == PieceColor::Black) && (position->board[movement] == 'K'))
+		    return true;
 
-    if (fatal_errors != 0) return false;
+		/* Otherwise, if we hit a piece, end this movement and go on to the next one */
+
+		if (position->board[movement] != 0) break;
+	    }
 
-    for (auto color : BothColors) {
-	for (auto fm = 0U; fm < num_futuremoves[color]; fm ++) {
-	    assign_pruning_statement(tb, color, fm);
 	}
     }
 
-    unpruned_futuremoves[PieceColor::White] = ~pruned_futuremoves[PieceColor::White];
-    unpruned_futuremoves[PieceColor::Black] = ~pruned_futuremoves[PieceColor::Black];
-
-    return (fatal_errors == 0);
+    return false;
 }
 
+bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position)
+{
+    if (tb->variant == Variant::Suicide) return false;
+
+    /* We only want to consider pieces of the side which is to move... */
 
-/* check_pruning()
+    return king_attacked(tb, position, position->side_to_move);
+}
+
+/* initialize_tablebase()
  *
- * We run this function after we've assigned numbers to the futuremoves and then matched pruning
- * statements against them, but before we initialize the tablebase.
+ * This is another critical function; don't be deceived by the tame word 'initialize'.
  *
- * Check the futurebases to see if there are any for a given futuremove.  If not, check to make sure
- * the futuremove is pruned.  Otherwise, signal an error and exit right now.  Just because this test
- * is passed doesn't mean a particular futuremove is handled in a particular position (that's why we
- * use the bit vector), but if the test fails, well, then we know (almost) for sure that we'd get to
- * the end of program with unhandled futurebases, so we can save ourselves a long computation by
- * making this basic check now.
+ * We determine that a position is won for the player not to move (PNTM) if all possible moves (of
+ * the player to move) lead to a won game for PNTM.  We count down this total during back
+ * propagation, so it stands to reason that we need an accurate count to start with.  Thus the
+ * importance of this function.
  *
- * If no futurebases exist for a given futuremove and it is correctly pruned, then flag it for
- * optimization, since there is no need to track its futurebase back propagation.
+ * We don't count moves into check at all.
  *
- * Also check to see if there are any futurebases that will always match a futuremove.  If so, we
- * can also optimize these away.  If multiple futurebases match a futuremove and one of them will
- * always match the futuremove, then we can also signal an error now, because we're going to get
- * multiply handled futuremoves.
+ * Basically, there are two types of moves we need to consider in each position:
+ *
+ * 1. non-capture, non-promotion, non-restricted moves
+ *
+ * We just add these up and then count them down during intra-table propagation, depending on the
+ * integrity of the program's algorithm to make sure that every move counted forward gets considered
+ * as a move backward.
+ *
+ * 2. everything else (futuremoves)
+ *
+ * These always lead to a different tablebase (a futurebase).  The only way we handle them is
+ * through inter-table back propagation.  We keep a seperate count of futuremoves because, unlike
+ * intratable moves, we might miss some of these moves if we don't have a complete set of
+ * futurebases.  So we count futuremoves by themselves (as well as part of the standard count), and
+ * count them down normally during a single sweep through our futurebases.  If that takes care of
+ * everything fine.  Otherwise, during our first pass through the current tablebase, we'll find that
+ * some of the futuremoves remain unaccounted for.  If they occur with the "good guys" as PTM, we
+ * just double-check that the restriction is OK, subtract the remaining futuremoves out from the
+ * standard count, and keep going.  But if the "bad guys" are PTM, then the position has to be
+ * assumed won for PTM.
  *
- * There is an off chance that piece restrictions will prevent a futuremove from taking place, but
- * this code will conclude nevertheless that it is possible and demand either a prune statement or a
- * futurebase.  In this rare case, introducing an extraneous prune statement or two should solve the
- * problem.
  */
 
-uint64_t tablebase_t::possible_capture_squares(const int capturing_piece) const
-{
-    uint64_t result = 0LL;
+class move {
 
-    for (square_t from=0; from < NUM_SQUARES; from++) {
-	if (pieces[capturing_piece].legal_squares & BITVECTOR(from)) {
-	    for (auto &dir: movements(pieces[capturing_piece].piece_type, pieces[capturing_piece].color,
-				     from, Movement::Forward, Movement::Capture)) {
-		for (auto &to: dir) {
-		    result |= BITVECTOR(to);
-		}
-	    }
-	}
-    }
+    PieceType piece_type;
+    square_t origin_square;
+    square_t destination_square;
+    PieceType promotion_type;
 
-    return result;
-}
+public:
 
-bool tablebase_t::futurebase_matches_capture(const tablebase_t& fb, const int captured_piece) const
-{
-    /* I've made this a bit more liberal now, because if we're dealing with move restrictions,
-     * then we might have a missing piece in the futurebase line up with one of our pieces that
-     * is identical to captured_piece in the sense that it's the same color and type, but not
-     * identical in the sense of next_piece_in_semilegal_group.
-     */
+    int futuremove;
 
-    if (fb.futurebase_type != FuturebaseType::Capture) return false;
+    bool is_futuremove;
+    bool is_capture;
+    bool is_promotion;
 
-    if (pieces[captured_piece].piece_type == PieceType::Pawn) {
-	if ((fb.missing_pawn != -1)
-	    && (pieces[fb.missing_pawn].color == pieces[captured_piece].color)) return true;
-    } else {
-	if ((fb.missing_non_pawn != -1)
-	    && (pieces[fb.missing_non_pawn].color == pieces[captured_piece].color)
-	    && (pieces[fb.missing_non_pawn].piece_type == pieces[captured_piece].piece_type)) return true;
-    }
+    move(PieceType piece_type, square_t origin_square, square_t destination_square)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  is_futuremove(false), is_capture(false), is_promotion(false)
+    { }
 
-    return false;
-}
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, int futuremove)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  futuremove(futuremove),
+	  is_futuremove(true), is_capture(false), is_promotion(false)
+    { }
 
-bool tablebase_t::futurebase_matches_capture_promotion(const tablebase_t& fb, const int captured_piece, const int promotion) const
-{
-    if (fb.futurebase_type != FuturebaseType::CapturePromotion) return false;
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, PieceType promotion_type)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  promotion_type(promotion_type),
+	  is_futuremove(true), is_capture(false), is_promotion(true)
+    { }
 
-    if ((pieces[fb.missing_non_pawn].color == pieces[captured_piece].color)
-	&& (pieces[fb.missing_non_pawn].piece_type == pieces[captured_piece].piece_type)
-	&& (fb.promotion == promotion)) {
-	return true;
-    }
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, PieceType promotion_type, int futuremove)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  promotion_type(promotion_type), futuremove(futuremove),
+	  is_futuremove(true), is_capture(false), is_promotion(true)
+    { }
 
-    return false;
-}
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  is_futuremove(true), is_capture(is_capture), is_promotion(false)
+    { }
 
-bool tablebase_t::futurebase_matches_promotion(const tablebase_t& fb, const int promoting_pawn, const int promotion) const
-{
-    if (fb.futurebase_type != FuturebaseType::Promotion) return false;
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, int futuremove)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  futuremove(futuremove),
+	  is_futuremove(true), is_capture(is_capture), is_promotion(false)
+    { }
 
-    if ((pieces[fb.missing_pawn].color == pieces[promoting_pawn].color)
-	&& (fb.promotion == promotion)) {
-	return true;
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, PieceType promotion_type)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  promotion_type(promotion_type),
+	  is_futuremove(true), is_capture(is_capture), is_promotion(true)
+    { }
+
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, PieceType promotion_type, int futuremove)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  promotion_type(promotion_type), futuremove(futuremove),
+	  is_futuremove(true), is_capture(is_capture), is_promotion(true)
+    { }
+
+    operator std::string() const {
+	return piece_char[piece_type] + algebraic_notation(origin_square)
+	    + (is_capture ? "x" : "") + algebraic_notation(destination_square)
+	    + (is_promotion ? (std::string)"=" + piece_char[promotion_type] : "");
     }
 
-    return false;
-}
+    const char * c_str() const {
+	return ((std::string)(*this)).c_str();
+    }
+};
 
-uint64_t flip_legal_squares(const uint64_t legal_squares)
-{
-    uint64_t output = 0LL;
+/* A list of at most MAX_MOVES moves (or move/position pairs) that lives wherever the caller puts
+ * it, usually on the stack, so generating moves never touches the heap.  The storage is left
+ * uninitialized until something is pushed into it, so it's cheap to create one for every position.
+ */
 
-    for (int i=0; i<64; i++) {
-	if (legal_squares & BITVECTOR(i)) {
-	    output |= BITVECTOR(63-i);
-	}
-    }
+template <typename T>
+class move_list {
 
-    return output;
-}
+    static_assert(std::is_trivially_destructible<T>::value, "move_list never destroys its elements");
 
-bool tablebase_t::futurebase_completely_handles_capture(const tablebase_t& fb, const int capturing_piece, const int captured_piece) const
-{
-    if (! futurebase_matches_capture(fb, captured_piece)) return false;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage[MAX_MOVES];
+    unsigned int count = 0;
 
-    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
-     * if our initial pawn positions are identical.
-     */
+public:
 
-    if (fb.pawngen) {
-	if (! pawngen) return false;
-	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
-	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
+    void clear(void) { count = 0; }
+
+    void push_back(const T & element) {
+	assert(count < MAX_MOVES);
+	new (&storage[count ++]) T(element);
     }
 
-    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
-     * to consider all possible such mappings.  Remember that there's one less piece in the
-     * futurebase, and that nothing in the futurebase maps to the captured piece.
-     */
+    unsigned int size(void) const { return count; }
+    bool empty(void) const { return count == 0; }
 
-    int local_piece[MAX_PIECES];
+    T * begin(void) { return reinterpret_cast<T *>(storage); }
+    T * end(void) { return begin() + count; }
+    const T * begin(void) const { return reinterpret_cast<const T *>(storage); }
+    const T * end(void) const { return begin() + count; }
+};
 
-    for (int piece = 0; piece < num_pieces - 1; piece ++) {
-	if (piece < captured_piece) {
-	    local_piece[piece] = piece;
-	} else {
-	    local_piece[piece] = piece+1;
-	}
-    }
+/* XXX perhaps collapse the next two functions together using templates  */
 
-    /* Compute a bitvector of squares where a capture is possible.  Slight proviso here for pawns -
-     * since capture-promotions are handled in a different subroutine, we use LEGAL_PAWN_BITVECTOR
-     * to exclude the last rank.
-     */
+/* This is a special exception value for PNTM mated positions.
+ *
+ * Since detecting a PNTM mate allows us to break out of the move generator and flag the position
+ * invalid, this exception probably doesn't cost much of a performance penalty vs continuing
+ * to run the loop.
+ */
 
-    uint64_t capture_squares = possible_capture_squares(capturing_piece);
+class PNTM_mated : public std::exception { };
 
-    if (pieces[capturing_piece].piece_type == PieceType::Pawn) {
-	capture_squares &= LEGAL_PAWN_BITVECTOR;
-    }
+void generate_moves(const local_position_t &position, move_list<move> &result)
+{
+    const tablebase_t *tb = position.tb;
 
-    /* Can we find a suitable mapping?
-     *
-     * The capturing piece will end up on the captured piece's square, so each legal square for the
-     * captured piece in the current tablebase must be legal for the capturing piece in the
-     * futurebase, assuming that a capture is possible on that square.
-     *
-     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
-     * its location restriction.
-     */
+    result.clear();
 
-    do {
-	int piece;
+    for (int piece = 0; piece < tb->num_pieces; piece++) {
 
-	for (piece = 0; piece < num_pieces - 1; piece ++) {
-	    if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
-	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
-	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
+	/* We only want to consider pieces of the side which is to move... */
 
-	    /* If we're using pawngen, we've already checked that the pawns match right */
-	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
+	if (tb->pieces[piece].color != position.side_to_move) continue;
 
-	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
+	int origin_square = position.piece_position[piece];
 
-	    if (fb.invert_colors) {
-		fb_legal_squares = flip_legal_squares(fb_legal_squares);
-	    }
+	for (auto &dir : movements(tb->pieces[piece].piece_type,
+				   tb->pieces[piece].color,
+				   position.piece_position[piece],
+				   Movement::Forward, Movement::AllMoves)) {
 
-	    if ((local_piece[piece] != capturing_piece)
-		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
-		    != pieces[local_piece[piece]].legal_squares)) break;
-	    if ((local_piece[piece] == capturing_piece)
-		&& ((fb_legal_squares & pieces[captured_piece].legal_squares & capture_squares)
-		    != (pieces[captured_piece].legal_squares & capture_squares))) break;
-	}
+	    for (auto &movement : dir) {
 
-	/* We've found a mapping of pieces that meets the above criteria. */
-	if (piece == num_pieces - 1) {
-	    return true;
-	}
+		bool is_promotion = ((tb->pieces[piece].piece_type == PieceType::Pawn)
+				     && ((ROW(movement) == 7) || (ROW(movement) == 0)));
 
-    } while (std::next_permutation(local_piece, local_piece + num_pieces - 1));
+		bool is_pawn_capture = ((tb->pieces[piece].piece_type == PieceType::Pawn)
+					&& (COL(movement) != COL(position.piece_position[piece])));
 
-    return false;
-}
+		bool is_non_capture = ((BITVECTOR(movement) & position.board_vector) == 0) && !is_pawn_capture;
 
-bool tablebase_t::futurebase_completely_handles_capture_promotion(const tablebase_t& fb, const int capturing_piece, const int captured_piece, const int promotion) const
-{
-    if (! futurebase_matches_capture_promotion(fb, captured_piece, promotion)) return false;
+		bool is_normal_capture = ((tb->pieces[piece].piece_type != PieceType::Pawn) || is_pawn_capture)
+		    && ((BITVECTOR(movement) & position.board_vector) != 0)
+		    && ((BITVECTOR(movement) & position.PTM_vector) == 0);
 
-    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
-     * if our initial pawn positions are identical.
-     */
+		bool is_en_passant_capture = is_pawn_capture
+		    && (movement == position.en_passant_square);
 
-    if (fb.pawngen) {
-	if (! pawngen) return false;
-	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
-	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
-    }
+		if (is_non_capture) {
 
-    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
-     * to consider all possible such mappings.  Remember that there's one less piece in the
-     * futurebase, and that nothing in the futurebase maps to the captured piece.
-     */
+		    /* Non-capture case: move the piece, so we can test the new position for check */
 
-    int local_piece[MAX_PIECES];
+		    local_position_t new_position = position;
 
-    for (int piece = 0; piece < num_pieces - 1; piece ++) {
-	if (piece < captured_piece) {
-	    local_piece[piece] = piece;
-	} else {
-	    local_piece[piece] = piece+1;
-	}
-    }
+		    new_position.move_piece(piece, movement);
 
-    /* Can we find a suitable mapping?
-     *
-     * The capturing piece will end up on the captured piece's square, so each legal square for the
-     * captured piece in the current tablebase must be legal for the capturing piece in the
-     * futurebase.
-     *
-     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
-     * its location restriction.
-     */
+		    /* We don't set en passant square here since it doesn't affect the in-check
+		     * calculation, and we're not using the position for anything else.
+		     */
 
-    do {
-	int piece;
+		    if (! PTM_in_check(tb, &new_position)) {
 
-	for (piece = 0; piece < num_pieces - 1; piece ++) {
-	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
-	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
+			/* If the piece is a pawn and we're moving to the last rank, then this has
+			 * to be a promotion move, in fact, promotion_possibilities moves.  (queen,
+			 * knight, maybe rook and bishop, king for suicide).  As such, they will
+			 * require back propagation from futurebases and must therefore be flagged
+			 * as futuremoves.
+			 */
 
-	    if (local_piece[piece] != capturing_piece) {
-		if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
-	    } else {
-		if (fb.pieces[piece].piece_type != promoted_pieces[promotion]) break;
-	    }
+			if (is_promotion) {
 
-	    /* If we're using pawngen, we've already checked that the pawns match right */
+			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
+				result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
+						      promoted_pieces[promotion], promotions[piece][promotion]));
 
-	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
+			    }
 
-	    if (fb.invert_colors) {
-		fb_legal_squares = flip_legal_squares(fb_legal_squares);
-	    }
+			    /* If we're NOT moving into check AND the piece is moving outside its
+			     * legal squares AND we can't permute the pieces into a position where
+			     * everything is legal (local_position_to_index), we regard this as a
+			     * futuremove (since it will require back prop from futurebases).  We
+			     * could just check if local_position_to_index() returns a valid index,
+			     * but checking the legal_squares bitvector first makes this a little
+			     * faster.
+			     */
 
-	    /* For most pieces, check that the legal squares in the futurebase are a superset
-	     * of the legal squares in the local tablebase. */
+			} else if (!(tb->pieces[piece].legal_squares & BITVECTOR(movement))
+			    && (local_position_to_index(tb, &new_position) == INVALID_INDEX)) {
 
-	    if ((local_piece[piece] != capturing_piece)
-		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
-		    != pieces[local_piece[piece]].legal_squares)) break;
+			    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
+						  futuremoves[piece][movement]));
 
-	    /* For the capturing and promoting pawn, find its possible promotion-capture squares,
-	     * and make sure the legal squares in the futurebase are a superset of them.
-	     *
-	     * This code ignores frozen pieces that might block a promotion, but this routine is
-	     * essentially an optimisation.  If it returns false, then we need to check every
-	     * position to see if its futuremoves are handled.  Ignoring frozen pieces just means
-	     * that we might need to check those positions by hand, slowing the program down but not
-	     * affecting its proper operation.
-	     */
+			} else {
+
+			    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement));
+
+			}
+
+		    }
 
-	    if (local_piece[piece] == capturing_piece) {
-		uint64_t promotion_squares = possible_capture_squares(capturing_piece);
-		if (pieces[capturing_piece].color == PieceColor::White) {
-		    promotion_squares &= 0xff00000000000000LL;
-		} else {
-		    promotion_squares &= 0x00000000000000ffLL;
 		}
-		promotion_squares &= pieces[captured_piece].legal_squares;
-		if ((fb_legal_squares & promotion_squares) != promotion_squares) break;
-	    }
-	}
 
-	/* We've found a mapping of pieces that meets the above criteria. */
-	if (piece == num_pieces - 1) {
-	    return true;
-	}
+		if (is_normal_capture) {
 
-    } while (std::next_permutation(local_piece, local_piece + num_pieces - 1));
+		    /* Capture case.
+		     *
+		     * Check to see if the movement ended because we hit against another piece of
+		     * the opposite color.  If so, add another move for the capture.  As before,
+		     * ignore moves into check.
+		     *
+		     * Actually, we check to see that we DIDN'T hit a piece of our OWN color.  The
+		     * difference is that this way we don't register a capture if we hit the end of
+		     * the list of movements in a given direction.
+		     *
+		     * We also check to see if the capture was against the enemy king! in which case
+		     * this position is a PNTM-mated.
+		     */
 
-    return false;
-}
+		    int captured_piece;
 
-bool tablebase_t::futurebase_completely_handles_promotion(const tablebase_t& fb, const int promoting_pawn, const int promotion) const
-{
-    if (! futurebase_matches_promotion(fb, promoting_pawn, promotion)) return false;
+		    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+
+			if (movement == position.piece_position[captured_piece]) {
+
+			    if ((captured_piece == tb->black_king) || (captured_piece == tb->white_king)) {
+				throw PNTM_mated();
+			    }
 
-    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
-     * if our initial pawn positions are identical.
-     */
+			    local_position_t new_position = position;
 
-    if (fb.pawngen) {
-	if (! pawngen) return false;
-	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
-	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
-    }
+			    new_position.capture_piece(piece, captured_piece);
 
-    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
-     * to consider all possible such mappings.
-     */
+			    if (! PTM_in_check(tb, &new_position)) {
 
-    int local_piece[MAX_PIECES];
+				if (! is_promotion) {
 
-    for (int piece = 0; piece < num_pieces; piece ++) {
-	local_piece[piece] = piece;
-    }
+				    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
+							  true, futurecaptures[piece][captured_piece]));
 
-    /* Can we find a suitable mapping?
-     *
-     * The capturing piece will end up on the captured piece's square, so each legal square for the
-     * captured piece in the current tablebase must be legal for the capturing piece in the
-     * futurebase.
-     *
-     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
-     * its location restriction.
-     */
+				} else {
 
-    do {
-	int piece;
+				    /* Promotion capture case
+				     *
+				     * In this part of the code, we're just counting forward moves, and
+				     * all captures are futurebase moves, so the only difference to us
+				     * whether this is a promotion move or not is how many futuremoves
+				     * get recorded.
+				     */
 
-	for (piece = 0; piece < num_pieces; piece ++) {
-	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
-	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
 
-	    if (local_piece[piece] != promoting_pawn) {
-		if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
-	    } else {
-		if (fb.pieces[piece].piece_type != promoted_pieces[promotion]) break;
-	    }
+				    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-	    /* If we're using pawngen, we've already checked that the pawns match right */
+					result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
+							      true, promoted_pieces[promotion], promotion_captures[piece][captured_piece][promotion]));
+				    }
+				}
+			    }
 
-	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
+			    break;
+			}
+		    }
 
-	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
+		    if (captured_piece == tb->num_pieces) {
+			fatal("Couldn't match capture!\n");
+		    }
+		}
 
-	    if (fb.invert_colors) {
-		fb_legal_squares = flip_legal_squares(fb_legal_squares);
-	    }
+		if (is_en_passant_capture) {
 
-	    /* For most pieces, check that the legal squares in the futurebase are a superset
-	     * of the legal squares in the local tablebase. */
+		    int captured_piece;
 
-	    if ((local_piece[piece] != promoting_pawn)
-		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
-		    != pieces[local_piece[piece]].legal_squares)) break;
+		    /* XXX recording en passant piece in position structure would avoid this loop */
 
-	    /* For the promoting pawn, find its possible promotion squares and make sure the legal
-	     * squares in the futurebase are a superset of them.
-	     *
-	     * This code ignores frozen pieces that might block a promotion, but this routine is
-	     * essentially an optimisation.  If it returns false, then we need to check every
-	     * position to see if its futuremoves are handled.  Ignoring frozen pieces just means
-	     * that we might need to check those positions by hand, slowing the program down but not
-	     * affecting its proper operation.
-	     */
+		    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
 
-	    if (local_piece[piece] == promoting_pawn) {
-		uint64_t promotion_squares;
-		if (pieces[promoting_pawn].color == PieceColor::White) {
-		    promotion_squares = (pieces[promoting_pawn].legal_squares & 0x00ff000000000000LL) << 8;
-		} else {
-		    promotion_squares = (pieces[promoting_pawn].legal_squares & 0x000000000000ff00LL) >> 8;
-		}
-		if ((fb_legal_squares & promotion_squares) != promotion_squares) break;
-	    }
-	}
+			if (movement ==
+			    (position.piece_position[captured_piece]
+			     + ((position.side_to_move == PieceColor::White) ? 8 : -8))) {
 
-	/* We've found a mapping of pieces that meets the above criteria. */
-	if (piece == num_pieces) {
-	    return true;
-	}
+			    local_position_t new_position = position;
 
-    } while (std::next_permutation(local_piece, local_piece + num_pieces));
+			    new_position.move_piece(captured_piece, position.en_passant_square);
 
-    return false;
-}
+			    new_position.capture_piece(piece, captured_piece);
 
-bool check_pruning(tablebase_t *tb)
-{
-    /* For each possible captured_piece (i.e, everything but the two kings) check for capture
-     * futurebases.  tb->white_king and tb->black_king are -1 for suicide, so all pieces are treated
-     * the same in a suicide analysis.
-     */
+			    if (! PTM_in_check(tb, &new_position)) {
 
-    for (int captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+				result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
+						      true, futurecaptures[piece][captured_piece]));
 
-	if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
+			    }
 
-	/* If we're not encoding side-to-move, then all of the positions in the tablebase are WHITE
-	 * to move positions, so we don't care if the captured piece is WHITE.
-	 */
+			    break;
+			}
+		    }
 
-	if ((! tb->encode_stm) && (tb->pieces[captured_piece].color == PieceColor::White)) continue;
+		    if (captured_piece == tb->num_pieces) {
+			fatal("Couldn't match en passant capture!\n");
+		    }
+		}
 
-	int futurebase_cnt = 0;
+		/* If we hit a piece (either a capture or our own piece), end this direction of movement */
 
-	for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-	    if (tb->futurebase_matches_capture(futurebases[fbnum], captured_piece)) {
-		futurebase_cnt ++;
+		if (! is_non_capture) break;
 	    }
 	}
+    }
+}
 
-	/* If no such futurebase exists, then for every other piece, see if the piece restrictions
-	 * would permit it to capture the original piece in question.  If so, there must be a prune
-	 * statement, or it's an error.  On the other hand, if a futurebase handles all of our
-	 * captures, then it must be the only matching futurebase.
-	 */
+void generate_moves(const global_position_t &position, move_list<std::pair<move, global_position_t>> &result)
+{
+    result.clear();
 
-	for (int capturing_piece = 0; capturing_piece < tb->num_pieces; capturing_piece ++) {
+    for (square_t origin_square = 0; origin_square < 64; origin_square ++) {
 
-	    if (futurecaptures[capturing_piece][captured_piece] == NO_FUTUREMOVE) continue;
-	    if (futurecaptures[capturing_piece][captured_piece] == RESIGN_FUTUREMOVE) continue;
+	if (position.board[origin_square] == 0) continue;
 
-	    if (futurecaptures[capturing_piece][captured_piece] < 0) {
-		fatal("futurecaptures (%d) < 0 but not NO_FUTUREMOVE!\n", futurecaptures[capturing_piece][captured_piece]);
-	    }
+	PieceColor piece_color = global_pieces2.at(position.board[origin_square]).first;
+	PieceType piece_type = global_pieces2.at(position.board[origin_square]).second;
 
-	    if (futurebase_cnt == 0) {
+	/* We only want to consider pieces of the side which is to move... */
 
-		if (discarded_futuremoves[tb->pieces[capturing_piece].color]
-		    & FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece])) {
-		    futurecaptures[capturing_piece][captured_piece] = DISCARD_FUTUREMOVE;
-		} else if (conceded_futuremoves[tb->pieces[capturing_piece].color]
-			   & FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece])) {
-		    futurecaptures[capturing_piece][captured_piece] = CONCEDE_FUTUREMOVE;
-		} else {
-		    fatal("No futurebase or pruning for %s move %s\n",
-			  colors.at(tb->pieces[capturing_piece].color).c_str(),
-			  movestr[tb->pieces[capturing_piece].color][futurecaptures[capturing_piece][captured_piece]]);
-		    return false;
-		}
+	if (piece_color != position.side_to_move) continue;
 
-	    } else {
-		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-		    if (tb->futurebase_completely_handles_capture(futurebases[fbnum], capturing_piece, captured_piece)) {
+	for (auto &dir : movements(piece_type, piece_color, origin_square,
+				   Movement::Forward, Movement::AllMoves)) {
 
-			if (futurebase_cnt > 1) {
-			    fatal("Multiple futurebases handle %s move %s\n",
-				  colors.at(tb->pieces[capturing_piece].color).c_str(),
-				  movestr[tb->pieces[capturing_piece].color][futurecaptures[capturing_piece][captured_piece]]);
-			    return false;
-			}
-			if (futurecaptures[capturing_piece][captured_piece] >= 0) {
-			    handled_futuremoves[tb->pieces[capturing_piece].color] |= FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece]);
-			    futurecaptures[capturing_piece][captured_piece] = HANDLED_FUTUREMOVE;
-			}
-			break;
-		    }
-		}
-	    }
-	}
-    }
+	    for (auto &movement : dir) {
 
-    /* Pawns - check for both promotion and promotion capture futurebases here.  Same idea. */
+		bool is_promotion = ((piece_type == PieceType::Pawn)
+				     && ((ROW(movement) == 7) || (ROW(movement) == 0)));
 
-    for (int pawn = 0; pawn < tb->num_pieces; pawn ++) {
+		bool is_pawn_capture = ((piece_type == PieceType::Pawn)
+					&& (COL(movement) != COL(origin_square)));
 
-	int promotion;
+		bool is_non_capture = (position.board[movement] == 0) && !is_pawn_capture;
 
-	if (tb->pieces[pawn].piece_type != PieceType::Pawn) continue;
+		bool is_normal_capture = ((piece_type != PieceType::Pawn) || is_pawn_capture)
+		    && (position.board[movement] != 0)
+		    && (global_pieces2.at(position.board[movement]).first != position.side_to_move);
 
-	if ((! tb->encode_stm) && (tb->pieces[pawn].color == PieceColor::Black)) continue;
+		bool is_en_passant_capture = is_pawn_capture
+		    && (movement == position.en_passant_square);
 
-	/* First, we're looking for promotion capture futurebases. */
+		if (is_non_capture) {
 
-	for (int captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+		    /* Non-capture case: move the piece, so we can test the new position for check */
 
-	    if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
+		    global_position_t new_position = position;
 
-	    /* Check to see if the pawn can even be on a square where a promotion capture is
-	     * possible.
-	     */
+		    new_position.flip_side_to_move();
 
-	    if (tb->pieces[pawn].color == PieceColor::White) {
-		if (! (tb->pieces[pawn].legal_squares & 0x00ff000000000000LL)) break;
-	    } else {
-		if (! (tb->pieces[pawn].legal_squares & 0x000000000000ff00LL)) break;
-	    }
+		    if ((piece_type == PieceType::Pawn) && (movement - origin_square == 16)
+			&& (   ((COL(movement) != 0) && (position.board[movement-1] == 'p'))
+			       || ((COL(movement) != 7) && (position.board[movement+1] == 'p')))) {
+			new_position.set_en_passant_square(origin_square + 8);
+		    } else if ((piece_type == PieceType::Pawn) && (movement - origin_square == -16)
+			&& (   ((COL(movement) != 0) && (position.board[movement-1] == 'P'))
+			       || ((COL(movement) != 7) && (position.board[movement+1] == 'P')))) {
+			new_position.set_en_passant_square(origin_square - 8);
+		    } else {
+			new_position.clear_en_passant_square();
+		    }
 
-	    /* Check to see that the other piece can be on a square where it could be promotion
-	     * captured.  It's still possible that the other piece could be on a back rank, but
-	     * never on a square where it could be captured by the pawn, but we leave that
-	     * possibility unchecked.  It'd probably be best to tie this code in with the code in
-	     * assign_numbers_to_futuremoves() - maybe by flagging which captures it was determined
-	     * that promotion was possible in?
-	     */
+		    new_position.move_piece(origin_square, movement);
 
-	    if (tb->pieces[pawn].color == PieceColor::White) {
-		if (! (tb->pieces[captured_piece].legal_squares & 0xff00000000000000LL)) continue;
-	    } else {
-		if (! (tb->pieces[captured_piece].legal_squares & 0x00000000000000ffLL)) continue;
-	    }
+		    if (! global_PNTM_in_check(&new_position)) {
+
+			if (is_promotion) {
+
+			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+
+				place_piece_in_global_position(&new_position, movement,
+							       piece_color, promoted_pieces[promotion]);
 
-	    /* check all futurebases for a 'promotion capture' with captured_piece missing */
+				result.push_back(std::make_pair(move(piece_type, origin_square, movement,
+								     promoted_pieces[promotion]),
+								new_position));
 
-	    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+			    }
 
-		int futurebase_cnt = 0;
+			} else {
 
-		if (promotion_captures[pawn][captured_piece][promotion] < 0) continue;
+			    result.push_back(std::make_pair(move(piece_type, origin_square, movement),
+							    new_position));
+
+			}
 
-		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-		    if (tb->futurebase_matches_capture_promotion(futurebases[fbnum], captured_piece, promotion)) {
-			futurebase_cnt ++;
 		    }
+
 		}
 
-		/* If no such futurebase exists, then there must be a prune statement, or it's an
-		 * error.
-		 */
+		if (is_normal_capture) {
 
-		if (futurebase_cnt == 0) {
+		    /* Capture case.
+		     *
+		     * We also check to see if the capture was against the enemy king in which case
+		     * this position is a PNTM-mated.
+		     */
 
-		    if (discarded_futuremoves[tb->pieces[pawn].color]
-			& FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion])) {
-			promotion_captures[pawn][captured_piece][promotion] = DISCARD_FUTUREMOVE;
-		    } else if (conceded_futuremoves[tb->pieces[pawn].color]
-			       & FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion])) {
-			promotion_captures[pawn][captured_piece][promotion] = CONCEDE_FUTUREMOVE;
-		    } else {
-			fatal("No futurebase or pruning for %s move %s\n",
-			      colors.at(tb->pieces[pawn].color).c_str(),
-			      movestr[tb->pieces[pawn].color][promotion_captures[pawn][captured_piece][promotion]]);
-			return false;
-		    }
+		    // PieceColor captured_piece_color = global_pieces2.at(position.board[movement]).first;
+		    PieceType captured_piece_type = global_pieces2.at(position.board[movement]).second;
 
-		} else {
+		    if (captured_piece_type == PieceType::King) {
+			throw PNTM_mated();
+		    }
 
-		    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-			if (tb->futurebase_completely_handles_capture_promotion(futurebases[fbnum], pawn, captured_piece, promotion)) {
+		    global_position_t new_position = position;
 
-			    if (futurebase_cnt > 1) {
-				fatal("Multiple futurebases handle %s move %s\n",
-				      colors.at(tb->pieces[pawn].color).c_str(),
-				      movestr[tb->pieces[pawn].color][promotion_captures[pawn][captured_piece][promotion]]);
-				return false;
-			    }
-			    if (promotion_captures[pawn][captured_piece][promotion] >= 0) {
-				handled_futuremoves[tb->pieces[pawn].color] |= FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion]);
-				promotion_captures[pawn][captured_piece][promotion] = HANDLED_FUTUREMOVE;
-			    }
-			    break;
-			}
-		    }
-		}
+		    new_position.flip_side_to_move();
 
-	    }
-	}
+		    new_position.clear_en_passant_square();
 
-	/* straight promotion futurebases */
+		    new_position.capture_piece(origin_square, movement);
 
-	for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+		    if (! global_PNTM_in_check(&new_position)) {
 
-	    if (promotions[pawn][promotion] < 0) continue;
+			if (! is_promotion) {
 
-	    int futurebase_cnt = 0;
+			    result.push_back(std::make_pair(move(piece_type, origin_square, movement, true),
+							    new_position));
 
-	    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-		if (tb->futurebase_matches_promotion(futurebases[fbnum], pawn, promotion)) {
-		    futurebase_cnt ++;
-		}
-	    }
+			} else {
 
-	    if (futurebase_cnt == 0) {
+			    /* Promotion capture case
+			     *
+			     * In this part of the code, we're just counting forward moves, and
+			     * all captures are futurebase moves, so the only difference to us
+			     * whether this is a promotion move or not is how many futuremoves
+			     * get recorded.
+			     */
 
-		if (discarded_futuremoves[tb->pieces[pawn].color] & FUTUREVECTOR(promotions[pawn][promotion])) {
-		    promotions[pawn][promotion] = DISCARD_FUTUREMOVE;
-		} else if (conceded_futuremoves[tb->pieces[pawn].color] & FUTUREVECTOR(promotions[pawn][promotion])) {
-		    promotions[pawn][promotion] = CONCEDE_FUTUREMOVE;
-		} else {
-		    fatal("No futurebase or pruning for %s move %s\n",
-			  colors.at(tb->pieces[pawn].color).c_str(),
-			  movestr[tb->pieces[pawn].color][promotions[pawn][promotion]]);
-		    return false;
-		}
 
-	    } else {
+			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-		    if (tb->futurebase_completely_handles_promotion(futurebases[fbnum], pawn, promotion)) {
+				place_piece_in_global_position(&new_position, movement,
+							       piece_color, promoted_pieces[promotion]);
 
-			if (futurebase_cnt > 1) {
-			    fatal("Multiple futurebases handle %s move %s\n",
-				  colors.at(tb->pieces[pawn].color).c_str(),
-				  movestr[tb->pieces[pawn].color][promotions[pawn][promotion]]);
-			    return false;
-			}
-			if (promotions[pawn][promotion] >= 0) {
-			    handled_futuremoves[tb->pieces[pawn].color] |= FUTUREVECTOR(promotions[pawn][promotion]);
-			    promotions[pawn][promotion] = HANDLED_FUTUREMOVE;
+				result.push_back(std::make_pair(move(piece_type, origin_square, movement,
+								     true, promoted_pieces[promotion]),
+								new_position));
+			    }
 			}
-			break;
 		    }
-		}
-	    }
-	}
-    }
-
-    /* Check for any futurebases that match our piece types exactly.  It (or they) must correspond
-     * to restricted piece movements.
-     */
 
-    int futurebase_cnt = 0;
+		    break;
+		}
 
-    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-	if (futurebases[fbnum].futurebase_type == FuturebaseType::Normal) {
-	    futurebase_cnt ++;
-	}
-    }
+		if (is_en_passant_capture) {
 
-    /* I'd like to construct a mask of all allowable squares for each color and type of piece, and
-     * verify that the futurebases or pruning actually account for all possible restricted
-     * movements.  This would let me catch early things like forgetting to specify a g4 tablebase
-     * for a pawn frozen on g2.  For now, we only check for missing pruning if there are no "normal"
-     * futurebases at all.
-     */
+		    global_position_t new_position = position;
 
-    if (futurebase_cnt == 0) {
-	for (int piece = 0; piece < tb->num_pieces; piece ++) {
-	    if ((! tb->encode_stm) && (tb->pieces[piece].color == PieceColor::Black)) continue;
-	    for (int sq = 0; sq < 64; sq ++) {
-		if (futuremoves[piece][sq] >= 0) {
+		    new_position.clear_en_passant_square();
 
-		    if (! (pruned_futuremoves[tb->pieces[piece].color] & FUTUREVECTOR(futuremoves[piece][sq]))) {
-			fatal("No futurebase or pruning for %s move %s\n",
-			      colors.at(tb->pieces[piece].color).c_str(),
-			      movestr[tb->pieces[piece].color][futuremoves[piece][sq]]);
-			return false;
-		    }
-		}
-	    }
-	}
-    }
+		    new_position.move_piece(movement + ((position.side_to_move == PieceColor::White) ? -8 : 8), movement);
 
-    return true;
-}
+		    new_position.capture_piece(origin_square, movement);
 
+		    new_position.flip_side_to_move();
 
-/* optimize_futuremoves()
- *
- * Once we've assigned futuremove numbers, then gone and checked pruning, some of those futuremoves
- * might now be completely pruned, and their numbers were changed to DISCARD_FUTUREMOVE,
- * CONCEDE_FUTUREMOVE, RESIGN_FUTUREMOVE or HANDLED_FUTUREMOVE.  Find any unused numbers and
- * collapse the remaining futuremoves down into a smaller set.
- */
+		    if (! global_PNTM_in_check(&new_position)) {
 
-void initialize_futuremoves(tablebase_t *tb)
-{
-    for (int piece = 0; piece < tb->num_pieces; piece ++) {
+			result.push_back(std::make_pair(move(piece_type, origin_square, movement, true),
+							new_position));
 
-	for (int piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
+		    }
+		}
 
-	    futurecaptures[piece][piece2] = NO_FUTUREMOVE;
+		/* If we hit a piece (either a capture or our own piece), end this direction of movement */
 
-	    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
-		promotion_captures[piece][piece2][promotion] = NO_FUTUREMOVE;
+		if (!is_non_capture) break;
 	    }
-	}
 
-	for (square_t sq = 0; sq < 64; sq ++) {
-	    futuremoves[piece][sq] = NO_FUTUREMOVE;
 	}
 
-	for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
-	    promotions[piece][promotion] = NO_FUTUREMOVE;
-	}
     }
 }
 
-void remove_futuremove(futurevector_t *fvp, int fm)
-{
-    *fvp = ((*fvp) & (FUTUREVECTOR(fm)-1)) | (((*fvp) & ~(FUTUREVECTOR(fm+1)-1)) >> 1);
-}
+/* There are three different variants of initialize_tablebase_entry(), that differ in their third
+ * argument.  The first one, that does all the work, takes a const local_position_t to protect
+ * against bugs in that code, the second takes a non-const local_position_t and performs an extra
+ * index_to_local_position conversion on it, and the third takes nothing and creates a
+ * local_position_t on the stack.  The third is deprecated since we now like to call
+ * index_to_local_position on an existing position, if possible, because it's often faster
+ * than creating a new position from scratch.
+ */
 
-void optimize_futuremoves(tablebase_t *tb)
+futurevector_t initialize_tablebase_entry(const tablebase_t *tb, const index_t index, const local_position_t &position)
 {
-    int fm, fm2, piece, piece2, sq, promotion;
-
-    for (auto color : BothColors) {
-
-	for (fm = 0; fm < (int) num_futuremoves[color]; fm++) {
-
-	    bool optimize_this_futuremove = true;
-
-	    /* XXX make this a subroutine */
+    /* Now we need to count moves.  FORWARD moves. */
+    unsigned int movecnt = 0;
+    unsigned int capturecnt = 0;
+    unsigned int futuremovecnt = 0;
+    futurevector_t futurevector = 0;
+    futurevector_t capture_futurevector = 0;
 
-	    for (piece = 0; piece < tb->num_pieces; piece ++) {
+    bool concede_prune = false;
+    bool resign_prune = false;
 
-		if (tb->pieces[piece].color != color) continue;
+    move_list<move> moves;
 
-		for (piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
-		    if (futurecaptures[piece][piece2] == fm) {
-			optimize_this_futuremove = false;
-			break;
-		    }
-		    if (tb->pieces[piece].piece_type == PieceType::Pawn) {
-			for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-			    if (promotion_captures[piece][piece2][promotion] == fm) {
-				optimize_this_futuremove = false;
-				break;
-			    }
-			}
-		    }
-		}
-		for (sq = 0; sq < 64; sq ++) {
-		    if (futuremoves[piece][sq] == fm) {
-			optimize_this_futuremove = false;
-			break;
-		    }
-		}
-		if (tb->pieces[piece].piece_type == PieceType::Pawn) {
-		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-			if (promotions[piece][promotion] == fm) {
-			    optimize_this_futuremove = false;
-			    break;
-			}
-		    }
-		}
-	    }
+    /* En passant:
+     *
+     * We're just counting moves here.  In particular, we don't compute the indices of the resulting
+     * positions.  If we did, we'd have to worry about clearing en passant status from any of fourth
+     * or fifth rank pawns, but we don't have to worry about it.
+     *
+     * We do have to count one or two possible extra en passant pawn captures, though...
+     */
 
+    try {
 
-	    if (optimize_this_futuremove) {
+	generate_moves(position, moves);
 
-		for (piece = 0; piece < tb->num_pieces; piece ++) {
+	for (auto &move : moves) {
 
-		    if (tb->pieces[piece].color == color) {
+	    if (index == debug_move) {
+		info("%s ", move.c_str());
+	    }
 
-			for (piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
-			    if (futurecaptures[piece][piece2] > fm) {
-				futurecaptures[piece][piece2] --;
-			    }
-			    if (tb->pieces[piece].piece_type == PieceType::Pawn) {
-				for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-				    if (promotion_captures[piece][piece2][promotion] > fm) {
-					promotion_captures[piece][piece2][promotion] --;
-				    }
-				}
-			    }
-			}
+	    movecnt ++;
 
-			for (sq = 0; sq < 64; sq ++) {
-			    if (futuremoves[piece][sq] > fm) {
-				futuremoves[piece][sq] --;
-			    }
-			}
+	    if (move.is_capture) {
+		capturecnt ++;
+	    }
 
-			if (tb->pieces[piece].piece_type == PieceType::Pawn) {
-			    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-				if (promotions[piece][promotion] > fm) {
-				    promotions[piece][promotion] --;
-				}
-			    }
-			}
+	    if (move.is_futuremove) {
+		if (move.futuremove == DISCARD_FUTUREMOVE) {
+		    /* it's a discard - decrement movecnt so net change is zero */
+		    movecnt --;
+		    /* discard prune - do nothing */
+		} else if (move.futuremove == CONCEDE_FUTUREMOVE) {
+		    concede_prune = true;
+		} else if (move.futuremove == RESIGN_FUTUREMOVE) {
+		    resign_prune = true;
+		} else if (move.futuremove == HANDLED_FUTUREMOVE) {
+		    // move doesn't have to be tracked
+		} else if (move.futuremove < 0) {
+		    global_position_t global;
+		    index_to_global_position(tb, index, &global);
+		    fatal("No futuremove: %" PRIindex " %s %s\n", index, global_position_to_FEN(&global), move.c_str());
+		} else if (futurevector & FUTUREVECTOR(move.futuremove)) {
+		    global_position_t global;
+		    index_to_global_position(tb, index, &global);
+		    // fatal("Duplicate futuremove: %s %s\n", global_position_to_FEN(&global), move.c_str());
+		    fatal("Duplicate futuremove: %" PRIindex " %s %s\n", index, global_position_to_FEN(&global),
+			  movestr[position.side_to_move][move.futuremove]);
+		} else {
+		    futurevector |= FUTUREVECTOR(move.futuremove);
+		    if (move.is_capture) {
+			capture_futurevector |= FUTUREVECTOR(move.futuremove);
 		    }
 		}
+		futuremovecnt ++;
+	    }
+	}
+    } catch (PNTM_mated ex) {
+	entriesTable->initialize_entry_with_PNTM_mated(index);
+	return 0;
+    }
 
-		if (pruned_futuremoves[color] & FUTUREVECTOR(fm)) {
-		    info("Pruned %s futuremove %s\n", colors.at(color).c_str(), movestr[color][fm]);
-		} else if (handled_futuremoves[color] & FUTUREVECTOR(fm)) {
-		    info("%s futuremove %s completely handled by futurebases\n", colors.at(color).c_str(), movestr[color][fm]);
-		} else {
-		    info("Optimized %s futuremove %s, but not sure how!\n", colors.at(color).c_str(), movestr[color][fm]);
-		}
+    if (concede_prune) {
+	entriesTable->initialize_entry_with_concede(index);
+	return 0;
+    }
 
-		remove_futuremove(&(pruned_futuremoves[color]), fm);
-		remove_futuremove(&(unpruned_futuremoves[color]), fm);
-		remove_futuremove(&(conceded_futuremoves[color]), fm);
-		remove_futuremove(&(discarded_futuremoves[color]), fm);
-		remove_futuremove(&(handled_futuremoves[color]), fm);
+    if (resign_prune) {
+	entriesTable->initialize_entry_with_resign(index);
+	return 0;
+    }
 
-		// free(movestr[color][fm]);
+    /* Finally, if every possible moves leads us into check, we determine if we're in check, being
+     * the difference between this being checkmate or stalemate.  In suicide analysis, a stalemate
+     * is a win for the stalemated player (international rules).
+     */
 
-		for (fm2 = fm + 1; fm2 < (int) num_futuremoves[color]; fm2++) {
-		    movestr[color][fm2-1] = movestr[color][fm2];
-		}
+    if (movecnt == 0) {
 
-		num_futuremoves[color] --;
-		fm --;
-	    }
+	if (tb->variant == Variant::Suicide) {
+	    entriesTable->initialize_entry_with_PNTM_mated(index);
+	} else if (PTM_in_check(tb, &position)) {
+	    entriesTable->initialize_entry_with_PTM_mated(index);
+	} else {
+	    entriesTable->initialize_entry_with_stalemate(index);
 	}
-    }
-}
+	return 0;
 
-/***** INTRA-TABLE MOVE PROPAGATION *****/
+    } else {
 
-/* We've got a move that needs to be propagated, so we back out one half-move to all of the
- * positions that could have gotten us here and update their counters in various obscure ways.
- */
+	/* In suicide, captures are forced, so if any captures are possible they are our only moves.
+	 * Of course, if we can capture the opponent's last piece, then we win!
+	 */
 
-void propagate_one_minimove_within_table(tablebase_t *tb, index_t future_index, local_position_t *current_position)
-{
-    index_t current_index;
-    int dtm = entriesTable[future_index].get_DTM();
+	if ((tb->variant == Variant::Suicide) && (capturecnt != 0)) {
+	    movecnt = capturecnt;
+	    futuremovecnt = capturecnt;
+	    futurevector = capture_futurevector;
+	}
 
-    current_index = local_position_to_index(tb, current_position);
+	/* Symmetry and multiplicity.  If we're using a symmetric index, then there might be more
+	 * than one actual board position that corresponds to a given index value.  The number of
+	 * non-identical board positions for a given index is called its multiplicity.  So here we
+	 * multiply the movecnt by the multiplicity of the position to get the total number of moves
+	 * out of all possible positions that correspond to this index.
+	 *
+	 * Actually, when computing position.multiplicity, we ignore horizontal and vertical
+	 * symmetry because they always result in doubled (or quadrupled) board positions.  Diagonal
+	 * symmetry is more difficult to handle because the pieces along the diagonal don't move
+	 * when you reflect the board.  So we need to use position.multiplicity to distinguish
+	 * between the two kings being on the a1/h8 diagonal (multiplicity 1), and one of them being
+	 * off the diagonal (multiplicity 2).
+	 */
 
-    if (current_index == INVALID_INDEX) {
+	entriesTable->initialize_entry_with_movecnt(index, movecnt * position.multiplicity, (capturecnt != 0));
 
-	if (future_index == debug_move) {
-	    info("propagate_one_minimove_within_table:  current_index=INVALID"
-		 "; future_index=%" PRIindex "; dtm=%d\n",
-		 future_index, dtm);
+	if (index == debug_move) {
+	    /* other fields were printed by debug_move statement in initialize_entry() */
+	    info("   futurevector %s\n", futurevector_to_hex(futurevector).c_str());
 	}
 
-	return;
+	total_moves += movecnt;
+	total_futuremoves += futuremovecnt;
+
+	return futurevector;
     }
+}
 
-    if ((current_index == debug_move) || (future_index == debug_move)) {
-	info("propagate_one_minimove_within_table:  current_index=%"
-	     PRIindex "; future_index=%" PRIindex "; dtm=%d\n",
-	     current_index, future_index, dtm);
+template <typename Encoding = index_encoding>
+futurevector_t initialize_tablebase_entry(const tablebase_t *tb, const index_t index, local_position_t &position)
+{
+    if (index == debug_move) {
+	info("Initializing %" PRIindex "\n", index);
     }
 
-    /* Parent position is the FUTURE position.  We now back-propagate to
-     * the current position, which is the PAST position.
-     *
-     * If the player to move in the FUTURE position wins, then we add one to that
-     * player's win count in the PAST position.  On other other hand, if the player not
-     * to move in the FUTURE position wins, then the player to move in the PAST position
-     * has a winning move (the one we're considering).
-     */
+    mark_progress();
+
+    if (! index_to_local_position<Encoding>(tb, index, REFLECTION_NONE, &position)) {
+
+	entriesTable->initialize_entry_as_illegal(index);
+	return 0;
 
-    if (dtm > 0) {
-	commit_update(current_index, -dtm, 1, NO_FUTUREMOVE);
-    } else if (dtm < 0) {
-	commit_update(current_index, -dtm+1, 1, NO_FUTUREMOVE);
-    } else if (entriesTable[future_index].does_PTM_win()) {
-	commit_update(current_index, -2, 1, NO_FUTUREMOVE);
-    } else if (entriesTable[future_index].does_PNTM_win()) {
-	commit_update(current_index, 2, 1, NO_FUTUREMOVE);
     } else {
-	fatal("Intra-table back prop doesn't match dtm or movecnt\n");
+
+	return initialize_tablebase_entry(tb, index, (const local_position_t) position);
+
     }
 }
 
-void propagate_one_move_within_table(tablebase_t *tb, index_t future_index, local_position_t *position)
+futurevector_t initialize_tablebase_entry(tablebase_t *tb, index_t index)
 {
-    int piece;
+    local_position_t position(tb);
 
-    propagate_one_minimove_within_table(tb, future_index, position);
+    return initialize_tablebase_entry(tb, index, position);
+}
 
-    /* En passant:
-     *
-     * We should never enter this function with en-passant set.
-     *
-     * However, we may need to consider a bunch of additional positions here that are identical to
-     * the base position except that a single one of the pawns on the fourth or fifth ranks was
-     * capturable en passant.  Those positions are identical to the base position except that one
-     * extra en passant capture is possible.  Since this is intra-table, we don't do captures.  Just
-     * back-prop into any extra en passant positions that might exist.
-     */
+/* Tablebase initialization is the first important place where we can use threads to speed things up
+ * on a multi-processor machine, though my experience is that actual gains are highly architecture
+ * specific.  Since initialization only touches single entries in the tablebase (no propagation at
+ * this point), thread synchronization is fairly trivial.  We do initialize entire sections instead
+ * of individual entries to avoid processors fighting over cache lines.
+ */
 
-    if (position->en_passant_square != ILLEGAL_POSITION) {
-	fatal("position->en_passant_square != ILLEGAL_POSITION in propagate_one_move_within_table()\n");
+template <typename Encoding>
+void initialize_tablebase_section(index_t start_index, index_t end_index)
+{
+    index_t index;
+    local_position_t position(current_tb);
+
+    for (index=start_index; index <= end_index; index++) {
+	if (current_tb->futurevector_bits > 0) {
+	    set_futurevector(current_tb, index, initialize_tablebase_entry<Encoding>(current_tb, index, position));
+	} else {
+	    initialize_tablebase_entry<Encoding>(current_tb, index, position);
+	}
     }
+}
 
-    for (piece = 0; piece < tb->num_pieces; piece ++) {
+/* Like back propagation, initialization runs sequentially through the whole table, so it also
+ * uses the copy of index_to_local_position() specialized for our index encoding.
+ */
 
-	if (tb->pieces[piece].color == position->side_to_move) continue;
-	if (tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+struct initialize_section {
+    index_t start_index;
+    index_t end_index;
 
-	/* I've taken care to update board_vector in the routine that calls here specifically so we
-	 * can check for en passant legality here.
-	 */
+    template <typename Encoding>
+    void operator()(void) const {
+	initialize_tablebase_section<Encoding>(start_index, end_index);
+    }
+};
 
-	if ((tb->pieces[piece].color == PieceColor::White)
-	    && (ROW(position->piece_position[piece]) == 3)
-	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] - 8))
-	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] - 16))) {
-	    position->set_en_passant_square(position->piece_position[piece] - 8);
-	    propagate_one_minimove_within_table(tb, future_index, position);
-	}
+void initialize_tablebase_section(index_t start_index, index_t end_index)
+{
+    dispatch_on_encoding(current_tb, initialize_section{start_index, end_index});
+}
 
-	if ((tb->pieces[piece].color == PieceColor::Black)
-	    && (ROW(position->piece_position[piece]) == 4)
-	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] + 8))
-	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] + 16))) {
-	    position->set_en_passant_square(position->piece_position[piece] + 8);
-	    propagate_one_minimove_within_table(tb, future_index, position);
-	}
+void initialize_tablebase(void)
+{
+    reset_progress_indicator("Initializing tablebase", current_tb->num_indices);
 
-	position->clear_en_passant_square();
-    }
+    pool.parallel_for(0, current_tb->num_indices,
+		      [](index_t start_index, index_t end_index) {
+			  initialize_tablebase_section(start_index, end_index);
+		      });
+
+    end_progress_indicator();
 }
 
-/* back_propagate_index_within_table()
+/***** CHECKPOINTS *****/
+
+/* A long generation run can save its state at the end of an intra-table pass, and a later run
+ * with --resume can pick up from there instead of starting over.  Intra-table passes are the only
+ * place we checkpoint: by then the futurebases have all been back propagated and the futuremoves
+ * checked, so the only state left is the entries table, the pass counters and statistics, which
+ * passes are still needed, and (if we're using proptables) the updates queued for the next pass.
+ * The intra-table proptable format only records indices, so that's all we save from it.
+ *
+ * The checkpoint is written to a new file which is then renamed over the old one, so there's
+ * always a complete checkpoint on disk, even if we die while writing.  We only checkpoint if at
+ * least checkpoint_interval_minutes have passed since the last one, since each one writes out the
+ * whole entries table.
  *
- * Once the final status of an index has been determined, this function back propagates all moves
- * (within the tablebase) from the corresponding position.
+ * The unpropagated index table and frontier bitmap aren't saved, so the first pass after a resume
+ * sweeps the entire table.
  */
 
-void back_propagate_index_within_table(index_t index, int reflection)
-{
-    local_position_t position(current_tb);
-
-    /* This can fail if the reflection isn't valid for this index */
+std::string checkpoint_filename;
+int checkpoint_interval_minutes = 60;
+bool resume_from_checkpoint = false;
 
-    if (! index_to_local_position(current_tb, index, reflection, &position)) {
+static const char checkpoint_magic[] = "Hoffman checkpoint 2\n";
 
-	if (index == debug_move) {
-	    info("back_propagate_index_within_table; index=%" PRIindex "; reflection %d; INVALID\n",
-		 index, reflection);
-	}
+/* Where propagate_all_moves_within_tablebase() starts or restarts */
 
-	return;
-    }
+struct propagation_state {
+    int dtm = 1;
+    uint64_t positions_finalized_on_last_pass = 0;
+};
 
-    if (index == debug_move) {
-	info("back_propagate_index_within_table; index=%" PRIindex "; reflection %d\n", index, reflection);
-    }
+template <typename T>
+void write_checkpoint_value(std::ostream & os, const T & value)
+{
+    os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
 
-    position.flip_side_to_move();
+template <typename T>
+T read_checkpoint_value(std::istream & is)
+{
+    T value;
+    is.read(reinterpret_cast<char *>(&value), sizeof(T));
+    if (! is) throw std::runtime_error("truncated checkpoint");
+    return value;
+}
 
-    /* If there are any en passant capturable pawns in the position, then the last move had to
-     * have been a pawn move.  In fact, in this case, we already know exactly what the last move
-     * had to have been.
-     */
+/* Things that have to match between the run that wrote the checkpoint and this one */
 
-    if (position.en_passant_square != ILLEGAL_POSITION) {
+void write_checkpoint_header(std::ostream & os)
+{
+    os.write(checkpoint_magic, sizeof(checkpoint_magic));
+    write_checkpoint_value<uint64_t>(os, control_file_hash);
+    write_checkpoint_value<uint64_t>(os, current_tb->num_indices);
+    write_checkpoint_value<int>(os, sizeof(entry_t));
+    write_checkpoint_value<int>(os, movecnt_bits);
+    write_checkpoint_value<int>(os, dtm_bits);
+    write_checkpoint_value<bool>(os, tracking_dtm);
+    write_checkpoint_value<bool>(os, using_proptables);
+    write_checkpoint_value<int>(os, min_tracked_dtm);
+    write_checkpoint_value<int>(os, max_tracked_dtm);
+}
 
-	int en_passant_pawn = -1;
+void write_checkpoint(const propagation_state & state)
+{
+    static time_t last_checkpoint = time(nullptr);
 
-	/* XXX let's store en_passant_pawn in the local position structure and avoid this loop */
+    if (checkpoint_filename.empty()) return;
+    if (time(nullptr) - last_checkpoint < checkpoint_interval_minutes * 60) return;
 
-	for (int piece = 0; piece < current_tb->num_pieces; piece++) {
+    std::string new_filename = checkpoint_filename + ".new";
+    std::ofstream os(new_filename, std::ofstream::binary | std::ofstream::trunc);
 
-	    if (current_tb->pieces[piece].color != position.side_to_move) continue;
-	    if (current_tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+    info("Writing checkpoint to '%s'\n", checkpoint_filename.c_str());
 
-	    if (((current_tb->pieces[piece].color == PieceColor::White)
-		 && (position.piece_position[piece] - 8 == position.en_passant_square))
-		|| ((current_tb->pieces[piece].color == PieceColor::Black)
-		    && (position.piece_position[piece] + 8 == position.en_passant_square))) {
-		if (en_passant_pawn != -1) fatal("Two en passant pawns in back prop?!\n");
-		en_passant_pawn = piece;
-	    }
-	}
-	if (en_passant_pawn == -1) {
-	    fatal("No en passant pawn in back prop!?\n");
-	} else {
+    write_checkpoint_header(os);
 
-	    int square;
+    write_checkpoint_value(os, state.dtm);
+    write_checkpoint_value(os, state.positions_finalized_on_last_pass);
 
-	    if (current_tb->pieces[en_passant_pawn].color == PieceColor::White)
-		square = position.piece_position[en_passant_pawn] - 16;
-	    else
-		square = position.piece_position[en_passant_pawn] + 16;
+    write_checkpoint_value(os, max_dtm);
+    write_checkpoint_value(os, min_dtm);
+    write_checkpoint_value<uint64_t>(os, total_legal_positions);
+    write_checkpoint_value<uint64_t>(os, total_PNTM_mated_positions);
+    write_checkpoint_value<uint64_t>(os, total_stalemate_positions);
+    write_checkpoint_value<uint64_t>(os, total_moves);
+    write_checkpoint_value<uint64_t>(os, total_futuremoves);
+    write_checkpoint_value<uint64_t>(os, total_backproped_moves);
+    write_checkpoint_value<uint64_t>(os, player_wins[PieceColor::White]);
+    write_checkpoint_value<uint64_t>(os, player_wins[PieceColor::Black]);
 
-	    /* We never back out into a restricted position.  Since we've already decided that this
-	     * is the only legal back-move from this point, well...
-	     */
+    os.write(reinterpret_cast<char *>(positive_passes_needed), (max_tracked_dtm + 1) * sizeof(bool));
+    os.write(reinterpret_cast<char *>(negative_passes_needed), (-min_tracked_dtm + 1) * sizeof(bool));
 
-	    if (! (current_tb->pieces[en_passant_pawn].semilegal_squares & BITVECTOR(square))) {
-		return;
-	    }
+    write_checkpoint_value(os, total_passes);
+    for (int pass = 0; pass < total_passes; pass ++) {
+	std::string type(pass_type[pass] ? pass_type[pass] : "");
+	write_checkpoint_value<uint32_t>(os, type.size());
+	os.write(type.data(), type.size());
+	write_checkpoint_value(os, pass_target_dtms[pass]);
+	write_checkpoint_value(os, positions_finalized[pass]);
+	write_checkpoint_value(os, backproped_moves[pass]);
+    }
 
-	    local_position_t new_position = position;
+    entriesTable->write_checkpoint(os);
 
-	    new_position.clear_en_passant_square();
+    /* Write out the queued updates where they are, in memory and in the proptable's temporary
+     * files, without retrieving them, since that would empty the proptable.  The count comes
+     * first, so we count them as we go and patch it in afterwards.
+     */
 
-	    new_position.move_piece(en_passant_pawn, square);
+    if (using_proptables) {
+	uint64_t count = 0;
+	std::streampos count_position = os.tellp();
 
-	    propagate_one_move_within_table(current_tb, index, &new_position);
-	}
+	write_checkpoint_value<uint64_t>(os, count);
+	output_proptable->for_each([&](const proptable_entry & entry) {
+		write_checkpoint_value<uint64_t>(os, entry.index);
+		count ++;
+	    });
 
-	return;
+	std::streampos end_position = os.tellp();
+	os.seekp(count_position);
+	write_checkpoint_value<uint64_t>(os, count);
+	os.seekp(end_position);
     }
 
-    /* foreach (mobile piece of player NOT TO PLAY) { */
-
-    for (int piece = 0; piece < current_tb->num_pieces; piece++) {
+    os.close();
 
-	/* We've moving BACKWARDS in the game, so we want the pieces of the player who is NOT TO
-	 * PLAY here - this is the LAST move we're considering, not the next move.
-	 */
+    if (! os) {
+	warning("Can't write checkpoint '%s': %s\n", new_filename.c_str(), strerror(errno));
+	unlink(new_filename.c_str());
+	return;
+    }
 
-	if (current_tb->pieces[piece].color != position.side_to_move)
-	    continue;
+    if (rename(new_filename.c_str(), checkpoint_filename.c_str()) == -1) {
+	warning("Can't rename '%s' to '%s': %s\n", new_filename.c_str(), checkpoint_filename.c_str(), strerror(errno));
+	return;
+    }
 
-	square_t origin_square = position.piece_position[piece];
+    last_checkpoint = time(nullptr);
+}
 
-	for (auto &dir : movements(current_tb->pieces[piece].piece_type,
-				   current_tb->pieces[piece].color,
-				   origin_square,
-				   Movement::Backward, Movement::NonCapture)) {
+/* Called instead of the initialization, futurebase back prop and futuremove check passes, once
+ * the entries table (and, with proptables, an empty output proptable) has been allocated.
+ */
 
-	    /* What about captures?  Well, first of all, there are no captures here!  We're moving
-	     * BACKWARDS in the game... and pieces don't appear out of thin air.  Captures are
-	     * handled by back-propagation from futurebases, not here in the movement code.  The
-	     * piece moving had to come from somewhere, and that somewhere will now be an empty
-	     * square, so once we've hit another piece along a movement vector, there's absolutely
-	     * no need to consider anything further.
-	     */
+bool read_checkpoint(propagation_state & state)
+{
+    std::ifstream is(checkpoint_filename, std::ifstream::binary);
 
-	    for (auto &movement : dir) {
+    if (! is) {
+	fatal("Can't open checkpoint '%s': %s\n", checkpoint_filename.c_str(), strerror(errno));
+	return false;
+    }
 
-		if ((position.board_vector & BITVECTOR(movement)) != 0) break;
+    info("Resuming from checkpoint '%s'\n", checkpoint_filename.c_str());
 
-		/* We never back out into a restricted position (obviously) */
+    try {
+	std::ostringstream expected;
+	write_checkpoint_header(expected);
 
-		if (! (current_tb->pieces[piece].semilegal_squares & BITVECTOR(movement))) continue;
+	std::string header(expected.str().size(), '\0');
+	is.read(&header[0], header.size());
 
-		/* Back stepping a half move here involves several things: flipping the side-to-move
-		 * flag, clearing any en passant pawns into regular pawns, moving the piece
-		 * (backwards), and considering a bunch of additional positions identical to the
-		 * base position except that a single one of the pawns on the fourth or fifth ranks
-		 * was capturable en passant.
-		 *
-		 * En passant.
-		 *
-		 * The only way we could have gotten an en passant pawn is if THIS MOVE created it.
-		 * We handle that as a special case above, so we shouldn't have to worry about
-		 * clearing en passant pawns here - there should be none.
-		 *
-		 * However, we may be considering a position without en passant set, but from which
-		 * a backwards double pawn move is possible.  We want to know if it has a matching
-		 * position with en passant set.  If so, we do nothing here, since the double pawn
-		 * move will be handled by the en passant code above.  If not, we process the double
-		 * pawn move here.
-		 *
-		 * Checking additional en passant positions is taken care of in
-		 * propagate_one_move_within_table()
-		 */
+	if (header != expected.str()) {
+	    fatal("Checkpoint '%s' doesn't match this tablebase or these options\n", checkpoint_filename.c_str());
+	    return false;
+	}
 
-		if ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
-		    && (abs(movement - origin_square) == 16)) {
+	state.dtm = read_checkpoint_value<int>(is);
+	state.positions_finalized_on_last_pass = read_checkpoint_value<uint64_t>(is);
 
-		    local_position_t new_position = position;
+	max_dtm = read_checkpoint_value<int>(is);
+	min_dtm = read_checkpoint_value<int>(is);
+	total_legal_positions = read_checkpoint_value<uint64_t>(is);
+	total_PNTM_mated_positions = read_checkpoint_value<uint64_t>(is);
+	total_stalemate_positions = read_checkpoint_value<uint64_t>(is);
+	total_moves = read_checkpoint_value<uint64_t>(is);
+	total_futuremoves = read_checkpoint_value<uint64_t>(is);
+	total_backproped_moves = read_checkpoint_value<uint64_t>(is);
+	player_wins[PieceColor::White] = read_checkpoint_value<uint64_t>(is);
+	player_wins[PieceColor::Black] = read_checkpoint_value<uint64_t>(is);
 
-		    if (new_position.side_to_move == PieceColor::White) {
-			new_position.set_en_passant_square(origin_square - 8);
-		    } else {
-			new_position.set_en_passant_square(origin_square + 8);
-		    }
-		    new_position.flip_side_to_move();
+	is.read(reinterpret_cast<char *>(positive_passes_needed), (max_tracked_dtm + 1) * sizeof(bool));
+	is.read(reinterpret_cast<char *>(negative_passes_needed), (-min_tracked_dtm + 1) * sizeof(bool));
 
-		    bool en_passant_position_exists = (local_position_to_index(current_tb, &new_position) != INVALID_INDEX);
+	/* The earlier passes' statistics come back, but not their timings, which were only ever
+	 * recorded in the old run's XML header.
+	 */
 
-		    if (en_passant_position_exists) continue;
-		}
+	int passes = read_checkpoint_value<int>(is);
+	while (max_passes <= passes) expand_per_pass_statistics();
 
-		local_position_t new_position = position;
+	for (total_passes = 0; total_passes < passes; total_passes ++) {
+	    std::string type(read_checkpoint_value<uint32_t>(is), '\0');
+	    is.read(&type[0], type.size());
+	    pass_type[total_passes] = strdup(type.c_str());
+	    pass_target_dtms[total_passes] = read_checkpoint_value<int>(is);
+	    positions_finalized[total_passes] = read_checkpoint_value<uint64_t>(is);
+	    backproped_moves[total_passes] = read_checkpoint_value<uint64_t>(is);
+	}
 
-		new_position.move_piece(piece, movement);
+	entriesTable->read_checkpoint(is);
 
-		propagate_one_move_within_table(current_tb, index, &new_position);
+	if (using_proptables) {
+	    uint64_t count = read_checkpoint_value<uint64_t>(is);
+	    for (uint64_t i = 0; i < count; i ++) {
+		proptable_entry entry(read_checkpoint_value<uint64_t>(is), 0, 1, 0);
+		output_proptable->push(entry);
 	    }
 	}
 
+	if (! is) throw std::runtime_error("truncated checkpoint");
+
+    } catch (std::exception & ex) {
+	fatal("Can't read checkpoint '%s': %s\n", checkpoint_filename.c_str(), ex.what());
+	return false;
     }
+
+    pass_type[total_passes] = "checkpoint resume";
+    finalize_pass_statistics();
+    total_passes ++;
+    if (total_passes == max_passes) expand_per_pass_statistics();
+
+    return true;
 }
 
-/* In-check tests
- *
- * We use board masks for quickly testing a position to see if we're in check.
- *
- * The test works by indexing an array by piece type, piece square, and king square, which returns a
- * mask that is ANDed with the board mask.  If the result is non-zero, then no capture is possible.
- * If the result is zero, then the king's in check from that piece.  For sliding piece attacks, we
- * use a mask with ones along the path between the two squares.  For positions where capture is
- * always possible, we use a zero mask.  For positions where no capture is possible, we use an
- * all-1s mask.
- *
- * We segregate pawn checks by color; they are a special case.
- *
- * sizeof(board_mask) = 229376, so this array should fit in your average L2 cache (mine is 2 MB)
+/* Intra-table propagation is (almost) trivial.  Keep making passes over the tablebase first until
+ * we've processed everything from the futurebases, then until no more progress can be made.  We
+ * don't even have to make every pass, just the ones that have mates in the entries table (and we
+ * track that as we finalize the mates).  Once we're past all the mates that came in from the
+ * futurebases (that's what max_tracked_dtm and min_tracked_dtm show), the only way we can have new
+ * mates is by following a line that's completely within this tablebase, so we keep going until one
+ * of the passes didn't finalize any positions.
  *
- * XXX could use this to speed up the routines after PTM_in_check(), but none of them are used
- * during generation, so they're not as important.
+ * We have to be a little bit careful when we're using proptables, since we can have stuff queued up
+ * in the current proptable that hasn't be reflected in the positive_passes_needed[] and
+ * negative_passes_needed[] arrays, so if we're using proptables, then we ALWAYS run the next pass
+ * after a pass that finalized some positions.
  */
 
-//board_mask[7][64][64];
-
-std::map<PieceType, uint64_t[64][64]> board_mask;
-std::map<PieceColor, bool[64][64]> pawn_board_mask;
-
-void initialize_board_masks(void)
+void propagate_all_moves_within_tablebase(tablebase_t *tb, propagation_state state)
 {
-    /* Initialize entire array with ALL_ONES_BITVECTOR */
-    for (square_t A = 0; A < 64; A ++) {
-	for (square_t B = 0; B < 64; B ++) {
-	    for (auto piece : AllPieceTypes) {
-		board_mask[piece][A][B] = ALL_ONES_BITVECTOR;
-	    }
-	    for (auto color : BothColors) {
-		pawn_board_mask[color][A][B] = false;
-	    }
-	}
-    }
-
-    for (int piece_square = 0; piece_square < 64; piece_square ++) {
-
-	for (auto piece : AllPieceTypes) {
+    int & dtm = state.dtm;
+    uint64_t & positions_finalized_on_last_pass = state.positions_finalized_on_last_pass;
 
-	    if (piece != PieceType::Pawn) {
-
-		for (auto &dir : movements(piece, PieceColor::White,
-					   piece_square,
-					   Movement::Forward, Movement::Capture)) {
+    doing_capture_backprop = false;
 
-		    uint64_t mask = 0;
+    /* DTM 1 positions are illegal (PNTM is in check), so back prop from these positions is not
+     * needed or desired because we don't count moves into check as part of movecnt.
+     */
 
-		    for (auto &movement : dir) {
+    positive_passes_needed[1] = false;
 
-			board_mask[piece][piece_square][movement] = mask;
+    /* If we're tracking DTM, then run at least until we've looked at all the DTM values that came
+     * in from the futurebases.
+     */
 
-			mask |= BITVECTOR(movement);
+    if (tracking_dtm) {
 
-		    }
-		}
+	while ((dtm <= max_tracked_dtm) || (-dtm >= min_tracked_dtm)) {
 
-	    } else {
+	    /* PTM wins */
+	    if (((dtm <= max_tracked_dtm) && positive_passes_needed[dtm])
+		|| (positions_finalized_on_last_pass > 0))
+		positions_finalized_on_last_pass = propagation_pass(dtm);
+	    else
+		positions_finalized_on_last_pass = 0;
 
-		for (auto color : BothColors) {
+	    if (dtm <= max_tracked_dtm) positive_passes_needed[dtm] = false;
 
-		    for (auto &dir : movements(piece, color,
-					       piece_square,
-					       Movement::Forward, Movement::Capture)) {
+	    /* PNTM wins */
+	    if (((-dtm >= min_tracked_dtm) && negative_passes_needed[dtm])
+		|| (positions_finalized_on_last_pass > 0))
+		positions_finalized_on_last_pass = propagation_pass(-dtm);
+	    else
+		positions_finalized_on_last_pass = 0;
 
-			for (auto &movement : dir) {
+	    if (-dtm >= min_tracked_dtm) negative_passes_needed[dtm] = false;
 
-			    pawn_board_mask[color][piece_square][movement] = true;
+	    dtm ++;
 
-			}
-		    }
-		}
-	    }
+	    write_checkpoint(state);
 	}
-    }
-}
-
-bool PTM_in_check(const tablebase_t *tb, const local_position_t *position)
-{
-    /* The concept of check doesn't exist in suicide - kings are normal pieces */
-
-    if (tb->variant == Variant::Suicide) return false;
-
-    const int king = (position->side_to_move == PieceColor::White) ? tb->white_king : tb->black_king;
-    const int king_position = position->piece_position[king];
-
-    for (int piece = 0; piece < tb->num_pieces; piece++) {
 
-	/* We only want to consider pieces of the side which is NOT to move... */
+    } else {
 
-	if (tb->pieces[piece].color == position->side_to_move) continue;
+	positions_finalized_on_last_pass = 1;
 
-	/* We might have removed the piece from the position... */
+    }
 
-	if (position->piece_position[piece] == ILLEGAL_POSITION) continue;
+    /* Now keep running until there's nothing left to process */
 
-	if (tb->pieces[piece].piece_type != PieceType::Pawn) {
+    while (1) {
 
-	    if ((board_mask[tb->pieces[piece].piece_type][position->piece_position[piece]][king_position]
-		 & position->board_vector) == 0) return true;
+	/* PTM wins */
+	if (positions_finalized_on_last_pass > 0)
+	    positions_finalized_on_last_pass = propagation_pass(dtm);
+	else break;
 
-	} else {
+	/* PNTM wins */
+	if (positions_finalized_on_last_pass > 0)
+	    positions_finalized_on_last_pass = propagation_pass(-dtm);
+	else break;
 
-	    if (pawn_board_mask[tb->pieces[piece].color][position->piece_position[piece]][king_position])
-		return true;
+	dtm ++;
 
-	}
+	write_checkpoint(state);
     }
 
-    return false;
 }
 
-bool global_PTM_in_check(global_position_t *position)
-{
-    if (position->variant == Variant::Suicide) return false;
+/* Writing the finished tablebase.
+ *
+ * The entries are packed and compressed in blocks, a batch of blocks at a time, by all the threads
+ * in the pool, and then written out in order by the main thread.  Packing needs random access to
+ * the entries table, so if it's a DiskEntriesTable (which wants its threads to move in lockstep),
+ * the main thread does the packing and only the compression is parallel.
+ *
+ * The blocked format already is a sequence of independently compressed blocks of futurebase_stride
+ * entries.  The gzip format is done the way pigz does it: each block is compressed as a separate
+ * raw deflate stream, primed with the last 32 KB of the data before it and ended with a sync flush
+ * (except for the last one, which finishes the stream), so that they concatenate into a single
+ * deflate stream.  We write the gzip header and trailer ourselves, combining the blocks' CRCs with
+ * crc32_combine().  The result is one ordinary gzip member, so anything that could read the old
+ * files can read the new ones.
+ */
 
-    for (square_t square = 0; square < 64; square ++) {
+const index_t gzip_output_block_size = 256 * 1024;	/* entries */
+const size_t output_batch_bytes = 64 * 1024 * 1024;	/* packed entries per batch, roughly */
+const size_t deflate_window_size = 32 * 1024;
 
-	if (position->board[square] == 0) continue;
+struct output_block {
+    std::vector<char> packed;
+    std::vector<char> compressed;
+    uLong crc;
+    bool ok;
+};
 
-	auto const pair = global_pieces2.at(position->board[square]);
+/* Pack 'count' entries, starting at 'start' (a multiple of eight), into 'buf' in the tablebase's
+ * output format.  Each eight entries take exactly tb->format.bits bytes.
+ */
 
-	/* We only want to consider pieces of the side which is NOT to move... */
+void pack_tablebase_entries(tablebase_t *tb, index_t start, index_t count, char *buf)
+{
+    for (index_t index = start; index < start + count; index ++) {
 
-	if (position->side_to_move == pair.first) continue;
+	char *entrybuf = buf + ((index - start) / 8) * tb->format.bits;
 
-	const PieceType piece_type = pair.second;
+	if (index == debug_move) {
+	    info("Writing %" PRIindex ": DTM %d; movecnt %d\n", index,
+		 entriesTable[index].get_DTM(), entriesTable[index].get_movecnt());
+	}
 
-	for (auto &dir : movements(piece_type, pair.first, square,
-				   Movement::Forward, Movement::Capture)) {
+	/* Right now, there's four possible fields in the tablebase format itself (as opposed to the
+	 * intermediate entries and proptable formats) - dtm, dtc, basic, and flag.
+	 */
 
-	    for (auto &movement : dir) {
+	if (tb->format.dtm_bits > 0) {
+	    set_int_field(entrybuf,
+			  tb->format.dtm_offset + ((index % 8) * tb->format.bits),
+			  tb->format.dtm_bits,
+			  entriesTable[index].get_DTM());
+	}
 
-		/* Now check to see if the movement ended because we hit against the king
-		 * of the opposite color.  If so, we're in check.
-		 */
+	if (tb->format.dtc_bits > 0) {
+	    set_int_field(entrybuf,
+			  tb->format.dtc_offset + ((index % 8) * tb->format.bits),
+			  tb->format.dtc_bits,
+			  entriesTable[index].get_DTM());
+	}
 
-		if ((position->side_to_move == PieceColor::White) && (position->board[movement] == 'K'))
-		    return true;
-		if ((position->side_to_move == PieceColor::Black) && (position->board[movement] == 'k'))
-		    return true;
-		
-		/* Otherwise, if we hit a piece, end this movement and go on to the next one */
+	if (tb->format.basic_offset != -1) {
+	    Basic basic;
 
-		if (position->board[movement] != 0) break;
+	    /* 2-bit BASIC format
+	     *
+	     * 0 - draw
+	     * 1 - PTM wins
+	     * 2 - PNTM wins
+	     * 3 - illegal position (PNTM in check)
+	     *
+	     * Indices that generate illegal positions, not in the above sense, but in the sense of
+	     * multiple pieces mapping to the same square, will get recorded as draws, but these can
+	     * be easily identified by the index-to-position function, so their values in the
+	     * tablebase are largely irrelevant.  Type 3 illegal positions (PNTM in check) are not
+	     * so obvious and need to be flagged as such to avoid using them during backprop.
+	     */
 
+	    if (entriesTable[index].get_DTM() == 1) {
+		basic = Basic::Illegal;
+	    } else if (entriesTable[index].does_PTM_win()) {
+		basic = Basic::PTMwins;
+	    } else if (entriesTable[index].does_PNTM_win()) {
+		basic = Basic::PNTMwins;
+	    } else {
+		basic = Basic::Draw;
 	    }
+	    set_unsigned_int_field(entrybuf,
+				   tb->format.basic_offset + ((index % 8) * tb->format.bits), 2,
+				   static_cast<int>(basic));
 	}
-    }
 
-    return false;
+	switch (tb->format.flag_type) {
+	case FormatFlag::WhiteWins:
+	    set_bit_field(entrybuf,
+			  tb->format.flag_offset + ((index % 8) * tb->format.bits),
+			  (index_to_side_to_move(tb, index) == PieceColor::White)
+			  ? entriesTable[index].does_PTM_win() : entriesTable[index].does_PNTM_win());
+	    break;
+	case FormatFlag::WhiteDraws:
+	    set_bit_field(entrybuf,
+			  tb->format.flag_offset + ((index % 8) * tb->format.bits),
+			  (index_to_side_to_move(tb, index) == PieceColor::White)
+			  ? ! entriesTable[index].does_PNTM_win() : ! entriesTable[index].does_PTM_win());
+	    break;
+	case FormatFlag::None:
+	    break;
+	}
+    }
 }
 
-/* XXX very similar to global_PTM_in_check */
+/* Compress one block of a gzip format tablebase as part of a larger raw deflate stream, as
+ * described above.  'dictionary' is the data immediately preceding it.
+ */
 
-bool global_PNTM_in_check(global_position_t *position)
+bool deflate_output_block(const std::vector<char> & data, const char *dictionary, size_t dictionary_size,
+			  bool last, std::vector<char> & out)
 {
-    if (position->variant == Variant::Suicide) return false;
+    z_stream strm;
+    int ret;
 
-    for (square_t square = 0; square < 64; square ++) {
+    memset(&strm, 0, sizeof(strm));
 
-	if (position->board[square] == 0) continue;
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	return false;
+    }
 
-	auto const pair = global_pieces2.at(position->board[square]);
+    if (dictionary_size > 0) {
+	deflateSetDictionary(&strm, reinterpret_cast<const Bytef *>(dictionary), dictionary_size);
+    }
 
-	/* We only want to consider pieces of the side which is to move... */
+    /* deflateBound() assumes Z_FINISH; a sync flush adds an empty stored block, five bytes */
 
-	if (position->side_to_move != pair.first) continue;
+    out.resize(deflateBound(&strm, data.size()) + 16);
 
-	const PieceType piece_type = pair.second;
+    strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    strm.avail_in = data.size();
+    strm.next_out = reinterpret_cast<Bytef *>(out.data());
+    strm.avail_out = out.size();
 
-	for (auto &dir : movements(piece_type, pair.first, square,
-				   Movement::Forward, Movement::Capture)) {
+    ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
 
-	    for (auto &movement : dir) {
+    out.resize(out.size() - strm.avail_out);
+    deflateEnd(&strm);
 
-		/* Now check to see if the movement ended because we hit against the king
-		 * of the opposite color.  If so, we're in check.
-		 */
+    return (ret == (last ? Z_STREAM_END : Z_OK)) && (strm.avail_in == 0) && (strm.avail_out > 0);
+}
 
-		if ((position->side_to_move == PieceColor::White) && (position->board[movement] == 'k'))
-		    return true;
-		if ((position->side_to_move == PieceColor::Black) && (position->board[movement] == 'K'))
-		    return true;
+void write_little_endian(std::ostream & os, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i ++) {
+	os.put((value >> (8*i)) & 0xff);
+    }
+}
 
-		/* Otherwise, if we hit a piece, end this movement and go on to the next one */
+/* The 'filename' argument passed in here can either be a filename or a URL.  We don't distinguish
+ * between them except by looking at their prefix (though it would be easy to add an extra flag
+ * argument to do so), so hopefully nobody will try to create tablebases starting with 'ftp:'.  Much
+ * of the error checking on 'filename' is done by the caller, since we'd like that error checking to
+ * occur prior to a time consuming generation run, rather than when we're ready to write the
+ * finished product out.
+ *
+ * XXX put URL support back in
+ *
+ * XXX figure out boost iostreams error handling
+ */
 
-		if (position->board[movement] != 0) break;
-	    }
+void write_tablebase_to_file(tablebase_t *tb, Glib::ustring filename)
+{
+    xmlpp::Document * doc;
+    int dtm_bits;
+    int size;
+    int padded_size;
+    int offset;
+
+    for (dtm_bits = 1; (1 << (dtm_bits - 1) <= max_dtm) || (1 << (dtm_bits - 1) < -min_dtm); dtm_bits ++);
 
+    if ((tb->format.dtm_offset != -1) && (tb->format.dtm_bits == 0)) {
+	tb->format.dtm_bits = dtm_bits;
+	tb->format.bits += dtm_bits;
+    } else if (tb->format.dtm_bits > 0) {
+	if (tb->format.dtm_bits < dtm_bits) {
+	    fatal("Requested DTM field size too small\n");
+	    terminate();
 	}
     }
 
-    return false;
-}
+    if ((tb->format.dtc_offset != -1) && (tb->format.dtc_bits == 0)) {
+	tb->format.dtc_bits = dtm_bits;
+	tb->format.bits += dtm_bits;
+    } else if (tb->format.dtc_bits > 0) {
+	if (tb->format.dtc_bits < dtm_bits) {
+	    fatal("Requested DTC field size too small\n");
+	    terminate();
+	}
+    }
 
-bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position)
-{
-    if (tb->variant == Variant::Suicide) return false;
+    doc = finalize_XML_header(tb);
 
-    for (int piece = 0; piece < tb->num_pieces; piece++) {
+    /* We want at least one zero byte after the XML header, because that's how we figure out where
+     * it ends when we read it back in, and I also want to align the tablebase on a four-byte
+     * boundary for the hell of it.  (size+5)&(~3) achieves these goals.  I then modify the XML
+     * header with the updated string that gives the offset to the tablebase, and make sure that its
+     * size hasn't changed.
+     */
 
-	/* We only want to consider pieces of the side which is to move... */
+    size = doc->write_to_string().length();
 
-	if (tb->pieces[piece].color != position->side_to_move) continue;
+    do {
 
-	for (auto &dir : movements(tb->pieces[piece].piece_type,
-				   tb->pieces[piece].color,
-				   position->piece_position[piece],
-				   Movement::Forward, Movement::Capture)) {
+	padded_size = (size+5)&(~3);
 
-	    for (auto &movement : dir) {
+	offset = padded_size;
+	if (tb->pawngen) {
+	    dynamic_cast<xmlpp::Element *>(doc->get_root_node()->find("//pawngen")[0])->set_attribute("offset", boost::lexical_cast<std::string>(offset));
+	    offset += pawn_position::binary_size * tb->pawngen->pawn_positions_by_index.size();
+	}
 
-		/* Now check to see if the movement ended because we hit against the king
-		 * of the opposite color.  If so, we're in check.
-		 */
+	doc->get_root_node()->set_attribute("offset", boost::lexical_cast<std::string>(offset));
 
-		if ((position->side_to_move == PieceColor::White)
-		    && (movement == position->piece_position[tb->black_king])) return true;
+	if (output_format == OutputFormat::Blocked) {
+	    doc->get_root_node()->set_attribute("block-size", boost::lexical_cast<std::string>(futurebase_stride));
+	}
 
-		if ((position->side_to_move == PieceColor::Black)
-		    && (movement == position->piece_position[tb->white_king])) return true;
+	size = doc->write_to_string().length();
 
-		if (position->board_vector & BITVECTOR(movement)) break;
-	    }
-	}
-    }
+    } while (padded_size != ((size+5)&(~3)));
 
-    return false;
-}
+    info("Writing '%s'\n", filename.c_str());
 
-/* initialize_tablebase()
- *
- * This is another critical function; don't be deceived by the tame word 'initialize'.
- *
- * We determine that a position is won for the player not to move (PNTM) if all possible moves (of
- * the player to move) lead to a won game for PNTM.  We count down this total during back
- * propagation, so it stands to reason that we need an accurate count to start with.  Thus the
- * importance of this function.
- *
- * We don't count moves into check at all.
- *
- * Basically, there are two types of moves we need to consider in each position:
- *
- * 1. non-capture, non-promotion, non-restricted moves
- *
- * We just add these up and then count them down during intra-table propagation, depending on the
- * integrity of the program's algorithm to make sure that every move counted forward gets considered
- * as a move backward.
- *
- * 2. everything else (futuremoves)
- *
- * These always lead to a different tablebase (a futurebase).  The only way we handle them is
- * through inter-table back propagation.  We keep a seperate count of futuremoves because, unlike
- * intratable moves, we might miss some of these moves if we don't have a complete set of
- * futurebases.  So we count futuremoves by themselves (as well as part of the standard count), and
- * count them down normally during a single sweep through our futurebases.  If that takes care of
- * everything fine.  Otherwise, during our first pass through the current tablebase, we'll find that
- * some of the futuremoves remain unaccounted for.  If they occur with the "good guys" as PTM, we
- * just double-check that the restriction is OK, subtract the remaining futuremoves out from the
- * standard count, and keep going.  But if the "bad guys" are PTM, then the position has to be
- * assumed won for PTM.
- *
- */
+    std::ofstream output_file;
+    output_file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+    output_file.open(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+
+    const index_t block_size = (output_format == OutputFormat::Blocked) ? futurebase_stride : gzip_output_block_size;
+    const index_t num_blocks = (tb->num_indices + block_size - 1) / block_size;
 
-class move {
+    /* Everything that comes before the entries goes into 'prefix'.  First we write an XML
+     * header...
+     */
 
-    PieceType piece_type;
-    square_t origin_square;
-    square_t destination_square;
-    PieceType promotion_type;
+    std::ostringstream prefix;
 
-public:
+    doc->write_to_stream(prefix);
 
-    int futuremove;
+    for (; size < padded_size; size ++) prefix << '\0';
 
-    bool is_futuremove;
-    bool is_capture;
-    bool is_promotion;
+    /* Then any pawngen data */
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  is_futuremove(false), is_capture(false), is_promotion(false)
-    { }
+    if (tb->pawngen) {
+	for (auto & pp : tb->pawngen->pawn_positions_by_index) {
+	    pp >> prefix;
+	}
+    }
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, int futuremove)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  futuremove(futuremove),
-	  is_futuremove(true), is_capture(false), is_promotion(false)
-    { }
+    /* In the block-compressed format, the table of block offsets goes at 'offset' and the blocks
+     * follow it.  We don't know the compressed sizes until we've written the blocks, so we leave
+     * space for the table here and come back to fill it in at the end.
+     */
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, PieceType promotion_type)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  promotion_type(promotion_type),
-	  is_futuremove(true), is_capture(false), is_promotion(true)
-    { }
+    std::vector<uint64_t> block_offsets;
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, PieceType promotion_type, int futuremove)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  promotion_type(promotion_type), futuremove(futuremove),
-	  is_futuremove(true), is_capture(false), is_promotion(true)
-    { }
+    if (output_format == OutputFormat::Blocked) {
+	block_offsets.push_back(offset + 8 * (num_blocks + 1));
+	for (index_t i = 0; i < num_blocks + 1; i ++) {
+	    prefix.write("\0\0\0\0\0\0\0\0", 8);
+	}
+    }
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  is_futuremove(true), is_capture(is_capture), is_promotion(false)
-    { }
+    const std::string prefix_data = prefix.str();
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, int futuremove)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  futuremove(futuremove),
-	  is_futuremove(true), is_capture(is_capture), is_promotion(false)
-    { }
+    /* For the gzip format, we track the CRC and length of the uncompressed data, and its last
+     * deflate_window_size bytes, which prime the compression of the next block.
+     */
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, PieceType promotion_type)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  promotion_type(promotion_type),
-	  is_futuremove(true), is_capture(is_capture), is_promotion(true)
-    { }
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint64_t uncompressed_size = prefix_data.size();
+    std::vector<char> previous_tail;
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, PieceType promotion_type, int futuremove)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  promotion_type(promotion_type), futuremove(futuremove),
-	  is_futuremove(true), is_capture(is_capture), is_promotion(true)
-    { }
+    if (output_format == OutputFormat::Gzip) {
+	static const char gzip_header[10] = {'\x1f', '\x8b', Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3};
+	std::vector<char> data(prefix_data.begin(), prefix_data.end());
+	std::vector<char> compressed;
 
-    operator std::string() const {
-	return piece_char[piece_type] + algebraic_notation(origin_square)
-	    + (is_capture ? "x" : "") + algebraic_notation(destination_square)
-	    + (is_promotion ? (std::string)"=" + piece_char[promotion_type] : "");
-    }
+	output_file.write(gzip_header, sizeof(gzip_header));
 
-    const char * c_str() const {
-	return ((std::string)(*this)).c_str();
+	if (! deflate_output_block(data, nullptr, 0, (num_blocks == 0), compressed)) {
+	    fatal("Can't compress tablebase header\n");
+	    terminate();
+	}
+	output_file.write(compressed.data(), compressed.size());
+
+	crc = crc32(crc, reinterpret_cast<const Bytef *>(data.data()), data.size());
+	previous_tail.assign(data.end() - std::min(data.size(), deflate_window_size), data.end());
+    } else {
+	output_file.write(prefix_data.data(), prefix_data.size());
     }
-};
 
-/* XXX perhaps collapse the next two functions together using templates  */
+    /* Then we write the tablebase data */
 
-/* This is a special exception value for PNTM mated positions.
- *
- * Since detecting a PNTM mate allows us to break out of the move generator and flag the position
- * invalid, this exception probably doesn't cost much of a performance penalty vs continuing
- * to run the loop.
- */
+    const size_t packed_block_bytes = ((block_size + 7) / 8) * tb->format.bits;
+    const size_t batch_size = std::max<size_t>(2 * num_threads, output_batch_bytes / packed_block_bytes);
+    const bool parallel_packing = ! entriesTable->lockstep();
 
-class PNTM_mated : public std::exception { };
+    std::vector<output_block> blocks(std::min<index_t>(batch_size, num_blocks));
 
-void generate_moves(const local_position_t &position, std::vector<move> &result)
-{
-    const tablebase_t *tb = position.tb;
+    for (index_t batch_start = 0; batch_start < num_blocks; batch_start += batch_size) {
 
-    result.clear();
+	const size_t batch_count = std::min<index_t>(batch_size, num_blocks - batch_start);
+	std::atomic<size_t> next_block(0);
 
-    for (int piece = 0; piece < tb->num_pieces; piece++) {
+	auto pack_block = [&](size_t i) {
+	    index_t start = (batch_start + i) * block_size;
+	    index_t count = std::min(block_size, tb->num_indices - start);
+	    size_t bytes = ((count + 7) / 8) * tb->format.bits;
 
-	/* We only want to consider pieces of the side which is to move... */
+	    /* The bit field routines can touch a word past the last entry, so pad the buffer */
 
-	if (tb->pieces[piece].color != position.side_to_move) continue;
+	    blocks[i].packed.assign(bytes + sizeof(uint64_t), 0);
+	    pack_tablebase_entries(tb, start, count, blocks[i].packed.data());
+	    blocks[i].packed.resize(bytes);
+	};
 
-	int origin_square = position.piece_position[piece];
+	if (parallel_packing) {
+	    pool.run([&]{
+		    size_t i;
+		    while ((i = next_block ++) < batch_count) pack_block(i);
+		});
+	} else {
+	    for (size_t i = 0; i < batch_count; i ++) pack_block(i);
+	}
+
+	if (output_format != OutputFormat::Uncompressed) {
+	    next_block = 0;
+	    pool.run([&]{
+		    size_t i;
+		    while ((i = next_block ++) < batch_count) {
+			output_block & block = blocks[i];
+
+			if (output_format == OutputFormat::Blocked) {
+			    uLongf compressed_size = compressBound(block.packed.size());
+			    block.compressed.resize(compressed_size);
+			    block.ok = (compress2(reinterpret_cast<Bytef *>(block.compressed.data()), &compressed_size,
+						  reinterpret_cast<Bytef *>(block.packed.data()), block.packed.size(),
+						  Z_DEFAULT_COMPRESSION) == Z_OK);
+			    block.compressed.resize(compressed_size);
+			} else {
+			    const std::vector<char> & previous = (i == 0) ? previous_tail : blocks[i-1].packed;
+			    size_t dictionary_size = std::min(previous.size(), deflate_window_size);
+			    block.ok = deflate_output_block(block.packed, previous.data() + previous.size() - dictionary_size,
+							    dictionary_size, (batch_start + i == num_blocks - 1),
+							    block.compressed);
+			    block.crc = crc32(crc32(0L, Z_NULL, 0),
+					      reinterpret_cast<Bytef *>(block.packed.data()), block.packed.size());
+			}
+		    }
+		});
+	}
 
-	for (auto &dir : movements(tb->pieces[piece].piece_type,
-				   tb->pieces[piece].color,
-				   position.piece_position[piece],
-				   Movement::Forward, Movement::AllMoves)) {
+	for (size_t i = 0; i < batch_count; i ++) {
+	    output_block & block = blocks[i];
 
-	    for (auto &movement : dir) {
+	    if (output_format == OutputFormat::Uncompressed) {
+		output_file.write(block.packed.data(), block.packed.size());
+		continue;
+	    }
 
-		bool is_promotion = ((tb->pieces[piece].piece_type == PieceType::Pawn)
-				     && ((ROW(movement) == 7) || (ROW(movement) == 0)));
+	    if (! block.ok) {
+		fatal("Can't compress tablebase block\n");
+		terminate();
+	    }
 
-		bool is_pawn_capture = ((tb->pieces[piece].piece_type == PieceType::Pawn)
-					&& (COL(movement) != COL(position.piece_position[piece])));
+	    output_file.write(block.compressed.data(), block.compressed.size());
 
-		bool is_non_capture = ((BITVECTOR(movement) & position.board_vector) == 0) && !is_pawn_capture;
+	    if (output_format == OutputFormat::Blocked) {
+		block_offsets.push_back(block_offsets.back() + block.compressed.size());
+	    } else {
+		crc = crc32_combine(crc, block.crc, block.packed.size());
+		uncompressed_size += block.packed.size();
+	    }
+	}
 
-		bool is_normal_capture = ((tb->pieces[piece].piece_type != PieceType::Pawn) || is_pawn_capture)
-		    && ((BITVECTOR(movement) & position.board_vector) != 0)
-		    && ((BITVECTOR(movement) & position.PTM_vector) == 0);
+	if (output_format == OutputFormat::Gzip) {
+	    const std::vector<char> & last = blocks[batch_count - 1].packed;
+	    previous_tail.assign(last.end() - std::min(last.size(), deflate_window_size), last.end());
+	}
+    }
 
-		bool is_en_passant_capture = is_pawn_capture
-		    && (movement == position.en_passant_square);
+    /* Finish off the gzip stream with its CRC and (modulo 2^32) length */
 
-		if (is_non_capture) {
+    if (output_format == OutputFormat::Gzip) {
+	write_little_endian(output_file, crc, 4);
+	write_little_endian(output_file, uncompressed_size & 0xffffffff, 4);
+    }
 
-		    /* Non-capture case: move the piece, so we can test the new position for check */
+    /* Go back and fill in the block offset table */
 
-		    local_position_t new_position = position;
+    if (output_format == OutputFormat::Blocked) {
+	output_file.seekp(offset);
+	for (auto block_offset : block_offsets) {
+	    write_little_endian(output_file, block_offset, 8);
+	}
+    }
 
-		    new_position.move_piece(piece, movement);
+    /* File close is done implicitly by the destructor. */
+}
 
-		    /* We don't set en passant square here since it doesn't affect the in-check
-		     * calculation, and we're not using the position for anything else.
-		     */
+/* The "master routine" for tablebase generation.
+ *
+ * Many of these subroutines have already printed error messages of their own if they return
+ * an error indication, which is why we just silently return in many cases.
+ */
 
-		    if (! PTM_in_check(tb, &new_position)) {
+/* Allocate an in-memory entries table (byte-aligned if we're tracking DTMs; bit-aligned if not),
+ * or, for proptable runs, one that can live on disk.
+ */
 
-			/* If the piece is a pawn and we're moving to the last rank, then this has
-			 * to be a promotion move, in fact, promotion_possibilities moves.  (queen,
-			 * knight, maybe rook and bishop, king for suicide).  As such, they will
-			 * require back propagation from futurebases and must therefore be flagged
-			 * as futuremoves.
-			 */
+void allocate_entries_table(void)
+{
+    /* The frontier bitmap's tracking state belongs to the last generation, if there was one */
 
-			if (is_promotion) {
+    delete frontier_bitmap;
+    frontier_bitmap = nullptr;
 
-			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+    if (using_proptables) {
+	try {
+	    if (compress_entries_table) {
+		entriesTable = new DiskEntriesTable;
+	    } else {
+		entriesTable = new MappedEntriesTable;
+	    }
+	} catch (std::exception &ex) {
+	    throw nested_exception("Constructing initial disk entries table", ex);
+	}
+    } else if (tracking_dtm) {
+	entriesTable = new MemoryEntriesTable;
+    } else {
+	entriesTable = new CompactMemoryEntriesTable;
+	if (use_frontier_bitmap) {
+	    frontier_bitmap = new FrontierBitmap(current_tb->num_indices);
+	} else if (unpropagated_index_table_MBs > 0) {
+	    size_t size = unpropagated_index_table_MBs * 1024*1024 / sizeof(index_t);
+	    unpropagated_index_table = new UnpropagatedIndexTable(size);
+	}
+    }
+}
 
-				result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
-						      promoted_pieces[promotion], promotions[piece][promotion]));
+/* And free it, along with the frontier bitmap that goes with it */
 
-			    }
+void free_entries_table(void)
+{
+    delete entriesTable;
+    entriesTable = nullptr;
 
-			    /* If we're NOT moving into check AND the piece is moving outside its
-			     * legal squares AND we can't permute the pieces into a position where
-			     * everything is legal (local_position_to_index), we regard this as a
-			     * futuremove (since it will require back prop from futurebases).  We
-			     * could just check if local_position_to_index() returns a valid index,
-			     * but checking the legal_squares bitvector first makes this a little
-			     * faster.
-			     */
+    delete frontier_bitmap;
+    frontier_bitmap = nullptr;
+}
 
-			} else if (!(tb->pieces[piece].legal_squares & BITVECTOR(movement))
-			    && (local_position_to_index(tb, &new_position) == INVALID_INDEX)) {
+bool generate_tablebase_from_control_file(char *control_filename, Glib::ustring output_filename)
+{
+    tablebase_t *tb;
+    xmlpp::NodeSet result;
+    size_t futurevector_bytes;
+    propagation_state state;
 
-			    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
-						  futuremoves[piece][movement]));
+#if defined(RLIMIT_MEMLOCK) && LOCK_MEMORY
+    struct rlimit rlimit;
+#endif
 
-			} else {
+    tb = parse_XML_control_file(control_filename);
+    if (tb == nullptr) return false;
 
-			    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement));
+    /* Need this no matter what.  I want to replace it with a global static tablebase for everything. */
+    current_tb = tb;
+    info("Total indices: %" PRIindex "\n", tb->num_indices);
 
-			}
+    if ((tb->format.dtm_offset == -1) && (tb->format.dtc_offset == -1)) {
+	tracking_dtm = false;
+    }
 
-		    }
+    /* Figure out where we want to write the finished product. */
+
+    result = tb->xml->get_root_node()->find("//output");
+    if (result.empty() && output_filename.empty()) {
+	fatal("Output filename must be specified either on command line or with <output> tag\n");
+	return false;
+    }
+    if (! result.empty()) {
+	if (! output_filename.empty()) {
+	    warning("Output filename specified on command line overrides <output> tag\n");
+	} else {
+	    // XXX use C++ casts
+	    output_filename = ((xmlpp::Element *) result[0])->get_attribute_value("filename");
+	    if (output_filename.empty()) {
+		output_filename = ((xmlpp::Element *) result[0])->get_attribute_value("url");
+	    }
+	}
+    }
+
+    if (output_filename.empty()) {
+	fatal("No output filename or URL specified\n");
+	return false;
+    }
+
+    // XXX make case insensitive
+
+    if (output_filename.substr(0,5) == "http:") {
+	fatal("http URLs currently unsupported for tablebase I/O\n");
+	return false;
+    }
+
+    if (output_filename.substr(0,4) == "ftp:") {
+	fatal("ftp URLs currently unsupported for tablebase I/O\n");
+	return false;
+    }
+
+    int proptable_size_in_XML = eval_to_number_or_zero(tb->xml->get_root_node(), "//enable-proptables/@MB");
+    if (proptable_size_in_XML > 0) {
+	if (using_proptables) {
+	    warning("Proptable size specified on command line (%zd MB) overrides <enable-proptables> tag\n", proptable_MBs);
+	} else {
+	    using_proptables = true;
+	    proptable_MBs = proptable_size_in_XML;
+	}
+    }
+
+    if (! preload_all_futurebases(tb)) return false;
+    initialize_futuremoves(tb);
+    assign_numbers_to_futuremoves(tb);
+    if (! compute_pruned_futuremoves(tb)) return false;
+    if (! check_pruning(tb)) return false;
+    optimize_futuremoves(tb);
+    print_futuremoves();
+
+    if (! check_1000_indices(tb)) return false;
+    if (! check_1000_positions(tb)) return false;
+
+    /* This actually initializes the statistics arrays the first time it's called, and it
+     * initializes for 100 passes, so these first few passes below here don't need any extra checks
+     * to see if they would overflow the arrays.
+     */
+    expand_per_pass_statistics();
+
+    /* Part of preloading the futurebases was to compute the smallest and largest DTMs in them, so
+     * we now know what the sizes of these two arrays have to be.
+     */
+    positive_passes_needed = new bool[max_tracked_dtm + 1] ();
+    negative_passes_needed = new bool[-min_tracked_dtm + 1] ();
 
-		}
+    /* With --resume, we only pick up from a checkpoint if there is one, so that a job scheduler
+     * can use the same command line to start a run and to restart it.
+     */
 
-		if (is_normal_capture) {
+    if (resume_from_checkpoint && checkpoint_filename.empty()) {
+	fatal("--resume requires --checkpoint\n");
+	return false;
+    }
 
-		    /* Capture case.
-		     *
-		     * Check to see if the movement ended because we hit against another piece of
-		     * the opposite color.  If so, add another move for the capture.  As before,
-		     * ignore moves into check.
-		     *
-		     * Actually, we check to see that we DIDN'T hit a piece of our OWN color.  The
-		     * difference is that this way we don't register a capture if we hit the end of
-		     * the list of movements in a given direction.
-		     *
-		     * We also check to see if the capture was against the enemy king! in which case
-		     * this position is a PNTM-mated.
-		     */
+    set_owned_index_range();
 
-		    int captured_piece;
+    if ((num_nodes > 1) && ! using_proptables) {
+	fatal("Distributed generation requires proptables\n");
+	return false;
+    }
 
-		    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+    if ((num_nodes > 1) && exchange_directory.empty()) {
+	fatal("Distributed generation requires --exchange-dir\n");
+	return false;
+    }
 
-			if (movement == position.piece_position[captured_piece]) {
+    if ((num_nodes > 1) && ! checkpoint_filename.empty()) {
+	fatal("Checkpoints can't be used with distributed generation\n");
+	return false;
+    }
 
-			    if ((captured_piece == tb->black_king) || (captured_piece == tb->white_king)) {
-				throw PNTM_mated();
-			    }
+    if (num_nodes > 1) join_distributed_run();
 
-			    local_position_t new_position = position;
+    if (! checkpoint_filename.empty() && using_proptables && compress_entries_table) {
+	fatal("Checkpoints can't be used with a compressed entries table\n");
+	return false;
+    }
 
-			    new_position.capture_piece(piece, captured_piece);
+    if (resume_from_checkpoint && (access(checkpoint_filename.c_str(), R_OK) == -1)) {
+	info("No checkpoint '%s'; starting from the beginning\n", checkpoint_filename.c_str());
+	resume_from_checkpoint = false;
+    }
 
-			    if (! PTM_in_check(tb, &new_position)) {
+    if (resume_from_checkpoint) {
 
-				if (! is_promotion) {
+	/* Skip straight to intra-table propagation, with everything up to that point (and maybe
+	 * some of it) coming from the checkpoint.
+	 */
 
-				    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
-							  true, futurecaptures[piece][captured_piece]));
+	allocate_entries_table();
 
-				} else {
+	if (using_proptables) {
+	    proptable_format format(tb->num_indices, 0, 0, 0, 0);
+	    output_proptable = new proptable(format, proptable_MBs << 20);
+	}
 
-				    /* Promotion capture case
-				     *
-				     * In this part of the code, we're just counting forward moves, and
-				     * all captures are futurebase moves, so the only difference to us
-				     * whether this is a promotion move or not is how many futuremoves
-				     * get recorded.
-				     */
+	if (! read_checkpoint(state)) return false;
 
+    } else if (!using_proptables) {
 
-				    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+	/* No proptables.  Allocate an in-memory tablebase, a futurevectors array, initialize the
+	 * tablebase, back propagate the futurebases (noting which futuremoves have been handled in
+	 * the futurevectors array), and run through the futurevectors array checking for unhandled
+	 * futuremoves.
+	 */
 
-					result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
-							      true, promoted_pieces[promotion], promotion_captures[piece][captured_piece][promotion]));
-				    }
-				}
-			    }
+	allocate_entries_table();
 
-			    break;
-			}
-		    }
+	/* tb->futurevectors = (futurevector_t *) calloc(tb->num_indices + 1, sizeof(futurevector_t)); */
+        if (num_futuremoves[PieceColor::White] > num_futuremoves[PieceColor::Black])
+	    tb->futurevector_bits = num_futuremoves[PieceColor::White];
+	else
+	    tb->futurevector_bits = num_futuremoves[PieceColor::Black];
 
-		    if (captured_piece == tb->num_pieces) {
-			fatal("Couldn't match capture!\n");
-		    }
+	if (tb->futurevector_bits > 0) {
+	    futurevector_bytes = (((tb->num_indices + 63) / 64) * tb->futurevector_bits + 1) * sizeof(uint64_t);
+	    tb->futurevectors = (char *) malloc(futurevector_bytes);
+	    if (tb->futurevectors == nullptr) {
+		fatal("Can't malloc %zdMB for tablebase futurevectors: %s\n", futurevector_bytes/(1024*1024),
+		      strerror(errno));
+		return false;
+	    } else {
+		if (futurevector_bytes < 1024*1024) {
+		    info("Malloced %zdKB for tablebase futurevectors\n", futurevector_bytes/1024);
+		} else {
+		    info("Malloced %zdMB for tablebase futurevectors\n", futurevector_bytes/(1024*1024));
 		}
+	    }
+	    /* Don't really need this, since they will all get initialized anyway */
+	    // memset(tb->futurevectors, 0, futurevector_bytes);
+	} else {
+	    tb->futurevectors = NULL;
+	}
 
-		if (is_en_passant_capture) {
+	/* Due to the heavily random access pattern of memory during back propagation, this
+	 * application performs horribly if required to swap.  Attempt to lock all of its pages into
+	 * memory, and die with a fatal error if we couldn't.  It seems better to die here, so we
+	 * can detect this condition and rerun with either simpler tablebases (if there are pawns
+	 * that can be factored) or using proptables.
+	 *
+	 * I'm finding that this system call is dangerous on Linux.  If you haven't set a resource
+	 * limit, it can hang the machine if you try to lock more memory than the system physically
+	 * possesses.  So I check first to make sure that a limit has been set before attempting the
+	 * lock.
+	 *
+	 * The #ifdef keeps this from even being attempted on a Windows system.
+	 */
 
-		    int captured_piece;
+#if defined(RLIMIT_MEMLOCK) && LOCK_MEMORY
 
-		    /* XXX recording en passant piece in position structure would avoid this loop */
+	if (getrlimit(RLIMIT_MEMLOCK, &rlimit) == -1) {
+	    warning("Can't getrlimit RLIMIT_MEMLOCK: %s\n", strerror(errno));
+	} else if (rlimit.rlim_cur != 0) {
+	    if ((mlockall(MCL_CURRENT) == -1) && (errno != EPERM)) {
+		fatal("Can't mlockall memory: %s\n", strerror(errno));
+		return false;
+	    }
+	}
 
-		    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+#endif
 
-			if (movement ==
-			    (position.piece_position[captured_piece]
-			     + ((position.side_to_move == PieceColor::White) ? 8 : -8))) {
+	pass_type[total_passes] = "initialization";
 
-			    local_position_t new_position = position;
+	initialize_tablebase();
 
-			    new_position.move_piece(captured_piece, position.en_passant_square);
+	finalize_pass_statistics();
+	total_passes ++;
 
-			    new_position.capture_piece(piece, captured_piece);
+	info("Total legal positions: %" PRIu64 "\n", (uint64_t) total_legal_positions);
+	info("Total moves: %" PRIu64 "\n", (uint64_t) total_moves);
 
-			    if (! PTM_in_check(tb, &new_position)) {
+	pass_type[total_passes] = "futurebase backprop";
 
-				result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
-						      true, futurecaptures[piece][captured_piece]));
+	if (! back_propagate_all_futurebases(tb)) return false;
 
-			    }
+	finalize_pass_statistics();
+	total_passes ++;
 
-			    break;
-			}
-		    }
+	pass_type[total_passes] = "futuremove check";
 
-		    if (captured_piece == tb->num_pieces) {
-			fatal("Couldn't match en passant capture!\n");
-		    }
-		}
+	info("Checking futuremoves...\n");
+	/* propagation_pass(0); */
+	if (! have_all_futuremoves_been_handled(tb)) return false;
+	info("All futuremoves handled under move restrictions\n");
 
-		/* If we hit a piece (either a capture or our own piece), end this direction of movement */
+	finalize_pass_statistics();
+	total_passes ++;
 
-		if (! is_non_capture) break;
-	    }
-	}
-    }
-}
+	free(tb->futurevectors);
+	tb->futurevectors=nullptr;
 
-std::vector<std::pair<move, global_position_t>> generate_moves(const global_position_t &position)
-{
-    std::vector<std::pair<move, global_position_t>> result;
+    } else {
 
-    for (square_t origin_square = 0; origin_square < 64; origin_square ++) {
+	/* Using proptables.  No futurevectors array.  We back propagate the futurebases into the
+	 * proptable, then in a single pass initialize the entries array and commit the proptable
+	 * into it, checking each position move as we go to make sure its futuremoves are handled.
+	 *
+	 * Required field sizes for futurebase back-propagation:
+	 *
+	 *   index - figure out from num_indices
+	 *   dtm - figure out from futurebase preload, unless it isn't being tracked
+	 *   movecnt - 0 (DTM 0 only), 1, or 2 for 8-way symmetry conversion
+	 *   futuremove - figure out from total_futuremoves
+	 *
+	 * We add one to max(num_futuremoves) to ensure that we've got enough room to store
+	 * NO_FUTUREMOVE (futuremove -1).
+	 *
+	 * Note: movecnt 0 / DTM 0 is handled as a special case in proptable_pass_thread()
+	 *
+	 * XXX turn off movecnt if we don't have 8-way symmetry
+	 */
 
-	if (position.board[origin_square] == 0) continue;
+	proptable_format format(tb->num_indices, min_tracked_dtm, max_tracked_dtm,
+				1, std::max(num_futuremoves[PieceColor::White], num_futuremoves[PieceColor::Black]) + 1);
 
-	PieceColor piece_color = global_pieces2.at(position.board[origin_square]).first;
-	PieceType piece_type = global_pieces2.at(position.board[origin_square]).second;
+	info("Initial proptable format: %d bits index; %d bits dtm; %d bit movecnt; %d bits futuremove\n",
+	     format.index_bits, format.dtm_bits, format.movecnt_bits, format.futuremove_bits);
 
-	/* We only want to consider pieces of the side which is to move... */
+	allocate_entries_table();
 
-	if (piece_color != position.side_to_move) continue;
+	try {
+	    output_proptable = new proptable(format, proptable_MBs << 20);
+	} catch (std::exception& ex) {
+	    throw nested_exception("Constructing initial proptable", ex);
+	}
 
-	for (auto &dir : movements(piece_type, piece_color, origin_square,
-				   Movement::Forward, Movement::AllMoves)) {
+	pass_type[total_passes] = "futurebase backprop";
 
-	    for (auto &movement : dir) {
+	if (! back_propagate_all_futurebases(tb)) return false;
 
-		bool is_promotion = ((piece_type == PieceType::Pawn)
-				     && ((ROW(movement) == 7) || (ROW(movement) == 0)));
+	finalize_pass_statistics();
+	total_passes ++;
 
-		bool is_pawn_capture = ((piece_type == PieceType::Pawn)
-					&& (COL(movement) != COL(origin_square)));
+	pass_type[total_passes] = "initialization";
+	propagation_pass(0);
 
-		bool is_non_capture = (position.board[movement] == 0) && !is_pawn_capture;
+	info("Total legal positions: %" PRIu64 "\n", (uint64_t) total_legal_positions);
+	info("Total moves: %" PRIu64 "\n", (uint64_t) total_moves);
 
-		bool is_normal_capture = ((piece_type != PieceType::Pawn) || is_pawn_capture)
-		    && (position.board[movement] != 0)
-		    && (global_pieces2.at(position.board[movement]).first != position.side_to_move);
+	info("All futuremoves handled under move restrictions\n");
+    }
 
-		bool is_en_passant_capture = is_pawn_capture
-		    && (movement == position.en_passant_square);
+    futurebases.clear();
 
-		if (is_non_capture) {
+    info("Intra-table propagating\n");
+    propagate_all_moves_within_tablebase(tb, state);
 
-		    /* Non-capture case: move the piece, so we can test the new position for check */
+    if ((num_nodes > 1) && ! gather_entries()) {
+	free_entries_table();
+	return true;
+    }
 
-		    global_position_t new_position = position;
+    write_tablebase_to_file(tb, output_filename);
 
-		    new_position.flip_side_to_move();
+    /* We alloced entriesTable in this routine, but we might still use it to verify itself
+     * internally.  That will only happen if we've got a MemoryEntriesTable, since a
+     * DiskEntriesTable can't be accessed randomly.  Furthermore, a DiskEntriesTable will leave
+     * temporary files lying around if it isn't destroyed properly.
+     *
+     * XXX a MappedEntriesTable could be verified, but it's not worth thrashing the disk to do it
+     */
 
-		    if ((piece_type == PieceType::Pawn) && (movement - origin_square == 16)
-			&& (   ((COL(movement) != 0) && (position.board[movement-1] == 'p'))
-			       || ((COL(movement) != 7) && (position.board[movement+1] == 'p')))) {
-			new_position.set_en_passant_square(origin_square + 8);
-		    } else if ((piece_type == PieceType::Pawn) && (movement - origin_square == -16)
-			&& (   ((COL(movement) != 0) && (position.board[movement-1] == 'P'))
-			       || ((COL(movement) != 7) && (position.board[movement+1] == 'P')))) {
-			new_position.set_en_passant_square(origin_square - 8);
-		    } else {
-			new_position.clear_en_passant_square();
-		    }
+    if (using_proptables) {
+	free_entries_table();
+    }
 
-		    new_position.move_piece(origin_square, movement);
+    return true;
+}
 
-		    if (! global_PNTM_in_check(&new_position)) {
+/***** VERIFYING TABLEBASES *****/
 
-			if (is_promotion) {
+/* A tablebase can be checked for internal consistency to see if all moves from PNTM won positions
+ * lead to PTM won positions.  We can also check drawn positions, to make sure that none of their
+ * moves lead to PNTM won positions.  We can't make a similar check for PTM won positions, because
+ * these only require a single move to win, and that move might be in a futurebase.
+ *
+ * This test will be run at the end of a generation run if the '-v' flag is specified in addition to
+ * the '-g' flag.  Doesn't work on proptable runs; the tablebase has to be in memory.  This is only
+ * used for software testing, since properly generated tablebases are always internally consistent!
+ *
+ * Both kinds of verification hand out chunks of indices to all the threads with parallel_for().
+ * With --verify-sample=K, they check K randomly chosen indices instead of all of them, which is
+ * enough to say with some confidence that not many positions are wrong, in a fraction of the time.
+ * If none of K uniformly sampled positions are wrong, then we can be 95% sure that fewer than
+ * 1 - 0.05^(1/K) (about 3/K) of the tablebase's positions are wrong.  Some indices aren't legal
+ * positions, and there's nothing to check there, so K only counts the ones that were checked, and
+ * the claim is about legal positions.  --seed makes the sample repeatable.
+ */
 
-			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+index_t verify_sample_size = 0;		/* 0 means verify everything */
+bool verify_seed_given = false;
+uint64_t verify_seed = 0;
 
-				place_piece_in_global_position(&new_position, movement,
-							       piece_color, promoted_pieces[promotion]);
+/* The sample is sorted, so that a gzip'ed tablebase is still read from front to back */
 
-				result.push_back(std::make_pair(move(piece_type, origin_square, movement,
-								     promoted_pieces[promotion]),
-								new_position));
+std::vector<index_t> sample_indices(index_t num_indices, index_t sample_size)
+{
+    std::random_device random;
+    std::mt19937_64 generator(verify_seed_given ? verify_seed : random());
+    std::uniform_int_distribution<index_t> distribution(0, num_indices - 1);
+    std::vector<index_t> sample;
 
-			    }
+    sample.reserve(sample_size);
+    for (index_t i = 0; i < sample_size; i ++) {
+	sample.push_back(distribution(generator));
+    }
+    std::sort(sample.begin(), sample.end());
 
-			} else {
+    return sample;
+}
 
-			    result.push_back(std::make_pair(move(piece_type, origin_square, movement),
-							    new_position));
+/* Run verify(index) on every index, or on a random sample of them, and report the results.  Any
+ * inconsistency is reported with fatal(), so we count errors by watching fatal_errors.  verify()
+ * returns false if the index wasn't a position it could check.
+ */
 
-			}
+bool verify_indices(const char * label, index_t num_indices, bool parallel, std::function<bool(index_t)> verify)
+{
+    std::vector<index_t> sample;
+    int previous_fatal_errors = fatal_errors;
 
-		    }
+    if ((verify_sample_size > 0) && (verify_sample_size < num_indices)) {
+	sample = sample_indices(num_indices, verify_sample_size);
+    }
 
-		}
+    index_t count = sample.empty() ? num_indices : sample.size();
+    std::atomic<index_t> checked(0);
 
-		if (is_normal_capture) {
+    auto section = [&](index_t first, index_t last) {
+	index_t local_checked = 0;
+	for (index_t i = first; i <= last; i ++) {
+	    mark_progress();
+	    if (verify(sample.empty() ? i : sample[i])) local_checked ++;
+	}
+	checked += local_checked;
+    };
 
-		    /* Capture case.
-		     *
-		     * We also check to see if the capture was against the enemy king in which case
-		     * this position is a PNTM-mated.
-		     */
+    reset_progress_indicator(label, count);
 
-		    // PieceColor captured_piece_color = global_pieces2.at(position.board[movement]).first;
-		    PieceType captured_piece_type = global_pieces2.at(position.board[movement]).second;
+    if (parallel) {
+	pool.parallel_for(0, count, section);
+    } else if (count > 0) {
+	section(0, count - 1);
+    }
 
-		    if (captured_piece_type == PieceType::King) {
-			throw PNTM_mated();
-		    }
+    end_progress_indicator();
 
-		    global_position_t new_position = position;
+    int errors = fatal_errors - previous_fatal_errors;
 
-		    new_position.flip_side_to_move();
+    if (! sample.empty()) {
+	index_t positions = checked;
+	if (positions == 0) {
+	    info("None of %" PRIindex " sampled indices were legal positions\n", count);
+	} else if (errors == 0) {
+	    info("No errors in %" PRIindex " sampled positions; with 95%% confidence, fewer than %.4f%% are wrong\n",
+		 positions, 100.0 * (1.0 - pow(0.05, 1.0 / positions)));
+	} else {
+	    info("%d errors in %" PRIindex " sampled positions; roughly %.4f%% are wrong\n",
+		 errors, positions, 100.0 * errors / positions);
+	}
+    }
 
-		    new_position.clear_en_passant_square();
+    return (errors == 0);
+}
 
-		    new_position.capture_piece(origin_square, movement);
+bool verify_index_internally(index_t index)
+{
+    index_t next_index;
+    local_position_t position(current_tb);
+    int piece;
+    int origin_square;
 
-		    if (! global_PNTM_in_check(&new_position)) {
+    if (!index_to_local_position(current_tb, index, REFLECTION_NONE, &position)) return false;
 
-			if (! is_promotion) {
+    position.flip_side_to_move();
+    position.clear_en_passant_square();
 
-			    result.push_back(std::make_pair(move(piece_type, origin_square, movement, true),
-							    new_position));
+    for (piece = 0; piece < current_tb->num_pieces; piece++) {
 
-			} else {
+	/* We only want to consider pieces of the side which is to move, but we flipped it... */
 
-			    /* Promotion capture case
-			     *
-			     * In this part of the code, we're just counting forward moves, and
-			     * all captures are futurebase moves, so the only difference to us
-			     * whether this is a promotion move or not is how many futuremoves
-			     * get recorded.
-			     */
+	if (current_tb->pieces[piece].color == position.side_to_move) continue;
 
+	origin_square = position.piece_position[piece];
 
-			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+	for (auto &dir : movements(current_tb->pieces[piece].piece_type,
+				   current_tb->pieces[piece].color,
+				   position.piece_position[piece],
+				   Movement::Forward, Movement::NonCapture)) {
 
-				place_piece_in_global_position(&new_position, movement,
-							       piece_color, promoted_pieces[promotion]);
+	    for (auto &movement : dir) {
 
-				result.push_back(std::make_pair(move(piece_type, origin_square, movement,
-								     true, promoted_pieces[promotion]),
-								new_position));
-			    }
-			}
-		    }
+		if (position.board_vector & BITVECTOR(movement)) break;
 
-		    break;
-		}
+		/* Move the piece, so we can test the new position for check */
 
-		if (is_en_passant_capture) {
+		local_position_t new_position = position;
 
-		    global_position_t new_position = position;
+		new_position.move_piece(piece, movement);
 
-		    new_position.clear_en_passant_square();
+		/* XXX wrap this into move_piece */
+		if ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
+		    && (abs(movement - origin_square) == 16)) {
+		    new_position.set_en_passant_square((movement + origin_square) / 2);
+		}
 
-		    new_position.move_piece(movement + ((position.side_to_move == PieceColor::White) ? -8 : 8), movement);
+		bool is_promotion = ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
+				     && ((ROW(movement) == 7) || (ROW(movement) == 0)));
 
-		    new_position.capture_piece(origin_square, movement);
+		/* We could just check if local_position_to_index() returns a valid index, but
+		 * checking the legal_squares bitvector first makes this a little faster.
+		 *
+		 * XXX what really should we use here?
+		 */
 
-		    new_position.flip_side_to_move();
+		if (! PNTM_in_check(current_tb, &new_position) && ! is_promotion
+		    && (current_tb->pieces[piece].legal_squares & BITVECTOR(movement))
+		    && ((next_index = local_position_to_index(current_tb, &new_position)) != INVALID_INDEX)) {
 
-		    if (! global_PNTM_in_check(&new_position)) {
+		    /* check this position */
+		    int n = entriesTable[index].get_DTM();
+		    if (n < 0) {
+			/* PNTM mates in (-n)-1 after this move, so next_index must be a PTM wins
+			 * in -n moves or less.
+			 */
+			if ((entriesTable[next_index].get_DTM() <= 0)
+			    || (entriesTable[next_index].get_DTM() > -n)) {
 
-			result.push_back(std::make_pair(move(piece_type, origin_square, movement, true),
-							new_position));
+			    fatal("index %" PRIindex " DTM %d inconsistent with %" PRIindex " DTM %d\n",
+				  index, n, next_index, entriesTable[next_index].get_DTM());
+			}
+		    } else if (n == 0) {
+			if (entriesTable[next_index].get_DTM() < 0) {
 
+			    fatal("index %" PRIindex " DTM %d inconsistent with %" PRIindex " DTM %d\n",
+				  index, n, next_index, entriesTable[next_index].get_DTM());
+			}
 		    }
 		}
-
-		/* If we hit a piece (either a capture or our own piece), end this direction of movement */
-
-		if (!is_non_capture) break;
 	    }
-
 	}
-
     }
 
-    return result;
+    return true;
 }
 
-/* There are three different variants of initialize_tablebase_entry(), that differ in their third
- * argument.  The first one, that does all the work, takes a const local_position_t to protect
- * against bugs in that code, the second takes a non-const local_position_t and performs an extra
- * index_to_local_position conversion on it, and the third takes nothing and creates a
- * local_position_t on the stack.  The third is deprecated since we now like to call
- * index_to_local_position on an existing position, if possible, because it's often faster
- * than creating a new position from scratch.
- */
-
-futurevector_t initialize_tablebase_entry(const tablebase_t *tb, const index_t index, const local_position_t &position)
+bool verify_tablebase_internally(void)
 {
-    /* Now we need to count moves.  FORWARD moves. */
-    unsigned int movecnt = 0;
-    unsigned int capturecnt = 0;
-    unsigned int futuremovecnt = 0;
-    futurevector_t futurevector = 0;
-    futurevector_t capture_futurevector = 0;
+    /* XXX this routine doesn't work on suicide */
+    if (current_tb->variant != Variant::Normal) return false;
 
-    bool concede_prune = false;
-    bool resign_prune = false;
+    entriesTable->set_threads(num_threads);
 
-    thread_local std::vector<move> moves;
+    bool success = verify_indices("Verifying internal consistency of tablebase", current_tb->num_indices,
+				  true, verify_index_internally);
 
-    /* En passant:
-     *
-     * We're just counting moves here.  In particular, we don't compute the indices of the resulting
-     * positions.  If we did, we'd have to worry about clearing en passant status from any of fourth
-     * or fifth rank pawns, but we don't have to worry about it.
-     *
-     * We do have to count one or two possible extra en passant pawn captures, though...
-     */
+    entriesTable->set_threads(1);
 
-    try {
+    return success;
+}
 
-	generate_moves(position, moves);
 
-	for (auto &move : moves) {
+/***** PROBING NALIMOV TABLEBASES *****/
 
-	    if (index == debug_move) {
-		info("%s ", move.c_str());
-	    }
+#ifdef USE_NALIMOV
 
-	    movecnt ++;
+#define EGTB_CACHE_DEFAULT (1024*1024)
 
-	    if (move.is_capture) {
-		capturecnt ++;
-	    }
+void *EGTB_cache;
 
-	    if (move.is_futuremove) {
-		if (move.futuremove == DISCARD_FUTUREMOVE) {
-		    /* it's a discard - decrement movecnt so net change is zero */
-		    movecnt --;
-		    /* discard prune - do nothing */
-		} else if (move.futuremove == CONCEDE_FUTUREMOVE) {
-		    concede_prune = true;
-		} else if (move.futuremove == RESIGN_FUTUREMOVE) {
-		    resign_prune = true;
-		} else if (move.futuremove == HANDLED_FUTUREMOVE) {
-		    // move doesn't have to be tracked
-		} else if (move.futuremove < 0) {
-		    global_position_t global;
-		    index_to_global_position(tb, index, &global);
-		    fatal("No futuremove: %" PRIindex " %s %s\n", index, global_position_to_FEN(&global), move.c_str());
-		} else if (futurevector & FUTUREVECTOR(move.futuremove)) {
-		    global_position_t global;
-		    index_to_global_position(tb, index, &global);
-		    // fatal("Duplicate futuremove: %s %s\n", global_position_to_FEN(&global), move.c_str());
-		    fatal("Duplicate futuremove: %" PRIindex " %s %s\n", index, global_position_to_FEN(&global),
-			  movestr[position.side_to_move][move.futuremove]);
-		} else {
-		    futurevector |= FUTUREVECTOR(move.futuremove);
-		    if (move.is_capture) {
-			capture_futurevector |= FUTUREVECTOR(move.futuremove);
-		    }
-		}
-		futuremovecnt ++;
-	    }
-	}
-    } catch (PNTM_mated ex) {
-	entriesTable->initialize_entry_with_PNTM_mated(index);
-	return 0;
-    }
+char *nalimov_path = (char *) ".";
 
-    if (concede_prune) {
-	entriesTable->initialize_entry_with_concede(index);
-	return 0;
-    }
+int nalimov_num = 0;
 
-    if (resign_prune) {
-	entriesTable->initialize_entry_with_resign(index);
-	return 0;
+void init_nalimov_code(void)
+{
+    nalimov_num = IInitializeTb(nalimov_path);
+    if (nalimov_num > 0) {
+	info("%d piece Nalimov tablebases found\n", nalimov_num);
     }
+    EGTB_cache = malloc(EGTB_CACHE_DEFAULT);
+    if (EGTB_cache == nullptr) {
+	fatal("Can't malloc EGTB cache\n");
+    } else {
+	FTbSetCacheSize(EGTB_cache, EGTB_CACHE_DEFAULT);
+    }
+}
 
-    /* Finally, if every possible moves leads us into check, we determine if we're in check, being
-     * the difference between this being checkmate or stalemate.  In suicide analysis, a stalemate
-     * is a win for the stalemated player (international rules).
-     */
-
-    if (movecnt == 0) {
-
-	if (tb->variant == Variant::Suicide) {
-	    entriesTable->initialize_entry_with_PNTM_mated(index);
-	} else if (PTM_in_check(tb, &position)) {
-	    entriesTable->initialize_entry_with_PTM_mated(index);
-	} else {
-	    entriesTable->initialize_entry_with_stalemate(index);
-	}
-	return 0;
+char * nalimov_to_english(int score)
+{
+    static char buffer[256];
 
+    if (score > 0) {
+	sprintf(buffer, "mate in %d", ((65536-4)/2)-score+1);
+    } else if (score < 0) {
+	sprintf(buffer, "mated in %d", ((65536-4)/2)+score);
     } else {
+	sprintf(buffer, "draw");
+    }
 
-	/* In suicide, captures are forced, so if any captures are possible they are our only moves.
-	 * Of course, if we can capture the opponent's last piece, then we win!
-	 */
-
-	if ((tb->variant == Variant::Suicide) && (capturecnt != 0)) {
-	    movecnt = capturecnt;
-	    futuremovecnt = capturecnt;
-	    futurevector = capture_futurevector;
-	}
+    return buffer;
+}
 
-	/* Symmetry and multiplicity.  If we're using a symmetric index, then there might be more
-	 * than one actual board position that corresponds to a given index value.  The number of
-	 * non-identical board positions for a given index is called its multiplicity.  So here we
-	 * multiply the movecnt by the multiplicity of the position to get the total number of moves
-	 * out of all possible positions that correspond to this index.
-	 *
-	 * Actually, when computing position.multiplicity, we ignore horizontal and vertical
-	 * symmetry because they always result in doubled (or quadrupled) board positions.  Diagonal
-	 * symmetry is more difficult to handle because the pieces along the diagonal don't move
-	 * when you reflect the board.  So we need to use position.multiplicity to distinguish
-	 * between the two kings being on the a1/h8 diagonal (multiplicity 1), and one of them being
-	 * off the diagonal (multiplicity 2).
-	 */
+extern unsigned long long ind;
 
-	entriesTable->initialize_entry_with_movecnt(index, movecnt * position.multiplicity, (capturecnt != 0));
+bool verify_index_against_nalimov(tablebase_t *tb, index_t index)
+{
+    global_position_t global;
+    local_position_t local(tb);
+    int score;
 
-	if (index == debug_move) {
-	    /* other fields were printed by debug_move statement in initialize_entry() */
-	    info("   futurevector " FUTUREVECTOR_HEX_FORMAT "\n", futurevector);
-	}
+    if (index_to_global_position(tb, index, &global)) {
 
-	total_moves += movecnt;
-	total_futuremoves += futuremovecnt;
+	index_to_local_position(tb, index, REFLECTION_NONE, &local);
 
-	return futurevector;
-    }
-}
+	if (PNTM_in_check(tb, &local)) {
 
-futurevector_t initialize_tablebase_entry(const tablebase_t *tb, const index_t index, local_position_t &position)
-{
-    if (index == debug_move) {
-	info("Initializing %" PRIindex "\n", index);
-    }
+	    /* I've learned the hard way not to probe a Nalimov tablebase for an illegal position... */
 
-    mark_progress();
+	    return false;
 
-    if (! index_to_local_position(tb, index, REFLECTION_NONE, &position)) {
+	} else if ((global.en_passant_square != ILLEGAL_POSITION)
+		   && ((global.board[global.en_passant_square - 9] != 'P')
+		       || (global.en_passant_square == 40)
+		       || (global.side_to_move == PieceColor::Black))
+		   && ((global.board[global.en_passant_square - 7] != 'P')
+		       || (global.en_passant_square == 47)
+		       || (global.side_to_move == PieceColor::Black))
+		   && ((global.board[global.en_passant_square + 7] != 'p')
+		       || (global.en_passant_square == 16)
+		       || (global.side_to_move == PieceColor::White))
+		   && ((global.board[global.en_passant_square + 9] != 'p')
+		       || (global.en_passant_square == 23)
+		       || (global.side_to_move == PieceColor::White))) {
+
+	    /* Nor does Nalimov like it if the en passant pawn can't actually be captured by
+	     * another pawn.
+	     */
 
-	entriesTable->initialize_entry_as_illegal(index);
-	return 0;
+	    return false;
 
-    } else {
+	} else if (EGTBProbe(global.side_to_move == PieceColor::White, global.board,
+			     global.en_passant_square == ILLEGAL_POSITION ? -1 : global.en_passant_square, &score) == 1) {
 
-	return initialize_tablebase_entry(tb, index, (const local_position_t) position);
+	    if (tb->format.dtm_bits > 0) {
 
-    }
-}
+		int dtm = tb->get_DTM(index);
 
-futurevector_t initialize_tablebase_entry(tablebase_t *tb, index_t index)
-{
-    local_position_t position(tb);
+		if (dtm > 0) {
+		    if ((dtm-1) != ((65536-4)/2)-score+1) {
+			fatal("%s (%" PRIindex "): Nalimov says %s (%d), but we say mate in %d\n",
+			      global_position_to_FEN(&global), index,
+			      nalimov_to_english(score), score, dtm-1);
+		    }
+		} else if (dtm < 0) {
+		    if ((-dtm-1) != ((65536-4)/2)+score) {
+			fatal("%s (%" PRIindex "): Nalimov says %s (%d), but we say mated in %d\n",
+			      global_position_to_FEN(&global), index,
+			      nalimov_to_english(score), score, -dtm-1);
+		    }
+		} else if (dtm == 0) {
+		    if (score != 0) {
+			fatal("%s (%" PRIindex "): Nalimov says %s (%d), but we say draw\n",
+			      global_position_to_FEN(&global), index,
+			      nalimov_to_english(score), ((65536-4)/2)+score);
+		    }
+		}
+	    }
 
-    return initialize_tablebase_entry(tb, index, position);
-}
+	    if (tb->format.basic_offset != -1) {
 
-/* Tablebase initialization is the first important place where we can use threads to speed things up
- * on a multi-processor machine, though my experience is that actual gains are highly architecture
- * specific.  Since initialization only touches single entries in the tablebase (no propagation at
- * this point), thread synchronization is fairly trivial.  We do initialize entire sections instead
- * of individual entries to avoid processors fighting over cache lines.
- */
+		Basic basic = tb->get_basic(index);
 
-void initialize_tablebase_section(index_t start_index, index_t end_index)
-{
-    index_t index;
-    local_position_t position(current_tb);
+		if ((basic != Basic::PNTMwins) && (score < 0)) {
+		    fatal("%s (%" PRIindex "): Nalimov says PNTM wins, but we say %s\n",
+			  global_position_to_FEN(&global), index, basic_meaning[basic]);
+		} else if ((basic != Basic::PTMwins) && (score > 0)) {
+		    fatal("%s (%" PRIindex "): Nalimov says PTM wins, but we say %s\n",
+			  global_position_to_FEN(&global), index, basic_meaning[basic]);
+		} else if ((basic != Basic::Draw) && (score == 0)) {
+		    fatal("%s (%" PRIindex "): Nalimov says draw, but we say %s\n",
+			  global_position_to_FEN(&global), index, basic_meaning[basic]);
+		}
 
-    for (index=start_index; index <= end_index; index++) {
-	long long bit_offset = ((long long)index * current_tb->futurevector_bits);
+	    }
 
-	if (current_tb->futurevector_bits > 0) {
-	    set_unsigned_int_field(current_tb->futurevectors, bit_offset, current_tb->futurevector_bits,
-				   initialize_tablebase_entry(current_tb, index, position));
-	} else {
-	    initialize_tablebase_entry(current_tb, index, position);
-	}
-    }
-}
+	    if (tb->format.flag_type != FormatFlag::None) {
 
-void initialize_tablebase(void)
-{
-    std::thread t[num_threads];
-    unsigned int thread;
-    index_t block_size = current_tb->num_indices /num_threads;
+		bool flag = tb->get_flag(index);
 
-    reset_progress_indicator("Initializing tablebase", current_tb->num_indices);
+		if (global.side_to_move == PieceColor::Black) score *= -1;
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	index_t start_index = thread*block_size;
-	index_t end_index;
+		if (flag && (score < 0)) {
+		    fatal("%s (%" PRIindex "): Nalimov says black wins, but we say white wins or draws\n",
+			  global_position_to_FEN(&global), index);
+		} else if (flag && (tb->format.flag_type == FormatFlag::WhiteWins) && (score == 0)) {
+		    fatal("%s (%" PRIindex "): Nalimov says draw, but we say white wins\n",
+			  global_position_to_FEN(&global), index);
+		} else if ((!flag) && (score > 0)) {
+		    fatal("%s (%" PRIindex "): Nalimov says white wins, but we say black wins or draws\n",
+			  global_position_to_FEN(&global), index);
+		} else if ((!flag) && (tb->format.flag_type == FormatFlag::WhiteDraws) && (score == 0)) {
+		    fatal("%s (%" PRIindex "): Nalimov says draw, but we say black wins\n",
+			  global_position_to_FEN(&global), index);
+		}
+	    }
+
+	    /* info("index %" PRIindex " agrees with Nalimov %llu\n", index, ind); */
 
-	if (thread != num_threads-1) {
-	    end_index = (thread+1)*block_size - 1;
 	} else {
-	    end_index = current_tb->num_indices - 1;
+	    fatal("%s (%" PRIindex "): Nalimov says illegal, but we don't\n",
+		  global_position_to_FEN(&global), index);
 	}
 
-	t[thread] = std::thread(initialize_tablebase_section, start_index, end_index);
-    }
-
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread].join();
+	return true;
     }
 
-    end_progress_indicator();
+    return false;
 }
 
-/* Intra-table propagation is (almost) trivial.  Keep making passes over the tablebase first until
- * we've processed everything from the futurebases, then until no more progress can be made.  We
- * don't even have to make every pass, just the ones that have mates in the entries table (and we
- * track that as we finalize the mates).  Once we're past all the mates that came in from the
- * futurebases (that's what max_tracked_dtm and min_tracked_dtm show), the only way we can have new
- * mates is by following a line that's completely within this tablebase, so we keep going until one
- * of the passes didn't finalize any positions.
- *
- * We have to be a little bit careful when we're using proptables, since we can have stuff queued up
- * in the current proptable that hasn't be reflected in the positive_passes_needed[] and
- * negative_passes_needed[] arrays, so if we're using proptables, then we ALWAYS run the next pass
- * after a pass that finalized some positions.
+/* Random access is only cheap if the tablebase is mmap'ed or block compressed.  Threads reading
+ * different parts of a gzip'ed tablebase would keep forcing it to rewind and decompress from the
+ * beginning, so those get verified with a single thread.
  */
 
-void propagate_all_moves_within_tablebase(tablebase_t *tb)
+void verify_tablebase_against_nalimov(tablebase_t *tb)
 {
-    int dtm = 1;
-    uint64_t positions_finalized_on_last_pass = 0;
+    bool parallel = (tb->mapped_entries != nullptr) || ! tb->block_offsets.empty();
 
-    doing_capture_backprop = false;
+    verify_indices("Verifying tablebase against Nalimov", tb->num_indices, parallel,
+		   [tb](index_t index) { return verify_index_against_nalimov(tb, index); });
+}
 
-    /* DTM 1 positions are illegal (PNTM is in check), so back prop from these positions is not
-     * needed or desired because we don't count moves into check as part of movecnt.
-     */
+#endif /* USE_NALIMOV */
 
-    positive_passes_needed[1] = false;
 
-    /* If we're tracking DTM, then run at least until we've looked at all the DTM values that came
-     * in from the futurebases.
-     */
+/***** SEARCHING TABLEBASES *****/
 
-    if (tracking_dtm) {
+/* search_tablebases_for_global_position() searches an array of tablebases for a global position,
+ * returning a search_result, which can be evaluated as a boolean and is true if the search
+ * succeeded.  Tablebase array should be terminated with nullptr.  Also probes an inverted copy of
+ * the position, so we can find a kqkqq position in a kqqkq tablebase, for example.
+ *
+ * search_result provides a print_score() method that fetches a tablebase score for a given index
+ * and prints the results in English.  Pass it an offset to add to PNTM results.  The offset is
+ * either 0 or 1, depending on whether we're printing the score for a single position, or printing
+ * the scores for a list of moves from a position.
+ *
+ * XXX Tablebases are becoming more complicated, so the result strings should be stored in the XML
+ * headers, like "wins", "draws", "queens", "queens and draws", "queens or draws", etc.
+ *
+ * XXX Since tablebases can be big, tablebase searches can be slow, so we should be able to queue up
+ * a set of indices that we want to score, then search each tablebase once for all of them.  Modify
+ * this function to take a list of tablebase/indices, or maybe add a wrapper function that takes the
+ * list, sorts the indices, and passes each one to this function.
+ */
 
-	while ((dtm <= max_tracked_dtm) || (-dtm >= min_tracked_dtm)) {
+class search_result {
 
-	    /* PTM wins */
-	    if (((dtm <= max_tracked_dtm) && positive_passes_needed[dtm])
-		|| (positions_finalized_on_last_pass > 0))
-		positions_finalized_on_last_pass = propagation_pass(dtm);
-	    else
-		positions_finalized_on_last_pass = 0;
+public:
+    tablebase_t *tb;
+    index_t index;
+    bool inverted;
 
-	    if (dtm <= max_tracked_dtm) positive_passes_needed[dtm] = false;
+    search_result():
+	tb(nullptr), index(INVALID_INDEX), inverted(false)
+    { }
 
-	    /* PNTM wins */
-	    if (((-dtm >= min_tracked_dtm) && negative_passes_needed[dtm])
-		|| (positions_finalized_on_last_pass > 0))
-		positions_finalized_on_last_pass = propagation_pass(-dtm);
-	    else
-		positions_finalized_on_last_pass = 0;
+    search_result(tablebase_t *tb, index_t index, bool inverted):
+	tb(tb), index(index), inverted(inverted)
+    { }
 
-	    if (-dtm >= min_tracked_dtm) negative_passes_needed[dtm] = false;
+    operator bool() {
+	return tb != nullptr;
+    }
 
-	    dtm ++;
+    /* score() returns the score in English, without a trailing newline, and print_score() prints
+     * it, preceded by the index if we're printing a move list.
+     */
+
+    std::string score(int pntm_offset) {
+
+	std::string white;
+	std::string black;
+	std::string ptm;
+	std::string pntm;
+
+	if (! inverted) {
+	    white = "White";
+	    black = "Black";
+	} else {
+	    white = "Black";
+	    black = "White";
 	}
 
-    } else {
+	if (index_to_side_to_move(tb, index) == PieceColor::White) {
+	    ptm = white;
+	    pntm = black;
+	} else {
+	    ptm = black;
+	    pntm = white;
+	}
 
-	positions_finalized_on_last_pass = 1;
+	if (tb->format.dtm_bits > 0) {
 
-    }
+	    int dtm = tb->get_DTM(index);
 
-    /* Now keep running until there's nothing left to process */
+	    if (dtm == 0) {
+		return "Draw";
+	    } else if (dtm == 1) {
+		return "Illegal position (" + pntm + " mated)";
+	    } else if (dtm > 1) {
+		return ptm + " wins in " + std::to_string(dtm-1);
+	    } else {
+		return pntm + " wins in " + std::to_string(pntm_offset-dtm-1);
+	    }
 
-    while (1) {
+	} else if (tb->format.dtc_bits > 0) {
 
-	/* PTM wins */
-	if (positions_finalized_on_last_pass > 0)
-	    positions_finalized_on_last_pass = propagation_pass(dtm);
-	else break;
+	    int dtm = tb->get_DTC(index);
 
-	/* PNTM wins */
-	if (positions_finalized_on_last_pass > 0)
-	    positions_finalized_on_last_pass = propagation_pass(-dtm);
-	else break;
+	    if (dtm == 0) {
+		return "Draw";
+	    } else if (dtm == 1) {
+		return "Illegal position (" + pntm + " mated)";
+	    } else if (dtm > 1) {
+		return ptm + " converts in " + std::to_string(dtm-1);
+	    } else {
+		return pntm + " converts in " + std::to_string(pntm_offset-dtm-1);
+	    }
 
-	dtm ++;
-    }
+	} else if (tb->format.basic_offset != -1) {
 
-}
+	    Basic basic = tb->get_basic(index);
 
-/* The 'filename' argument passed in here can either be a filename or a URL.  We don't distinguish
- * between them except by looking at their prefix (though it would be easy to add an extra flag
- * argument to do so), so hopefully nobody will try to create tablebases starting with 'ftp:'.  Much
- * of the error checking on 'filename' is done by the caller, since we'd like that error checking to
- * occur prior to a time consuming generation run, rather than when we're ready to write the
- * finished product out.
- *
- * XXX put URL support back in
- *
- * XXX figure out boost iostreams error handling
- */
+	    if (basic == Basic::PTMwins) {
+		return ptm + " wins";
+	    } else if (basic == Basic::PNTMwins) {
+		return pntm + " wins";
+	    } else if (basic == Basic::Draw) {
+		return "Draw";
+	    } else if (basic == Basic::Illegal) {
+		return "Illegal";
+	    } else {
+		return "NO SCORE AVAILABLE";
+	    }
 
-void write_tablebase_to_file(tablebase_t *tb, Glib::ustring filename)
-{
-    xmlpp::Document * doc;
-    int dtm_bits;
-    int size;
-    int padded_size;
-    int offset;
-    char entrybuf[MAX_FORMAT_BYTES];
+	} else if (tb->format.flag_type != FormatFlag::None) {
 
-    for (dtm_bits = 1; (1 << (dtm_bits - 1) <= max_dtm) || (1 << (dtm_bits - 1) < -min_dtm); dtm_bits ++);
+	    bool flag = tb->get_flag(index);
 
-    if ((tb->format.dtm_offset != -1) && (tb->format.dtm_bits == 0)) {
-	tb->format.dtm_bits = dtm_bits;
-	tb->format.bits += dtm_bits;
-    } else if (tb->format.dtm_bits > 0) {
-	if (tb->format.dtm_bits < dtm_bits) {
-	    fatal("Requested DTM field size too small\n");
-	    terminate();
-	}
-    }
+	    if (tb->format.flag_type == FormatFlag::WhiteWins) {
+		if (flag) return white + " wins";
+		else return black + " wins or draws";
+	    } else {
+		if (flag) return white + " wins or draws";
+		else return black + " wins";
+	    }
 
-    if ((tb->format.dtc_offset != -1) && (tb->format.dtc_bits == 0)) {
-	tb->format.dtc_bits = dtm_bits;
-	tb->format.bits += dtm_bits;
-    } else if (tb->format.dtc_bits > 0) {
-	if (tb->format.dtc_bits < dtm_bits) {
-	    fatal("Requested DTC field size too small\n");
-	    terminate();
+	} else {
+	    return "NO SCORE AVAILABLE";
 	}
     }
 
-    doc = finalize_XML_header(tb);
-
-    /* We want at least one zero byte after the XML header, because that's how we figure out where
-     * it ends when we read it back in, and I also want to align the tablebase on a four-byte
-     * boundary for the hell of it.  (size+5)&(~3) achieves these goals.  I then modify the XML
-     * header with the updated string that gives the offset to the tablebase, and make sure that its
-     * size hasn't changed.
-     */
+    void print_score(int pntm_offset) {
+	if (pntm_offset == 1) printf("(%" PRIindex ") ", index);
+	printf("%s\n", score(pntm_offset).c_str());
+    }
+};
 
-    size = doc->write_to_string().length();
+search_result search_tablebases_for_global_position(tablebase_t **tbs, global_position_t *global_position)
+{
+    global_position_t inverted_global_position = *global_position;
+    invert_colors_of_global_position(&inverted_global_position);
 
-    do {
+    index_t index;
 
-	padded_size = (size+5)&(~3);
+    for (; *tbs; tbs++) {
+	index = global_position_to_index(*tbs, global_position);
+	if (index != INVALID_INDEX) {
+	    return search_result(*tbs, index, global_position->side_to_move != index_to_side_to_move(*tbs, index));
+	}
 
-	offset = padded_size;
-	if (tb->pawngen) {
-	    dynamic_cast<xmlpp::Element *>(doc->get_root_node()->find("//pawngen")[0])->set_attribute("offset", boost::lexical_cast<std::string>(offset));
-	    offset += pawn_position::binary_size * tb->pawngen->pawn_positions_by_index.size();
+	index = global_position_to_index(*tbs, &inverted_global_position);
+	if (index != INVALID_INDEX) {
+	    return search_result(*tbs, index, inverted_global_position.side_to_move == index_to_side_to_move(*tbs, index));
 	}
+    }
 
-	doc->get_root_node()->set_attribute("offset", boost::lexical_cast<std::string>(offset));
+    return search_result();
+}
 
-	size = doc->write_to_string().length();
+int print_move_list(tablebase_t **tbs, tablebase_t *tb, global_position_t *global_position_ptr,
+		    bool print_non_captures, bool print_captures)
+{
+    global_position_t saved_global_position;
+    int moves_printed = 0;
 
-    } while (padded_size != ((size+5)&(~3)));
+    move_list<std::pair<move, global_position_t>> moves;
 
-    info("Writing '%s'\n", filename.c_str());
+    saved_global_position = *global_position_ptr;
+    PieceColor piece_color = saved_global_position.side_to_move;
 
-    std::ofstream output_file;
-    output_file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    output_file.open(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+    try {
+	generate_moves(*global_position_ptr, moves);
 
-    io::filtering_ostream outstream;
+	for (auto & pair : moves) {
 
-    outstream.push(io::gzip_compressor());
-    outstream.push(output_file);
+	    auto move = pair.first;
+	    auto position = pair.second;
 
-    /* First we write an XML header */
+	    if (move.is_capture && !print_captures) continue;
+	    if (!move.is_capture && !print_non_captures) continue;
 
-    doc->write_to_stream(outstream);
+	    search_result result = search_tablebases_for_global_position(tbs, &position);
 
-    for (; size < padded_size; size ++) outstream << '\0';
+	    printf("   %-8s ", move.c_str());
 
-    /* Then we write any pawngen data */
+	    if (result) {
+		result.print_score(1);
+	    } else if ((tb->variant == Variant::Suicide)
+		       && (tb->num_pieces_by_color[~ piece_color] == 1)) {
+		printf("%s WINS\n", colors.at(~ piece_color).c_str());
+	    } else {
+		printf("NO DATA\n");
+	    }
 
-    if (tb->pawngen) {
-	for (auto & pp : tb->pawngen->pawn_positions_by_index) {
-	    pp >> outstream;
+	    moves_printed ++;
 	}
+    } catch (PNTM_mated ex) {
+	// printf("  PNTM mated\n");
     }
 
-    /* Then we write the tablebase data */
-
-    for (index_t index = 0; index < tb->num_indices; index ++) {
-
-	if (index == debug_move) {
-	    info("Writing %" PRIindex ": DTM %d; movecnt %d\n", index,
-		 entriesTable[index].get_DTM(), entriesTable[index].get_movecnt());
-	}
+    return moves_printed;
+}
 
-	/* Right now, there's four possible fields in the tablebase format itself (as opposed to the
-	 * intermediate entries and proptable formats) - dtm, dtc, basic, and flag.
-	 */
+void probe_tablebases(tablebase_t **tbs) {
+    global_position_t global_position;
+    bool global_position_valid = false;
 
-	if (tb->format.dtm_bits > 0) {
-	    set_int_field(entrybuf,
-			  tb->format.dtm_offset + ((index % 8) * tb->format.bits),
-			  tb->format.dtm_bits,
-			  entriesTable[index].get_DTM());
-	}
+    if (tbs[0] == nullptr) {
+	fatal("No valid tablebases to probe!\n");
+	terminate();
+    }
 
-	if (tb->format.dtc_bits > 0) {
-	    set_int_field(entrybuf,
-			  tb->format.dtc_offset + ((index % 8) * tb->format.bits),
-			  tb->format.dtc_bits,
-			  entriesTable[index].get_DTM());
+    for (int i=1; tbs[i]; i ++) {
+	if (tbs[i]->variant != tbs[0]->variant) {
+	    fatal("All probed tablebases must use same variant!\n");
+	    terminate();
 	}
+    }
 
-	if (tb->format.basic_offset != -1) {
-	    Basic basic;
+#ifdef HAVE_LIBREADLINE
+    read_history(".hoffman_history");
+#endif
 
-	    /* 2-bit BASIC format
-	     *
-	     * 0 - draw
-	     * 1 - PTM wins
-	     * 2 - PNTM wins
-	     * 3 - illegal position (PNTM in check)
-	     *
-	     * Indices that generate illegal positions, not in the above sense, but in the sense of
-	     * multiple pieces mapping to the same square, will get recorded as draws, but these can
-	     * be easily identified by the index-to-position function, so their values in the
-	     * tablebase are largely irrelevant.  Type 3 illegal positions (PNTM in check) are not
-	     * so obvious and need to be flagged as such to avoid using them during backprop.
-	     */
+    while (true) {
+	index_t index;
+	bool index_valid = false;
+	search_result result;
+#ifdef USE_NALIMOV
+	int score;
+#endif
 
-	    if (entriesTable[index].get_DTM() == 1) {
-		basic = Basic::Illegal;
-	    } else if (entriesTable[index].does_PTM_win()) {
-		basic = Basic::PTMwins;
-	    } else if (entriesTable[index].does_PNTM_win()) {
-		basic = Basic::PNTMwins;
-	    } else {
-		basic = Basic::Draw;
+	/* print current position */
+	if (global_position_valid) {
+	    for (int i = 0; i < 64; i++) {
+		char c = global_position.board[i % 8 + 8*(7-i/8)];
+		if (i % 8 == 0)
+		    printf("%c |",'8'-i/8);
+		printf(" %s%c\e[0m", c >= 'a' ? "\e[7m" : "", c ? c : '.');
+		if (i % 8 == 7)
+		    printf("\n");
 	    }
-	    set_unsigned_int_field(entrybuf,
-				   tb->format.basic_offset + ((index % 8) * tb->format.bits), 2,
-				   static_cast<int>(basic));
-	}
-
-	switch (tb->format.flag_type) {
-	case FormatFlag::WhiteWins:
-	    set_bit_field(entrybuf,
-			  tb->format.flag_offset + ((index % 8) * tb->format.bits),
-			  (index_to_side_to_move(tb, index) == PieceColor::White)
-			  ? entriesTable[index].does_PTM_win() : entriesTable[index].does_PNTM_win());
-	    break;
-	case FormatFlag::WhiteDraws:
-	    set_bit_field(entrybuf,
-			  tb->format.flag_offset + ((index % 8) * tb->format.bits),
-			  (index_to_side_to_move(tb, index) == PieceColor::White)
-			  ? ! entriesTable[index].does_PNTM_win() : ! entriesTable[index].does_PTM_win());
-	    break;
-	case FormatFlag::None:
-	    break;
+	    printf("  +----------------\n");
+	    printf("    a b c d e f g h\n");
+	    printf("FEN %s\n", global_position_to_FEN(&global_position));
+	    //printf("%s to move\n", colors[global_position.side_to_move]);
 	}
 
-	/* If the next index will be aligned on a byte boundary, write out what we've buffered.  The
-	 * logic here is that if each index requires 'bits' bits, we write eight indices at a time
-	 * and that requires exactly 'bits' bytes.
-	 */
+	/* Loop until we've read a valid input string */
+	while (true) {
 
-	if ((index % 8 == 7) || (index == tb->num_indices - 1)) {
-	    outstream.write(entrybuf, tb->format.bits);
-	}
-    }
+	    char *endptr;
 
-    /* File close is done implicitly by the destructor. */
-}
+#ifdef HAVE_LIBREADLINE
+	    char *buffer;
 
-/* The "master routine" for tablebase generation.
- *
- * Many of these subroutines have already printed error messages of their own if they return
- * an error indication, which is why we just silently return in many cases.
- */
+	    buffer = readline(global_position_valid ? "Index, FEN or move? " : "Index or FEN? ");
+	    if (buffer == nullptr) {
+		write_history(".hoffman_history");
+		printf("\n");
+		return;
+	    }
+	    if (*buffer == '\0') continue;
+	    add_history(buffer);
+#else
+	    char buffer[256];
 
-bool generate_tablebase_from_control_file(char *control_filename, Glib::ustring output_filename)
-{
-    tablebase_t *tb;
-    xmlpp::NodeSet result;
-    size_t futurevector_bytes;
+	    printf(global_position_valid ? "Index, FEN or move? " : "Index or FEN? ");
+	    if (fgets(buffer, sizeof(buffer), stdin) == nullptr) {
+		printf("\n");
+		return;
+	    }
 
-#if defined(RLIMIT_MEMLOCK) && LOCK_MEMORY
-    struct rlimit rlimit;
+	    if (strchr(buffer, '\n') != NULL) {
+		* strchr(buffer, '\n') = '\0';
+	    }
 #endif
 
-    tb = parse_XML_control_file(control_filename);
-    if (tb == nullptr) return false;
-
-    /* Need this no matter what.  I want to replace it with a global static tablebase for everything. */
-    current_tb = tb;
-    info("Total indices: %" PRIindex "\n", tb->num_indices);
-
-    if ((tb->format.dtm_offset == -1) && (tb->format.dtc_offset == -1)) {
-	tracking_dtm = false;
-    }
-
-    /* Figure out where we want to write the finished product. */
-
-    result = tb->xml->get_root_node()->find("//output");
-    if (result.empty() && output_filename.empty()) {
-	fatal("Output filename must be specified either on command line or with <output> tag\n");
-	return false;
-    }
-    if (! result.empty()) {
-	if (! output_filename.empty()) {
-	    warning("Output filename specified on command line overrides <output> tag\n");
-	} else {
-	    // XXX use C++ casts
-	    output_filename = ((xmlpp::Element *) result[0])->get_attribute_value("filename");
-	    if (output_filename.empty()) {
-		output_filename = ((xmlpp::Element *) result[0])->get_attribute_value("url");
+	    if (global_position_valid && parse_move_in_global_position(buffer, &global_position)) {
+		index_valid = false;
+		break;
 	    }
-	}
-    }
 
-    if (output_filename.empty()) {
-	fatal("No output filename or URL specified\n");
-	return false;
-    }
+	    if (parse_FEN_to_global_position(buffer, &global_position)) {
+		global_position.variant = tbs[0]->variant;
+		global_position_valid = true;
+		index_valid = false;
+		break;
+	    }
 
-    // XXX make case insensitive
+	    /* Check to see if the entire string parses as an integer.  Otherwise, a corrupt FEN
+	     * might parse as something like "8", and that's very confusing.
+	     */
 
-    if (output_filename.substr(0,5) == "http:") {
-	fatal("http URLs currently unsupported for tablebase I/O\n");
-	return false;
-    }
+	    index = strtol(buffer, &endptr, 10);
+	    if (*endptr == '\0') {
+		if (index >= tbs[0]->num_indices) {
+		    printf("Index out of range (%" PRIindex " max)\n", tbs[0]->num_indices - 1);
+		} else {
+		    global_position_valid = false;
+		    index_valid = true;
+		    break;
+		}
+	    }
 
-    if (output_filename.substr(0,4) == "ftp:") {
-	fatal("ftp URLs currently unsupported for tablebase I/O\n");
-	return false;
-    }
+	    printf("Bad input\n\n");
+	}
 
-    int proptable_size_in_XML = eval_to_number_or_zero(tb->xml->get_root_node(), "//enable-proptables/@MB");
-    if (proptable_size_in_XML > 0) {
-	if (using_proptables) {
-	    warning("Proptable size specified on command line (%zd MB) overrides <enable-proptables> tag\n", proptable_MBs);
+	assert(index_valid || global_position_valid);
+	assert(!(index_valid && global_position_valid));
+
+	if (global_position_valid) {
+	    result = search_tablebases_for_global_position(tbs, &global_position);
 	} else {
-	    using_proptables = true;
-	    proptable_MBs = proptable_size_in_XML;
+	    /* index_valid */
+	    if (index_to_global_position(tbs[0], index, &global_position)) {
+		global_position_valid = true;
+		result = search_result(tbs[0], index, false);
+	    } else {
+		printf("Illegal position\n\n");
+		result = search_result();
+	    }
 	}
-    }
-
-    if (! preload_all_futurebases(tb)) return false;
-    initialize_futuremoves(tb);
-    assign_numbers_to_futuremoves(tb);
-    if (! compute_pruned_futuremoves(tb)) return false;
-    if (! check_pruning(tb)) return false;
-    optimize_futuremoves(tb);
-    print_futuremoves();
 
-    if (! check_1000_indices(tb)) return false;
-    if (! check_1000_positions(tb)) return false;
+	if (result) {
 
-    /* This actually initializes the statistics arrays the first time it's called, and it
-     * initializes for 100 passes, so these first few passes below here don't need any extra checks
-     * to see if they would overflow the arrays.
-     */
-    expand_per_pass_statistics();
+	    const char *ptm;
+	    const char *pntm;
 
-    /* Part of preloading the futurebases was to compute the smallest and largest DTMs in them, so
-     * we now know what the sizes of these two arrays have to be.
-     */
-    positive_passes_needed = new bool[max_tracked_dtm + 1] ();
-    negative_passes_needed = new bool[-min_tracked_dtm + 1] ();
+	    printf("Index %" PRIindex " (%s)\n", result.index, result.tb->filename.c_str());
 
-    if (!using_proptables) {
+	    if (global_position.side_to_move == PieceColor::White) {
+		ptm = "White";
+		pntm = "Black";
+	    } else {
+		ptm = "Black";
+		pntm = "White";
+	    }
 
-	/* No proptables.  Allocate an in-memory tablebase (byte-aligned if we're tracking DTMs;
-	 * bit-aligned if not), a futurevectors array, initialize the tablebase, back propagate the
-	 * futurebases (noting which futuremoves have been handled in the futurevectors array), and
-	 * run through the futurevectors array checking for unhandled futuremoves.
-	 */
+	    result.print_score(0);
 
-	if (tracking_dtm) {
-	    entriesTable = new MemoryEntriesTable;
-	} else {
-	    entriesTable = new CompactMemoryEntriesTable;
-	    if (unpropagated_index_table_MBs > 0) {
-		size_t size = unpropagated_index_table_MBs * 1024*1024 / sizeof(index_t);
-		unpropagated_index_table = new UnpropagatedIndexTable(size);
+#ifdef USE_NALIMOV
+	    if ((global_position.variant == Variant::Normal) && (nalimov_num > 0)
+		&& EGTBProbe(global_position.side_to_move == PieceColor::White, global_position.board, -1, &score) == 1) {
+		printf("Nalimov score: ");
+		if (score > 0) {
+		    printf("%s wins in %d.5\n", ptm, ((65536-4)/2)-score+1);
+		} else if (score < 0) {
+		    printf("%s wins in %d\n", pntm, ((65536-4)/2)+score);
+		} else {
+		    printf("DRAW\n");
+		}
 	    }
-	}
+#endif
 
-	/* tb->futurevectors = (futurevector_t *) calloc(tb->num_indices + 1, sizeof(futurevector_t)); */
-        if (num_futuremoves[PieceColor::White] > num_futuremoves[PieceColor::Black])
-	    tb->futurevector_bits = num_futuremoves[PieceColor::White];
-	else
-	    tb->futurevector_bits = num_futuremoves[PieceColor::Black];
+	    /* In suicide, capture moves are forced, so if any exist they are the only moves. */
 
-	if (tb->futurevector_bits > 0) {
-	    futurevector_bytes = (((tb->num_indices * tb->futurevector_bits) + 7) >> 3) + 2*sizeof(int);
-	    tb->futurevectors = (char *) malloc(futurevector_bytes);
-	    if (tb->futurevectors == nullptr) {
-		fatal("Can't malloc %zdMB for tablebase futurevectors: %s\n", futurevector_bytes/(1024*1024),
-		      strerror(errno));
-		return false;
+	    if (global_position.variant != Variant::Suicide) {
+		print_move_list(tbs, result.tb, &global_position, true, true);
 	    } else {
-		if (futurevector_bytes < 1024*1024) {
-		    info("Malloced %zdKB for tablebase futurevectors\n", futurevector_bytes/1024);
-		} else {
-		    info("Malloced %zdMB for tablebase futurevectors\n", futurevector_bytes/(1024*1024));
+		if (print_move_list(tbs, result.tb, &global_position, false, true) == 0) {
+		    print_move_list(tbs, result.tb, &global_position, true, false);
 		}
 	    }
-	    /* Don't really need this, since they will all get initialized anyway */
-	    // memset(tb->futurevectors, 0, futurevector_bytes);
-	} else {
-	    tb->futurevectors = NULL;
 	}
+    }
+}
 
-	/* Due to the heavily random access pattern of memory during back propagation, this
-	 * application performs horribly if required to swap.  Attempt to lock all of its pages into
-	 * memory, and die with a fatal error if we couldn't.  It seems better to die here, so we
-	 * can detect this condition and rerun with either simpler tablebases (if there are pawns
-	 * that can be factored) or using proptables.
-	 *
-	 * I'm finding that this system call is dangerous on Linux.  If you haven't set a resource
-	 * limit, it can hang the machine if you try to lock more memory than the system physically
-	 * possesses.  So I check first to make sure that a limit has been set before attempting the
-	 * lock.
-	 *
-	 * The #ifdef keeps this from even being attempted on a Windows system.
-	 */
+/***** BATCH PROBING *****/
+
+/* Batch probing reads FENs from standard input, one per line, and writes one line of results for
+ * each of them to standard output:
+ *
+ *    FEN <tab> tablebase filename <tab> index <tab> score
+ *
+ * or "NO DATA" or "Bad FEN" in place of the last three fields.  This is meant for feeding large
+ * numbers of positions through a program, not for people, so there's no prompting, no move lists,
+ * and no readline.  To serve a socket instead, run us under inetd, socat, or a systemd socket
+ * unit; the tablebases stay loaded (and their caches warm) for as long as the connection lasts.
+ *
+ * search_tablebases_for_global_position() tries every tablebase in turn, twice (once with colors
+ * inverted).  With hundreds of tablebases loaded, that dominates the time spent on each position,
+ * so we instead index the tablebases by their material, and only try the ones with the right
+ * pieces.  More than one tablebase can have the same material if they differ in their movement
+ * restrictions.
+ *
+ * We read our input with read() instead of stdio and treat each chunk of complete lines as a
+ * batch.  A pipe full of positions arrives in big chunks, which we score in tablebase and index
+ * order for cache locality, while a client sending one position at a time gets its answer without
+ * having to wait for a batch to fill up.
+ *
+ * Starting up used to mean loading every tablebase on the command line, which parses and validates
+ * its XML header, builds its index encoding, and reads its block table, even though a typical
+ * batch of positions only touches a handful of them.  Now all we need at startup is each
+ * tablebase's material and variant, to put it in the directory, and we load it the first time a
+ * position with that material comes along.  Getting the material still means parsing the XML, but
+ * not validating it or doing anything else with it, and with --header-cache=FILE we remember the
+ * material of each tablebase (keyed by its size and modification time) so the next startup doesn't
+ * have to open the tablebases at all.  Pawngen, Nalimov, and Syzygy tablebases are loaded right
+ * away, as before.  Pawngen tablebases because their pawns are in the pawngen data rather than in
+ * piece elements; the others because they're cheap to load anyway.
+ */
 
-#if defined(RLIMIT_MEMLOCK) && LOCK_MEMORY
+/* A material signature is the count of each kind of piece, white first, in global_pieces order */
 
-	if (getrlimit(RLIMIT_MEMLOCK, &rlimit) == -1) {
-	    warning("Can't getrlimit RLIMIT_MEMLOCK: %s\n", strerror(errno));
-	} else if (rlimit.rlim_cur != 0) {
-	    if ((mlockall(MCL_CURRENT) == -1) && (errno != EPERM)) {
-		fatal("Can't mlockall memory: %s\n", strerror(errno));
-		return false;
+std::string material_signature(const tablebase_t *tb)
+{
+    std::string signature(2*NUM_PIECES, '0');
+
+    for (int piece = 0; piece < tb->num_pieces; piece ++) {
+	const int color = (tb->pieces[piece].color == PieceColor::White) ? 0 : 1;
+	signature[color*NUM_PIECES + static_cast<int>(tb->pieces[piece].piece_type)] ++;
+    }
+
+    return signature;
+}
+
+std::string material_signature(const global_position_t *global)
+{
+    std::string signature(2*NUM_PIECES, '0');
+
+    for (square_t square = 0; square < 64; square ++) {
+	if (global->board[square] == 0) continue;
+	for (int color = 0; color < 2; color ++) {
+	    for (int type = 0; type < NUM_PIECES; type ++) {
+		if (global->board[square] == global_pieces[color][type]) {
+		    signature[color*NUM_PIECES + type] ++;
+		}
 	    }
 	}
+    }
 
-#endif
+    return signature;
+}
 
-	pass_type[total_passes] = "initialization";
+/* What we need to know about a tablebase to put it in the directory without loading it */
 
-	initialize_tablebase();
+struct tablebase_summary {
+    off_t size;
+    time_t mtime;
+    Variant variant;
+    std::string material;
+};
 
-	finalize_pass_statistics();
-	total_passes ++;
+/* Read just enough of a tablebase's XML header to get its summary.  Returns false if it's a kind of
+ * tablebase that we can't (or needn't) summarize, and the caller should load it instead.
+ */
 
-	info("Total legal positions: %" PRIu64 "\n", (uint64_t) total_legal_positions);
-	info("Total moves: %" PRIu64 "\n", (uint64_t) total_moves);
+bool read_tablebase_summary(const std::string &filename, tablebase_summary &summary)
+{
+    if ((filename.length() < 5)
+	|| (filename.substr(filename.length() - 4) == ".emd")
+	|| (filename.substr(filename.length() - 4) == ".nbw")
+	|| (filename.substr(filename.length() - 4) == ".nbb")
+	|| (filename.substr(filename.length() - 5) == ".rtbw")
+	|| (filename.substr(filename.length() - 5) == ".rtbz")) {
+	return false;
+    }
 
-	pass_type[total_passes] = "futurebase backprop";
+    std::ifstream input_file(filename, std::ifstream::in | std::ifstream::binary);
 
-	if (! back_propagate_all_futurebases(tb)) return false;
+    if (! input_file.good()) return false;
 
-	finalize_pass_statistics();
-	total_passes ++;
+    io::filtering_istream instream;
 
-	pass_type[total_passes] = "futuremove check";
+    instream.push(limiting_input_filter("</tablebase>"));
+    if (input_file.peek() == '\037') {
+	instream.push(io::gzip_decompressor());
+    }
+    instream.push(input_file);
 
-	info("Checking futuremoves...\n");
-	/* propagation_pass(0); */
-	if (! have_all_futuremoves_been_handled(tb)) return false;
-	info("All futuremoves handled under move restrictions\n");
+    xmlpp::DomParser parser;
 
-	finalize_pass_statistics();
-	total_passes ++;
+    try {
+	parser.parse_stream(instream);
+    } catch (std::exception &ex) {
+	return false;
+    }
 
-	free(tb->futurevectors);
-	tb->futurevectors=nullptr;
+    xmlpp::Element * tablebase = parser.get_document()->get_root_node();
 
-    } else {
+    if (! tablebase->find("//pawngen").empty()) return false;
 
-	/* Using proptables.  No futurevectors array.  We back propagate the futurebases into the
-	 * proptable, then in a single pass initialize the entries array and commit the proptable
-	 * into it, checking each position move as we go to make sure its futuremoves are handled.
-	 *
-	 * Required field sizes for futurebase back-propagation:
-	 *
-	 *   index - figure out from num_indices
-	 *   dtm - figure out from futurebase preload, unless it isn't being tracked
-	 *   movecnt - 0 (DTM 0 only), 1, or 2 for 8-way symmetry conversion
-	 *   futuremove - figure out from total_futuremoves
-	 *
-	 * We add one to max(num_futuremoves) to ensure that we've got enough room to store
-	 * NO_FUTUREMOVE (futuremove -1).
-	 *
-	 * Note: movecnt 0 / DTM 0 is handled as a special case in proptable_pass_thread()
-	 *
-	 * XXX turn off movecnt if we don't have 8-way symmetry
-	 */
+    auto it = variant_names.find(tablebase->eval_to_string("//variant/@name"));
+    if (it == variant_names.end()) return false;
+    summary.variant = it->second;
 
-	proptable_format format(tb->num_indices, min_tracked_dtm, max_tracked_dtm,
-				1, std::max(num_futuremoves[PieceColor::White], num_futuremoves[PieceColor::Black]) + 1);
+    summary.material = std::string(2*NUM_PIECES, '0');
 
-	info("Initial proptable format: %d bits index; %d bits dtm; %d bit movecnt; %d bits futuremove\n",
-	     format.index_bits, format.dtm_bits, format.movecnt_bits, format.futuremove_bits);
+    for (auto node : tablebase->find("//piece")) {
+	auto color = colors.find(node->eval_to_string("@color"));
+	auto type = piece_name.find(node->eval_to_string("@type"));
+	if ((color == colors.end()) || (type == piece_name.end())) return false;
+	summary.material[((color->second == PieceColor::White) ? 0 : NUM_PIECES)
+			 + static_cast<int>(type->second)] ++;
+    }
 
-	try {
-	    entriesTable = new DiskEntriesTable;
-	} catch (std::exception &ex) {
-	    throw nested_exception("Constructing initial disk entries table", ex);
-	}
+    return true;
+}
 
-	try {
-	    output_proptable = new proptable(format, proptable_MBs << 20);
-	} catch (std::exception& ex) {
-	    throw nested_exception("Constructing initial proptable", ex);
-	}
+/* The header cache is a text file with one line per tablebase:
+ *
+ *    size <space> mtime <space> variant <space> material signature <space> filename
+ *
+ * The filename comes last so that it can contain spaces.  An entry is good as long as the
+ * tablebase's size and modification time haven't changed; otherwise we summarize the file again.
+ */
 
-	pass_type[total_passes] = "futurebase backprop";
+class header_cache {
+    std::string cache_filename;
+    std::map<std::string, tablebase_summary> entries;
+    bool modified;
 
-	if (! back_propagate_all_futurebases(tb)) return false;
+public:
 
-	finalize_pass_statistics();
-	total_passes ++;
+    header_cache(std::string cache_filename) : cache_filename(cache_filename), modified(false)
+    {
+	if (cache_filename.empty()) return;
 
-	pass_type[total_passes] = "initialization";
-	propagation_pass(0);
+	std::ifstream cache_file(cache_filename);
+	std::string line;
 
-	info("Total legal positions: %" PRIu64 "\n", (uint64_t) total_legal_positions);
-	info("Total moves: %" PRIu64 "\n", (uint64_t) total_moves);
+	while (std::getline(cache_file, line)) {
+	    std::istringstream fields(line);
+	    tablebase_summary summary;
+	    long long size;
+	    long long mtime;
+	    std::string variant;
+	    std::string filename;
 
-	info("All futuremoves handled under move restrictions\n");
-    }
+	    if (! (fields >> size >> mtime >> variant >> summary.material)) continue;
+	    fields.get();
+	    if (! std::getline(fields, filename) || filename.empty()) continue;
+	    if (summary.material.length() != 2*NUM_PIECES) continue;
 
-    futurebases.clear();
+	    auto it = variant_names.find(variant);
+	    if (it == variant_names.end()) continue;
 
-    info("Intra-table propagating\n");
-    propagate_all_moves_within_tablebase(tb);
+	    summary.size = size;
+	    summary.mtime = mtime;
+	    summary.variant = it->second;
+	    entries[filename] = summary;
+	}
+    }
 
-    write_tablebase_to_file(tb, output_filename);
+    ~header_cache()
+    {
+	if (cache_filename.empty() || ! modified) return;
 
-    /* We alloced entriesTable in this routine, but we might still use it to verify itself
-     * internally.  That will only happen if we've got a MemoryEntriesTable, since a
-     * DiskEntriesTable can't be accessed randomly.  Furthermore, a DiskEntriesTable will leave
-     * temporary files lying around if it isn't destroyed properly.
-     */
+	/* Write a new file and rename it over the old one, so two servers starting at the same time
+	 * can't leave a half-written cache behind.
+	 */
 
-    if (using_proptables) {
-	delete entriesTable;
-	entriesTable = nullptr;
-    }
+	std::string temp_filename = cache_filename + ".tmp." + std::to_string(getpid());
+	std::ofstream cache_file(temp_filename, std::ofstream::out | std::ofstream::trunc);
 
-    return true;
-}
+	for (auto & entry : entries) {
+	    const char * variant = (entry.second.variant == Variant::Suicide) ? "suicide" : "normal";
+	    cache_file << entry.second.size << " " << entry.second.mtime << " " << variant << " "
+		       << entry.second.material << " " << entry.first << std::endl;
+	}
 
-/***** VERIFYING TABLEBASES *****/
+	cache_file.close();
 
-/* A tablebase can be checked for internal consistency to see if all moves from PNTM won positions
- * lead to PTM won positions.  We can also check drawn positions, to make sure that none of their
- * moves lead to PNTM won positions.  We can't make a similar check for PTM won positions, because
- * these only require a single move to win, and that move might be in a futurebase.
- *
- * This test will be run at the end of a generation run if the '-v' flag is specified in addition to
- * the '-g' flag.  Doesn't work on proptable runs; the tablebase has to be in memory.  This is only
- * used for software testing, since properly generated tablebases are always internally consistent!
- */
+	if (! cache_file.good() || (rename(temp_filename.c_str(), cache_filename.c_str()) != 0)) {
+	    warning("Can't write header cache '%s': %s\n", cache_filename.c_str(), strerror(errno));
+	    unlink(temp_filename.c_str());
+	}
+    }
 
-std::atomic<index_t> next_verify_index;
+    bool lookup(const std::string &filename, tablebase_summary &summary)
+    {
+	struct stat statbuf;
 
-void verify_tablebase_internally_thread(void)
-{
-    while (1) {
-	index_t index = (next_verify_index ++);
-	index_t next_index;
-	local_position_t position(current_tb);
-	int piece;
-	int origin_square;
+	if (stat(filename.c_str(), &statbuf) != 0) return false;
 
-	if (index >= current_tb->num_indices) break;
+	auto it = entries.find(filename);
 
-	mark_progress();
+	if ((it != entries.end()) && (it->second.size == statbuf.st_size)
+	    && (it->second.mtime == statbuf.st_mtime)) {
+	    summary = it->second;
+	    return true;
+	}
 
-	if (!index_to_local_position(current_tb, index, REFLECTION_NONE, &position)) continue;
+	if (! read_tablebase_summary(filename, summary)) return false;
 
-	position.flip_side_to_move();
-	position.clear_en_passant_square();
+	summary.size = statbuf.st_size;
+	summary.mtime = statbuf.st_mtime;
 
-	for (piece = 0; piece < current_tb->num_pieces; piece++) {
+	if (! cache_filename.empty()) {
+	    entries[filename] = summary;
+	    modified = true;
+	}
+
+	return true;
+    }
+};
 
-	    /* We only want to consider pieces of the side which is to move, but we flipped it... */
+std::string header_cache_filename;
 
-	    if (current_tb->pieces[piece].color == position.side_to_move) continue;
+/* The directory holds a tablebase pointer for each tablebase that's been loaded, and just a
+ * filename for the ones that haven't.  Batch probing is single threaded, so there's no locking
+ * around the load.
+ */
 
-	    origin_square = position.piece_position[piece];
+class tablebase_directory {
 
-	    for (auto &dir : movements(current_tb->pieces[piece].piece_type,
-				       current_tb->pieces[piece].color,
-				       position.piece_position[piece],
-				       Movement::Forward, Movement::NonCapture)) {
+    struct entry {
+	std::string filename;
+	tablebase_t * tb;
+    };
 
-		for (auto &movement : dir) {
+    std::unordered_map<std::string, std::vector<entry>> by_material;
 
-		    if (position.board_vector & BITVECTOR(movement)) break;
+    tablebase_t * load(entry &entry)
+    {
+	if ((entry.tb == nullptr) && ! entry.filename.empty()) {
+	    info("Loading '%s'\n", entry.filename.c_str());
+	    try {
+		entry.tb = new tablebase_t(entry.filename);
+	    } catch (const char *msg) {
+		fatal("Error loading tablebase '%s': %s\n", entry.filename.c_str(), msg);
+	    } catch (std::exception &ex) {
+		fatal("Error loading tablebase '%s': %s\n", entry.filename.c_str(), ex.what());
+	    }
+	    /* Don't try again if it failed */
+	    entry.filename.clear();
+	}
+	return entry.tb;
+    }
 
-		    /* Move the piece, so we can test the new position for check */
+public:
 
-		    local_position_t new_position = position;
+    Variant variant;
+    int num_tablebases;
 
-		    new_position.move_piece(piece, movement);
+    tablebase_directory(void) : variant(Variant::Normal), num_tablebases(0) { }
 
-		    /* XXX wrap this into move_piece */
-		    if ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
-			&& (abs(movement - origin_square) == 16)) {
-			new_position.set_en_passant_square((movement + origin_square) / 2);
-		    }
+    void add(tablebase_t *tb)
+    {
+	if ((num_tablebases > 0) && (tb->variant != variant)) {
+	    fatal("All probed tablebases must use same variant!\n");
+	    terminate();
+	}
+	variant = tb->variant;
+	by_material[material_signature(tb)].push_back({"", tb});
+	num_tablebases ++;
+    }
 
-		    bool is_promotion = ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
-					 && ((ROW(movement) == 7) || (ROW(movement) == 0)));
+    void add(std::string filename, const tablebase_summary &summary)
+    {
+	if ((num_tablebases > 0) && (summary.variant != variant)) {
+	    fatal("All probed tablebases must use same variant!\n");
+	    terminate();
+	}
+	variant = summary.variant;
+	by_material[summary.material].push_back({filename, nullptr});
+	num_tablebases ++;
+    }
 
-		    /* We could just check if local_position_to_index() returns a valid index, but
-		     * checking the legal_squares bitvector first makes this a little faster.
-		     *
-		     * XXX what really should we use here?
-		     */
+    /* Same result as search_tablebases_for_global_position(), except that we try all the
+     * uninverted matches before the inverted ones.
+     */
 
-		    if (! PNTM_in_check(current_tb, &new_position) && ! is_promotion
-			&& (current_tb->pieces[piece].legal_squares & BITVECTOR(movement))
-			&& ((next_index = local_position_to_index(current_tb, &new_position)) != INVALID_INDEX)) {
+    search_result search(global_position_t *global_position)
+    {
+	auto it = by_material.find(material_signature(global_position));
+
+	if (it != by_material.end()) {
+	    for (auto & entry : it->second) {
+		tablebase_t * tb = load(entry);
+		if (tb == nullptr) continue;
+		index_t index = global_position_to_index(tb, global_position);
+		if (index != INVALID_INDEX) {
+		    return search_result(tb, index, global_position->side_to_move != index_to_side_to_move(tb, index));
+		}
+	    }
+	}
 
-			/* check this position */
-			int n = entriesTable[index].get_DTM();
-			if (n < 0) {
-			    /* PNTM mates in (-n)-1 after this move, so next_index must be a PTM wins
-			     * in -n moves or less.
-			     */
-			    if ((entriesTable[next_index].get_DTM() <= 0)
-				|| (entriesTable[next_index].get_DTM() > -n)) {
+	global_position_t inverted_global_position = *global_position;
+	invert_colors_of_global_position(&inverted_global_position);
 
-				fatal("index %" PRIindex " DTM %d inconsistent with %" PRIindex " DTM %d\n",
-				      index, n, next_index, entriesTable[next_index].get_DTM());
-			    }
-			} else if (n == 0) {
-			    if (entriesTable[next_index].get_DTM() < 0) {
+	it = by_material.find(material_signature(&inverted_global_position));
 
-				fatal("index %" PRIindex " DTM %d inconsistent with %" PRIindex " DTM %d\n",
-				      index, n, next_index, entriesTable[next_index].get_DTM());
-			    }
-			}
-		    }
+	if (it != by_material.end()) {
+	    for (auto & entry : it->second) {
+		tablebase_t * tb = load(entry);
+		if (tb == nullptr) continue;
+		index_t index = global_position_to_index(tb, &inverted_global_position);
+		if (index != INVALID_INDEX) {
+		    return search_result(tb, index, inverted_global_position.side_to_move == index_to_side_to_move(tb, index));
 		}
 	    }
 	}
+
+	return search_result();
     }
-}
+};
 
-bool verify_tablebase_internally(void)
+void batch_probe_tablebases(tablebase_directory &directory)
 {
-    std::thread t[num_threads];
-    unsigned int thread;
+    std::string pending;
+    char buffer[65536];
+    bool eof = false;
 
-    /* XXX this routine doesn't work on suicide */
-    if (current_tb->variant != Variant::Normal) return false;
+    if (directory.num_tablebases == 0) {
+	fatal("No valid tablebases to probe!\n");
+	terminate();
+    }
 
-    reset_progress_indicator("Verifying internal consistency of tablebase", current_tb->num_indices);
+    while (! eof) {
+	ssize_t len = read(0, buffer, sizeof(buffer));
 
-    entriesTable->set_threads(num_threads);
-    next_verify_index = 0;
+	if (len < 0) {
+	    if (errno == EINTR) continue;
+	    fatal("Error reading positions: %s\n", strerror(errno));
+	    return;
+	}
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread] = std::thread(verify_tablebase_internally_thread);
-    }
+	pending.append(buffer, len);
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread].join();
-    }
+	/* At EOF, a final line without a newline still counts */
 
-    entriesTable->set_threads(1);
+	if (len == 0) {
+	    eof = true;
+	    if (! pending.empty() && (pending.back() != '\n')) pending.push_back('\n');
+	}
 
-    end_progress_indicator();
-    
-    return (fatal_errors == 0);
-}
+	std::vector<std::string> lines;
+	size_t start = 0;
+	size_t end;
 
+	while ((end = pending.find('\n', start)) != std::string::npos) {
+	    std::string line = pending.substr(start, end - start);
+	    if (! line.empty() && (line.back() == '\r')) line.pop_back();
+	    lines.push_back(line);
+	    start = end + 1;
+	}
+	pending.erase(0, start);
 
-/***** PROBING NALIMOV TABLEBASES *****/
+	if (lines.empty()) continue;
 
-#ifdef USE_NALIMOV
+	/* Look up every position in the batch, then score them sorted by tablebase and index, then
+	 * print them in their original order.
+	 */
 
-#define EGTB_CACHE_DEFAULT (1024*1024)
+	std::vector<search_result> results(lines.size());
+	std::vector<bool> parsed(lines.size());
+	std::vector<std::string> scores(lines.size());
+	std::vector<size_t> order;
+
+	for (size_t i = 0; i < lines.size(); i ++) {
+	    global_position_t global_position;
+	    std::vector<char> FEN(lines[i].begin(), lines[i].end());
+	    FEN.push_back('\0');
+
+	    parsed[i] = parse_FEN_to_global_position(FEN.data(), &global_position);
+	    if (parsed[i]) {
+		global_position.variant = directory.variant;
+		results[i] = directory.search(&global_position);
+		if (results[i]) order.push_back(i);
+	    }
+	}
 
-void *EGTB_cache;
+	std::sort(order.begin(), order.end(), [&results](size_t a, size_t b) {
+		return (results[a].tb != results[b].tb) ? (results[a].tb < results[b].tb)
+		    : (results[a].index < results[b].index);
+	    });
 
-char *nalimov_path = (char *) ".";
+	for (auto i : order) {
+	    scores[i] = results[i].score(0);
+	}
 
-int nalimov_num = 0;
+	for (size_t i = 0; i < lines.size(); i ++) {
+	    if (! parsed[i]) {
+		printf("%s\tBad FEN\n", lines[i].c_str());
+	    } else if (! results[i]) {
+		printf("%s\tNO DATA\n", lines[i].c_str());
+	    } else {
+		printf("%s\t%s\t%" PRIindex "\t%s\n", lines[i].c_str(), results[i].tb->filename.c_str(),
+		       results[i].index, scores[i].c_str());
+	    }
+	}
 
-void init_nalimov_code(void)
-{
-    nalimov_num = IInitializeTb(nalimov_path);
-    if (nalimov_num > 0) {
-	info("%d piece Nalimov tablebases found\n", nalimov_num);
-    }
-    EGTB_cache = malloc(EGTB_CACHE_DEFAULT);
-    if (EGTB_cache == nullptr) {
-	fatal("Can't malloc EGTB cache\n");
-    } else {
-	FTbSetCacheSize(EGTB_cache, EGTB_CACHE_DEFAULT);
+	fflush(stdout);
     }
 }
 
-char * nalimov_to_english(int score)
-{
-    static char buffer[256];
+/***** BENCHMARKING *****/
 
-    if (score > 0) {
-	sprintf(buffer, "mate in %d", ((65536-4)/2)-score+1);
-    } else if (score < 0) {
-	sprintf(buffer, "mated in %d", ((65536-4)/2)+score);
-    } else {
-	sprintf(buffer, "draw");
-    }
+/* Microbenchmarks for the index encodings.  For each control file, we build the tablebase
+ * structure (but not the tablebase itself) once for each index type, then time the functions that
+ * dominate generation: index_to_local_position(), normalized_position_to_index(), and
+ * local_position_t::move_piece() followed by local_position_to_index(), since most encodings just
+ * mark the position un-decoded in move_piece() and do the real work when the index is computed.
+ *
+ * We sample benchmark_samples indices evenly spaced through the tablebase, so small and large
+ * tablebases take about the same time to benchmark.  Index types that can't handle a particular
+ * control file (8-way symmetry with naive indices, for example) are reported as unsupported.
+ */
 
-    return buffer;
-}
+const index_t benchmark_samples = 100000;
 
-extern unsigned long long ind;
+double nanoseconds_per_op(std::chrono::steady_clock::time_point start, uint64_t ops)
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    return (ops > 0) ? static_cast<double>(elapsed.count()) / ops : 0.0;
+}
 
-void verify_tablebase_against_nalimov(tablebase_t *tb)
+void benchmark_index_encodings(char * control_filename)
 {
-    index_t index;
-    global_position_t global;
-    local_position_t local(tb);
-    int score;
+    static const Index encodings[] = {Index::Naive, Index::Naive2, Index::Simple, Index::Compact,
+				      Index::Combinadic3, Index::Combinadic4, Index::Combinadic5, Index::Syzygy};
 
-    info("Verifying tablebase against Nalimov\n");
+    printf("%s\n", control_filename);
+    printf("   %-12s %16s %12s %12s %12s\n", "index", "num_indices", "decode ns", "encode ns", "move ns");
 
-    for (index = 0; index < tb->num_indices; index++) {
-	if (index_to_global_position(tb, index, &global)) {
+    for (auto encoding : encodings) {
 
-	    index_to_local_position(tb, index, REFLECTION_NONE, &local);
+	/* Reparse the control file every time, since parsing it modifies the XML */
 
-	    if (PNTM_in_check(tb, &local)) {
+	xmlpp::DomParser parser;
+	parser.parse_file(control_filename);
 
-		/* I've learned the hard way not to probe a Nalimov tablebase for an illegal position... */
+	xmlpp::Element * root = parser.get_document()->get_root_node();
+	xmlpp::NodeSet result = root->find("//index");
+	xmlpp::Element * index_node;
 
-	    } else if ((global.en_passant_square != ILLEGAL_POSITION)
-		       && ((global.board[global.en_passant_square - 9] != 'P')
-			   || (global.en_passant_square == 40)
-			   || (global.side_to_move == PieceColor::Black))
-		       && ((global.board[global.en_passant_square - 7] != 'P')
-			   || (global.en_passant_square == 47)
-			   || (global.side_to_move == PieceColor::Black))
-		       && ((global.board[global.en_passant_square + 7] != 'p')
-			   || (global.en_passant_square == 16)
-			   || (global.side_to_move == PieceColor::White))
-		       && ((global.board[global.en_passant_square + 9] != 'p')
-			   || (global.en_passant_square == 23)
-			   || (global.side_to_move == PieceColor::White))) {
+	/* tablebase_t would refuse these anyway */
 
-		/* Nor does Nalimov like it if the en passant pawn can't actually be captured by
-		 * another pawn.
-		 */
+	if ((encoding == Index::Syzygy)
+	    && (! root->find("//pawngen").empty() || (root->eval_to_string("//variant/@name") == "suicide"))) {
+	    continue;
+	}
 
-	    } else if (EGTBProbe(global.side_to_move == PieceColor::White, global.board,
-				 global.en_passant_square == ILLEGAL_POSITION ? -1 : global.en_passant_square, &score) == 1) {
+	root->remove_attribute("index");
+	if (result.empty()) {
+	    index_node = root->add_child("index");
+	} else {
+	    index_node = dynamic_cast<xmlpp::Element *>(result[0]);
+	}
+	index_node->set_attribute("type", index_types.at(encoding));
 
-		if (tb->format.dtm_bits > 0) {
+	std::istringstream xml(parser.get_document()->write_to_string());
+	std::unique_ptr<tablebase_t> tb;
+	int previous_fatal_errors = fatal_errors;
 
-		    int dtm = tb->get_DTM(index);
+	try {
+	    tb.reset(new tablebase_t(&xml));
+	} catch (std::exception &ex) {
+	    printf("   %-12s unsupported (%s)\n", index_types.at(encoding).c_str(), ex.what());
+	    continue;
+	}
 
-		    if (dtm > 0) {
-			if ((dtm-1) != ((65536-4)/2)-score+1) {
-			    fatal("%s (%" PRIindex "): Nalimov says %s (%d), but we say mate in %d\n",
-				  global_position_to_FEN(&global), index,
-				  nalimov_to_english(score), score, dtm-1);
-			}
-		    } else if (dtm < 0) {
-			if ((-dtm-1) != ((65536-4)/2)+score) {
-			    fatal("%s (%" PRIindex "): Nalimov says %s (%d), but we say mated in %d\n",
-				  global_position_to_FEN(&global), index,
-				  nalimov_to_english(score), score, -dtm-1);
-			}
-		    } else if (dtm == 0) {
-			if (score != 0) {
-			    fatal("%s (%" PRIindex "): Nalimov says %s (%d), but we say draw\n",
-				  global_position_to_FEN(&global), index,
-				  nalimov_to_english(score), ((65536-4)/2)+score);
-			}
-		    }
-		}
+	if (fatal_errors != previous_fatal_errors) {
+	    /* Don't let an unsupported index type make the whole run fail */
+	    fatal_errors = previous_fatal_errors;
+	    printf("   %-12s unsupported\n", index_types.at(encoding).c_str());
+	    continue;
+	}
 
-		if (tb->format.basic_offset != -1) {
+	current_tb = tb.get();
 
-		    Basic basic = tb->get_basic(index);
+	index_t step = tb->num_indices / benchmark_samples + 1;
+	local_position_t position(tb.get());
+	std::vector<local_position_t> positions;
+	std::vector<std::pair<int, int>> moves;
+	uint64_t ops;
 
-		    if ((basic != Basic::PNTMwins) && (score < 0)) {
-			fatal("%s (%" PRIindex "): Nalimov says PNTM wins, but we say %s\n",
-			      global_position_to_FEN(&global), index, basic_meaning[basic]);
-		    } else if ((basic != Basic::PTMwins) && (score > 0)) {
-			fatal("%s (%" PRIindex "): Nalimov says PTM wins, but we say %s\n",
-			      global_position_to_FEN(&global), index, basic_meaning[basic]);
-		    } else if ((basic != Basic::Draw) && (score == 0)) {
-			fatal("%s (%" PRIindex "): Nalimov says draw, but we say %s\n",
-			      global_position_to_FEN(&global), index, basic_meaning[basic]);
-		    }
+	/* Decode */
 
-		}
+	auto start = std::chrono::steady_clock::now();
+	ops = 0;
+	for (index_t index = 0; index < tb->num_indices; index += step) {
+	    index_to_local_position(tb.get(), index, REFLECTION_NONE, &position);
+	    ops ++;
+	}
+	double decode_ns = nanoseconds_per_op(start, ops);
 
-		if (tb->format.flag_type != FormatFlag::None) {
+	/* Collect the valid positions, and pick a legal non-capture destination for one piece in
+	 * each of them, without timing any of it.
+	 */
 
-		    bool flag = tb->get_flag(index);
+	for (index_t index = 0; index < tb->num_indices; index += step) {
+	    if (index_to_local_position(tb.get(), index, REFLECTION_NONE, &position)) {
+		int piece = positions.size() % tb->num_pieces;
+		uint64_t destinations = tb->pieces[piece].legal_squares & ~position.board_vector;
+		positions.push_back(position);
+		moves.emplace_back(piece, destinations ? __builtin_ctzll(destinations) : -1);
+	    }
+	}
 
-		    if (global.side_to_move == PieceColor::Black) score *= -1;
+	/* Encode.  normalized_position_to_index() only updates the output fields of the position,
+	 * so we can reuse the same positions without copying them.
+	 */
 
-		    if (flag && (score < 0)) {
-			fatal("%s (%" PRIindex "): Nalimov says black wins, but we say white wins or draws\n",
-			      global_position_to_FEN(&global), index);
-		    } else if (flag && (tb->format.flag_type == FormatFlag::WhiteWins) && (score == 0)) {
-			fatal("%s (%" PRIindex "): Nalimov says draw, but we say white wins\n",
-			      global_position_to_FEN(&global), index);
-		    } else if ((!flag) && (score > 0)) {
-			fatal("%s (%" PRIindex "): Nalimov says white wins, but we say black wins or draws\n",
-			      global_position_to_FEN(&global), index);
-		    } else if ((!flag) && (tb->format.flag_type == FormatFlag::WhiteDraws) && (score == 0)) {
-			fatal("%s (%" PRIindex "): Nalimov says draw, but we say black wins\n",
-			      global_position_to_FEN(&global), index);
-		    }
-		}
+	start = std::chrono::steady_clock::now();
+	ops = 0;
+	for (auto & p : positions) {
+	    normalized_position_to_index(tb.get(), &p);
+	    ops ++;
+	}
+	double encode_ns = nanoseconds_per_op(start, ops);
 
-		/* info("index %" PRIindex " agrees with Nalimov %llu\n", index, ind); */
+	/* Move a piece and compute the new index */
 
-	    } else {
-		fatal("%s (%" PRIindex "): Nalimov says illegal, but we don't\n",
-		      global_position_to_FEN(&global), index);
-	    }
+	start = std::chrono::steady_clock::now();
+	ops = 0;
+	for (size_t i = 0; i < positions.size(); i ++) {
+	    if (moves[i].second == -1) continue;
+	    local_position_t p = positions[i];
+	    p.move_piece(moves[i].first, moves[i].second);
+	    local_position_to_index(tb.get(), &p);
+	    ops ++;
 	}
-    }
-}
+	double move_ns = nanoseconds_per_op(start, ops);
 
-#endif /* USE_NALIMOV */
+	printf("   %-12s %16" PRIindex " %12.1f %12.1f %12.1f\n", index_types.at(encoding).c_str(),
+	       tb->num_indices, decode_ns, encode_ns, move_ns);
 
+	current_tb = nullptr;
+    }
+}
 
-/***** SEARCHING TABLEBASES *****/
+/***** BUILD DRIVER *****/
 
-/* search_tablebases_for_global_position() searches an array of tablebases for a global position,
- * returning a search_result, which can be evaluated as a boolean and is true if the search
- * succeeded.  Tablebase array should be terminated with nullptr.  Also probes an inverted copy of
- * the position, so we can find a kqkqq position in a kqqkq tablebase, for example.
+/* --build takes a whole set of control files (all the five-piece endings, say), works out which
+ * ones are futurebases of which others by matching their <futurebase> filenames against the
+ * <output> filenames of the rest, and generates them all, running independent tablebases at the
+ * same time.
  *
- * search_result provides a print_score() method that fetches a tablebase score for a given index
- * and prints the results in English.  Pass it an offset to add to PNTM results.  The offset is
- * either 0 or 1, depending on whether we're printing the score for a single position, or printing
- * the scores for a list of moves from a position.
+ * The generation code is full of global state, so each tablebase is generated by a child process
+ * that we fork and exec with our own generating options, plus -g, -t, and the control file.  The
+ * -t given with --build is a budget for the whole set.  We hand threads out to tablebases as they
+ * become ready to run, and never have more than that many in use at once.  Likewise,
+ * --memory-budget=MB limits the total estimated size of the running entries tables (and
+ * proptables).  A tablebase too big for the memory budget still gets built, but only by itself.
  *
- * XXX Tablebases are becoming more complicated, so the result strings should be stored in the XML
- * headers, like "wins", "draws", "queens", "queens and draws", "queens or draws", etc.
+ * Tablebases whose output files already exist are assumed to be up to date and aren't rebuilt, so
+ * an interrupted build can just be restarted.
  *
- * XXX Since tablebases can be big, tablebase searches can be slow, so we should be able to queue up
- * a set of indices that we want to score, then search each tablebase once for all of them.  Modify
- * this function to take a list of tablebase/indices, or maybe add a wrapper function that takes the
- * list, sorts the indices, and passes each one to this function.
+ * Futurebases stay resident only in the sense that the kernel keeps them in its page cache, which
+ * we ask it to do (with posix_fadvise) as soon as a tablebase is finished that somebody else still
+ * needs.  That works best with --output-format=uncompressed, since uncompressed futurebases are
+ * mmap'ed directly instead of being decompressed into memory for every dependent.
+ *
+ * Options that name a file or a run (-o, --stats-file, --checkpoint, --resume, --exchange-dir
+ * and --node) would be shared by all the children at once, so they can't be used with --build.
+ *
+ * XXX a failed tablebase fails everything that depends on it, but the rest of the set still gets
+ * built, and the logs of all the running children are interleaved on stderr
  */
 
-class search_result {
-
-public:
-    tablebase_t *tb;
-    index_t index;
-    bool inverted;
+size_t build_memory_budget_MBs = 0;
 
-    search_result():
-	tb(nullptr), index(INVALID_INDEX), inverted(false)
-    { }
+extern struct option options[];
+extern const char short_options[];
 
-    search_result(tablebase_t *tb, index_t index, bool inverted):
-	tb(tb), index(index), inverted(inverted)
-    { }
+struct build_job {
+    std::string control_filename;
+    std::string output_filename;
+    std::vector<std::string> futurebase_filenames;
+    std::vector<int> dependents;
+    int unfinished_dependencies = 0;
+    size_t memory_MBs = 0;
+    unsigned int threads = 0;
+    pid_t pid = 0;
+    enum {Waiting, Running, Done, Failed} state = Waiting;
+};
 
-    operator bool() {
-	return tb != nullptr;
-    }
+std::string absolute_filename(const Glib::ustring & filename)
+{
+    return boost::filesystem::absolute(std::string(filename)).string();
+}
 
-    void print_score(int pntm_offset) {
+bool read_build_job(char * control_filename, build_job & job)
+{
+    job.control_filename = control_filename;
 
-	const char *white;
-	const char *black;
-	const char *ptm;
-	const char *pntm;
+    try {
+	xmlpp::DomParser parser;
+	parser.parse_file(control_filename);
+	xmlpp::Element * root = parser.get_document()->get_root_node();
 
-	if (! inverted) {
-	    white = "White";
-	    black = "Black";
-	} else {
-	    white = "Black";
-	    black = "White";
+	xmlpp::NodeSet result = root->find("//output");
+	if (! result.empty()) {
+	    Glib::ustring filename = ((xmlpp::Element *) result[0])->get_attribute_value("filename");
+	    if (filename.empty()) {
+		filename = ((xmlpp::Element *) result[0])->get_attribute_value("url");
+	    }
+	    if (! filename.empty()) job.output_filename = absolute_filename(filename);
 	}
-
-	if (index_to_side_to_move(tb, index) == PieceColor::White) {
-	    ptm = white;
-	    pntm = black;
-	} else {
-	    ptm = black;
-	    pntm = white;
+	if (job.output_filename.empty()) {
+	    fatal("%s: --build needs an <output> tag in every control file\n", control_filename);
+	    return false;
 	}
 
-	if (pntm_offset == 1) printf("(%" PRIindex ") ", index);
-
-	if (tb->format.dtm_bits > 0) {
-
-	    int dtm = tb->get_DTM(index);
+	for (auto node : root->find("//futurebase")) {
+	    job.futurebase_filenames.push_back(absolute_filename(node->eval_to_string("@filename")));
+	}
 
-	    if (dtm == 0) {
-		printf("Draw\n");
-	    } else if (dtm == 1) {
-		printf("Illegal position (%s mated)\n", pntm);
-	    } else if (dtm > 1) {
-		printf("%s wins in %d\n", ptm, dtm-1);
-	    } else if (dtm < 0) {
-		printf("%s wins in %d\n", pntm, pntm_offset-dtm-1);
-	    }
+	/* Estimating the memory needed means building the tablebase structure, which can take a
+	 * while for pawngen tablebases, so only do it if we've got a budget to enforce.
+	 */
 
-	} else if (tb->format.dtc_bits > 0) {
+	if (build_memory_budget_MBs > 0) {
+	    std::istringstream xml(parser.get_document()->write_to_string());
+	    std::unique_ptr<tablebase_t> tb(new tablebase_t(&xml));
+	    job.memory_MBs = tb->num_indices * sizeof(atomic_entry) / (1024*1024) + 1;
+	    if (using_proptables) job.memory_MBs += proptable_MBs;
+	}
+    } catch (std::exception &ex) {
+	fatal("%s: %s\n", control_filename, ex.what());
+	return false;
+    }
 
-	    int dtm = tb->get_DTC(index);
+    return true;
+}
 
-	    if (dtm == 0) {
-		printf("Draw\n");
-	    } else if (dtm == 1) {
-		printf("Illegal position (%s mated)\n", pntm);
-	    } else if (dtm > 1) {
-		printf("%s converts in %d\n", ptm, dtm-1);
-	    } else if (dtm < 0) {
-		printf("%s converts in %d\n", pntm, pntm_offset-dtm-1);
-	    }
+/* Fork and exec a copy of ourself to generate one tablebase */
 
-	} else if (tb->format.basic_offset != -1) {
+bool start_build_job(const char * program, const std::vector<std::string> & options, build_job & job)
+{
+    std::vector<std::string> args;
+    std::vector<char *> argv;
 
-	    Basic basic = tb->get_basic(index);
+    args.push_back(program);
+    args.insert(args.end(), options.begin(), options.end());
+    args.push_back("-g");
+    args.push_back("-t");
+    args.push_back(std::to_string(job.threads));
+    args.push_back(job.control_filename);
 
-	    if (basic == Basic::PTMwins) {
-		printf("%s wins\n", ptm);
-	    } else if (basic == Basic::PNTMwins) {
-		printf("%s wins\n", pntm);
-	    } else if (basic == Basic::Draw) {
-		printf("Draw\n");
-	    } else if (basic == Basic::Illegal) {
-		printf("Illegal\n");
-	    } else {
-		printf("NO SCORE AVAILABLE\n");
-	    }
+    for (auto & arg : args) argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
 
-	} else if (tb->format.flag_type != FormatFlag::None) {
+    std::cout.flush();
+    std::cerr.flush();
 
-	    bool flag = tb->get_flag(index);
+    job.pid = fork();
+    if (job.pid == -1) {
+	fatal("Can't fork to build '%s': %s\n", job.control_filename.c_str(), strerror(errno));
+	return false;
+    }
+    if (job.pid == 0) {
+	execvp(program, argv.data());
+	fprintf(stderr, "Can't exec '%s': %s\n", program, strerror(errno));
+	_exit(EXIT_FAILURE);
+    }
 
-	    if (tb->format.flag_type == FormatFlag::WhiteWins) {
-		if (flag) printf("%s wins\n", white);
-		else printf("%s wins or draws\n", black);
-	    } else {
-		if (flag) printf("%s wins or draws\n", white);
-		else printf("%s wins\n", black);
-	    }
+    info("Building '%s' with %u thread%s (pid %d)\n", job.output_filename.c_str(),
+	 job.threads, (job.threads == 1) ? "" : "s", job.pid);
+    job.state = build_job::Running;
+    return true;
+}
 
-	} else {
-	    printf("NO SCORE AVAILABLE\n");
-	}
-    }
-};
+/* Ask the kernel to pull a finished futurebase into the page cache before its dependents start */
 
-search_result search_tablebases_for_global_position(tablebase_t **tbs, global_position_t *global_position)
+void keep_futurebase_resident(const std::string & filename)
 {
-    global_position_t inverted_global_position = *global_position;
-    invert_colors_of_global_position(&inverted_global_position);
-
-    index_t index;
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
 
-    for (; *tbs; tbs++) {
-	index = global_position_to_index(*tbs, global_position);
-	if (index != INVALID_INDEX) {
-	    return search_result(*tbs, index, global_position->side_to_move != index_to_side_to_move(*tbs, index));
-	}
+/* Mark a failed job, and everything downstream of it, as failed.  Returns the number of jobs that
+ * will now never run.
+ */
 
-	index = global_position_to_index(*tbs, &inverted_global_position);
-	if (index != INVALID_INDEX) {
-	    return search_result(*tbs, index, inverted_global_position.side_to_move == index_to_side_to_move(*tbs, index));
+int fail_build_job(std::vector<build_job> & jobs, int jobnum)
+{
+    int failed = 0;
+
+    for (auto dependent : jobs[jobnum].dependents) {
+	if (jobs[dependent].state == build_job::Waiting) {
+	    warning("Not building '%s', since '%s' failed\n", jobs[dependent].output_filename.c_str(),
+		    jobs[jobnum].output_filename.c_str());
+	    jobs[dependent].state = build_job::Failed;
+	    failed += 1 + fail_build_job(jobs, dependent);
 	}
     }
 
-    return search_result();
+    return failed;
 }
 
-int print_move_list(tablebase_t **tbs, tablebase_t *tb, global_position_t *global_position_ptr,
-		    bool print_non_captures, bool print_captures)
+bool build_tablebase_set(int argc, char *argv[], int first_control_file)
 {
-    global_position_t saved_global_position;
-    int moves_printed = 0;
+    std::vector<build_job> jobs(argc - first_control_file);
+    std::unordered_map<std::string, int> job_by_output;
+    std::vector<std::string> child_options;
+    int waiting = 0;
+    int running = 0;
+    int failures = 0;
+    unsigned int threads_available = num_threads;
+    size_t memory_in_use = 0;
+
+    if (jobs.empty()) {
+	fatal("--build needs at least one control file\n");
+	return false;
+    }
 
-    saved_global_position = *global_position_ptr;
-    PieceColor piece_color = saved_global_position.side_to_move;
+    /* Pass along all of our options except the ones that only make sense to us.  getopt_long()
+     * has already permuted the control files to the end, so we parse a copy of the options in
+     * front of them with main()'s own option table, which takes care of combined short options
+     * (-gt4) and abbreviated long ones (--mem=...), and pass each one along in a canonical form.
+     */
 
-    try {
-	for (auto pair : generate_moves(*global_position_ptr)) {
+    std::vector<char *> args(argv, argv + first_control_file);
+    args.push_back(nullptr);
 
-	    auto move = pair.first;
-	    auto position = pair.second;
+    optind = 0;
 
-	    if (move.is_capture && !print_captures) continue;
-	    if (!move.is_capture && !print_non_captures) continue;
+    while (true) {
+	int long_index = -1;
+	int c = getopt_long(first_control_file, args.data(), short_options, options, &long_index);
 
-	    search_result result = search_tablebases_for_global_position(tbs, &position);
+	if (c == -1) break;
 
-	    printf("   %-8s ", move.c_str());
+	std::string name = (long_index != -1) ? std::string("--") + options[long_index].name
+	    : std::string("-") + (char) c;
 
-	    if (result) {
-		result.print_score(1);
-	    } else if ((tb->variant == Variant::Suicide)
-		       && (tb->num_pieces_by_color[~ piece_color] == 1)) {
-		printf("%s WINS\n", colors.at(~ piece_color).c_str());
+	switch (c) {
+	case 'g':
+	case 't':
+	case 12:		/* --build */
+	case 13:		/* --memory-budget */
+	    break;
+
+	case 'o':
+	case 3:			/* --stats-file */
+	case 7:			/* --checkpoint */
+	case 9:			/* --resume */
+	case 10:		/* --exchange-dir */
+	case 11:		/* --node */
+	    fatal("%s can't be used with --build, since all the tablebases would share it\n", name.c_str());
+	    return false;
+
+	default:
+	    if (long_index != -1) {
+		child_options.push_back(optarg ? name + "=" + optarg : name);
 	    } else {
-		printf("NO DATA\n");
+		child_options.push_back(name);
+		if (optarg) child_options.push_back(optarg);
 	    }
-
-	    moves_printed ++;
+	    break;
 	}
-    } catch (PNTM_mated ex) {
-	// printf("  PNTM mated\n");
     }
 
-    return moves_printed;
-}
-
-void probe_tablebases(tablebase_t **tbs) {
-    global_position_t global_position;
-    bool global_position_valid = false;
+    /* Read the control files and work out the dependencies */
 
-    if (tbs[0] == nullptr) {
-	fatal("No valid tablebases to probe!\n");
-	terminate();
+    for (size_t jobnum = 0; jobnum < jobs.size(); jobnum ++) {
+	if (! read_build_job(argv[first_control_file + jobnum], jobs[jobnum])) return false;
+	if (job_by_output.count(jobs[jobnum].output_filename) > 0) {
+	    fatal("'%s' is the output of both '%s' and '%s'\n", jobs[jobnum].output_filename.c_str(),
+		  jobs[job_by_output[jobs[jobnum].output_filename]].control_filename.c_str(),
+		  jobs[jobnum].control_filename.c_str());
+	    return false;
+	}
+	job_by_output[jobs[jobnum].output_filename] = jobnum;
     }
 
-    for (int i=1; tbs[i]; i ++) {
-	if (tbs[i]->variant != tbs[0]->variant) {
-	    fatal("All probed tablebases must use same variant!\n");
-	    terminate();
+    for (size_t jobnum = 0; jobnum < jobs.size(); jobnum ++) {
+	if (boost::filesystem::exists(jobs[jobnum].output_filename)) {
+	    info("'%s' already exists; not rebuilding it\n", jobs[jobnum].output_filename.c_str());
+	    jobs[jobnum].state = build_job::Done;
+	} else {
+	    waiting ++;
 	}
     }
 
-#ifdef HAVE_LIBREADLINE
-    read_history(".hoffman_history");
-#endif
-
-    while (true) {
-	index_t index;
-	bool index_valid = false;
-	search_result result;
-#ifdef USE_NALIMOV
-	int score;
-#endif
-
-	/* print current position */
-	if (global_position_valid) {
-	    for (int i = 0; i < 64; i++) {
-		char c = global_position.board[i % 8 + 8*(7-i/8)];
-		if (i % 8 == 0)
-		    printf("%c |",'8'-i/8);
-		printf(" %s%c\e[0m", c >= 'a' ? "\e[7m" : "", c ? c : '.');
-		if (i % 8 == 7)
-		    printf("\n");
+    for (size_t jobnum = 0; jobnum < jobs.size(); jobnum ++) {
+	for (auto & futurebase : jobs[jobnum].futurebase_filenames) {
+	    auto it = job_by_output.find(futurebase);
+	    if ((it != job_by_output.end()) && (jobs[it->second].state != build_job::Done)) {
+		jobs[it->second].dependents.push_back(jobnum);
+		jobs[jobnum].unfinished_dependencies ++;
 	    }
-	    printf("  +----------------\n");
-	    printf("    a b c d e f g h\n");
-	    printf("FEN %s\n", global_position_to_FEN(&global_position));
-	    //printf("%s to move\n", colors[global_position.side_to_move]);
 	}
+    }
 
-	/* Loop until we've read a valid input string */
-	while (true) {
-
-	    char *endptr;
+    info("Building %d of %zd tablebases using %u threads\n", waiting, jobs.size(), num_threads);
 
-#ifdef HAVE_LIBREADLINE
-	    char *buffer;
+    while (waiting + running > 0) {
 
-	    buffer = readline(global_position_valid ? "Index, FEN or move? " : "Index or FEN? ");
-	    if (buffer == nullptr) {
-		write_history(".hoffman_history");
-		printf("\n");
-		return;
-	    }
-	    if (*buffer == '\0') continue;
-	    add_history(buffer);
-#else
-	    char buffer[256];
+	/* Start everything that's ready, as long as we've got the threads and memory for it.  The
+	 * available threads get split evenly between the tablebases that are ready to go.
+	 */
 
-	    printf(global_position_valid ? "Index, FEN or move? " : "Index or FEN? ");
-	    if (fgets(buffer, sizeof(buffer), stdin) == nullptr) {
-		printf("\n");
-		return;
-	    }
+	std::vector<int> ready;
 
-	    if (strchr(buffer, '\n') != NULL) {
-		* strchr(buffer, '\n') = '\0';
+	for (size_t jobnum = 0; jobnum < jobs.size(); jobnum ++) {
+	    if ((jobs[jobnum].state == build_job::Waiting) && (jobs[jobnum].unfinished_dependencies == 0)) {
+		ready.push_back(jobnum);
 	    }
-#endif
+	}
 
-	    if (global_position_valid && parse_move_in_global_position(buffer, &global_position)) {
-		index_valid = false;
-		break;
-	    }
+	for (size_t i = 0; (i < ready.size()) && (threads_available > 0); i ++) {
+	    build_job & job = jobs[ready[i]];
 
-	    if (parse_FEN_to_global_position(buffer, &global_position)) {
-		global_position.variant = tbs[0]->variant;
-		global_position_valid = true;
-		index_valid = false;
-		break;
+	    if ((build_memory_budget_MBs > 0) && (running > 0)
+		&& (memory_in_use + job.memory_MBs > build_memory_budget_MBs)) {
+		continue;
 	    }
 
-	    /* Check to see if the entire string parses as an integer.  Otherwise, a corrupt FEN
-	     * might parse as something like "8", and that's very confusing.
-	     */
-
-	    index = strtol(buffer, &endptr, 10);
-	    if (*endptr == '\0') {
-		if (index >= tbs[0]->num_indices) {
-		    printf("Index out of range (%" PRIindex " max)\n", tbs[0]->num_indices - 1);
-		} else {
-		    global_position_valid = false;
-		    index_valid = true;
-		    break;
-		}
+	    job.threads = std::max(1u, threads_available / static_cast<unsigned int>(ready.size() - i));
+	    if (! start_build_job(argv[0], child_options, job)) {
+		job.state = build_job::Failed;
+		waiting -= 1 + fail_build_job(jobs, ready[i]);
+		failures ++;
+		continue;
 	    }
 
-	    printf("Bad input\n\n");
+	    threads_available -= job.threads;
+	    memory_in_use += job.memory_MBs;
+	    waiting --;
+	    running ++;
 	}
 
-	assert(index_valid || global_position_valid);
-	assert(!(index_valid && global_position_valid));
-
-	if (global_position_valid) {
-	    result = search_tablebases_for_global_position(tbs, &global_position);
-	} else {
-	    /* index_valid */
-	    if (index_to_global_position(tbs[0], index, &global_position)) {
-		global_position_valid = true;
-		result = search_result(tbs[0], index, false);
-	    } else {
-		printf("Illegal position\n\n");
-		result = search_result();
+	if (running == 0) {
+	    if (waiting > 0) {
+		fatal("Circular futurebase dependencies; %d tablebases can't be built\n", waiting);
+		return false;
 	    }
+	    break;
 	}
 
-	if (result) {
-
-	    const char *ptm;
-	    const char *pntm;
-
-	    printf("Index %" PRIindex " (%s)\n", result.index, result.tb->filename.c_str());
+	/* Wait for something to finish */
 
-	    if (global_position.side_to_move == PieceColor::White) {
-		ptm = "White";
-		pntm = "Black";
-	    } else {
-		ptm = "Black";
-		pntm = "White";
-	    }
+	int status;
+	pid_t pid = waitpid(-1, &status, 0);
 
-	    result.print_score(0);
+	if (pid == -1) {
+	    if (errno == EINTR) continue;
+	    fatal("waitpid: %s\n", strerror(errno));
+	    return false;
+	}
 
-#ifdef USE_NALIMOV
-	    if ((global_position.variant == Variant::Normal) && (nalimov_num > 0)
-		&& EGTBProbe(global_position.side_to_move == PieceColor::White, global_position.board, -1, &score) == 1) {
-		printf("Nalimov score: ");
-		if (score > 0) {
-		    printf("%s wins in %d.5\n", ptm, ((65536-4)/2)-score+1);
-		} else if (score < 0) {
-		    printf("%s wins in %d\n", pntm, ((65536-4)/2)+score);
-		} else {
-		    printf("DRAW\n");
-		}
-	    }
-#endif
+	auto job = std::find_if(jobs.begin(), jobs.end(),
+				[pid](const build_job & j) { return (j.pid == pid) && (j.state == build_job::Running); });
+	if (job == jobs.end()) continue;
 
-	    /* In suicide, capture moves are forced, so if any exist they are the only moves. */
+	threads_available += job->threads;
+	memory_in_use -= job->memory_MBs;
+	running --;
 
-	    if (global_position.variant != Variant::Suicide) {
-		print_move_list(tbs, result.tb, &global_position, true, true);
-	    } else {
-		if (print_move_list(tbs, result.tb, &global_position, false, true) == 0) {
-		    print_move_list(tbs, result.tb, &global_position, true, false);
-		}
+	if (WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS)) {
+	    info("Finished '%s'\n", job->output_filename.c_str());
+	    job->state = build_job::Done;
+	    if (! job->dependents.empty()) keep_futurebase_resident(job->output_filename);
+	    for (auto dependent : job->dependents) {
+		jobs[dependent].unfinished_dependencies --;
 	    }
+	} else {
+	    warning("Building '%s' failed\n", job->output_filename.c_str());
+	    job->state = build_job::Failed;
+	    waiting -= fail_build_job(jobs, job - jobs.begin());
+	    failures ++;
 	}
     }
+
+    if (failures > 0) {
+	fatal("%d tablebase%s failed to build\n", failures, (failures == 1) ? "" : "s");
+	return false;
+    }
+
+    return true;
 }
 
 void usage(char *program_name)
@@ -16013,7 +20476,11 @@ void usage(char *program_name)
     fprintf(stderr, "\n");
     fprintf(stderr, "Usage: %s -g [GENERATING-OPTIONS] XML-CONTROL-FILE   (generate)\n", program_name);
     fprintf(stderr, "   or: %s -p TABLEBASE                               (probe)\n", program_name);
+    fprintf(stderr, "   or: %s --batch TABLEBASE... < FENS                (probe FENs from stdin)\n", program_name);
     fprintf(stderr, "   or: %s -i TABLEBASE                               (info)\n", program_name);
+    fprintf(stderr, "   or: %s --benchmark XML-CONTROL-FILE...            (benchmark index types)\n", program_name);
+    fprintf(stderr, "   or: %s --build [GENERATING-OPTIONS] XML-CONTROL-FILE...\n", program_name);
+    fprintf(stderr, "                                                     (generate a set of tablebases)\n");
 #ifdef USE_NALIMOV
     fprintf(stderr, "   or: %s -v [-n NALIMOV-PATH] TABLEBASE             (verify)\n", program_name);
 #endif
@@ -16024,14 +20491,44 @@ void usage(char *program_name)
     fprintf(stderr, "   -U UNPROP-TBL-SIZE    set size of unpropagated index table in MBs (default 1)\n");
     fprintf(stderr, "   -t NUM-THREADS        sets number of threads to use (default 1)\n");
     fprintf(stderr, "   -q                    quiet mode; suppress informational messages\n");
-    fprintf(stderr, "   --compress-files      compress intermediate files in proptable mode\n");
+    fprintf(stderr, "   --compress-files[=CODEC]\n");
+    fprintf(stderr, "                         compress intermediate files in proptable mode, using\n");
+    fprintf(stderr, "                         'gzip' (default), 'fast' (varints and quick gzip),\n");
+    fprintf(stderr, "                         or 'varint' (varint proptables only)\n");
+    fprintf(stderr, "   --output-format=FMT   write finished tablebase as 'gzip' (default), 'blocked',\n");
+    fprintf(stderr, "                         or 'uncompressed'\n");
+    fprintf(stderr, "   --stats-file=FILE     write per-pass statistics to FILE as JSON lines\n");
+    fprintf(stderr, "   --frontier-bitmap     track unpropagated bitbase positions in a bitmap\n");
+    fprintf(stderr, "                         instead of the unpropagated index table\n");
+    fprintf(stderr, "   --checkpoint=FILE     save state to FILE between intra-table passes\n");
+    fprintf(stderr, "   --checkpoint-interval=MINUTES\n");
+    fprintf(stderr, "                         minimum time between checkpoints (default 60)\n");
+    fprintf(stderr, "   --resume              resume from the checkpoint file, if it exists\n");
+    fprintf(stderr, "   --node=K/N            generate as node K of N, in proptable mode only\n");
+    fprintf(stderr, "   --exchange-dir=DIR    shared directory used by distributed nodes\n");
+    fprintf(stderr, "   --exchange-timeout=MINUTES\n");
+    fprintf(stderr, "                         give up waiting for another node (default 60; 0 waits\n");
+    fprintf(stderr, "                         forever)\n");
+    fprintf(stderr, "   --numa[=partition|interleave]\n");
+    fprintf(stderr, "                         pin threads to NUMA nodes and spread the entries table\n");
+    fprintf(stderr, "                         over them, by index range (default) or page by page\n");
+    fprintf(stderr, "   --huge-pages[=none|transparent|hugetlb]\n");
+    fprintf(stderr, "                         page size for large tables (default transparent;\n");
+    fprintf(stderr, "                         hugetlb uses reserved 1GB or 2MB pages)\n");
+    fprintf(stderr, "   --memory-budget=MB    with --build, limit the total estimated memory use of\n");
+    fprintf(stderr, "                         tablebases generated at the same time\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Additional GENERATING-OPTIONS for debugging are:\n");
     fprintf(stderr, "   -d INDEX              trace calculation of specified tablebase index\n");
     fprintf(stderr, "                         if INDEX is negative; trace this index in futurebases\n");
     fprintf(stderr, "   -v                    verify internal consistency of tablebase when finished\n");
+    fprintf(stderr, "   --verify-sample=K     only verify K randomly chosen positions (also with -v\n");
+    fprintf(stderr, "                         against Nalimov)\n");
+    fprintf(stderr, "   --seed=N              seed for --verify-sample, to repeat a sample\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Other options:\n");
+    fprintf(stderr, "   --header-cache=FILE   with --batch, remember the material of each tablebase\n");
+    fprintf(stderr, "                         in FILE, so they don't have to be opened at startup\n");
 #ifdef USE_NALIMOV
     fprintf(stderr, "   -n NALIMOV-PATH       sets path to find Nalimov tablebases\n");
 #endif
@@ -16039,7 +20536,27 @@ void usage(char *program_name)
     fprintf(stderr, "   -h                    display this help message and exit\n");
 }
 
-struct option options[] = {{"compress-files", no_argument, NULL, 1},
+const char short_options[] = "hiqgpsvo:n:S:P:U:t:d:";
+
+struct option options[] = {{"compress-files", optional_argument, NULL, 1},
+			   {"output-format", required_argument, NULL, 2},
+			   {"stats-file", required_argument, NULL, 3},
+			   {"benchmark", no_argument, NULL, 4},
+			   {"batch", no_argument, NULL, 5},
+			   {"frontier-bitmap", no_argument, NULL, 6},
+			   {"checkpoint", required_argument, NULL, 7},
+			   {"checkpoint-interval", required_argument, NULL, 8},
+			   {"resume", no_argument, NULL, 9},
+			   {"exchange-dir", required_argument, NULL, 10},
+			   {"node", required_argument, NULL, 11},
+			   {"build", no_argument, NULL, 12},
+			   {"memory-budget", required_argument, NULL, 13},
+			   {"verify-sample", required_argument, NULL, 14},
+			   {"header-cache", required_argument, NULL, 15},
+			   {"numa", optional_argument, NULL, 16},
+			   {"huge-pages", optional_argument, NULL, 17},
+			   {"seed", required_argument, NULL, 18},
+			   {"exchange-timeout", required_argument, NULL, 19},
 			   {NULL, 0, NULL, 0}};
 
 int main(int argc, char *argv[])
@@ -16054,6 +20571,9 @@ int main(int argc, char *argv[])
     int verify=0;
     int summarize=0;
     int dump_info=0;
+    int benchmark=0;
+    int batch=0;
+    int build=0;
     std::string output_filename;
     extern char *optarg;
     extern int optind;
@@ -16110,7 +20630,7 @@ int main(int argc, char *argv[])
     initialize_board_masks();
 
     while (1) {
-	c = getopt_long (argc, argv, "hiqgpsvo:n:S:P:U:t:d:", options, NULL);
+	c = getopt_long (argc, argv, short_options, options, NULL);
 
 	if (c == -1) break;
 
@@ -16173,8 +20693,108 @@ int main(int argc, char *argv[])
 	    unpropagated_index_table_MBs = strtol(optarg, nullptr, 0);
 	    break;
 	case 1:
-	    compress_proptables = true;
-	    compress_entries_table = true;
+	    if ((optarg == nullptr) || (strcmp(optarg, "gzip") == 0)) {
+		compress_proptables = true;
+		compress_entries_table = true;
+	    } else if (strcmp(optarg, "fast") == 0) {
+		compress_proptables = true;
+		compress_entries_table = true;
+		varint_proptables = true;
+		temporary_file_compression_level = io::zlib::best_speed;
+	    } else if (strcmp(optarg, "varint") == 0) {
+		varint_proptables = true;
+	    } else {
+		fatal("Unknown temporary file codec '%s'\n", optarg);
+		terminate();
+	    }
+	    break;
+	case 2:
+	    if (strcmp(optarg, "gzip") == 0) {
+		output_format = OutputFormat::Gzip;
+	    } else if (strcmp(optarg, "blocked") == 0) {
+		output_format = OutputFormat::Blocked;
+	    } else if (strcmp(optarg, "uncompressed") == 0) {
+		output_format = OutputFormat::Uncompressed;
+	    } else {
+		fatal("Unknown output format '%s'\n", optarg);
+		terminate();
+	    }
+	    break;
+	case 4:
+	    benchmark = 1;
+	    break;
+	case 5:
+	    batch = 1;
+	    break;
+	case 6:
+	    use_frontier_bitmap = true;
+	    break;
+	case 7:
+	    checkpoint_filename = optarg;
+	    break;
+	case 8:
+	    checkpoint_interval_minutes = strtol(optarg, nullptr, 0);
+	    break;
+	case 9:
+	    resume_from_checkpoint = true;
+	    break;
+	case 10:
+	    exchange_directory = optarg;
+	    break;
+	case 11:
+	    if ((sscanf(optarg, "%u/%u", &node_number, &num_nodes) != 2)
+		|| (num_nodes == 0) || (node_number >= num_nodes)) {
+		fatal("--node wants K/N, with K less than N\n");
+		terminate();
+	    }
+	    break;
+	case 12:
+	    build = 1;
+	    break;
+	case 13:
+	    build_memory_budget_MBs = strtol(optarg, nullptr, 0);
+	    break;
+	case 14:
+	    verify_sample_size = strtoll(optarg, nullptr, 0);
+	    break;
+	case 15:
+	    header_cache_filename = optarg;
+	    break;
+	case 16:
+	    if ((optarg == nullptr) || (strcmp(optarg, "partition") == 0)) {
+		numa_mode = NumaMode::Partition;
+	    } else if (strcmp(optarg, "interleave") == 0) {
+		numa_mode = NumaMode::Interleave;
+	    } else {
+		fatal("--numa must be 'partition' or 'interleave'\n");
+		terminate();
+	    }
+	    break;
+	case 17:
+	    if ((optarg == nullptr) || (strcmp(optarg, "hugetlb") == 0)) {
+		huge_pages = HugePages::HugeTLB;
+	    } else if (strcmp(optarg, "transparent") == 0) {
+		huge_pages = HugePages::Transparent;
+	    } else if (strcmp(optarg, "none") == 0) {
+		huge_pages = HugePages::None;
+	    } else {
+		fatal("--huge-pages must be 'none', 'transparent', or 'hugetlb'\n");
+		terminate();
+	    }
+	    break;
+	case 18:
+	    verify_seed = strtoull(optarg, nullptr, 0);
+	    verify_seed_given = true;
+	    break;
+	case 19:
+	    exchange_timeout_minutes = strtol(optarg, nullptr, 0);
+	    break;
+	case 3:
+	    stats_stream.open(optarg, std::ofstream::out | std::ofstream::trunc);
+	    if (! stats_stream.good()) {
+		fatal("Can't open '%s' for writing: %s\n", optarg, strerror(errno));
+		terminate();
+	    }
 	    break;
 	case '?':
 	    terminate();
@@ -16183,13 +20803,30 @@ int main(int argc, char *argv[])
     }
 
     // XXX need to consider other invalid possibilities like -g and -s
-    if (generating && probing) {
+    if (generating && (probing || batch)) {
 	fatal("Only one of the generating (-g) and probing (-p) options can be specified\n");
 	usage(argv[0]);
 	terminate();
     }
 
-    if (!generating && !probing && !verify && !dump_info && !summarize) {
+    if (build && (probing || batch || ! output_filename.empty())) {
+	fatal("--build can't be combined with probing or an output filename\n");
+	usage(argv[0]);
+	terminate();
+    }
+
+    /* Early, because --build estimates memory by constructing tablebases, and pawngen tablebases
+     * use the thread pool for that.
+     */
+
+    if (numa_mode != NumaMode::None) initialize_numa();
+
+    if (build) {
+	build_tablebase_set(argc, argv, optind);
+	terminate();
+    }
+
+    if (!generating && !probing && !verify && !dump_info && !summarize && !benchmark && !batch) {
 #if USE_NALIMOV
 	fatal("At least one of -g, -p, -i, -s, or -v must be specified\n");
 #else
@@ -16213,6 +20850,15 @@ int main(int argc, char *argv[])
     }
 #endif
 
+    /* Benchmark */
+
+    if (benchmark) {
+	for (argi=optind; argi<argc; argi++) {
+	    benchmark_index_encodings(argv[argi]);
+	}
+	terminate();
+    }
+
     /* Summarize */
 
     if (summarize) {
@@ -16246,19 +20892,44 @@ int main(int argc, char *argv[])
 	    if (success && verify && !using_proptables) verify_tablebase_internally();
 
 	    if (entriesTable != nullptr) {
-		delete entriesTable;
-		entriesTable = nullptr;
+		free_entries_table();
 	    }
 	} catch (std::exception) {
 	    if (entriesTable != nullptr) {
-		delete entriesTable;
-		entriesTable = nullptr;
+		free_entries_table();
 	    }
 	    throw;
 	}
 	terminate();
     }
 
+    /* Batch probing.  Tablebases we can summarize aren't loaded until they're needed. */
+
+    if (batch && !dump_info && !verify) {
+	tablebase_directory directory;
+	{
+	    header_cache cache(header_cache_filename);
+
+	    for (argi=optind; argi<argc; argi++) {
+		tablebase_summary summary;
+		if (cache.lookup(argv[argi], summary)) {
+		    directory.add(argv[argi], summary);
+		    continue;
+		}
+		info("Loading '%s'\n", argv[argi]);
+		try {
+		    directory.add(new tablebase_t(argv[argi]));
+		} catch (const char *msg) {
+		    fatal("Error loading tablebase '%s': %s\n", argv[argi], msg);
+		} catch (std::exception &ex) {
+		    fatal("Error loading tablebase '%s': %s\n", argv[argi], ex.what());
+		}
+	    }
+	}
+	batch_probe_tablebases(directory);
+	terminate();
+    }
+
     /* Probing / Verifying */
 
     i = 0;
@@ -16285,6 +20956,15 @@ int main(int argc, char *argv[])
 	i++;
     }
 
+    if (batch) {
+	tablebase_directory directory;
+	for (i = 0; tbs[i]; i ++) {
+	    directory.add(tbs[i]);
+	}
+	batch_probe_tablebases(directory);
+	terminate();
+    }
+
     if (!probing) terminate();
 
     probe_tablebases(tbs);